@@ -45,6 +45,8 @@ void init_cpu() {
         cpus[i].proc = NULL;
         cpus[i].noff = 0;
         cpus[i].base_interrupt_status = FALSE;
+        cpus[i].preempt_count = 0;
+        cpus[i].need_resched = FALSE;
         cpus[i].core_id = i;
         cpus[i].last_time_stamp = 0;
         for (int j = 0; j < SAMPLE_SLOT_COUNT; j++)
@@ -55,6 +57,16 @@ void init_cpu() {
         }
         cpus[i].next_slot = 0;
         cpus[i].start_cycle = r_time();
+        cpus[i].page_magazine.count = 0;
+        cpus[i].page_magazine.hit = 0;
+        cpus[i].page_magazine.miss = 0;
+        cpus[i].page_magazine.drain = 0;
+        cpus[i].kernel_pagetable = NULL;
+        cpus[i].idle = FALSE;
+        cpus[i].idle_acquires = 0;
+        cpus[i].idle_wakeups = 0;
+        cpus[i].uwindow_version = 0;
+        cpus[i].uwindow_lo = cpus[i].uwindow_hi = 0;
     }
 }
 
@@ -68,6 +80,7 @@ void print_cpu(struct cpu *c) {
     printf_k("* core id: %d\n", c->core_id);
     printf_k("* interrupt before: %d\n", c->base_interrupt_status);
     printf_k("* num push off: %d\n", c->noff);
+    printf_k("* preempt count: %d\n", c->preempt_count);
     printf_k("* proc: %p\n", c->proc);
     printf_k("* -------------------------------\n\n");
 }
\ No newline at end of file
@@ -7,6 +7,8 @@
 #define NCPU 1
 #endif // NCPU
 
+#define CPUS_ALL ((1ULL << NCPU) - 1)   // a bit per hart
+
 extern volatile int booted[NCPU];
 extern volatile int halted[NCPU];
 
@@ -32,6 +34,21 @@ struct context
 };
 
 #define SAMPLE_SLOT_COUNT 8
+
+#define PAGE_MAGAZINE_SIZE 64   // max free pages parked on one cpu
+#define PAGE_MAGAZINE_BATCH 16  // pages moved per refill / drain
+
+// Per-CPU cache of free physical pages in front of kmem.freelist.
+// Only touched by its own cpu with interrupts off, so no lock is needed.
+struct page_magazine
+{
+  void *pages[PAGE_MAGAZINE_SIZE];
+  int count;
+  uint64 hit;   // allocations served without touching kmem.lock
+  uint64 miss;  // allocations that had to refill from kmem.freelist
+  uint64 drain; // frees that overflowed back to kmem.freelist
+};
+
 // Per-CPU state.
 struct cpu
 {
@@ -39,6 +56,8 @@ struct cpu
   struct context context; // swtch() here to enter scheduler().
   int noff;               // Depth of push_off() nesting.
   int base_interrupt_status;        // Were interrupts enabled before push_off()?
+  int preempt_count;      // Depth of preempt_disable() nesting.
+  bool need_resched;      // proc should give up the cpu at the next preemption point
   int core_id;
 
   uint64 last_time_stamp; // not used
@@ -49,6 +68,16 @@ struct cpu
   int next_slot;
   uint64 start_cycle;
 
+  struct page_magazine page_magazine;
+
+  pagetable_t kernel_pagetable; // copy of the kernel root page table with this hart's user window
+  uint64 uwindow_version;       // pt_version of the process in the user window, 0 if none
+  uint64 uwindow_lo, uwindow_hi; // user pages accessed through the window since it was loaded
+
+  bool idle;                // in scheduler() with nothing to run
+  uint64 idle_acquires;     // spinlocks acquired while idle, counted with LOCKSTAT
+  uint64 idle_wakeups;      // returns from WFI
+
 };
 
 // debug print
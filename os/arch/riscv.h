@@ -23,6 +23,12 @@ static inline void wfi() {
     asm volatile("wfi");
 }
 
+// spin-wait hint, the Zihintpause "pause", which is a plain fence
+// encoding that older harts run as a no-op
+static inline void cpu_relax() {
+    asm volatile(".word 0x0100000f" ::: "memory");
+}
+
 static inline uint64 r_mstatus() {
     uint64 x;
     asm volatile("csrr %0, mstatus"
@@ -78,6 +84,8 @@ static inline void w_sip(uint64 x) { asm volatile("csrw sip, %0"
                                                   :
                                                   : "r"(x)); }
 
+#define SIP_SSIP (1L << 1)// software interrupt pending
+
 // Supervisor Interrupt Enable
 #define SIE_SEIE (1L << 9)// external
 #define SIE_STIE (1L << 5)// timer
@@ -177,7 +185,10 @@ static inline void w_mtvec(uint64 x) {
 // use riscv's sv39 page table scheme.
 #define SATP_SV39 (8L << 60)
 
-#define MAKE_SATP(pagetable) (SATP_SV39 | (((uint64) pagetable) >> 12))
+#define SATP_ASID(asid) (((uint64)(asid) & 0xffff) << 44)
+#define SATP_ASID_OF(satp) (((satp) >> 44) & 0xffff)
+
+#define MAKE_SATP(pagetable, asid) (SATP_SV39 | SATP_ASID(asid) | (((uint64) pagetable) >> 12))
 
 // supervisor address translation and protection;
 // holds the address of the page table.
@@ -312,6 +323,22 @@ static inline void sfence_vma() {
     asm volatile("sfence.vma zero, zero");
 }
 
+// flush the TLB entries of one address space.
+static inline void sfence_vma_asid(uint64 asid) {
+    asm volatile("sfence.vma zero, %0"
+                 :
+                 : "r"(asid)
+                 : "memory");
+}
+
+// flush the TLB entries of one page in one address space.
+static inline void sfence_vma_page(uint64 va, uint64 asid) {
+    asm volatile("sfence.vma %0, %1"
+                 :
+                 : "r"(va), "r"(asid)
+                 : "memory");
+}
+
 #define PGSIZE 4096// bytes per page
 #define PGSHIFT 12// bits of offset within a page
 
@@ -329,6 +356,9 @@ static inline void sfence_vma() {
 #define PTE_G (1L << 5)
 #define PTE_A (1L << 6)
 #define PTE_D (1L << 7)
+// software bits (RSW) for copy-on-write
+#define PTE_COW (1L << 8)   // private page shared with another process after fork, W is cleared
+#define PTE_COW_W (1L << 9) // a PTE_COW page was writable, restore PTE_W after the copy
 
 #define HAS_BIT(val, bit) (((val) & (bit)) != 0)
 
@@ -339,11 +369,17 @@ static inline void sfence_vma() {
 
 #define PTE_FLAGS(pte) ((pte) &0x3FF)
 
+// a valid PTE with any of R/W/X is a leaf, otherwise it points to the next level
+#define PTE_LEAF(pte) (((pte) & (PTE_R | PTE_W | PTE_X)) != 0)
+
 // extract the three 9-bit page table indices from a virtual address.
 #define PXMASK 0x1FF// 9 bits
 #define PXSHIFT(level) (PGSHIFT + (9 * (level)))
 #define PX(level, va) ((((uint64)(va)) >> PXSHIFT(level)) & PXMASK)
 
+// bytes mapped by a leaf PTE at the level: 4KB page, 2MB megapage, 1GB gigapage
+#define PXSIZE(level) (1ULL << PXSHIFT(level))
+
 // one beyond the highest possible virtual address.
 // MAXVA is actually one bit less than the max allowed by
 // Sv39, to avoid having to sign-extend virtual addresses
@@ -2,75 +2,112 @@
 #include <ucore/defs.h>
 #include <ucore/ucore.h>
 #include <proc/proc.h>
+#include <mem/slab.h>
 
 #include "timer.h"
 
-struct timer timer_pool[NTIMER];
-struct spinlock timers_lock;
+// active timers, allocated from timer_cache
+struct timer *timer_list;
+// the lock of the list, the sequence covers min_wakeup_tick, which every
+// hart reads when it sets its timer, so that none of them sees the ~0 a
+// deletion leaves there while it looks for the new minimum
+static struct seqlock timers;
+static uint64 min_wakeup_tick = ~0ULL;
+static struct kmem_cache *timer_cache;
 
 void timerinit() {
-    init_spin_lock_with_name(&timers_lock, "timer");
-    for (int i = 0; i < NTIMER; i++) {
-        timer_pool[i].wakeup_tick = 0;
-        timer_pool[i].valid = 0;
-        init_spin_lock(&timer_pool[i].guard_lock);
-    }
+    init_seqlock(&timers, "timer");
+    timer_list = NULL;
+    timer_cache = kmem_cache_create("timer", sizeof(struct timer));
+    KERNEL_ASSERT(timer_cache != NULL, "timer cache");
 }
 
+/**
+ * @brief Arm a new timer that fires expires_us from now.
+ * Returns with timer->guard_lock held, so that the caller can sleep
+ * on the timer without missing the wakeup.
+ *
+ * @return the timer, or NULL if out of memory
+ */
 struct timer *add_timer(uint64 expires_us) {
-    struct timer *timer = NULL;
-    acquire(&timers_lock);
-    for (int i = 0; i < NTIMER; i++) {
-        acquire(&timer_pool[i].guard_lock);
-        if (!timer_pool[i].valid) {
-            timer = &timer_pool[i];
-            timer->wakeup_tick = get_tick() + US_TO_TICK(expires_us);
-            timer->valid = TRUE;
-            // don't release the guard lock here
-            break;
-        }
-        release(&timer_pool[i].guard_lock);
-    }
-    release(&timers_lock);
+    struct timer *timer = kmem_cache_alloc(timer_cache);
+    if (timer == NULL)
+        return NULL;
+    init_spin_lock_with_name(&timer->guard_lock, "timer.guard_lock");
+    init_wait_queue(&timer->wq);
+    timer->wakeup_tick = get_tick() + US_TO_TICK(expires_us);
+    timer->valid = TRUE;
+    write_seqlock(&timers);
+    acquire(&timer->guard_lock);
+    timer->prev = NULL;
+    timer->next = timer_list;
+    if (timer_list)
+        timer_list->prev = timer;
+    timer_list = timer;
+    if (timer->wakeup_tick < min_wakeup_tick)
+        min_wakeup_tick = timer->wakeup_tick;
+    // don't release the guard lock here
+    write_sequnlock(&timers);
     return timer;
 }
 
+/**
+ * @brief Disarm and free a timer returned by add_timer().
+ * The guard lock must not be held.
+ */
 int del_timer(struct timer *timer) {
+    write_seqlock(&timers);
     acquire(&timer->guard_lock);
     if (!timer->valid) {
         infof("del_timer: timer %p is not valid\n", timer);
         release(&timer->guard_lock);
+        write_sequnlock(&timers);
         return -1;
     }
     timer->valid = FALSE;
+    if (timer->prev)
+        timer->prev->next = timer->next;
+    else
+        timer_list = timer->next;
+    if (timer->next)
+        timer->next->prev = timer->prev;
     release(&timer->guard_lock);
+    // wakeup ticks never change, so only a deletion needs a new scan
+    if (timer->wakeup_tick == min_wakeup_tick) {
+        min_wakeup_tick = ~0ULL;
+        for (struct timer *t = timer_list; t != NULL; t = t->next) {
+            if (t->wakeup_tick < min_wakeup_tick)
+                min_wakeup_tick = t->wakeup_tick;
+        }
+    }
+    write_sequnlock(&timers);
+    kmem_cache_free(timer_cache, timer);
     return 0;
 }
 
 void try_wakeup_timer() {
     uint64 tick = get_tick();
-    acquire(&timers_lock);
-    for (int i = 0; i < NTIMER; i++) {
-        acquire(&timer_pool[i].guard_lock);
-        if (timer_pool[i].valid && tick >= timer_pool[i].wakeup_tick) {
-            wakeup(&timer_pool[i]);
+    // the list does not change, no need to bump the sequence
+    acquire(&timers.lock);
+    for (struct timer *t = timer_list; t != NULL; t = t->next) {
+        acquire(&t->guard_lock);
+        if (t->valid && tick >= t->wakeup_tick) {
+            wake_up_all(&t->wq);
         }
-        release(&timer_pool[i].guard_lock);
+        release(&t->guard_lock);
     }
-    release(&timers_lock);
+    release(&timers.lock);
 }
 
+// The earliest wakeup tick of the active timers, ~0 if there are none.
+// Takes no lock.
 uint64 get_min_wakeup_tick() {
-    uint64 min_tick = ~0ULL;
-    acquire(&timers_lock);
-    for (int i = 0; i < NTIMER; i++) {
-        acquire(&timer_pool[i].guard_lock);
-        if (timer_pool[i].valid && timer_pool[i].wakeup_tick < min_tick) {
-            min_tick = timer_pool[i].wakeup_tick;
-        }
-        release(&timer_pool[i].guard_lock);
-    }
-    release(&timers_lock);
+    uint64 min_tick;
+    uint seq;
+    do {
+        seq = read_seqbegin(&timers);
+        min_tick = min_wakeup_tick;
+    } while (read_seqretry(&timers, seq));
     return min_tick;
 }
 
@@ -89,9 +126,25 @@ void set_next_timer() {
     const uint64 timebase = TICK_FREQ / TIME_SLICE_PER_SEC; // how many ticks
     uint64 slice_tick = r_time() + timebase;
     uint64 timer_tick = get_min_wakeup_tick();
+    // an RR quantum may end before the slice does
+    struct proc *p = curr_proc();
+    if (p != NULL && p->policy == SCHED_RR && p->slice_end < slice_tick)
+        slice_tick = p->slice_end;
     set_timer(slice_tick < timer_tick ? slice_tick : timer_tick);
 }
 
+/// Set the timer for the next deadline only, or turn it off if there is
+/// none. An idle hart has no time slice to end.
+void set_idle_timer() {
+    uint64 timer_tick = get_min_wakeup_tick();
+    if (timer_tick == ~0ULL) {
+        stop_timer_interrupt();
+        return;
+    }
+    w_sie(r_sie() | SIE_STIE);
+    set_timer(timer_tick);
+}
+
 
 uint64 get_time_ms() {
     uint64 time = r_time();
@@ -20,8 +20,6 @@
 #define MS_TO_CYCLE(ms) ((ms) * (CYCLE_FREQ / MSEC_PER_SEC))
 #define SECOND_TO_CYCLE(sec) ((sec)*CYCLE_FREQ)
 
-#define NTIMER 10
-
 struct timeval {
     uint64 tv_sec;
     uint64 tv_usec;
@@ -41,6 +39,9 @@ struct timer {
     uint64 wakeup_tick;
     bool valid;
     struct spinlock guard_lock;
+    struct wait_queue wq;   // woken every tick once expired
+    struct timer *prev;     // active timers list, protected by timers.lock
+    struct timer *next;
 };
 
 struct tm {
@@ -13,7 +13,7 @@ int64 console_write(char *src, int64 len, int from_user) {
     if (from_user) {
         struct proc *p = curr_proc();
         acquire(&p->lock);
-        if (copyin(p->pagetable, copybuf, (uint64)src, len) < 0) {
+        if (copyin(p->mm->pagetable, copybuf, (uint64)src, len) < 0) {
             release(&p->lock);
             return 0;
         }
@@ -6,6 +6,8 @@ struct cpu_stat
     uint64 uptime;
     uint64 sample_duration;
     uint64 sample_busy_duration;
+    uint64 idle_acquires;   // spinlocks acquired with nothing to run, ~0 if not counted
+    uint64 idle_wakeups;    // returns from WFI
 };
 
 int64 cpu_write(char *src, int64 len, int from_user)
@@ -42,6 +44,13 @@ int64 cpu_read(char *dst, int64 len, int to_user)
         stat_buf[i].sample_duration = all_average;
         stat_buf[i].sample_busy_duration = busy_average;
         stat_buf[i].uptime = r_time()-cpus[i].start_cycle;
+#ifdef LOCKSTAT
+        stat_buf[i].idle_acquires = cpus[i].idle_acquires;
+#else
+        // counted along with the lock statistics only
+        stat_buf[i].idle_acquires = ~0ULL;
+#endif
+        stat_buf[i].idle_wakeups = cpus[i].idle_wakeups;
 
     }
 
@@ -0,0 +1,74 @@
+#include <file/file.h>
+#include <lock/lock.h>
+#include <proc/proc.h>
+#include <ucore/defs.h>
+#include "lockstat_device.h"
+
+void lockstat_device_init() {
+    device_handler[LOCKSTAT_DEVICE].read = lockstat_read;
+    device_handler[LOCKSTAT_DEVICE].write = lockstat_write;
+}
+
+#ifdef LOCKSTAT
+
+// any write zeroes the counters
+int64 lockstat_write(char *src, int64 len, int from_user) {
+    lockstat_reset();
+    return len;
+}
+
+static void append_field(char *buf, char *title, uint64 value, int base) {
+    char svalue[66];
+    strcat(buf, " ");
+    strcat(buf, title);
+    strcat(buf, base == 16 ? " 0x" : " ");
+    strcat(buf, utoa(value, svalue, base));
+}
+
+static void append_kind(char *buf, int kind) {
+    const char *name;
+    struct lock_stat st;
+    uint64 site;
+    for (int i = 0; i < NLOCK_CLASS; i++) {
+        if (lockstat_sum(kind, i, &name, &st, &site) < 0 || st.acquisitions == 0)
+            continue;
+        if (strlen(buf) + strlen(name) + 200 > PGSIZE)
+            break;
+        strcat(buf, name);
+        strcat(buf, ":");
+        append_field(buf, "acquired", st.acquisitions, 10);
+        append_field(buf, "contended", st.contended, 10);
+        append_field(buf, "wait", st.wait_total, 10);
+        append_field(buf, "wait_max", st.wait_max, 10);
+        append_field(buf, "hold", st.hold_total, 10);
+        append_field(buf, "hold_max", st.hold_max, 10);
+        append_field(buf, "site", site, 16);
+        strcat(buf, "\n");
+    }
+}
+
+// one line per lock name that was taken since the last reset:
+// <name>: acquired <n> contended <n> wait <n> wait_max <n> hold <n> hold_max <n> site 0x<pc>
+// spinlocks first, times in cycles, then mutexes, times in ticks
+int64 lockstat_read(char *dst, int64 len, int to_user) {
+    char buf[PGSIZE];
+    buf[0] = '\0';
+    strcat(buf, "# spinlocks, cycles\n");
+    append_kind(buf, LOCK_SPIN);
+    strcat(buf, "# mutexes, ticks\n");
+    append_kind(buf, LOCK_MUTEX);
+    return either_copyout(dst, buf, MIN(strlen(buf), len), to_user);
+}
+
+#else
+
+int64 lockstat_write(char *src, int64 len, int from_user) {
+    return len;
+}
+
+int64 lockstat_read(char *dst, int64 len, int to_user) {
+    char *msg = "# lockstat is off, build with LOCKSTAT=1\n";
+    return either_copyout(dst, msg, MIN(strlen(msg), len), to_user);
+}
+
+#endif // LOCKSTAT
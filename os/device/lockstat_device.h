@@ -0,0 +1,10 @@
+#if !defined(LOCKSTAT_DEVICE_H)
+#define LOCKSTAT_DEVICE_H
+
+#include <ucore/ucore.h>
+
+int64 lockstat_write(char *src, int64 len, int from_user);
+
+int64 lockstat_read(char *dst, int64 len, int to_user);
+
+#endif // LOCKSTAT_DEVICE_H
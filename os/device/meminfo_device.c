@@ -1,3 +1,5 @@
+#include <arch/cpu.h>
+#include <mem/memory_layout.h>
 #include <proc/proc.h>
 #include <ucore/defs.h>
 #include "meminfo_device.h"
@@ -11,20 +13,66 @@ int64 meminfo_write(char *src, int64 len, int from_user) {
     return 0;
 }
 
-static void append_info(char *buf, char *title, int value, char *unit) {
+static void append_info(char *buf, char *title, uint64 value, char *unit) {
     strcat(buf, title);
     strcat(buf, ": ");
-    char svalue[16];
-    itoa(value, svalue, 10);
+    char svalue[24];
+    utoa(value, svalue, 10);
     strcat(buf, svalue);
-    strcat(buf, " ");
-    strcat(buf, unit);
+    if (unit[0]) {
+        strcat(buf, " ");
+        strcat(buf, unit);
+    }
     strcat(buf, "\n");
 }
 
+static void append_cpu_info(char *buf, int cpu, char *title, uint64 value, char *unit) {
+    char cpu_title[32] = "Cpu";
+    char sid[16];
+    itoa(cpu, sid, 10);
+    strcat(cpu_title, sid);
+    strcat(cpu_title, title);
+    append_info(buf, cpu_title, value, unit);
+}
+
 int64 meminfo_read(char *dst, int64 len, int to_user) {
-    char buf[1024];
+    // room for every counter at its full 20 digits
+    char buf[4096];
+    buf[0] = '\0';
     append_info(buf, "MemAvailable", get_free_page_count() * 4, "kB");
+
+    uint64 zero_count, zero_hit, zero_miss;
+    get_zero_pool_stat(&zero_count, &zero_hit, &zero_miss);
+    append_info(buf, "ZeroPool", zero_count * 4, "kB");
+    append_info(buf, "ZeroPoolHit", zero_hit, "");
+    append_info(buf, "ZeroPoolMiss", zero_miss, "");
+
+    // buddy fragmentation: free blocks per order, and how much of the
+    // free memory cannot serve a 2MB (order 9) request
+    uint64 counts[BUDDY_MAX_ORDER + 1];
+    uint64 total = 0, huge = 0;
+    char title[32];
+    char sorder[16];
+    get_free_block_counts(counts);
+    for (int i = 0; i <= BUDDY_MAX_ORDER; i++) {
+        strcpy(title, "FreeBlocksOrder");
+        itoa(i, sorder, 10);
+        strcat(title, sorder);
+        append_info(buf, title, counts[i], "");
+        total += counts[i] << i;
+        if (i >= 9)
+            huge += counts[i] << i;
+    }
+    append_info(buf, "FragmentationOrder9", total ? (total - huge) * 100 / total : 0, "%");
+#ifdef PAGE_MAGAZINE
+    for (int i = 0; i < NCPU; i++) {
+        struct page_magazine *m = &cpus[i].page_magazine;
+        append_cpu_info(buf, i, "Magazine", m->count * 4, "kB");
+        append_cpu_info(buf, i, "MagazineHit", m->hit, "");
+        append_cpu_info(buf, i, "MagazineMiss", m->miss, "");
+        append_cpu_info(buf, i, "MagazineDrain", m->drain, "");
+    }
+#endif
     infof("meminfo: %s", buf);
     return either_copyout(dst, buf, strlen(buf), to_user);
 }
@@ -13,6 +13,8 @@ struct proc_stat
     uint64 heap_sz;
     uint64 total_size;
     uint64 cpu_time; // ms, user and kernel
+    int last_cpu;    // hart it last ran on, -1 if none
+    uint64 nr_migrations; // runs on another hart than the run before
 };
 
 int64 proc_write(char *src, int64 len, int from_user)
@@ -31,34 +33,41 @@ int64 proc_read(char *dst, int64 len, int to_user)
     }
 
     int cnt = 0;
-    acquire(&pool_lock);
+    // a snapshot without any lock, the fields may be a moment apart
+    rcu_read_lock();
     for (struct proc *p = pool; p < &pool[NPROC]; p++)
     {
         if ((cnt + 1) * sizeof(struct proc_stat) > len)
             break;
-        acquire(&p->lock);
-        if (p->state != UNUSED)
+        if (proc_in_use(p))
         {
             strncpy(stat_buf[cnt].name, p->name, PROC_NAME_MAX);
             stat_buf[cnt].pid = p->pid;
-            if (p->parent)
+            struct proc *parent = p->parent;
+            if (parent)
             {
-                stat_buf[cnt].ppid = p->parent->pid;
+                stat_buf[cnt].ppid = parent->pid;
             }
             else
             {
                 stat_buf[cnt].ppid = -1;
             }
-            stat_buf[cnt].heap_sz = p->heap_sz;
-            stat_buf[cnt].total_size = p->total_size;
-            stat_buf[cnt].cpu_time = p->kernel_time + p->user_time;
+            // a zombie has left its address space, which is
+            // not freed before we are done with it
+            struct mm *mm = p->mm;
+            stat_buf[cnt].heap_sz = mm ? mm->heap_sz : 0;
+            stat_buf[cnt].total_size = mm ? mm->total_size : 0;
+            uint64 user, kernel;
+            get_proc_times(p, &user, &kernel);
+            stat_buf[cnt].cpu_time = kernel + user;
             stat_buf[cnt].state = p->state;
+            stat_buf[cnt].last_cpu = p->last_cpu;
+            stat_buf[cnt].nr_migrations = p->nr_migrations;
             cnt++;
         }
-        release(&p->lock);
     }
+    rcu_read_unlock();
     printf("cnt %d\n",cnt);
-    release(&pool_lock);
 
     if (either_copyout(dst, stat_buf, cnt * sizeof(struct proc_stat), to_user) < 0)
     {
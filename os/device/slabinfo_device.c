@@ -0,0 +1,49 @@
+#include <file/file.h>
+#include <mem/slab.h>
+#include <proc/proc.h>
+#include <ucore/defs.h>
+#include "slabinfo_device.h"
+
+void slabinfo_device_init() {
+    device_handler[SLABINFO_DEVICE].read = slabinfo_read;
+    device_handler[SLABINFO_DEVICE].write = slabinfo_write;
+}
+
+int64 slabinfo_write(char *src, int64 len, int from_user) {
+    return 0;
+}
+
+static void append_field(char *buf, char *title, uint64 value) {
+    char svalue[16];
+    itoa(value, svalue, 10);
+    strcat(buf, " ");
+    strcat(buf, title);
+    strcat(buf, " ");
+    strcat(buf, svalue);
+}
+
+// one line per cache:
+// <name>: objsize <n> perslab <n> pages <n> slabs <n> active <n> cached <n> alloc <n> refill <n>
+int64 slabinfo_read(char *dst, int64 len, int to_user) {
+    char buf[PGSIZE];
+    struct slab_stat stat;
+    buf[0] = '\0';
+    for (int i = 0; i < NSLAB_CACHE; i++) {
+        if (get_slab_stat(i, &stat) < 0)
+            continue;
+        if (strlen(buf) + 160 > sizeof(buf))
+            break;
+        strcat(buf, stat.name);
+        strcat(buf, ":");
+        append_field(buf, "objsize", stat.obj_size);
+        append_field(buf, "perslab", stat.objs_per_slab);
+        append_field(buf, "pages", stat.pages_per_slab);
+        append_field(buf, "slabs", stat.nr_slabs);
+        append_field(buf, "active", stat.active_objs);
+        append_field(buf, "cached", stat.cached_objs);
+        append_field(buf, "alloc", stat.nr_alloc);
+        append_field(buf, "refill", stat.nr_refill);
+        strcat(buf, "\n");
+    }
+    return either_copyout(dst, buf, MIN(strlen(buf), len), to_user);
+}
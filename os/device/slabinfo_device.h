@@ -0,0 +1,10 @@
+#if !defined(SLABINFO_DEVICE_H)
+#define SLABINFO_DEVICE_H
+
+#include <ucore/ucore.h>
+
+int64 slabinfo_write(char *src, int64 len, int from_user);
+
+int64 slabinfo_read(char *dst, int64 len, int to_user);
+
+#endif // SLABINFO_DEVICE_H
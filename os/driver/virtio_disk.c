@@ -21,10 +21,10 @@
 
 static struct disk {
     // the virtio driver and device mostly communicate through a set of
-    // structures in RAM. pages[] allocates that memory. pages[] is a
-    // global (instead of calls to alloc_physical_page()) because it must consist of
-    // two contiguous pages of page-aligned physical memory.
-    char pages[2 * PGSIZE];
+    // structures in RAM. pages[] allocates that memory. it must consist of
+    // two contiguous pages of page-aligned physical memory, so it comes
+    // from alloc_physical_pages(1).
+    char *pages;
 
     // pages[] is divided into three regions (descriptors, avail, and
     // used), as explained in Section 2.6 of the virtio specification
@@ -55,6 +55,7 @@ static struct disk {
     // our own book-keeping.
     char free[NUM];  // is a descriptor free?
     uint16 used_idx; // we've looked this far in used[2..NUM].
+    struct wait_queue free_wait; // requests waiting for descriptors
 
     // track info about in-flight operations,
     // for use when completion interrupt arrives.
@@ -63,17 +64,21 @@ static struct disk {
     {
         struct buf *b;
         char status;
+        struct wait_queue done; // the request waiting for completion
     } info[NUM];
 
     // disk command headers.
     // one-for-one with descriptors, for convenience.
     struct virtio_blk_req ops[NUM];
     struct spinlock vdisk_lock;
-} __attribute__((aligned(PGSIZE))) disk;
+} disk;
 
 void virtio_disk_init(void) {
     uint32 status = 0;
     init_spin_lock_with_name(&disk.vdisk_lock, "virtio_disk");
+    init_wait_queue(&disk.free_wait);
+    for (int i = 0; i < NUM; i++)
+        init_wait_queue(&disk.info[i].done);
 
     if (*R(VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
         *R(VIRTIO_MMIO_VERSION) != 1 ||
@@ -117,7 +122,10 @@ void virtio_disk_init(void) {
     if (max < NUM)
         panic("virtio disk max queue too short");
     *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
-    memset(disk.pages, 0, sizeof(disk.pages));
+    disk.pages = alloc_physical_pages(1);
+    if (disk.pages == NULL)
+        panic("virtio disk ring alloc");
+    memset(disk.pages, 0, 2 * PGSIZE);
     *R(VIRTIO_MMIO_QUEUE_PFN) = ((uint64)disk.pages) >> PGSHIFT;
 
     // desc = pages -- num * virtq_desc
@@ -159,7 +167,6 @@ free_desc(int i) {
     disk.desc[i].flags = 0;
     disk.desc[i].next = 0;
     disk.free[i] = 1;
-    wakeup(&disk.free[0]);
 }
 
 // free a chain of descriptors.
@@ -175,6 +182,7 @@ free_chain(int i) {
         else
             break;
     }
+    wake_up_all(&disk.free_wait);
 }
 
 // allocate three descriptors (they need not be contiguous).
@@ -209,7 +217,7 @@ void virtio_disk_rw(struct buf *b, int write) {
         if (alloc3_desc(idx) == 0) {
             break;
         }
-        sleep(&disk.free[0], &disk.vdisk_lock);
+        wait_queue_sleep(&disk.free_wait, &disk.vdisk_lock);
     }
     // format the three descriptors.
     // qemu's virtio-blk.c reads them.
@@ -260,7 +268,7 @@ void virtio_disk_rw(struct buf *b, int write) {
 
     // Wait for virtio_disk_intr() to say request has finished.
     while (b->disk_is_reading == 1) {
-        sleep(b, &disk.vdisk_lock);
+        wait_queue_sleep(&disk.info[idx[0]].done, &disk.vdisk_lock);
     }
 
     // infof("wait for intr over = %d\n", intr_get());
@@ -296,7 +304,7 @@ void virtio_disk_intr() {
         struct buf *b = disk.info[id].b;
         b->disk_is_reading = 0; // disk is done with buf
         // debugcore("wakeup start");
-        wakeup(b);
+        wake_up(&disk.info[id].done);
         // debugcore("wakeup end");
         disk.used_idx += 1;
     }
@@ -79,7 +79,7 @@ int ff_cre_syncobj (	/* 1:Function succeeded, 0:Could not create the sync object
 //    }
 //    return 0;
     if (!m_init) {
-        init_mutex(&m);
+        init_mutex_with_name(&m, "fatfs.lock");
         m_init = true;
     }
     *sobj = &m;
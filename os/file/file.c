@@ -6,14 +6,16 @@
 #include <ucore/types.h>
 #include <device/console.h>
 #include <file/stat.h>
+#include <mem/slab.h>
 /**
  * @brief The global file pool
- * Every opened file is kept here in system level
- * Process files are pointing here.
+ * Every opened file is allocated from file_cache in system level,
+ * process files are pointing there. The lock protects the ref counts.
  * 
  */
 struct {
-    struct file files[FILE_MAX];    // system level files
+    struct kmem_cache *file_cache;
+    struct kmem_cache *fdtable_cache;
     struct spinlock lock;
 } filepool;
 struct device_handler device_handler[NDEV];
@@ -27,6 +29,8 @@ void mount_device_init();
 void meminfo_device_init();
 void rtc_device_init();
 void urandom_device_init();
+void slabinfo_device_init();
+void lockstat_device_init();
 
 /**
  * @brief Call xxx_init of all devices
@@ -43,6 +47,8 @@ void device_init() {
     meminfo_device_init();
     rtc_device_init();
     urandom_device_init();
+    slabinfo_device_init();
+    lockstat_device_init();
 }
 /**
  * @brief Init the global file pool
@@ -50,6 +56,11 @@ void device_init() {
  */
 void fileinit() {
     init_spin_lock_with_name(&filepool.lock, "filepool.lock");
+    filepool.file_cache = kmem_cache_create("file", sizeof(struct file));
+    KERNEL_ASSERT(filepool.file_cache != NULL, "file cache");
+    filepool.fdtable_cache = kmem_cache_create("fdtable", sizeof(struct fdtable));
+    KERNEL_ASSERT(filepool.fdtable_cache != NULL, "fdtable cache");
+    pipeinit();
     device_init();
 }
 
@@ -74,6 +85,7 @@ void fileclose(struct file *f) {
     f->ref = 0;
     f->type = FD_NONE;
     release(&filepool.lock);
+    kmem_cache_free(filepool.file_cache, f);
 
     if (ff.type == FD_PIPE) {
         pipeclose(ff.pipe, ff.writable);
@@ -88,24 +100,21 @@ void fileclear(struct file *f) {
     KERNEL_ASSERT(f->ref == 0, "file reference should be 0");
     f->type = FD_NONE;
     release(&filepool.lock);
+    kmem_cache_free(filepool.file_cache, f);
 }
 
 /**
- * @brief Scans the file table for an unreferenced file
+ * @brief Allocate a new file from the file cache
  * 
- * @return struct file* the unreferenced file, or NULL if all used
+ * @return struct file* the new file with ref 1, or NULL if out of memory
  */
 struct file *filealloc() {
-    acquire(&filepool.lock);
-    for (int i = 0; i < FILE_MAX; ++i) {
-        if (filepool.files[i].ref == 0) {
-            filepool.files[i].ref = 1;
-            release(&filepool.lock);
-            return &filepool.files[i];
-        }
-    }
-    release(&filepool.lock);
-    return NULL;
+    struct file *f = kmem_cache_alloc(filepool.file_cache);
+    if (f == NULL)
+        return NULL;
+    memset(f, 0, sizeof(struct file));
+    f->ref = 1;
+    return f;
 }
 
 struct inode * create(char *path, short type, short major, short minor) {
@@ -171,6 +180,65 @@ filedup(struct file *f) {
     return f;
 }
 
+/**
+ * @brief Allocate an empty file descriptor table
+ * 
+ * @return struct fdtable* with one reference, NULL if out of memory
+ */
+struct fdtable *fdtable_alloc() {
+    struct fdtable *t = kmem_cache_alloc(filepool.fdtable_cache);
+    if (t == NULL) {
+        infof("fdtable_alloc: out of memory");
+        return NULL;
+    }
+    t->ref = 1;
+    init_rwlock(&t->lock, "fdtable.lock");
+    for (int i = 0; i < FD_MAX; i++) {
+        t->fd[i] = NULL;
+    }
+    return t;
+}
+
+/**
+ * @brief Copy a file descriptor table for fork
+ * The new table refers to the same open files.
+ */
+struct fdtable *fdtable_dup(struct fdtable *src) {
+    struct fdtable *t = fdtable_alloc();
+    if (t == NULL) {
+        return NULL;
+    }
+    read_lock(&src->lock);
+    for (int i = 0; i < FD_MAX; i++) {
+        if (src->fd[i]) {
+            t->fd[i] = filedup(src->fd[i]);
+        }
+    }
+    read_unlock(&src->lock);
+    return t;
+}
+
+struct fdtable *fdtable_get(struct fdtable *t) {
+    __atomic_fetch_add(&t->ref, 1, __ATOMIC_RELAXED);
+    return t;
+}
+
+/**
+ * @brief Drop a reference, the last one closes every file in the table
+ */
+void fdtable_put(struct fdtable *t) {
+    if (__atomic_sub_fetch(&t->ref, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+    for (int i = 0; i < FD_MAX; i++) {
+        if (t->fd[i] != NULL) {
+            fileclose(t->fd[i]);
+            t->fd[i] = NULL;
+        }
+    }
+    kmem_cache_free(filepool.fdtable_cache, t);
+}
+
 char* fix_cwd_slashes(char *path) {
     while(*path) {
         if (path[0] == '.' && path[1] == '/') {
@@ -284,7 +352,7 @@ int fileopenat(int dirfd, char *filename, int flags) {
     }
 
     struct proc *p = curr_proc();
-    struct file *f = p->files[dirfd];
+    struct file *f = fget(p, dirfd);
 
     if (f == NULL) {
         infof("fileopenat: invalid dirfd %d", dirfd);
@@ -296,6 +364,7 @@ int fileopenat(int dirfd, char *filename, int flags) {
     if (inode->type != T_DIR) {
         infof("fileopenat: %s is not a dir", filename);
         iunlock(inode);
+        fileclose(f);
         return -1;
     }
 
@@ -307,6 +376,7 @@ int fileopenat(int dirfd, char *filename, int flags) {
     }
     strcat(path, filename);
     iunlock(inode);
+    fileclose(f);
     return fileopen(path, flags);
 }
 
@@ -403,7 +473,7 @@ int filestat(struct file *f, uint64 addr) {
 
     iunlock(f->ip);
 
-    if (copyout(p->pagetable, addr, (char *) &st, sizeof(st)) < 0) {
+    if (copyout(p->mm->pagetable, addr, (char *) &st, sizeof(st)) < 0) {
         infof("filestat: copyout failed");
         return -1;
     }
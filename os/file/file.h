@@ -32,6 +32,8 @@ struct pipe {
     int readopen;  // read fd is still open
     int writeopen; // write fd is still open
     struct spinlock lock;
+    struct wait_queue rwait;    // readers waiting for data
+    struct wait_queue wwait;    // writers waiting for room
 };
 
 // file.h
@@ -52,6 +54,17 @@ struct file {
     short major;       // FD_DEVICE
 };
 
+#define FD_MAX (256)
+
+// File descriptors of a process, shared by threads created with CLONE_FILES.
+// lock protects the slots, fget() reads them on every file syscall while
+// only open, dup and close write them.
+struct fdtable {
+    int ref;
+    struct rwlock lock;
+    struct file *fd[FD_MAX];
+};
+
 struct iovec {
     uint64 iov_base;
     uint64 iov_len;
@@ -81,6 +94,7 @@ struct fd_set {
 // int init_mailbox(struct mailbox *mb);
 struct inode *create(char *path, short type, short major, short minor);
 void fileinit();
+void pipeinit();
 void device_init();
 void fileclose(struct file *f);
 ssize_t fileread(struct file *f, void *dst_va, size_t len);
@@ -89,6 +103,10 @@ struct file *filealloc();
 int fileopen(char *path, int flags);
 int fileopenat(int dirfd, char *filename, int flags);
 struct file *filedup(struct file *f);
+struct fdtable *fdtable_alloc();
+struct fdtable *fdtable_dup(struct fdtable *src);
+struct fdtable *fdtable_get(struct fdtable *t);
+void fdtable_put(struct fdtable *t);
 int filestat(struct file *f, uint64 addr);
 int getdents(struct file *f, char *buf, unsigned long len);
 int filelink(struct file *oldfile, struct file *newfile);
@@ -98,7 +116,6 @@ int filelseek(struct file *f, off_t offset, int whence);
 int filepath(struct file *file, char *path);
 int filerename(struct file *file, char *new_path);
 int fileioctl(struct file *f, int cmd, void *arg);
-#define FILE_MAX (128 * 16)
 
 #define CONSOLE 1
 #define CPU_DEVICE 2
@@ -110,5 +127,7 @@ int fileioctl(struct file *f, int cmd, void *arg);
 #define MEMINFO_DEVICE 8
 #define RTC_DEVICE 9
 #define URANDOM_DEVICE 10
+#define SLABINFO_DEVICE 11
+#define LOCKSTAT_DEVICE 12
 
 #endif //!__FILE_H__
\ No newline at end of file
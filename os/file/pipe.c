@@ -2,6 +2,14 @@
 #include <ucore/defs.h>
 #include <proc/proc.h>
 #include <file/file.h>
+#include <mem/slab.h>
+
+static struct kmem_cache *pipe_cache;
+
+void pipeinit() {
+    pipe_cache = kmem_cache_create("pipe", sizeof(struct pipe));
+    KERNEL_ASSERT(pipe_cache != NULL, "pipe cache");
+}
 
 int pipealloc(struct file **f0, struct file **f1) {
     struct pipe *pi;
@@ -10,13 +18,15 @@ int pipealloc(struct file **f0, struct file **f1) {
     *f0 = *f1 = NULL;
     if ((*f0 = filealloc()) == NULL || (*f1 = filealloc()) == NULL)
         goto bad;
-    if ((pi = (struct pipe *)alloc_physical_page()) == NULL)
+    if ((pi = (struct pipe *)kmem_cache_alloc(pipe_cache)) == NULL)
         goto bad;
     pi->readopen = 1;
     pi->writeopen = 1;
     pi->nwrite = 0;
     pi->nread = 0;
     init_spin_lock_with_name(&pi->lock, "pipe.lock");
+    init_wait_queue(&pi->rwait);
+    init_wait_queue(&pi->wwait);
     (*f0)->type = FD_PIPE;
     (*f0)->readable = 1;
     (*f0)->writable = 0;
@@ -29,7 +39,7 @@ int pipealloc(struct file **f0, struct file **f1) {
 
 bad:
     if (pi)
-        recycle_physical_page((char *)pi);
+        kmem_cache_free(pipe_cache, pi);
     if (*f0)
         fileclose(*f0);
     if (*f1)
@@ -46,14 +56,14 @@ pipeclose(struct pipe *pi, int writable)
           pi, writable, pi->readopen, pi->writeopen, pi->nread, pi->nwrite);
     if(writable){
         pi->writeopen = 0;
-        wakeup(&pi->nread);
+        wake_up_all(&pi->rwait);
     } else {
         pi->readopen = 0;
-        wakeup(&pi->nwrite);
+        wake_up_all(&pi->wwait);
     }
     if(pi->readopen == 0 && pi->writeopen == 0){
         release(&pi->lock);
-        recycle_physical_page((char*)pi);
+        kmem_cache_free(pipe_cache, pi);
     }else
         release(&pi->lock);
 }
@@ -70,19 +80,19 @@ int pipewrite(struct pipe *pi, uint64 addr, int n) {
             return -1;
         }
         if (pi->nwrite == pi->nread + PIPESIZE) { 
-            wakeup(&pi->nread);
+            wake_up_all(&pi->rwait);
             infof("pipewrite at %p: pid = %d pipe is full", pi, pr->pid);
-            sleep(&pi->nwrite, &pi->lock);
+            wait_queue_sleep(&pi->wwait, &pi->lock);
             infof("pipewrite at %p: pid = %d woke up", pi, pr->pid);
         } else {
 //            char ch;
-//            if (copyin(pr->pagetable, &ch, addr + i, 1) == -1)
+//            if (copyin(pr->mm->pagetable, &ch, addr + i, 1) == -1)
 //                break;
 //            pi->data[pi->nwrite++ % PIPESIZE] = ch;
 //            i++;
             int write_size = MIN(n - i, PIPESIZE - (pi->nwrite - pi->nread));
             char write_buf[write_size];
-            if (copyin(pr->pagetable, write_buf, addr + i, write_size) == -1) {
+            if (copyin(pr->mm->pagetable, write_buf, addr + i, write_size) == -1) {
                 infof("pipewrite: copyin error");
                 break;
             }
@@ -95,7 +105,7 @@ int pipewrite(struct pipe *pi, uint64 addr, int n) {
     }
     infof("pipewrite at %p: pid = %d want to write %d bytes, finally write %d "
           "bytes", pi, pr->pid, n, i);
-    wakeup(&pi->nread);
+    wake_up_all(&pi->rwait);
     release(&pi->lock);
 
     return i;
@@ -114,14 +124,14 @@ int piperead(struct pipe *pi, uint64 addr, int n) {
             return -1;
         }
         infof("piperead at  %p: pid = %d listen to nread", pi, pr->pid);
-        sleep(&pi->nread, &pi->lock);
+        wait_queue_sleep(&pi->rwait, &pi->lock);
         infof("piperead at  %p: pid = %d woke up from nread", pi, pr->pid);
     }
 //    for (i = 0; i < n; i++) {
 //        if (pi->nread == pi->nwrite)
 //            break;
 //        ch = pi->data[pi->nread++ % PIPESIZE];
-//        if (copyout(pr->pagetable, addr + i, &ch, 1) == -1)
+//        if (copyout(pr->mm->pagetable, addr + i, &ch, 1) == -1)
 //            break;
 //    }
     int read_size = MIN(n, pi->nwrite - pi->nread);
@@ -129,14 +139,14 @@ int piperead(struct pipe *pi, uint64 addr, int n) {
     for (i = 0; i < read_size; i++) {
         read_buf[i] = pi->data[pi->nread++ % PIPESIZE];
     }
-    if (copyout(pr->pagetable, addr, read_buf, read_size) == -1) {
+    if (copyout(pr->mm->pagetable, addr, read_buf, read_size) == -1) {
         infof("piperead: copyout error");
         i = 0;
     }
     infof("piperead at  %p: pid = %d want to read %d bytes, finally read %d "
           "bytes", pi, pr->pid, n, i);
 
-    wakeup(&pi->nwrite); 
+    wake_up_all(&pi->wwait);
     release(&pi->lock);
     return i;
 }
@@ -35,7 +35,7 @@ void binit(void) {
     for (b = bcache.buf; b < bcache.buf + NBUF; b++) {
         b->next = bcache.head.next;
         b->prev = &bcache.head;
-        init_mutex(&b->mu);
+        init_mutex_with_name(&b->mu, "buf.mu");
         bcache.head.next->prev = b;
         bcache.head.next = b;
     }
@@ -9,8 +9,9 @@
 
 #define NFILE       100  // open files per system
 #define NINODE       50  // maximum number of active i-nodes
-#define NCACHE       200 // page cache size
-#define NDEV         11  // maximum major device number
+#define CACHE_RESERVED_PAGES 1024 // page cache stops growing below this many free pages
+#define CACHE_MAX_PAGES 4096      // and at this many pages
+#define NDEV         13  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
 #define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
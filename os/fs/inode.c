@@ -2,93 +2,103 @@
 #include <fs/fs.h>
 #include <fs/buf.h>
 #include <proc/proc.h>
+#include <mem/slab.h>
 
 struct {
     struct mutex lock;
     struct inode inode[NINODE];
 } itable;
 
+/**
+ * Page cache entries are allocated from cache_cache on demand, found by
+ * (inode, offset) in a hash table and kept in a LRU list, most recently
+ * used first. Once the cache holds CACHE_MAX_PAGES pages, or free memory
+ * drops below CACHE_RESERVED_PAGES, the least recently used entries are
+ * evicted instead of growing the cache further. Entries mapped into user
+ * space cannot be evicted, if all are the cache may go over the limit.
+ */
+#define NCACHE_HASH 256
+
 struct {
     struct mutex lock;
-    struct page_cache cache[NCACHE];
-    struct page_cache* lru[NCACHE];
+    struct page_cache *hash[NCACHE_HASH];
+    struct page_cache *lru_head;
+    struct page_cache *lru_tail;
+    uint count;
+    struct kmem_cache *cache_cache;
 } ctable;
 
-static int cache_writeback(struct page_cache* cache);
-
-static int ctable_lru_evict() {
-//    infof("ctable_lru_evict");
-    for (int i = NCACHE - 1; i>=0;i--) {
-        struct page_cache* cache = ctable.lru[i];
-        if (cache &&                                        // cache entry exists
-            get_physical_page_ref(cache->page) == 1) {  // cache page is not shared
-
-            // if dirty, write back to disk
-            if (cache->dirty && cache_writeback(cache) != 0) {
-                panic("cache_writeback error");
-            }
-            recycle_physical_page(cache->page);
+static struct page_cache **ctable_bucket(struct inode *ip, uint offset) {
+    uint64 h = (uint64)(ip - itable.inode) * 31 + (offset >> PGSHIFT);
+    return &ctable.hash[h % NCACHE_HASH];
+}
 
-            // dereference inode
-            iput(cache->host);
+static void ctable_hash_remove(struct page_cache *cache) {
+    struct page_cache **pp = ctable_bucket(cache->host, cache->offset);
+    while (*pp != cache)
+        pp = &(*pp)->hash_next;
+    *pp = cache->hash_next;
+    cache->hash_next = NULL;
+}
 
-            // clear the cache entry
-            memset(cache, 0, sizeof(struct page_cache));
+static int cache_writeback(struct page_cache* cache);
 
-            // move cache entry from back to front
-            for (int j = i; j < NCACHE - 1; j++) {
-                ctable.lru[j] = ctable.lru[j+1];
-            }
-            ctable.lru[NCACHE - 1] = NULL;
+static void ctable_lru_remove(struct page_cache* cache) {
+    if (cache->prev)
+        cache->prev->next = cache->next;
+    else
+        ctable.lru_head = cache->next;
+    if (cache->next)
+        cache->next->prev = cache->prev;
+    else
+        ctable.lru_tail = cache->prev;
+    cache->prev = cache->next = NULL;
+}
 
-            return 0;
-        }
-    }
-    infof("ctable_lru_evict: no cache entry to evict");
-    return -1;
+static void ctable_lru_add(struct page_cache* cache) {
+    cache->prev = NULL;
+    cache->next = ctable.lru_head;
+    if (ctable.lru_head)
+        ctable.lru_head->prev = cache;
+    else
+        ctable.lru_tail = cache;
+    ctable.lru_head = cache;
 }
 
-static int ctable_lru_add(struct page_cache* cache) {
-//    infof("ctable_lru_add");
-    int i;
-    if (ctable.lru[NCACHE-1] != NULL && ctable_lru_evict() < 0) {
-        infof("ctable_lru_add: ctable_lru_evict error");
-        return -1;
-    }
-    for (i = NCACHE - 1; i > 0; i--) {
-        ctable.lru[i] = ctable.lru[i-1];
-    }
-    ctable.lru[0] = cache;
-    return 0;
+static void ctable_lru_adjust(struct page_cache* cache) {
+    ctable_lru_remove(cache);
+    ctable_lru_add(cache);
 }
 
-static int ctable_lru_remove(struct page_cache* cache) {
-//    infof("ctable_lru_remove");
-    for (int i = 0; i < NCACHE; i++) {
-        if (ctable.lru[i] == cache) {
-            for (int j = i; j < NCACHE - 1; j++) {
-                ctable.lru[j] = ctable.lru[j+1];
-            }
-            ctable.lru[NCACHE - 1] = NULL;
-            return 0;
-        }
+// write back and free one entry, caller holds ctable.lock
+static void ctable_free_entry(struct page_cache* cache) {
+    // if dirty, write back to disk
+    if (cache->dirty && cache_writeback(cache) != 0) {
+        panic("cache_writeback error");
     }
-    infof("ctable_lru_remove: cache not found");
-    return -1;
+    recycle_physical_page(cache->page);
+
+    ctable_hash_remove(cache);
+    // dereference inode
+    iput(cache->host);
+
+    ctable_lru_remove(cache);
+    ctable.count--;
+    kmem_cache_free(ctable.cache_cache, cache);
 }
 
-static int ctable_lru_adjust(struct page_cache* cache) {
-//    infof("ctable_lru_adjust");
-    for (int i = 0; i < NCACHE; i++) {
-        if (ctable.lru[i] == cache) {
-            for (int j = i; j > 0; j--) {
-                ctable.lru[j] = ctable.lru[j-1];
-            }
-            ctable.lru[0] = cache;
+static int ctable_lru_evict() {
+//    infof("ctable_lru_evict");
+    for (struct page_cache* cache = ctable.lru_tail; cache; cache = cache->prev) {
+        // nobody can look the entry up without ctable.lock,
+        // so an unlocked one is not in use
+        if (!mutex_is_locked(&cache->lock) &&
+            get_physical_page_ref(cache->page) == 1) {  // cache page is not shared
+            ctable_free_entry(cache);
             return 0;
         }
     }
-    infof("ctable_lru_adjust: cache not found");
+    infof("ctable_lru_evict: no cache entry to evict");
     return -1;
 }
 
@@ -100,46 +110,48 @@ struct page_cache* ctable_acquire(struct inode* ip, uint offset) {
     struct page_cache* cache;
 
     acquire_mutex_sleep(&ctable.lock);
-    // reuse cache if it is already in the cache
-    for (cache = ctable.cache; cache < ctable.cache + NCACHE; cache++) {
-        acquire_mutex_sleep(&cache->lock);
-        if (cache->valid && cache->host == ip && cache->offset == offset) {
+    // reuse cache if it is already in the cache,
+    // host and offset never change while the entry is in the table
+    struct page_cache **bucket = ctable_bucket(ip, offset);
+    for (cache = *bucket; cache; cache = cache->hash_next) {
+        if (cache->host == ip && cache->offset == offset) {
 //            infof("reuse cache");
             ctable_lru_adjust(cache);
+            acquire_mutex_sleep(&cache->lock);
             release_mutex_sleep(&ctable.lock);
             return cache;
         }
-        release_mutex_sleep(&cache->lock);
     }
-    // if not, find an empty cache
-    int first_chance = 1;
-find_again:
-    for (cache = ctable.cache; cache < ctable.cache + NCACHE; cache++) {
-        acquire_mutex_sleep(&cache->lock);
-        if (!cache->valid) {
-//            infof("create cache");
-            cache->host = ip;
-            cache->offset = offset;
-            cache->valid = TRUE;
-            cache->dirty = FALSE;
-            cache->page = alloc_physical_page();
-            memset(cache->page, 0, PGSIZE);
+    // if not, make a new entry
+    if (ctable.count >= CACHE_MAX_PAGES || get_free_page_count() < CACHE_RESERVED_PAGES) {
+        ctable_lru_evict();
+    }
+    void *page = NULL;
+    cache = kmem_cache_alloc(ctable.cache_cache);
+    if (cache == NULL || (page = alloc_zeroed_physical_page()) == NULL) {
+        // out of memory, make room and try once more
+        if (ctable_lru_evict() == 0) {
+            if (cache == NULL)
+                cache = kmem_cache_alloc(ctable.cache_cache);
+            if (cache != NULL)
+                page = alloc_zeroed_physical_page();
+        }
+        if (page == NULL) {
+            kmem_cache_free(ctable.cache_cache, cache);
             release_mutex_sleep(&ctable.lock);
-            goto read_page;
+            infof("ctable_acquire: no free space");
+            return NULL;
         }
-        release_mutex_sleep(&cache->lock);
-    }
-    if (first_chance) {
-        first_chance = 0;
-        ctable_lru_evict();
-        goto find_again;
-    } else {
-        release_mutex_sleep(&ctable.lock);
-        infof("ctable_acquire: no free space");
-        return NULL;
     }
+//    infof("create cache");
+    init_mutex_with_name(&cache->lock, "page_cache.lock");
+    acquire_mutex_sleep(&cache->lock);
+    cache->host = ip;
+    cache->offset = offset;
+    cache->valid = TRUE;
+    cache->dirty = FALSE;
+    cache->page = page;
 
-read_page:
     if (f_lseek(&ip->file, offset) != FR_OK) {
         infof("ctable_acquire: invalid offset");
         goto read_page_err;
@@ -152,17 +164,17 @@ read_page:
     }
 
     idup(ip);
+    cache->hash_next = *bucket;
+    *bucket = cache;
     ctable_lru_add(cache);
+    ctable.count++;
+    release_mutex_sleep(&ctable.lock);
     return cache;
 
 read_page_err:
-    cache->host = NULL;
-    cache->offset = 0;
-    cache->valid = FALSE;
-    cache->dirty = FALSE;
+    release_mutex_sleep(&ctable.lock);
     recycle_physical_page(cache->page);
-    cache->page = NULL;
-    release_mutex_sleep(&cache->lock);
+    kmem_cache_free(ctable.cache_cache, cache);
     return NULL;
 }
 
@@ -220,40 +232,27 @@ static int cache_writeback(struct page_cache* cache) {
 // so the disk can get all changes back to it
 void ctable_release(struct inode *ip) {
     infof("ctable_release");
-    struct page_cache* cache;
+    struct page_cache *cache, *next;
     acquire_mutex_sleep(&ctable.lock);
-    for (cache = ctable.cache; cache < ctable.cache + NCACHE; cache++) {
-        acquire_mutex_sleep(&cache->lock);
-        if (cache->valid && (cache->host == ip || ip == NULL)) {
-            // if dirty, write back to disk
-            if (cache->dirty && cache_writeback(cache) != 0) {
-                panic("cache_writeback error");
-            }
-
-            // release physical page
+    for (cache = ctable.lru_head; cache; cache = next) {
+        next = cache->next;
+        if (cache->host == ip || ip == NULL) {
+            acquire_mutex_sleep(&cache->lock);
             KERNEL_ASSERT(get_physical_page_ref(cache->page) == 1, "page ref is not 1");
-            recycle_physical_page(cache->page);
-
-            // dereference inode
-            iput(cache->host);
-
-            // clear the cache entry
-            memset(cache, 0, sizeof(struct page_cache));
-
-            // remove it from the lru list
-            ctable_lru_remove(cache);
-
+            ctable_free_entry(cache);
         }
-        release_mutex_sleep(&cache->lock);
     }
     release_mutex_sleep(&ctable.lock);
 }
 
 static void cache_table_init() {
-    init_mutex(&ctable.lock);
-    for (int i = 0; i < NCACHE; i++) {
-        init_mutex(&ctable.cache[i].lock);
-    }
+    init_mutex_with_name(&ctable.lock, "ctable.lock");
+    for (int i = 0; i < NCACHE_HASH; i++)
+        ctable.hash[i] = NULL;
+    ctable.lru_head = ctable.lru_tail = NULL;
+    ctable.count = 0;
+    ctable.cache_cache = kmem_cache_create("page_cache", sizeof(struct page_cache));
+    KERNEL_ASSERT(ctable.cache_cache != NULL, "page cache cache");
 }
 
 
@@ -386,9 +385,9 @@ skipelem(char *path, char *name) {
 
 void inode_table_init() {
 //    init_spin_lock_with_name(&itable.lock, "itable");
-    init_mutex(&itable.lock);
+    init_mutex_with_name(&itable.lock, "itable.lock");
     for (int i = 0; i < NINODE; i++) {
-        init_mutex(&itable.inode[i].lock);
+        init_mutex_with_name(&itable.inode[i].lock, "inode.lock");
     }
     cache_table_init();
 }
@@ -446,30 +445,85 @@ void inode_table_init() {
 //    return inode_ptr;
 //}
 
-struct inode *iget_root() {
-    debugcore("iget_root");
+/**
+ * Path lookups that hit take no lock, see ilookup_fast(). They only ever
+ * add to a ref that is not 0, so a slot whose ref reaches 0 is owned by
+ * itable.lock, and is filled again only after a grace period, when no
+ * lockless lookup can still be comparing its path.
+ */
 
-    struct inode *inode_ptr, *empty;
-    //    acquire(&itable.lock);
-    acquire_mutex_sleep(&itable.lock);
-    // Is the inode already in the table?
-    empty = NULL;
-    for (inode_ptr = &itable.inode[0]; inode_ptr < &itable.inode[NINODE]; inode_ptr++) {
-        if (inode_ptr->ref > 0 && inode_ptr->dev == ROOTDEV && strcmp(inode_ptr->path, "/") == 0) {
-            inode_ptr->ref++;
-            //    release(&itable.lock);
-            release_mutex_sleep(&itable.lock);
-            return inode_ptr;
-        }
-        if (inode_ptr->ref == 0) { // Remember empty slot.
-            empty = inode_ptr; // still holding lock
+// Make a slot filled under itable.lock visible to lockless lookups.
+static void inode_publish(struct inode *ip) {
+    __atomic_store_n(&ip->ref, 1, __ATOMIC_RELEASE);
+}
+
+// Find the inode of path in the table without itable.lock.
+// Returns it with a reference taken, or NULL to look with the lock.
+static struct inode *ilookup_fast(const char *path) {
+    struct inode *found = NULL;
+    rcu_read_lock();
+    for (struct inode *ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++) {
+        int ref = __atomic_load_n(&ip->ref, __ATOMIC_ACQUIRE);
+        if (ref == 0 || ip->dev != ROOTDEV || strcmp(ip->path, path) != 0)
+            continue;
+        // unless its last reference went meanwhile
+        while (ref > 0 && !__atomic_compare_exchange_n(&ip->ref, &ref, ref + 1, FALSE,
+                                                       __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+            ;
+        if (ref > 0) {
+            found = ip;
             break;
         }
     }
+    rcu_read_unlock();
+    return found;
+}
+
+// Find the inode of path in the table, taking itable.lock.
+// Returns it with a reference taken and the lock released, or NULL with
+// the lock held and in *empty a slot to fill. When only recently freed
+// slots are left, waits for a grace period without the lock and looks
+// again.
+static struct inode *itable_find(const char *path, struct inode **empty) {
+    for (;;) {
+        bool freeing = FALSE;
+//        acquire(&itable.lock);
+        acquire_mutex_sleep(&itable.lock);
+        *empty = NULL;
+        for (struct inode *ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++) {
+            if (ip->ref > 0 && ip->dev == ROOTDEV && strcmp(ip->path, path) == 0) {
+                __atomic_fetch_add(&ip->ref, 1, __ATOMIC_RELAXED);
+//                release(&itable.lock);
+                release_mutex_sleep(&itable.lock);
+                return ip;
+            }
+            if (*empty == NULL && ip->ref == 0) {
+                if (rcu_gp_done(ip->free_gp))
+                    *empty = ip;
+                else
+                    freeing = TRUE;
+            }
+        }
+        if (*empty != NULL)
+            return NULL;
+        if (!freeing)
+            panic("iget: no inodes");
+        // lookups that take the lock wait meanwhile, not the ones that don't
+//        release(&itable.lock);
+        release_mutex_sleep(&itable.lock);
+        synchronize_rcu();
+    }
+}
+
+struct inode *iget_root() {
+    debugcore("iget_root");
 
-    // Recycle an inode entry.
-    if (empty == NULL)
-        panic("iget: no inodes");
+    struct inode *inode_ptr, *empty;
+    if ((inode_ptr = ilookup_fast("/")) != NULL)
+        return inode_ptr;
+    // Is the inode already in the table? Holds itable.lock if not.
+    if ((inode_ptr = itable_find("/", &empty)) != NULL)
+        return inode_ptr;
 
     inode_ptr = empty;
 
@@ -482,11 +536,11 @@ struct inode *iget_root() {
 
     // fill other fields in inode
     inode_ptr->dev = ROOTDEV;
-    inode_ptr->ref = 1;
     inode_ptr->type = T_DIR;
     strcpy(inode_ptr->path, "/");
     inode_ptr->unlinked = 0;
     inode_ptr->new_path[0] = '\0';
+    inode_publish(inode_ptr);
 
 //    acquire(&itable.lock);
     release_mutex_sleep(&itable.lock);
@@ -503,11 +557,20 @@ struct inode *iget_root() {
 void iput(struct inode *ip) {
 //    tracecore("iput");
     KERNEL_ASSERT(ip != NULL, "inode can not be NULL");
+    int ref = __atomic_load_n(&ip->ref, __ATOMIC_RELAXED);
+    KERNEL_ASSERT(ref > 0, "inode ref can not be 0");
+    // not the last reference, no lock needed
+    while (ref > 1) {
+        if (__atomic_compare_exchange_n(&ip->ref, &ref, ref - 1, FALSE,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            return;
+    }
 //    acquire(&itable.lock);
     acquire_mutex_sleep(&itable.lock);
-    KERNEL_ASSERT(ip->ref > 0, "inode ref can not be 0");
-
-    if (ip->ref == 1) {
+    ref = 1;
+    // a lockless lookup may take one meanwhile
+    if (__atomic_compare_exchange_n(&ip->ref, &ref, 0, FALSE,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
         // close file/direcroty via fatfs interface
         if (ip->type == T_DIR) {
             // close directory via fatfs interface
@@ -543,8 +606,12 @@ void iput(struct inode *ip) {
                 panic("iput: f_rename failed");
             }
         }
+        // lockless lookups may still be looking at it
+        ip->free_gp = rcu_gp_snapshot();
+        rcu_gp_request(ip->free_gp);
+    } else {
+        __atomic_fetch_sub(&ip->ref, 1, __ATOMIC_RELEASE);
     }
-    ip->ref--;
 //    release(&itable.lock);
     release_mutex_sleep(&itable.lock);
 }
@@ -555,11 +622,8 @@ struct inode *
 idup(struct inode *ip) {
 //    tracecore("idup");
     KERNEL_ASSERT(ip != NULL, "inode can not be NULL");
-//    acquire(&itable.lock);
-    acquire_mutex_sleep(&itable.lock);
-    ip->ref++;
-//    release(&itable.lock);
-    release_mutex_sleep(&itable.lock);
+    KERNEL_ASSERT(ip->ref > 0, "inode ref can not be 0");
+    __atomic_fetch_add(&ip->ref, 1, __ATOMIC_RELAXED);
     return ip;
 }
 
@@ -750,7 +814,7 @@ int writei(struct inode *ip, int user_src, void *src, uint off, uint n) {
 //    } else {
 //        // user address, copyin
 //        char buf[n];
-//        if (copyin(curr_proc()->pagetable, buf, src, n) < 0) {
+//        if (copyin(curr_proc()->mm->pagetable, buf, src, n) < 0) {
 //            return 0;
 //        }
 //        if (f_write(&ip->file, buf, n, &total) != FR_OK) {
@@ -806,8 +870,10 @@ inode_or_parent_by_name(char *path, int nameiparent, char *name) {
 
     // only if the current process is the shell, cwd can be NULL
     // because fs may sleep, so we can't initialize it in the kernel init code
-    if (curr_proc()->cwd == NULL) {
-        curr_proc()->cwd = iget_root();
+    struct fs_struct *fs = curr_proc()->fs;
+    acquire_mutex_sleep(&fs->lock);
+    if (fs->cwd == NULL) {
+        fs->cwd = iget_root();
     }
 
     if (*path == '/') {
@@ -815,8 +881,9 @@ inode_or_parent_by_name(char *path, int nameiparent, char *name) {
         ip = iget_root();
     } else {
         // relative path
-        ip = idup(curr_proc()->cwd);
+        ip = idup(fs->cwd);
     }
+    release_mutex_sleep(&fs->lock);
 
     while ((path = skipelem(path, name)) != 0) {
         ilock(ip);
@@ -952,35 +1019,22 @@ dirlookup(struct inode *dp, char *name) {
 
     // get the inode of the queried entity
     struct inode *inode_ptr, *empty;
-//    acquire(&itable.lock);
-    acquire_mutex_sleep(&itable.lock);
-    // Is the inode already in the table?
-    empty = NULL;
-    for (inode_ptr = &itable.inode[0]; inode_ptr < &itable.inode[NINODE]; inode_ptr++) {
-        if (inode_ptr->ref > 0 && inode_ptr->dev == ROOTDEV && strcmp(inode_ptr->path, path) == 0) {
-            inode_ptr->ref++;
-//            release(&itable.lock);
-            release_mutex_sleep(&itable.lock);
-            return inode_ptr;
-        }
-        if (empty == 0 && inode_ptr->ref == 0) // Remember empty slot.
-            empty = inode_ptr;
-    }
-
-    // Recycle an inode entry.
-    if (empty == NULL)
-        panic("iget: no inodes");
+    if ((inode_ptr = ilookup_fast(path)) != NULL)
+        return inode_ptr;
+    // Is the inode already in the table? Holds itable.lock if not.
+    if ((inode_ptr = itable_find(path, &empty)) != NULL)
+        return inode_ptr;
 
     inode_ptr = empty;
 
     // try to open root directory via fatfs interface
     if (f_opendir(&inode_ptr->dir, path) == FR_OK) {
         inode_ptr->dev = ROOTDEV;
-        inode_ptr->ref = 1;
         inode_ptr->type = T_DIR;
         strcpy(inode_ptr->path, path);
         inode_ptr->unlinked = 0;
         inode_ptr->new_path[0] = '\0';
+        inode_publish(inode_ptr);
 //        release(&itable.lock);
         release_mutex_sleep(&itable.lock);
         return inode_ptr;
@@ -999,13 +1053,13 @@ dirlookup(struct inode *dp, char *name) {
             devinfo.magic == DEVICE_MAGIC) {
             infof("dirlookup: open device: %s", path);
             inode_ptr->dev = ROOTDEV;
-            inode_ptr->ref = 1;
             inode_ptr->type = T_DEVICE;
             inode_ptr->device.major = devinfo.major;
             inode_ptr->device.minor = devinfo.minor;
             strcpy(inode_ptr->path, path);
             inode_ptr->unlinked = 0;
             inode_ptr->new_path[0] = '\0';
+            inode_publish(inode_ptr);
 //            release(&itable.lock);
             release_mutex_sleep(&itable.lock);
             return inode_ptr;
@@ -1021,14 +1075,15 @@ dirlookup(struct inode *dp, char *name) {
             // record new file
             if (f_open(&inode_ptr->file, symlink_info.path, FA_READ | FA_WRITE) != FR_OK) {
                 infof("dirlookup: symlink destination is invalid: %s", symlink_info.path);
+                release_mutex_sleep(&itable.lock);
                 return NULL;
             }
             inode_ptr->dev = ROOTDEV;
-            inode_ptr->ref = 1;
             inode_ptr->type = T_FILE;
             strcpy(inode_ptr->path, symlink_info.path);
             inode_ptr->unlinked = 0;
             inode_ptr->new_path[0] = '\0';
+            inode_publish(inode_ptr);
 //            release(&itable.lock);
             release_mutex_sleep(&itable.lock);
             ienable_fastseek(inode_ptr);
@@ -1037,11 +1092,11 @@ dirlookup(struct inode *dp, char *name) {
         } else {
             infof("dirlookup: open file: %s", path);
             inode_ptr->dev = ROOTDEV;
-            inode_ptr->ref = 1;
             inode_ptr->type = T_FILE;
             strcpy(inode_ptr->path, path);
             inode_ptr->unlinked = 0;
             inode_ptr->new_path[0] = '\0';
+            inode_publish(inode_ptr);
 //            release(&itable.lock);
             release_mutex_sleep(&itable.lock);
             ienable_fastseek(inode_ptr);
@@ -1073,24 +1128,9 @@ icreate(struct inode *dp, char *name, int type, int major, int minor) {
     // create the inode of the queried entity
     // get the inode of the queried entity
     struct inode *inode_ptr, *empty;
-//    acquire(&itable.lock);
-    acquire_mutex_sleep(&itable.lock);
-    // Is the inode already in the table?
-    empty = NULL;
-    for (inode_ptr = &itable.inode[0]; inode_ptr < &itable.inode[NINODE]; inode_ptr++) {
-        if (inode_ptr->ref > 0 && inode_ptr->dev == ROOTDEV && strcmp(inode_ptr->path, path) == 0) {
-            inode_ptr->ref++;
-//            release(&itable.lock);
-            release_mutex_sleep(&itable.lock);
-            return inode_ptr;
-        }
-        if (empty == 0 && inode_ptr->ref == 0) // Remember empty slot.
-            empty = inode_ptr;
-    }
-
-    // Recycle an inode entry.
-    if (empty == NULL)
-        panic("iget: no inodes");
+    // Is the inode already in the table? Holds itable.lock if not.
+    if ((inode_ptr = itable_find(path, &empty)) != NULL)
+        return inode_ptr;
 
     inode_ptr = empty;
     FRESULT result;
@@ -1113,11 +1153,11 @@ icreate(struct inode *dp, char *name, int type, int major, int minor) {
             return NULL;
         }
         inode_ptr->dev = ROOTDEV;
-        inode_ptr->ref = 1;
         inode_ptr->type = T_DIR;
         strcpy(inode_ptr->path, path);
         inode_ptr->unlinked = 0;
         inode_ptr->new_path[0] = '\0';
+        inode_publish(inode_ptr);
 //        release(&itable.lock);
         release_mutex_sleep(&itable.lock);
         return inode_ptr;
@@ -1132,11 +1172,11 @@ icreate(struct inode *dp, char *name, int type, int major, int minor) {
             return NULL;
         }
         inode_ptr->dev = ROOTDEV;
-        inode_ptr->ref = 1;
         inode_ptr->type = T_FILE;
         strcpy(inode_ptr->path, path);
         inode_ptr->unlinked = 0;
         inode_ptr->new_path[0] = '\0';
+        inode_publish(inode_ptr);
 //        release(&itable.lock);
         release_mutex_sleep(&itable.lock);
         ienable_fastseek(inode_ptr);
@@ -1160,13 +1200,13 @@ icreate(struct inode *dp, char *name, int type, int major, int minor) {
             return NULL;
         }
         inode_ptr->dev = ROOTDEV;
-        inode_ptr->ref = 1;
         inode_ptr->type = T_DEVICE;
         inode_ptr->device.major = major;
         inode_ptr->device.minor = minor;
         strcpy(inode_ptr->path, path);
         inode_ptr->unlinked = 0;
         inode_ptr->new_path[0] = '\0';
+        inode_publish(inode_ptr);
 //        release(&itable.lock);
         release_mutex_sleep(&itable.lock);
         return inode_ptr;
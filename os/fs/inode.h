@@ -38,6 +38,7 @@ struct inode {
     bool unlinked;      // has been unlinked
     char new_path[MAXPATH]; // absolute path, if it has been renamed
     uint32 clmt[NFASTSEEK]; // cluster link map table buffer, for fatfs fast seek
+    uint64 free_gp;         // the slot may be filled again once rcu_gp_done()
 };
 
 struct page_cache {
@@ -47,6 +48,9 @@ struct page_cache {
     uint dirty;
     uint valid;
     void *page;
+    struct page_cache *prev;    // LRU list, protected by ctable.lock
+    struct page_cache *next;
+    struct page_cache *hash_next;   // hash chain, protected by ctable.lock
 };
 
 struct device {
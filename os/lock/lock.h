@@ -4,6 +4,10 @@
 #include <ucore/defs.h>
 
 #include "mutex.h"
+#include "rcu.h"
+#include "rwlock.h"
+#include "seqlock.h"
 #include "spinlock.h"
+#include "waitqueue.h"
 
 #endif // LOCK_H
@@ -0,0 +1,88 @@
+#include <lock/lock.h>
+#include <arch/riscv.h>
+#include <arch/timer.h>
+#include <ucore/ucore.h>
+
+/**
+ * Spinlock scaling benchmark, built in with LOCK_BENCH=1.
+ * Every booted hart calls lock_bench() before it enters scheduler(). For
+ * BENCH_MS they all take turns on one lock around a short critical
+ * section, then the first hart to arrive prints the throughput, how the
+ * acquisitions were shared out between harts and the longest wait.
+ * scripts/lock_bench.py runs it for each spinlock flavour and hart count.
+ */
+
+#ifdef LOCK_BENCH
+
+#define BENCH_MS 500
+#define BENCH_CS_WORDS 8    // shared words written under the lock
+
+static struct spinlock bench_lock = {.name = "lock_bench"};
+static volatile uint64 bench_data[BENCH_CS_WORDS];
+static struct {
+    uint64 ops;
+    uint64 max_wait;    // ticks
+} bench_stat[NCPU];
+static int arrived, finished;
+
+static const char *lock_flavour() {
+#if defined(SPINLOCK_MCS)
+    return "mcs";
+#elif defined(SPINLOCK_TICKET)
+    return "ticket";
+#else
+    return "tas";
+#endif
+}
+
+void lock_bench(void) {
+    int me = cpuid();
+    int harts = 0;
+    for (int i = 0; i < NCPU; i++) {
+        if (booted[i])
+            harts++;
+    }
+    int order = __atomic_fetch_add(&arrived, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&arrived, __ATOMIC_ACQUIRE) < harts)
+        cpu_relax();
+
+    uint64 ops = 0, max_wait = 0;
+    uint64 end = r_time() + MS_TO_TICK(BENCH_MS);
+    for (uint64 t0; (t0 = r_time()) < end; ops++) {
+        acquire(&bench_lock);
+        uint64 wait = r_time() - t0;
+        for (int i = 0; i < BENCH_CS_WORDS; i++)
+            bench_data[i]++;
+        release(&bench_lock);
+        if (wait > max_wait)
+            max_wait = wait;
+    }
+    bench_stat[me].ops = ops;
+    bench_stat[me].max_wait = max_wait;
+    __atomic_fetch_add(&finished, 1, __ATOMIC_SEQ_CST);
+    if (order != 0)
+        return;
+
+    while (__atomic_load_n(&finished, __ATOMIC_ACQUIRE) < harts)
+        cpu_relax();
+    uint64 total = 0, min = ~0ULL, max = 0;
+    max_wait = 0;
+    for (int i = 0; i < NCPU; i++) {
+        if (!booted[i])
+            continue;
+        total += bench_stat[i].ops;
+        if (bench_stat[i].ops < min)
+            min = bench_stat[i].ops;
+        if (bench_stat[i].ops > max)
+            max = bench_stat[i].ops;
+        if (bench_stat[i].max_wait > max_wait)
+            max_wait = bench_stat[i].max_wait;
+    }
+    KERNEL_ASSERT(bench_data[0] == total, "lock_bench: lost updates under the lock");
+    printf("[lockbench] %s, %d harts: %l acquisitions in %d ms, %l ns each\n",
+           lock_flavour(), harts, total, BENCH_MS, total ? BENCH_MS * 1000000ULL / total : 0);
+    printf("[lockbench] %s, %d harts: per hart min %l max %l, longest wait %l us\n",
+           lock_flavour(), harts, min, max, TICK_TO_US(max_wait));
+}
+
+#endif // LOCK_BENCH
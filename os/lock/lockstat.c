@@ -0,0 +1,86 @@
+#include "lockstat.h"
+#include <ucore/ucore.h>
+
+#ifdef LOCKSTAT
+
+static struct lock_class lock_classes[2][NLOCK_CLASS];
+
+/**
+ * @brief Find or make the class of locks of this name and kind
+ *
+ * Slots are claimed with a compare-and-swap, so locks can be initialised
+ * before and while other harts run, and no lock is needed to look up.
+ * @return NULL if the table is full, the lock is then not counted
+ */
+struct lock_class *lock_class_get(const char *name, int kind) {
+    uint32 h = 2166136261u;     // FNV-1a
+    for (const char *s = name; *s; s++)
+        h = (h ^ (uchar)*s) * 16777619u;
+    for (int i = 0; i < NLOCK_CLASS; i++) {
+        struct lock_class *c = &lock_classes[kind][(h + i) % NLOCK_CLASS];
+        const char *cur = __atomic_load_n(&c->name, __ATOMIC_ACQUIRE);
+        if (cur == NULL) {
+            if (__atomic_compare_exchange_n(&c->name, &cur, name, FALSE,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                return c;
+        }
+        if (cur == name || strcmp(cur, name) == 0)
+            return c;
+    }
+    return NULL;
+}
+
+// Interrupts must be off, the counters are this cpu's.
+void lockstat_acquired(struct lock_class *class, uint64 wait, uint64 site) {
+    struct lock_stat *st = &class->stat[cpuid()];
+    st->acquisitions++;
+    if (wait == 0)
+        return;
+    st->contended++;
+    st->wait_total += wait;
+    if (wait > st->wait_max)
+        st->wait_max = wait;
+    class->contention_site = site;
+}
+
+// Interrupts must be off.
+void lockstat_released(struct lock_class *class, uint64 hold) {
+    struct lock_stat *st = &class->stat[cpuid()];
+    st->hold_total += hold;
+    if (hold > st->hold_max)
+        st->hold_max = hold;
+}
+
+// Sum the counters of the i-th class of kind over all cpus.
+// Returns -1 if there is no such class.
+int lockstat_sum(int kind, int i, const char **name, struct lock_stat *sum, uint64 *site) {
+    struct lock_class *c = &lock_classes[kind][i];
+    if ((*name = __atomic_load_n(&c->name, __ATOMIC_ACQUIRE)) == NULL)
+        return -1;
+    memset(sum, 0, sizeof(*sum));
+    for (int cpu = 0; cpu < NCPU; cpu++) {
+        struct lock_stat *st = &c->stat[cpu];
+        sum->acquisitions += st->acquisitions;
+        sum->contended += st->contended;
+        sum->wait_total += st->wait_total;
+        sum->hold_total += st->hold_total;
+        sum->wait_max = MAX(sum->wait_max, st->wait_max);
+        sum->hold_max = MAX(sum->hold_max, st->hold_max);
+    }
+    *site = c->contention_site;
+    return 0;
+}
+
+// Zero every counter. Racy against locks taken meanwhile, which may keep
+// a count or two from before.
+void lockstat_reset() {
+    for (int kind = 0; kind < 2; kind++) {
+        for (int i = 0; i < NLOCK_CLASS; i++) {
+            struct lock_class *c = &lock_classes[kind][i];
+            memset(c->stat, 0, sizeof(c->stat));
+            c->contention_site = 0;
+        }
+    }
+}
+
+#endif // LOCKSTAT
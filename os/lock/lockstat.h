@@ -0,0 +1,42 @@
+#if !defined(LOCKSTAT_H)
+#define LOCKSTAT_H
+#include <ucore/types.h>
+
+/**
+ * Lock statistics, built in with LOCKSTAT=1.
+ * Locks of the same name and kind share one lock_class. Its counters are
+ * kept per cpu, so updates need no atomics, and summed when read from
+ * /dev/lockstat. Spinlock times are in cycles, mutex times in ticks,
+ * since a sleeping mutex may be taken and given back on different harts.
+ */
+
+#define LOCK_SPIN 0
+#define LOCK_MUTEX 1
+#define NLOCK_CLASS 128     // per kind
+
+struct lock_stat {
+    uint64 acquisitions;
+    uint64 contended;       // had to wait
+    uint64 wait_total;
+    uint64 wait_max;
+    uint64 hold_total;
+    uint64 hold_max;
+};
+
+struct lock_class {
+    const char *name;       // NULL while the slot is free
+    uint64 contention_site; // return address of the last contended acquire
+    struct lock_stat stat[NCPU];
+};
+
+#ifdef LOCKSTAT
+
+struct lock_class *lock_class_get(const char *name, int kind);
+void lockstat_acquired(struct lock_class *class, uint64 wait, uint64 site);
+void lockstat_released(struct lock_class *class, uint64 hold);
+int lockstat_sum(int kind, int i, const char **name, struct lock_stat *sum, uint64 *site);
+void lockstat_reset();
+
+#endif // LOCKSTAT
+
+#endif // LOCKSTAT_H
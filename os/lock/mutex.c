@@ -3,36 +3,150 @@
 #include <proc/proc.h>
 #include <ucore/ucore.h>
 
+// lives on the kernel stack of the sleeping proc
+struct mutex_waiter {
+    struct proc *proc;
+    bool granted;       // the mutex was handed to us
+    struct mutex_waiter *next;
+};
+
 void init_mutex(struct mutex *mutex) {
+    init_mutex_with_name(mutex, "unnamed");
+}
+
+void init_mutex_with_name(struct mutex *mutex, const char *name) {
     init_spin_lock_with_name(&mutex->guard_lock, "mutex.guard_lock");
-    mutex->locked = FALSE;
-    mutex->pid = 0;
+    mutex->owner = NULL;
+    mutex->head = mutex->tail = NULL;
+    mutex->name = name;
+#ifdef LOCKSTAT
+    mutex->class = lock_class_get(name, LOCK_MUTEX);
+#endif
+}
+
+static inline int mutex_trylock(struct mutex *mu, struct proc *p) {
+    struct proc *expected = NULL;
+    return __atomic_compare_exchange_n(&mu->owner, &expected, p, FALSE,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Wait for the owner to let go while it runs on another hart
+ *
+ * Interrupts stay on, so the spinner can be preempted like any other
+ * kernel code. Stops once the owner sleeps or is preempted, or when
+ * others sleep for the mutex already, who come first.
+ * @return whether the mutex is ours
+ */
+static int mutex_spin_on_owner(struct mutex *mu, struct proc *p) {
+#ifdef MUTEX_SPIN
+    for (;;) {
+        struct proc *owner = __atomic_load_n(&mu->owner, __ATOMIC_RELAXED);
+        if (owner == NULL) {
+            if (mutex_trylock(mu, p))
+                return TRUE;
+            continue;
+        }
+        if (owner->state != RUNNING || __atomic_load_n(&mu->head, __ATOMIC_RELAXED) != NULL)
+            return FALSE;
+        cpu_relax();
+    }
+#endif
+    return FALSE;
+}
+
+static void mutex_acquired(struct mutex *mu, uint64 start, uint64 site) {
+#ifdef LOCKSTAT
+    if (mu->class) {
+        push_off();
+        uint64 now = r_time();
+        lockstat_acquired(mu->class, start ? now - start : 0, site);
+        mu->acquired_at = now;
+        pop_off();
+    }
+#endif
 }
 
 void acquire_mutex_sleep(struct mutex *mu) {
+    struct proc *p = curr_proc();
+    uint64 site = (uint64)__builtin_return_address(0);
+    if (mutex_trylock(mu, p)) {
+        mutex_acquired(mu, 0, site);
+        return;
+    }
+    if (mu->owner == p) {
+        printf("mutex \"%s\" is held by pid %d, cannot be reacquired", mu->name, p->pid);
+        panic("This proc is acquiring an acquired mutex");
+    }
+    uint64 start = r_time();
+    if (mutex_spin_on_owner(mu, p)) {
+        mutex_acquired(mu, start, site);
+        return;
+    }
+
+    struct mutex_waiter w;
+    w.proc = p;
+    w.granted = FALSE;
+    w.next = NULL;
     acquire(&mu->guard_lock);
-    while (mu->locked) {
-        debugcore("acquire mutex sleep start");
-        sleep(mu, &mu->guard_lock);
-        debugcore("acquire mutex sleep end");
+    // owner only becomes NULL under the guard lock, so if it is not now
+    // the release that clears it will see us
+    if (mutex_trylock(mu, p)) {
+        release(&mu->guard_lock);
+        mutex_acquired(mu, start, site);
+        return;
     }
-    mu->locked = 1;
-    mu->pid = curr_proc()->pid;
+    if (mu->tail)
+        mu->tail->next = &w;
+    else
+        mu->head = &w;
+    mu->tail = &w;
+
+    debugcore("acquire mutex sleep start");
+    acquire(&p->lock);
     release(&mu->guard_lock);
+    // killed or not, we wait for the handoff
+    while (!w.granted) {
+        p->waiting_target = &w;
+        p->state = SLEEPING;
+        switch_to_scheduler();
+        p->waiting_target = NULL;
+    }
+    release(&p->lock);
+    debugcore("acquire mutex sleep end");
+    mutex_acquired(mu, start, site);
 }
+
 void release_mutex_sleep(struct mutex *mu) {
     acquire(&mu->guard_lock);
-    mu->locked = 0;
-    mu->pid = 0;
-    wakeup(mu);
+#ifdef LOCKSTAT
+    if (mu->class)
+        lockstat_released(mu->class, r_time() - mu->acquired_at);
+#endif
+    struct mutex_waiter *w = mu->head;
+    if (w == NULL) {
+        __atomic_store_n(&mu->owner, NULL, __ATOMIC_RELEASE);
+        release(&mu->guard_lock);
+        return;
+    }
+    mu->head = w->next;
+    if (mu->head == NULL)
+        mu->tail = NULL;
+    // hand over, spinners see an owner that does not run and go to sleep
+    struct proc *p = w->proc;
+    __atomic_store_n(&mu->owner, p, __ATOMIC_RELEASE);
+    // the waiter holds p->lock from before it dropped the guard lock
+    // until it sleeps, so it cannot miss this
+    acquire(&p->lock);
+    w->granted = TRUE;      // w may be gone as soon as this is seen
+    if (p->state == SLEEPING && p->waiting_target == w)
+        make_runnable(p);
+    release(&p->lock);
     release(&mu->guard_lock);
 }
 
+// Only the owner writes owner while it is set, no lock is needed to
+// see whether we are it.
 int holdingsleep(struct mutex *lk) {
-    int ret;
-
-    acquire(&lk->guard_lock);
-    ret = lk->locked && (lk->pid == curr_proc()->pid);
-    release(&lk->guard_lock);
-    return ret;
-}
\ No newline at end of file
+    return __atomic_load_n(&lk->owner, __ATOMIC_RELAXED) == curr_proc();
+}
@@ -2,16 +2,39 @@
 #define MUTEX_H
 #include "spinlock.h"
 
+struct proc;
+struct mutex_waiter;
+
+/**
+ * Sleeping mutex.
+ * A free mutex is taken with one compare-and-swap on owner. A contender
+ * spins while the owner runs on another hart, since then it will soon
+ * let go, and otherwise sleeps in FIFO order. release_mutex_sleep()
+ * hands the mutex straight to the first sleeper, so it is never woken
+ * only to find the mutex taken again.
+ */
 struct mutex {
-    uint locked; // Is the lock held?
-    struct spinlock guard_lock;
+    struct proc *owner;             // NULL when free
+    struct spinlock guard_lock;     // protects the waiters, owner only
+                                    // becomes NULL under it
+    struct mutex_waiter *head;      // sleepers, oldest first
+    struct mutex_waiter *tail;
     const char *name;
-    int pid;
+#ifdef LOCKSTAT
+    struct lock_class *class;
+    uint64 acquired_at;     // tick
+#endif
 };
 
 void init_mutex(struct mutex *mutex);
+void init_mutex_with_name(struct mutex *mutex, const char *name);
 void acquire_mutex_sleep(struct mutex *mu);
 void release_mutex_sleep(struct mutex *mu);
 int holdingsleep(struct mutex *lk);
 
+// Racy, for heuristics and for locks nobody else can look up.
+static inline int mutex_is_locked(struct mutex *mu) {
+    return __atomic_load_n(&mu->owner, __ATOMIC_RELAXED) != NULL;
+}
+
 #endif // MUTEX_H
@@ -0,0 +1,172 @@
+#include "rcu.h"
+#include <proc/proc.h>
+#include <proc/scheduler.h>
+#include <ucore/ucore.h>
+
+/**
+ * One grace period runs at a time. Starting one marks every online hart
+ * as owing a quiescent state; the last hart to report completes it.
+ * Callbacks wait on one list in the order they were queued, each for the
+ * first grace period that starts after it, so the ready ones are at the
+ * front. They run from scheduler() on whichever hart gets there first.
+ */
+
+static struct {
+    struct spinlock lock;
+    uint64 gp_seq;          // grace periods completed
+    bool gp_active;
+    uint64 gp_req;          // the latest grace period anybody waits for
+    uint64 qs_pending;      // harts yet to pass a quiescent state
+    struct rcu_head *head;  // callbacks not yet run
+    struct rcu_head **tail;
+} rcu;
+
+void rcu_init(void) {
+    init_spin_lock_with_name(&rcu.lock, "rcu.lock");
+    rcu.gp_seq = 0;
+    rcu.gp_active = FALSE;
+    rcu.gp_req = 0;
+    rcu.qs_pending = 0;
+    rcu.head = NULL;
+    rcu.tail = &rcu.head;
+}
+
+void rcu_read_lock(void) {
+    preempt_disable();
+}
+
+void rcu_read_unlock(void) {
+    preempt_enable();
+}
+
+// The grace period that a reader running now is sure to have left by the
+// time it completes. With rcu.lock held.
+static uint64 gp_target(void) {
+    return rcu.gp_seq + (rcu.gp_active ? 2 : 1);
+}
+
+// With rcu.lock held. Returns TRUE if idle harts need waking.
+static bool start_gp(void) {
+    uint64 online = 0;
+    for (int i = 0; i < NCPU; i++) {
+        if (run_queues[i].online)
+            online |= 1ULL << i;
+    }
+    if (online == 0) {
+        // no hart runs procs yet, there can be no reader
+        rcu.gp_seq++;
+        return FALSE;
+    }
+    rcu.gp_active = TRUE;
+    // whatever was unpublished before must be visible before the harts
+    // see they owe a quiescent state, pairs with rcu_qs_pending()
+    __sync_synchronize();
+    __atomic_store_n(&rcu.qs_pending, online, __ATOMIC_RELAXED);
+    __sync_synchronize();
+    return TRUE;
+}
+
+// Ask for grace periods up to target, the one running now is followed by
+// another while target is not reached.
+void rcu_gp_request(uint64 target) {
+    bool wake = FALSE;
+    acquire(&rcu.lock);
+    if (target > rcu.gp_req)
+        rcu.gp_req = target;
+    if (!rcu.gp_active && rcu.gp_seq < target)
+        wake = start_gp();
+    release(&rcu.lock);
+    // a hart in WFI would not report until its next timer deadline
+    if (wake)
+        wake_idle_harts();
+}
+
+/**
+ * @brief Call func(head) once every reader that may see the object is gone
+ *
+ * func runs from scheduler(), it must not sleep.
+ */
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head)) {
+    head->func = func;
+    head->next = NULL;
+    acquire(&rcu.lock);
+    head->snap = gp_target();
+    *rcu.tail = head;
+    rcu.tail = &head->next;
+    release(&rcu.lock);
+    rcu_gp_request(head->snap);
+}
+
+// A cookie for rcu_gp_done(), which is TRUE once every reader running
+// now has left. Starts no grace period, see rcu_gp_request().
+uint64 rcu_gp_snapshot(void) {
+    acquire(&rcu.lock);
+    uint64 snap = gp_target();
+    release(&rcu.lock);
+    return snap;
+}
+
+bool rcu_gp_done(uint64 snap) {
+    return __atomic_load_n(&rcu.gp_seq, __ATOMIC_ACQUIRE) >= snap;
+}
+
+// Wait for every reader running now to leave. Must not be called by one.
+void synchronize_rcu(void) {
+    uint64 snap = rcu_gp_snapshot();
+    // our own hart reports when we yield
+    while (!rcu_gp_done(snap)) {
+        rcu_gp_request(snap);
+        yield();
+    }
+}
+
+bool rcu_qs_pending(int cpu) {
+    return (__atomic_load_n(&rcu.qs_pending, __ATOMIC_RELAXED) & (1ULL << cpu)) != 0;
+}
+
+// This hart holds no reference from any reader, with no proc or one that
+// came from user mode.
+void rcu_qs_report(int cpu) {
+    if (!rcu_qs_pending(cpu))
+        return;
+    bool wake = FALSE;
+    acquire(&rcu.lock);
+    uint64 pending = rcu.qs_pending & ~(1ULL << cpu);
+    __atomic_store_n(&rcu.qs_pending, pending, __ATOMIC_RELAXED);
+    if (rcu.gp_active && pending == 0) {
+        rcu.gp_active = FALSE;
+        __atomic_store_n(&rcu.gp_seq, rcu.gp_seq + 1, __ATOMIC_RELEASE);
+        // asked for while it ran
+        if (rcu.gp_req > rcu.gp_seq)
+            wake = start_gp();
+    }
+    release(&rcu.lock);
+    if (wake)
+        wake_idle_harts();
+}
+
+// The quiescent state of scheduler(), which also runs the callbacks
+// whose grace period is over.
+void rcu_qs(int cpu) {
+    rcu_qs_report(cpu);
+    if (__atomic_load_n(&rcu.head, __ATOMIC_RELAXED) == NULL)
+        return;
+    acquire(&rcu.lock);
+    struct rcu_head *ready = rcu.head, **end = &rcu.head;
+    while (*end != NULL && (*end)->snap <= rcu.gp_seq)
+        end = &(*end)->next;
+    if (end == &rcu.head) {
+        release(&rcu.lock);
+        return;
+    }
+    rcu.head = *end;
+    if (rcu.head == NULL)
+        rcu.tail = &rcu.head;
+    *end = NULL;
+    release(&rcu.lock);
+    while (ready != NULL) {
+        struct rcu_head *next = ready->next;
+        ready->func(ready);
+        ready = next;
+    }
+}
@@ -0,0 +1,34 @@
+#if !defined(RCU_H)
+#define RCU_H
+#include <ucore/types.h>
+
+/**
+ * Read-copy-update, quiescent-state based.
+ * A reader only keeps its proc on the hart, it takes no lock and writes
+ * nothing shared. A writer unpublishes an object, then frees it once
+ * every online hart has passed a quiescent state, where it can hold no
+ * reference from before: a pass of scheduler() after swtch() comes
+ * back, a trap from user mode, or a timer tick outside any read
+ * section.
+ * A reader must not sleep before rcu_read_unlock().
+ */
+
+struct rcu_head {
+    struct rcu_head *next;
+    uint64 snap;            // the grace period it waits for
+    void (*func)(struct rcu_head *head);
+};
+
+void rcu_init(void);
+void rcu_read_lock(void);
+void rcu_read_unlock(void);
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head));
+void synchronize_rcu(void);
+uint64 rcu_gp_snapshot(void);
+bool rcu_gp_done(uint64 snap);
+void rcu_gp_request(uint64 target);
+void rcu_qs(int cpu);
+void rcu_qs_report(int cpu);
+bool rcu_qs_pending(int cpu);
+
+#endif // RCU_H
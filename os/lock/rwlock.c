@@ -0,0 +1,59 @@
+#include "rwlock.h"
+#include <arch/riscv.h>
+#include <ucore/ucore.h>
+
+void init_rwlock(struct rwlock *rw, const char *name) {
+    for (int i = 0; i < NCPU; i++)
+        rw->readers[i].count = 0;
+    rw->writer = FALSE;
+    init_spin_lock_with_name(&rw->wlock, name);
+}
+
+void read_lock(struct rwlock *rw) {
+    push_off();
+    uint *count = &rw->readers[cpuid()].count;
+    if (*count > 0) {
+        // a writer waits for us, it must not block us
+        (*count)++;
+        return;
+    }
+    for (;;) {
+        __atomic_store_n(count, 1, __ATOMIC_RELAXED);
+        // the count must be visible before we look for a writer,
+        // pairs with the fence in write_lock()
+        __sync_synchronize();
+        if (!__atomic_load_n(&rw->writer, __ATOMIC_RELAXED))
+            break;
+        __atomic_store_n(count, 0, __ATOMIC_RELEASE);
+        while (__atomic_load_n(&rw->writer, __ATOMIC_RELAXED)) {
+            cpu_relax();
+            // the writer may be waiting for this hart to flush its TLB
+            tlb_shootdown_handle();
+        }
+    }
+}
+
+void read_unlock(struct rwlock *rw) {
+    uint *count = &rw->readers[cpuid()].count;
+    KERNEL_ASSERT(*count > 0, "read_unlock: not read locked");
+    __atomic_store_n(count, *count - 1, __ATOMIC_RELEASE);
+    pop_off();
+}
+
+void write_lock(struct rwlock *rw) {
+    acquire(&rw->wlock);
+    KERNEL_ASSERT(rw->readers[cpuid()].count == 0, "write_lock: read locked by this cpu");
+    __atomic_store_n(&rw->writer, TRUE, __ATOMIC_RELAXED);
+    __sync_synchronize();
+    for (int i = 0; i < NCPU; i++) {
+        while (__atomic_load_n(&rw->readers[i].count, __ATOMIC_ACQUIRE) != 0) {
+            cpu_relax();
+            tlb_shootdown_handle();
+        }
+    }
+}
+
+void write_unlock(struct rwlock *rw) {
+    __atomic_store_n(&rw->writer, FALSE, __ATOMIC_RELEASE);
+    release(&rw->wlock);
+}
@@ -0,0 +1,29 @@
+#if !defined(RWLOCK_H)
+#define RWLOCK_H
+#include "spinlock.h"
+
+/**
+ * Reader-writer spinlock for read-mostly data.
+ * A reader only touches its own cpu's count, so readers on different
+ * harts never share a cache line. A writer announces itself, then waits
+ * for every count to drain. Both sides keep interrupts off like a
+ * spinlock. A reader may nest read_lock() on its own hart.
+ */
+
+struct rwlock_count {
+    uint count;
+} __attribute__((aligned(64)));
+
+struct rwlock {
+    struct rwlock_count readers[NCPU];
+    uint writer;            // a writer holds or waits for the lock
+    struct spinlock wlock;  // serialises writers
+};
+
+void init_rwlock(struct rwlock *rw, const char *name);
+void read_lock(struct rwlock *rw);
+void read_unlock(struct rwlock *rw);
+void write_lock(struct rwlock *rw);
+void write_unlock(struct rwlock *rw);
+
+#endif // RWLOCK_H
@@ -0,0 +1,73 @@
+#if !defined(SEQLOCK_H)
+#define SEQLOCK_H
+#include "spinlock.h"
+
+/**
+ * Sequence counters for small read-mostly data.
+ * A writer makes the count odd while it changes the data. A reader takes
+ * no lock, it copies the data out and tries again if the count was odd
+ * or moved meanwhile. Readers must not follow pointers they read.
+ *
+ * A seqcount leaves serialising the writers to the caller, a seqlock
+ * brings its own spinlock for that.
+ */
+
+struct seqcount {
+    uint seq;
+};
+
+struct seqlock {
+    struct seqcount seqcount;
+    struct spinlock lock;
+};
+
+static inline void init_seqcount(struct seqcount *s) {
+    s->seq = 0;
+}
+
+static inline uint read_seqcount_begin(struct seqcount *s) {
+    uint seq;
+    while ((seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE)) & 1)
+        ;
+    return seq;
+}
+
+// Whether what was read since read_seqcount_begin() returned seq may be torn.
+static inline int read_seqcount_retry(struct seqcount *s, uint seq) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&s->seq, __ATOMIC_RELAXED) != seq;
+}
+
+static inline void write_seqcount_begin(struct seqcount *s) {
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void write_seqcount_end(struct seqcount *s) {
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
+
+static inline void init_seqlock(struct seqlock *sl, const char *name) {
+    init_seqcount(&sl->seqcount);
+    init_spin_lock_with_name(&sl->lock, name);
+}
+
+static inline uint read_seqbegin(struct seqlock *sl) {
+    return read_seqcount_begin(&sl->seqcount);
+}
+
+static inline int read_seqretry(struct seqlock *sl, uint seq) {
+    return read_seqcount_retry(&sl->seqcount, seq);
+}
+
+static inline void write_seqlock(struct seqlock *sl) {
+    acquire(&sl->lock);
+    write_seqcount_begin(&sl->seqcount);
+}
+
+static inline void write_sequnlock(struct seqlock *sl) {
+    write_seqcount_end(&sl->seqcount);
+    release(&sl->lock);
+}
+
+#endif // SEQLOCK_H
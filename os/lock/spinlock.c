@@ -3,56 +3,214 @@
 #include <proc/proc.h>
 #include <ucore/ucore.h>
 #include <arch/timer.h>
-// if you get a deadlock in debugging, define TIMEOUT so that spinlock will panic after
-// some time, and you will see the debugging information
-// but this will impact the performance greatly 
 
-// #define TIMEOUT
+/**
+ * Spinlocks.
+ * A waiter spins with interrupts off. Each round it answers TLB shootdowns,
+ * since the holder may be waiting for this hart to flush, and after
+ * SPIN_REPORT_MS it prints who it waits for, again every SPIN_REPORT_MS,
+ * which names the lock of a deadlock without slowing the fast path.
+ */
 
+#define SPIN_REPORT_MS 1000
+#define BACKOFF_MAX 1024        // pauses between test-and-set tries
+#define TICKET_BACKOFF 16       // pauses per waiter ahead of a ticket
+
+#if defined(SPINLOCK_MCS)
+static struct mcs_node mcs_nodes[NCPU][NMCS_NODE];
+#endif
 
 void init_spin_lock(struct spinlock *slock) {
-    slock->locked = 0;
-    slock->cpu = NULL;
-    slock->name = "unnamed";
+    init_spin_lock_with_name(slock, "unnamed");
 }
 
 void init_spin_lock_with_name(struct spinlock *slock, const char *name) {
+#if defined(SPINLOCK_MCS)
+    slock->tail = NULL;
+    slock->node = NULL;
+#elif defined(SPINLOCK_TICKET)
+    slock->next = 0;
+    slock->owner = 0;
+#else
     slock->locked = 0;
+#endif
     slock->cpu = NULL;
     slock->name = name;
+#ifdef LOCKSTAT
+    slock->class = lock_class_get(name, LOCK_SPIN);
+#endif
 }
-// Acquire the lock.
-// Loops (spins) until the lock is acquired.
-void acquire(struct spinlock *slock) {
-    push_off(); // disable interrupts to avoid deadlock.
-    if (holding(slock)) {
-        printf("lock \"%s\" is held by core %d, cannot be reacquired", slock->name, slock->cpu - cpus);
-        panic("This cpu is acquiring a acquired lock");
+
+static inline void spin_delay(int n) {
+    while (n-- > 0)
+        cpu_relax();
+}
+
+// One round of waiting for slock, since start.
+static void spin_wait(struct spinlock *slock, uint64 start, uint64 *reported) {
+    // the holder may be waiting for this hart to flush its TLB
+    tlb_shootdown_handle();
+    uint64 ms = CYCLE_TO_MS(r_cycle() - start);
+    if (ms >= *reported + SPIN_REPORT_MS) {
+        *reported = ms;
+        // printf_k() takes no lock, the one we wait for may be printf's
+        struct cpu *holder = slock->cpu;
+        printf_k("[spinlock] hart %d waits %d ms for \"%s\" held by hart %d\n",
+                 cpuid(), (int)ms, slock->name, holder ? (int)(holder - cpus) : -1);
     }
+}
 
-    #ifdef TIMEOUT
-    uint64 start = r_cycle();
+#if defined(SPINLOCK_MCS)
+static struct mcs_node *mcs_node_get() {
+    struct mcs_node *n = mcs_nodes[cpuid()];
+    // locks are not always released in the order they were taken
+    for (int i = 0; i < NMCS_NODE; i++) {
+        if (!n[i].used) {
+            n[i].used = TRUE;
+            n[i].next = NULL;
+            n[i].locked = 0;
+            return &n[i];
+        }
+    }
+    panic("mcs_node_get: too many spinlocks held");
+    return NULL;
+}
 #endif
 
-    while (__sync_lock_test_and_set(&slock->locked, 1) != 0)
-        {
-    #ifdef TIMEOUT
-            uint64 now = r_cycle();
-            if(now-start > SECOND_TO_CYCLE(10)){
-                errorf("timeout lock name: %s, hold by cpu %d",slock->name, slock->cpu->core_id);
-                panic("spinlock timeout");
-            }
-    #endif
+// Spin until slock is ours. Interrupts must be off.
+// Returns the cycle we started to wait at, 0 if we did not.
+static uint64 spin_lock(struct spinlock *slock) {
+    uint64 start = 0, reported = 0;
+#if defined(SPINLOCK_MCS)
+    struct mcs_node *node = mcs_node_get();
+    struct mcs_node *prev = __atomic_exchange_n(&slock->tail, node, __ATOMIC_ACQ_REL);
+    if (prev != NULL) {
+        __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+        start = r_cycle();
+        while (!__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE)) {
+            cpu_relax();
+            spin_wait(slock, start, &reported);
+        }
+    }
+    slock->node = node;
+#elif defined(SPINLOCK_TICKET)
+    uint ticket = __atomic_fetch_add(&slock->next, 1, __ATOMIC_RELAXED);
+    uint owner;
+    while ((owner = __atomic_load_n(&slock->owner, __ATOMIC_ACQUIRE)) != ticket) {
+        if (start == 0)
+            start = r_cycle();
+        // the waiters ahead of us hold it about this long each
+        spin_delay((ticket - owner - 1) * TICKET_BACKOFF + 1);
+        spin_wait(slock, start, &reported);
+    }
+#else
+    int backoff = 1;
+    while (__sync_lock_test_and_set(&slock->locked, 1) != 0) {
+        if (start == 0)
+            start = r_cycle();
+        // wait with plain loads, which leave the line shared
+        do {
+            spin_delay(backoff);
+            if (backoff < BACKOFF_MAX)
+                backoff <<= 1;
+            spin_wait(slock, start, &reported);
+        } while (__atomic_load_n(&slock->locked, __ATOMIC_RELAXED) != 0);
+    }
+#endif
+    return start;
+}
 
+static void spin_unlock(struct spinlock *slock) {
+#if defined(SPINLOCK_MCS)
+    struct mcs_node *node = slock->node;
+    struct mcs_node *next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+    if (next == NULL) {
+        struct mcs_node *expected = node;
+        if (__atomic_compare_exchange_n(&slock->tail, &expected, NULL, FALSE,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            node->used = FALSE;
+            return;
         }
+        // a waiter swapped itself in and is about to link behind us
+        while ((next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) == NULL)
+            cpu_relax();
+    }
+    __atomic_store_n(&next->locked, 1, __ATOMIC_RELEASE);
+    node->used = FALSE;
+#elif defined(SPINLOCK_TICKET)
+    __atomic_store_n(&slock->owner, slock->owner + 1, __ATOMIC_RELEASE);
+#else
+    // On RISC-V, sync_lock_release turns into an atomic swap:
+    //   s1 = &lk->locked
+    //   amoswap.w zero, zero, (s1)
+    __sync_lock_release(&slock->locked);
+#endif
+}
 
+static void lock_acquired(struct spinlock *slock, uint64 start, void *site) {
     // Tell the C compiler and the processor to not move loads or stores
     // past this point, to ensure that the critical section's memory
     // references happen strictly after the lock is acquired.
     // On RISC-V, this emits a fence instruction.
     __sync_synchronize();
 
-    slock->cpu = mycpu();
+    struct cpu *c = mycpu();
+    slock->cpu = c;
+#ifdef LOCKSTAT
+    if (c->idle)
+        c->idle_acquires++;
+    if (slock->class) {
+        uint64 now = r_cycle();
+        lockstat_acquired(slock->class, start ? now - start : 0, (uint64)site);
+        slock->acquired_at = now;
+    }
+#endif
+}
+
+// Acquire the lock.
+// Loops (spins) until the lock is acquired.
+void acquire(struct spinlock *slock) {
+    push_off(); // disable interrupts to avoid deadlock.
+    if (holding(slock)) {
+        printf("lock \"%s\" is held by core %d, cannot be reacquired", slock->name, slock->cpu - cpus);
+        panic("This cpu is acquiring a acquired lock");
+    }
+    uint64 start = spin_lock(slock);
+    lock_acquired(slock, start, __builtin_return_address(0));
+}
+
+// Acquire the lock only if it is free, returns whether it was.
+// Never queues behind other waiters.
+int try_acquire(struct spinlock *slock) {
+    push_off();
+    if (holding(slock)) {
+        printf("lock \"%s\" is held by core %d, cannot be reacquired", slock->name, slock->cpu - cpus);
+        panic("This cpu is acquiring a acquired lock");
+    }
+    int ok;
+#if defined(SPINLOCK_MCS)
+    struct mcs_node *node = mcs_node_get();
+    struct mcs_node *expected = NULL;
+    ok = __atomic_compare_exchange_n(&slock->tail, &expected, node, FALSE,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+    if (ok)
+        slock->node = node;
+    else
+        node->used = FALSE;
+#elif defined(SPINLOCK_TICKET)
+    // the ticket being served is free only while no later one is out
+    uint ticket = __atomic_load_n(&slock->owner, __ATOMIC_RELAXED);
+    ok = __atomic_compare_exchange_n(&slock->next, &ticket, ticket + 1, FALSE,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+#else
+    ok = __sync_lock_test_and_set(&slock->locked, 1) == 0;
+#endif
+    if (!ok) {
+        pop_off();
+        return FALSE;
+    }
+    lock_acquired(slock, 0, __builtin_return_address(0));
+    return TRUE;
 }
 
 // Release the lock.
@@ -63,6 +221,10 @@ void release(struct spinlock *slock) {
         panic("Try to release a lock when not holding it");
     }
 
+#ifdef LOCKSTAT
+    if (slock->class)
+        lockstat_released(slock->class, r_cycle() - slock->acquired_at);
+#endif
     slock->cpu = NULL;
 
     // Tell the C compiler and the CPU to not move loads or stores
@@ -73,14 +235,7 @@ void release(struct spinlock *slock) {
     // On RISC-V, this emits a fence instruction.
     __sync_synchronize();
 
-    // Release the lock, equivalent to lk->locked = 0.
-    // This code doesn't use a C assignment, since the C standard
-    // implies that an assignment might be implemented with
-    // multiple store instructions.
-    // On RISC-V, sync_lock_release turns into an atomic swap:
-    //   s1 = &lk->locked
-    //   amoswap.w zero, zero, (s1)
-    __sync_lock_release(&slock->locked);
+    spin_unlock(slock);
 
     pop_off();
 }
@@ -88,7 +243,7 @@ void release(struct spinlock *slock) {
 // Interrupts must be off.
 int holding(struct spinlock *lk) {
     int r;
-    r = (lk->locked && lk->cpu == mycpu());
+    r = (spin_is_locked(lk) && lk->cpu == mycpu());
     return r;
 }
 
@@ -113,6 +268,10 @@ void pop_off(void) {
         panic("pop_off");
     c->noff -= 1;
     if (c->noff == 0 && c->base_interrupt_status) {
+        // an interrupt could preempt us from now on anyway
+        bool preempt = need_preempt();
         intr_on();
+        if (preempt)
+            preempt_schedule();
     }
 }
@@ -1,21 +1,77 @@
 #if !defined(SPINLOCK_H)
 #define SPINLOCK_H
 #include <ucore/types.h>
+#include "lockstat.h"
+
+/**
+ * The lock word depends on the build, see SPINLOCK in the Makefile:
+ * SPINLOCK_TICKET  waiters take a ticket and are served in order
+ * SPINLOCK_MCS     waiters queue up and each spins on its own node
+ * neither          test-and-set with exponential backoff
+ */
+
+#if defined(SPINLOCK_MCS)
+// A waiter's place in an MCS queue, one per lock a hart holds or waits on.
+struct mcs_node {
+    struct mcs_node *next;  // set by the waiter queued behind us
+    uint locked;            // set by our predecessor when it hands over
+    bool used;
+};
+#define NMCS_NODE 8         // locks a hart may hold at once
+#endif
 
 struct spinlock {
+#if defined(SPINLOCK_MCS)
+    struct mcs_node *tail;  // last in the queue, NULL when free
+    struct mcs_node *node;  // the holder's node
+#elif defined(SPINLOCK_TICKET)
+    uint next;              // the next ticket to hand out
+    uint owner;             // the ticket being served
+#else
     uint locked;
+#endif
     struct cpu *cpu;
 
     const char *name;
+#ifdef LOCKSTAT
+    struct lock_class *class;
+    uint64 acquired_at;     // cycle
+#endif
 };
 
 void acquire(struct spinlock *slock);
+int try_acquire(struct spinlock *slock);
 void release(struct spinlock *slock);
 void push_off(void);
 void pop_off(void);
 int holding(struct spinlock *lk);
 
+// Racy peeks at the lock word, good for heuristics only.
+static inline int spin_is_locked(struct spinlock *lk) {
+#if defined(SPINLOCK_MCS)
+    return __atomic_load_n(&lk->tail, __ATOMIC_RELAXED) != NULL;
+#elif defined(SPINLOCK_TICKET)
+    return __atomic_load_n(&lk->next, __ATOMIC_RELAXED) != __atomic_load_n(&lk->owner, __ATOMIC_RELAXED);
+#else
+    return __atomic_load_n(&lk->locked, __ATOMIC_RELAXED) != 0;
+#endif
+}
+
+// Is some other hart waiting for lk? Always false for test-and-set.
+static inline int spin_is_contended(struct spinlock *lk) {
+#if defined(SPINLOCK_MCS)
+    struct mcs_node *tail = __atomic_load_n(&lk->tail, __ATOMIC_RELAXED);
+    return tail != NULL && tail != __atomic_load_n(&lk->node, __ATOMIC_RELAXED);
+#elif defined(SPINLOCK_TICKET)
+    return __atomic_load_n(&lk->next, __ATOMIC_RELAXED) - __atomic_load_n(&lk->owner, __ATOMIC_RELAXED) > 1;
+#else
+    return 0;
+#endif
+}
+
 void init_spin_lock(struct spinlock *slock);
 void init_spin_lock_with_name(struct spinlock *slock, const char *name);
 
+void lock_bench(void);
+
 #endif // SPINLOCK_H
@@ -0,0 +1,176 @@
+#include "waitqueue.h"
+#include <arch/riscv.h>
+#include <proc/proc.h>
+#include <ucore/ucore.h>
+
+/**
+ * Wait queues.
+ * A process sleeping for a condition puts an entry on the condition's
+ * queue, a wake up walks only that queue. Lock order is the caller's
+ * condition lock, then wq->lock, then p->lock.
+ *
+ * sleep() and wakeup() on a channel pointer remain for old callers, they
+ * use a small hashed table of queues.
+ */
+
+#define CHAN_HASH_BITS 6
+#define CHAN_HASH_SIZE (1 << CHAN_HASH_BITS)
+
+static struct wait_queue chan_table[CHAN_HASH_SIZE];
+
+void init_wait_queue(struct wait_queue *wq) {
+    init_spin_lock_with_name(&wq->lock, "wait_queue.lock");
+    wq->head = wq->tail = NULL;
+}
+
+void init_wait_queue_entry(struct wait_queue_entry *e, struct proc *p, void *chan, int flags) {
+    e->proc = p;
+    e->chan = chan;
+    e->flags = flags;
+    e->woken = FALSE;
+    e->prev = e->next = NULL;
+}
+
+// Must hold wq->lock.
+static void queue_append(struct wait_queue *wq, struct wait_queue_entry *e) {
+    e->next = NULL;
+    e->prev = wq->tail;
+    if (wq->tail)
+        wq->tail->next = e;
+    else
+        wq->head = e;
+    wq->tail = e;
+}
+
+// Must hold wq->lock.
+static void queue_unlink(struct wait_queue *wq, struct wait_queue_entry *e) {
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        wq->head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        wq->tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+void wait_queue_add(struct wait_queue *wq, struct wait_queue_entry *e) {
+    acquire(&wq->lock);
+    queue_append(wq, e);
+    release(&wq->lock);
+}
+
+// Take e off wq unless a wake up did already.
+void wait_queue_remove(struct wait_queue *wq, struct wait_queue_entry *e) {
+    acquire(&wq->lock);
+    if (!e->woken)
+        queue_unlink(wq, e);
+    release(&wq->lock);
+}
+
+// Dequeue e and make its process runnable. Must hold wq->lock.
+static void wake_entry(struct wait_queue *wq, struct wait_queue_entry *e) {
+    struct proc *p = e->proc;
+    queue_unlink(wq, e);
+    e->woken = TRUE;
+    // the sleeper holds p->lock from before it dropped wq->lock
+    // until it sleeps, so it cannot miss this
+    acquire(&p->lock);
+    if (p->state == SLEEPING && p->waiting_target == e->chan) {
+        make_runnable(p);
+    }
+    release(&p->lock);
+}
+
+// Wake the waiters on chan, or all of them if chan is NULL, but at most
+// nr_exclusive exclusive ones. Returns how many were woken.
+static int __wake_up(struct wait_queue *wq, int nr_exclusive, void *chan) {
+    int woken = 0;
+    acquire(&wq->lock);
+    struct wait_queue_entry *e = wq->head, *next;
+    for (; e != NULL; e = next) {
+        next = e->next;
+        if (chan != NULL && e->chan != chan)
+            continue;
+        if (e->flags & WQ_FLAG_EXCLUSIVE) {
+            if (nr_exclusive == 0)
+                continue;
+            nr_exclusive--;
+        }
+        wake_entry(wq, e);
+        woken++;
+    }
+    release(&wq->lock);
+    return woken;
+}
+
+// Wake every non-exclusive waiter and the first exclusive one.
+int wake_up(struct wait_queue *wq) {
+    return __wake_up(wq, 1, NULL);
+}
+
+int wake_up_all(struct wait_queue *wq) {
+    return __wake_up(wq, NPROC, NULL);
+}
+
+// Atomically release lk and sleep on wq as chan, reacquire lk when awakened.
+static void __wait_queue_sleep(struct wait_queue *wq, void *chan, int flags, struct spinlock *lk) {
+    struct proc *p = curr_proc();
+    struct wait_queue_entry e;
+
+    init_wait_queue_entry(&e, p, chan, flags);
+    acquire(&wq->lock);
+    queue_append(wq, &e);
+    acquire(&p->lock);
+    release(&wq->lock);
+    release(lk);
+
+    // Go to sleep.
+    p->waiting_target = chan;
+    p->state = SLEEPING;
+
+    switch_to_scheduler();
+    pushtrace(0x3031);
+
+    // Tidy up.
+    p->waiting_target = NULL;
+    release(&p->lock);
+
+    // killed sleepers are made runnable without a wake up
+    wait_queue_remove(wq, &e);
+
+    // Reacquire original lock.
+    acquire(lk);
+}
+
+void wait_queue_sleep(struct wait_queue *wq, struct spinlock *lk) {
+    __wait_queue_sleep(wq, wq, 0, lk);
+}
+
+// Sleep as one of the waiters of which wake_up() wakes only the first,
+// for waiters of which only one can make progress.
+void wait_queue_sleep_exclusive(struct wait_queue *wq, struct spinlock *lk) {
+    __wait_queue_sleep(wq, wq, WQ_FLAG_EXCLUSIVE, lk);
+}
+
+void wait_queue_init_chans() {
+    for (int i = 0; i < CHAN_HASH_SIZE; i++) {
+        init_wait_queue(&chan_table[i]);
+    }
+}
+
+static struct wait_queue *chan_queue(void *chan) {
+    return &chan_table[((uint64)chan * 0x9E3779B97F4A7C15ULL) >> (64 - CHAN_HASH_BITS)];
+}
+
+// Atomically release lock and sleep on chan.
+// Reacquires lock when awakened.
+void sleep(void *waiting_target, struct spinlock *lk) {
+    __wait_queue_sleep(chan_queue(waiting_target), waiting_target, 0, lk);
+}
+
+// Wake up all processes sleeping on chan.
+void wakeup(void *waiting_target) {
+    __wake_up(chan_queue(waiting_target), NPROC, waiting_target);
+}
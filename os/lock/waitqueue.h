@@ -0,0 +1,38 @@
+#if !defined(WAITQUEUE_H)
+#define WAITQUEUE_H
+#include "spinlock.h"
+
+#define WQ_FLAG_EXCLUSIVE 0x1   // wake_up() wakes only one of these
+
+struct proc;
+
+// A sleeping process on a wait queue, lives on the sleeper's kernel stack.
+struct wait_queue_entry {
+    struct proc *proc;
+    void *chan;         // proc->waiting_target while it sleeps
+    int flags;
+    bool woken;         // dequeued by a wake up
+    struct wait_queue_entry *prev;
+    struct wait_queue_entry *next;
+};
+
+// Processes sleeping for one condition, in the order they came.
+struct wait_queue {
+    struct spinlock lock;
+    struct wait_queue_entry *head;
+    struct wait_queue_entry *tail;
+};
+
+void init_wait_queue(struct wait_queue *wq);
+void init_wait_queue_entry(struct wait_queue_entry *e, struct proc *p, void *chan, int flags);
+void wait_queue_add(struct wait_queue *wq, struct wait_queue_entry *e);
+void wait_queue_remove(struct wait_queue *wq, struct wait_queue_entry *e);
+
+void wait_queue_sleep(struct wait_queue *wq, struct spinlock *lk);
+void wait_queue_sleep_exclusive(struct wait_queue *wq, struct spinlock *lk);
+int wake_up(struct wait_queue *wq);
+int wake_up_all(struct wait_queue *wq);
+
+void wait_queue_init_chans();
+
+#endif // WAITQUEUE_H
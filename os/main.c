@@ -2,8 +2,10 @@
 #include <ucore/ucore.h>
 #include <file/file.h>
 #include <proc/proc.h>
+#include <proc/futex.h>
 #include <fatfs/init.h>
 #include <fatfs/fftest.h>
+#include <mem/slab.h>
 extern char s_bss[];
 extern char e_bss[];
 extern char s_text[];
@@ -71,6 +73,8 @@ void main(uint64 hartid, uint64 a1) {
         trapinit();
         trapinit_hart();
         kinit();
+        slab_init();
+        rcu_init();
         procinit();
         plicinit();     // set up interrupt controller
         plicinithart(); // ask PLIC for device interrupts
@@ -82,7 +86,9 @@ void main(uint64 hartid, uint64 a1) {
         infof("kernel vm created");
         kvminithart();
         infof("kernel vm enabled");
+        asid_init();
         timerinit();    // do nothing
+        futex_init();
         init_app_names();
         init_scheduler();
         make_shell_proc();
@@ -116,6 +122,9 @@ void main(uint64 hartid, uint64 a1) {
         ; // wait until all hard started
     }
 
+#ifdef LOCK_BENCH
+    lock_bench();
+#endif
     debugcore("start scheduling!");
     scheduler();
     debugf("halt");
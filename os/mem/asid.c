@@ -0,0 +1,130 @@
+#include <arch/riscv.h>
+#include <lock/lock.h>
+#include <proc/proc.h>
+#include <ucore/defs.h>
+
+/**
+ * Address space identifiers.
+ * Every user page table gets an ASID that tags its TLB entries, so the
+ * trampoline switches satp without flushing the TLB. ASID 0 is the kernel
+ * page table. ASIDs are handed out in generations: when they run out, a new
+ * generation starts, every hart flushes its whole TLB before it next returns
+ * to user mode, and a process from an older generation takes a new ASID the
+ * next time it runs. If the hart implements no ASID bits, everything runs
+ * with ASID 0 and the trampoline flushes on every switch as before.
+ */
+
+#define ASID_MAX_BITS 16
+// a range flush of more pages than this flushes the whole ASID
+#define TLB_FLUSH_PAGES_MAX 64
+
+static struct spinlock asid_lock;
+static uint asid_bits;
+static uint64 asid_generation;  // current generation, in the bits above the ASID
+static uint64 asid_next;        // next ASID to try
+static uint64 asid_map[(1 << ASID_MAX_BITS) / 64];
+static volatile bool asid_flush_pending[NCPU];
+
+#define ASID_MASK ((1ULL << asid_bits) - 1)
+
+// Find out how many ASID bits satp holds. Called on the boot hart
+// with the kernel page table in satp.
+void asid_init() {
+    init_spin_lock_with_name(&asid_lock, "asid_lock");
+    uint64 satp = r_satp();
+    w_satp(satp | SATP_ASID(0xffff));
+    uint64 asid = SATP_ASID_OF(r_satp());
+    w_satp(satp);
+    while (asid & 1) {
+        asid_bits++;
+        asid >>= 1;
+    }
+    // with a single ASID there is nothing to hand out beside the kernel's
+    if (asid_bits < 2) {
+        asid_bits = 0;
+    }
+    asid_generation = 1ULL << asid_bits;
+    asid_next = 1;
+    infof("asid: %d bits", asid_bits);
+}
+
+static bool asid_stale(uint64 asid) {
+    return ((asid ^ __atomic_load_n(&asid_generation, __ATOMIC_ACQUIRE)) >> asid_bits) != 0;
+}
+
+// asid_lock must be held.
+static uint64 asid_new() {
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint64 asid = asid_next; asid <= ASID_MASK; asid++) {
+            if ((asid_map[asid / 64] & (1ULL << (asid % 64))) == 0) {
+                asid_map[asid / 64] |= 1ULL << (asid % 64);
+                asid_next = asid + 1;
+                return asid_generation | asid;
+            }
+        }
+        // roll over, nothing of the old generation stays in any TLB
+        memset(asid_map, 0, sizeof(asid_map));
+        for (int i = 0; i < NCPU; i++) {
+            asid_flush_pending[i] = TRUE;
+        }
+        __atomic_store_n(&asid_generation, asid_generation + (1ULL << asid_bits), __ATOMIC_RELEASE);
+        asid_next = 1;
+    }
+    panic("asid_new: no free asid");
+    return 0;
+}
+
+// Give mm a fresh ASID for its new page table.
+// Stale entries of an old page table keep its old ASID,
+// which is not handed out again before the next generation.
+void asid_alloc(struct mm *mm) {
+    mm->tlb_harts = 0;
+    if (asid_bits == 0) {
+        mm->asid = 0;
+        return;
+    }
+    acquire(&asid_lock);
+    mm->asid = asid_new();
+    release(&asid_lock);
+}
+
+// Make sure the TLB of this hart holds nothing stale for p and
+// return the satp value to run it with. Interrupts must be off.
+uint64 asid_switch(struct proc *p) {
+    struct mm *mm = p->mm;
+    if (asid_bits == 0) {
+        return MAKE_SATP(mm->pagetable, 0);
+    }
+    int hart = cpuid();
+    if (asid_stale(mm->asid)) {
+        acquire(&asid_lock);
+        if (asid_stale(mm->asid)) {
+            mm->asid = asid_new();
+            mm->tlb_harts = 0;
+        }
+        release(&asid_lock);
+    }
+    if (asid_flush_pending[hart]) {
+        asid_flush_pending[hart] = FALSE;
+        sfence_vma();
+        __atomic_fetch_or(&mm->tlb_harts, 1ULL << hart, __ATOMIC_RELAXED);
+    } else if ((__atomic_load_n(&mm->tlb_harts, __ATOMIC_ACQUIRE) & (1ULL << hart)) == 0) {
+        // the page table changed since it last ran on this hart
+        sfence_vma_asid(mm->asid & ASID_MASK);
+        __atomic_fetch_or(&mm->tlb_harts, 1ULL << hart, __ATOMIC_RELAXED);
+    }
+    return MAKE_SATP(mm->pagetable, mm->asid & ASID_MASK);
+}
+
+// Flush [va, va + len) of the address space with this asid from
+// the TLB of this hart, the whole address space for a long range.
+void asid_flush_local(uint64 asid, uint64 va, uint64 len) {
+    asid &= ASID_MASK;
+    if (len > TLB_FLUSH_PAGES_MAX * PGSIZE) {
+        sfence_vma_asid(asid);
+        return;
+    }
+    for (uint64 a = PGROUNDDOWN(va); a < va + len; a += PGSIZE) {
+        sfence_vma_page(a, asid);
+    }
+}
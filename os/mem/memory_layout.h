@@ -39,6 +39,15 @@
 #define PHYSTOP (0x80000000ULL + (unsigned long long)(1ULL * 256 * 1024 * \
 1024)) // 256MB
 
+// the buddy allocator hands out blocks of 2^order pages,
+// order 9 is a 2MB megapage, order 10 is 4MB
+#define BUDDY_MAX_ORDER 10
+
+// user huge pages are 2MB megapages backed by one order 9 block
+#define HUGE_PAGE_ORDER 9
+#define HUGE_PAGE_NPAGES (1 << HUGE_PAGE_ORDER)
+#define HUGE_PAGE_SIZE (PGSIZE << HUGE_PAGE_ORDER)
+
 // map the trampoline page to the highest address,
 // in both user and kernel space.
 
@@ -75,6 +84,10 @@
 #define USER_STACK_BOTTOM 0xC0000000   // 3GB, user stack lower address 
 #define USER_TEXT_START 0x1000
 
+// each hart's kernel page table shows the user memory [0, USER_STACK_BOTTOM)
+// of the running process here, for copyin / copyout with sstatus.SUM
+#define USER_WINDOW 0x2000000000ULL    // 128GB, a 1GB aligned free range
+
 
 #ifdef K210
 #define GPIOHS                  0x38001000
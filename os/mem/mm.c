@@ -0,0 +1,118 @@
+#include "mm.h"
+#include <arch/riscv.h>
+#include <mem/memory_layout.h>
+#include <mem/shared.h>
+#include <mem/slab.h>
+#include <proc/proc.h>
+#include <ucore/defs.h>
+#include <utils/log.h>
+
+/**
+ * User address spaces.
+ * A process gets a new one from fork and exec. A thread made by
+ * clone(CLONE_VM) takes a reference to the one of its creator, the
+ * memory is freed when the last thread drops it. The trapframe of a
+ * thread is not part of it, see proc_pagetable().
+ */
+
+static struct kmem_cache *mm_cache;
+
+void mm_init() {
+    mm_cache = kmem_cache_create("mm", sizeof(struct mm));
+    KERNEL_ASSERT(mm_cache != NULL, "mm cache");
+}
+
+/**
+ * @brief Create an empty address space with only the trampoline mapped
+ *
+ * @return struct mm* with one reference, NULL if out of memory
+ */
+struct mm *mm_create() {
+    struct mm *mm = kmem_cache_alloc(mm_cache);
+    if (mm == NULL) {
+        infof("mm_create: out of memory");
+        return NULL;
+    }
+    memset(mm, 0, sizeof(*mm));
+    mm->ref = 1;
+    init_spin_lock_with_name(&mm->lock, "mm.lock");
+    init_mutex_with_name(&mm->mmap_lock, "mm.mmap_lock");
+    mm->stack_rlimit = USTACK_SIZE;
+    vma_tree_init(&mm->vmas);
+
+    // An empty page table.
+    mm->pagetable = create_empty_user_pagetable();
+    if (mm->pagetable == NULL) {
+        kmem_cache_free(mm_cache, mm);
+        return NULL;
+    }
+    asid_alloc(mm);
+    uwindow_reset(mm);
+
+    if (mappages(mm->pagetable, TRAMPOLINE, PGSIZE,
+                 (uint64)trampoline, PTE_R | PTE_X) < 0) {
+        free_pagetable_pages(mm->pagetable);
+        kmem_cache_free(mm_cache, mm);
+        return NULL;
+    }
+    return mm;
+}
+
+struct mm *mm_get(struct mm *mm) {
+    __atomic_fetch_add(&mm->ref, 1, __ATOMIC_RELAXED);
+    return mm;
+}
+
+static void mm_free_rcu(struct rcu_head *head) {
+    kmem_cache_free(mm_cache, container_of(head, struct mm, rcu));
+}
+
+// Free the memory and the page table of an address space no thread uses.
+static void mm_free(struct mm *mm) {
+    uvmunmap(mm->pagetable, TRAMPOLINE, 1, FALSE);  // unmap, don't recycle physical, shared
+
+    // unmap shared memory
+    for (int i = 0; i < MAX_PROC_SHARED_MEM_INSTANCE; i++)
+    {
+        if (mm->shmem[i])
+        { // active shared memory
+            debugcore("free shared mem");
+            uvmunmap(mm->pagetable, (uint64)mm->shmem_map_start[i], mm->shmem[i]->page_cnt, FALSE);
+            drop_shared_mem(mm->shmem[i]);
+            mm->shmem[i]=NULL;
+            mm->shmem_map_start[i] = 0;
+        }
+    }
+
+    // unmap mapping pages
+    for (struct vma *v = mm->vmas.first; v != NULL; v = v->next) {
+        uvmunmap(mm->pagetable, v->start, (v->end - v->start) / PGSIZE, TRUE);
+    }
+    vma_tree_clear(&mm->vmas);
+
+    if (mm->total_size == 0) {
+        // nothing was loaded
+        free_pagetable_pages(mm->pagetable);
+        call_rcu(&mm->rcu, mm_free_rcu);
+        return;
+    }
+
+    // total_size sanity check, avoid memory leak
+    KERNEL_ASSERT(
+            mm->total_size ==
+            (mm->heap_start - USER_TEXT_START) + // bin size
+            mm->heap_sz + // heap size
+            USTACK_SIZE, // stack size
+            "mm_free: total_size sanity check failed"
+    );
+    free_user_mem_and_pagetables(mm->pagetable, mm->total_size);
+    call_rcu(&mm->rcu, mm_free_rcu);
+}
+
+// Drop a reference, the last one frees the address space.
+// The trapframe of the caller must be unmapped already.
+void mm_put(struct mm *mm) {
+    if (__atomic_sub_fetch(&mm->ref, 1, __ATOMIC_ACQ_REL) == 0) {
+        mm_free(mm);
+    }
+}
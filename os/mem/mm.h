@@ -0,0 +1,40 @@
+#if !defined(MM_H)
+#define MM_H
+
+#include <ucore/ucore.h>
+#include <lock/lock.h>
+#include <mem/vma.h>
+
+#define MAX_PROC_SHARED_MEM_INSTANCE (32)   // every address space
+
+// The user address space of a process.
+// Threads created with CLONE_VM share one, it goes away with the last of them.
+// mmap_lock serializes mmap, munmap, brk, mprotect and shared memory maps,
+// which may sleep to read a file. lock protects the page table and the
+// fields below, page faults of other threads change them concurrently.
+struct mm {
+    int ref;
+    struct spinlock lock;
+    struct mutex mmap_lock;
+
+    pagetable_t pagetable;       // User page table
+    uint64 total_size;           // total memory used by this process
+    uint64 heap_start;           // start of heap
+    uint64 heap_sz;
+    uint64 stack_rlimit;         // stack may grow down to USER_STACK_BOTTOM - stack_rlimit
+    struct shared_mem * shmem[MAX_PROC_SHARED_MEM_INSTANCE];
+    void * shmem_map_start[MAX_PROC_SHARED_MEM_INSTANCE];
+    void* next_shmem_addr;
+    struct vma_tree vmas;        // mmap regions
+    uint64 asid;                 // generation and ASID of the page table
+    uint64 tlb_harts;            // harts whose TLB holds nothing stale for asid
+    uint64 pt_version;           // changes whenever the user window must be reloaded
+    struct rcu_head rcu;         // lockless readers of the pool may still look at it
+};
+
+void mm_init();
+struct mm *mm_create();
+struct mm *mm_get(struct mm *mm);
+void mm_put(struct mm *mm);
+
+#endif // MM_H
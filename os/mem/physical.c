@@ -1,31 +1,91 @@
+#include <arch/cpu.h>
 #include <arch/riscv.h>
 #include <lock/lock.h>
 #include <mem/memory_layout.h>
 #include <ucore/defs.h>
+#include <utils/assert.h>
 #include <utils/log.h>
 void freerange(void *pa_start, void *pa_end);
 
 extern char ekernel[];
 
-struct linklist {
-    struct linklist *next;
+// define PAGE_POISON to fill freed pages with 1 and fresh pages with 5,
+// so that use-after-free and use-before-init show up quickly.
+// it writes every page twice more per lifecycle, so it is for debugging only
+
+// #define PAGE_POISON
+
+#ifdef PAGE_POISON
+#define poison_page(pa, c, size) memset((pa), (c), (size))
+#else
+#define poison_page(pa, c, size)
+#endif
+
+// idle harts keep at most this many pages zeroed in advance
+#define ZERO_POOL_HIGH 256
+
+#define PFN(pa) (((uint64)(pa) - KERNBASE) >> PGSHIFT)
+
+// a free block, kept inside its own first page
+struct free_block {
+    struct free_block *prev;
+    struct free_block *next;
 };
 
+/**
+ * Binary buddy allocator.
+ * A free block of order k covers 2^k pages and is aligned to its own size.
+ * Its buddy is the block whose address differs only in bit (PGSHIFT + k),
+ * two free buddies are always merged into one block of order k + 1.
+ */
 struct
 {
     struct spinlock lock;
-    struct linklist *freelist;
+    struct free_block *free_area[BUDDY_MAX_ORDER + 1];
+    uint64 nr_free[BUDDY_MAX_ORDER + 1];    // free blocks of each order
     uint64 free_page_count;
-    uint8 pfn_ref[(PHYSTOP - KERNBASE) >> PGSHIFT];
+    uint64 managed_start;                   // first page owned by the allocator
+    uint16 pfn_ref[(PHYSTOP - KERNBASE) >> PGSHIFT];  // wide enough for every process sharing a page
+    uint8 free_order[(PHYSTOP - KERNBASE) >> PGSHIFT];  // order + 1 of a free block head, 0 otherwise
 } kmem;
 
+// Pages zeroed by idle harts, see fill_zero_pool().
+// The first word of each page links the list and is cleared on the way out.
+struct
+{
+    struct spinlock lock;
+    struct free_block *list;
+    uint64 count;
+    uint64 hit;     // alloc_zeroed_physical_page() served from the pool
+    uint64 miss;    // alloc_zeroed_physical_page() had to zero by itself
+} zero_pool;
+
 uint64 get_free_page_count(){
     acquire(&kmem.lock);
     uint64 c = kmem.free_page_count;
     release(&kmem.lock);
+    c += zero_pool.count;
+#ifdef PAGE_MAGAZINE
+    // pages parked in per-CPU magazines are free as well
+    for (int i = 0; i < NCPU; i++) {
+        c += cpus[i].page_magazine.count;
+    }
+#endif
     return c;
 }
 
+/**
+ * @brief Copy the number of free blocks of every order into counts,
+ * which must hold BUDDY_MAX_ORDER + 1 entries.
+ */
+void get_free_block_counts(uint64 *counts) {
+    acquire(&kmem.lock);
+    for (int i = 0; i <= BUDDY_MAX_ORDER; i++) {
+        counts[i] = kmem.nr_free[i];
+    }
+    release(&kmem.lock);
+}
+
 /**
  * Kernel mem init
  * collect kernel pages
@@ -33,80 +93,396 @@ uint64 get_free_page_count(){
 void kinit() {
     init_spin_lock_with_name(&kmem.lock, "kmem.lock");
     kmem.free_page_count = 0;
+    for (int i = 0; i <= BUDDY_MAX_ORDER; i++) {
+        kmem.free_area[i] = NULL;
+        kmem.nr_free[i] = 0;
+    }
+    kmem.managed_start = PGROUNDUP((uint64)ekernel);
+    init_spin_lock_with_name(&zero_pool.lock, "zero_pool.lock");
+    zero_pool.list = NULL;
+    zero_pool.count = zero_pool.hit = zero_pool.miss = 0;
     freerange(ekernel, (void *)PHYSTOP);
 }
 
+/**
+ * @brief Report how the pre-zeroed page pool is doing.
+ */
+void get_zero_pool_stat(uint64 *count, uint64 *hit, uint64 *miss) {
+    acquire(&zero_pool.lock);
+    *count = zero_pool.count;
+    *hit = zero_pool.hit;
+    *miss = zero_pool.miss;
+    release(&zero_pool.lock);
+}
+
+static void free_area_add(uint64 pa, int order) {
+    struct free_block *b = (struct free_block *)pa;
+    b->prev = NULL;
+    b->next = kmem.free_area[order];
+    if (b->next)
+        b->next->prev = b;
+    kmem.free_area[order] = b;
+    kmem.nr_free[order]++;
+    kmem.free_order[PFN(pa)] = order + 1;
+}
+
+static void free_area_del(uint64 pa, int order) {
+    struct free_block *b = (struct free_block *)pa;
+    if (b->prev)
+        b->prev->next = b->next;
+    else
+        kmem.free_area[order] = b->next;
+    if (b->next)
+        b->next->prev = b->prev;
+    kmem.nr_free[order]--;
+    kmem.free_order[PFN(pa)] = 0;
+}
+
+// Give a block back to the buddy system, merging it with its buddies.
+// Caller must hold kmem.lock.
+static void buddy_free(uint64 pa, int order) {
+    kmem.free_page_count += 1 << order;
+    while (order < BUDDY_MAX_ORDER) {
+        uint64 buddy = pa ^ ((uint64)PGSIZE << order);
+        if (buddy < kmem.managed_start || buddy >= PHYSTOP ||
+            kmem.free_order[PFN(buddy)] != order + 1)
+            break;
+        free_area_del(buddy, order);
+        pa = MIN(pa, buddy);
+        order++;
+    }
+    free_area_add(pa, order);
+}
+
+// Take a block of 2^order pages, splitting a larger one when needed.
+// Caller must hold kmem.lock.
+static void *buddy_alloc(int order) {
+    int o = order;
+    while (o <= BUDDY_MAX_ORDER && kmem.free_area[o] == NULL)
+        o++;
+    if (o > BUDDY_MAX_ORDER)
+        return NULL;
+    uint64 pa = (uint64)kmem.free_area[o];
+    free_area_del(pa, o);
+    // return the upper halves we do not need
+    while (o > order) {
+        o--;
+        free_area_add(pa + ((uint64)PGSIZE << o), o);
+    }
+    kmem.free_page_count -= 1 << order;
+    return (void *)pa;
+}
+
 void freerange(void *pa_start, void *pa_end) {
     char *p;
     p = (char *)PGROUNDUP((uint64)pa_start);
-    for (; p + PGSIZE <= (char *)pa_end; p += PGSIZE)
-        recycle_physical_page(p);
+    // boot path, fill the buddy system directly instead of going
+    // through the magazine of the boot hart
+    acquire(&kmem.lock);
+    for (; p + PGSIZE <= (char *)pa_end; p += PGSIZE) {
+        poison_page(p, 1, PGSIZE);
+        kmem.pfn_ref[PFN(p)] = 0;
+        buddy_free((uint64)p, 0);
+    }
+    release(&kmem.lock);
+}
+
+#ifdef PAGE_MAGAZINE
+/**
+ * @brief Move a batch of pages from the buddy system into the magazine.
+ * Interrupts must be disabled.
+ */
+static void magazine_refill(struct page_magazine *m) {
+    acquire(&kmem.lock);
+    while (m->count < PAGE_MAGAZINE_BATCH) {
+        void *pa = buddy_alloc(0);
+        if (pa == NULL)
+            break;
+        m->pages[m->count++] = pa;
+    }
+    release(&kmem.lock);
+}
+
+/**
+ * @brief Give a batch of pages in the magazine back to the buddy system.
+ * Interrupts must be disabled.
+ */
+static void magazine_drain(struct page_magazine *m) {
+    acquire(&kmem.lock);
+    for (int i = 0; i < PAGE_MAGAZINE_BATCH && m->count > 0; i++) {
+        buddy_free((uint64)m->pages[--m->count], 0);
+    }
+    release(&kmem.lock);
+    m->drain++;
+}
+#endif
+
+// take a zeroed page out of the pool, NULL if it is empty
+static void *zero_pool_pop(int want_zeroed) {
+    acquire(&zero_pool.lock);
+    struct free_block *b = zero_pool.list;
+    if (b) {
+        zero_pool.list = b->prev;
+        zero_pool.count--;
+    }
+    if (want_zeroed) {
+        if (b)
+            zero_pool.hit++;
+        else
+            zero_pool.miss++;
+    }
+    release(&zero_pool.lock);
+    if (b)
+        b->prev = NULL; // the only word that is not zero
+    return b;
+}
+
+// put a page with no reference left back to the free pages
+static void free_page(void *pa) {
+#ifdef PAGE_MAGAZINE
+    push_off();
+    struct page_magazine *m = &mycpu()->page_magazine;
+    if (m->count == PAGE_MAGAZINE_SIZE)
+        magazine_drain(m);
+    m->pages[m->count++] = pa;
+    pop_off();
+#else
+    acquire(&kmem.lock);
+    buddy_free((uint64)pa, 0);
+    release(&kmem.lock);
+#endif
 }
 
 // Free the page of physical memory pointed at by v,
 // which normally should have been returned by a
-// call to alloc_physical_page().  (The exception is when
-// initializing the allocator; see kinit above.)
+// call to alloc_physical_page().
 void recycle_physical_page(void *pa) {
-    struct linklist *l;
     if (((uint64)pa % PGSIZE) != 0 || (char *)pa < ekernel || (uint64)pa >= PHYSTOP)
         panic("recycle_physical_page");
     // Fill with junk to catch dangling refs.
-    memset(pa, 1, PGSIZE);
-    l = (struct linklist *)pa;
+    poison_page(pa, 1, PGSIZE);
+    kmem.pfn_ref[PFN(pa)] = 0;
+    free_page(pa);
+}
 
+// Allocate one 4096-byte page of physical memory.
+// Returns a pointer that the kernel can use.
+// Returns 0 if the memory cannot be allocated.
+// With PAGE_MAGAZINE, at most PAGE_MAGAZINE_SIZE pages per cpu can
+// be stranded in other harts' magazines when memory runs out.
+void *alloc_physical_page(void) {
+    void *pa;
+#ifdef PAGE_MAGAZINE
+    push_off();
+    struct page_magazine *m = &mycpu()->page_magazine;
+    if (m->count > 0) {
+        m->hit++;
+    } else {
+        m->miss++;
+        magazine_refill(m);
+    }
+    pa = m->count > 0 ? m->pages[--m->count] : NULL;
+    pop_off();
+#else
     acquire(&kmem.lock);
+    pa = buddy_alloc(0);
+    release(&kmem.lock);
+#endif
+    if (pa == NULL) {
+        // the last free pages may be sitting in the zero pool
+        pa = zero_pool_pop(FALSE);
+    }
+    if (pa) {
+        // the page is exclusively ours now, no lock needed
+        kmem.pfn_ref[PFN(pa)] = 1;
+        poison_page(pa, 5, PGSIZE); // fill with junk
+    } else
+        warnf("Out of memory");
+    return pa;
+}
 
-    l->next = kmem.freelist;
+/**
+ * @brief Allocate one page filled with zeros.
+ * Prefer this over alloc_physical_page() + memset(), it takes a page
+ * zeroed in advance by an idle hart when there is one.
+ */
+void *alloc_zeroed_physical_page(void) {
+    void *pa = zero_pool_pop(TRUE);
+    if (pa) {
+        kmem.pfn_ref[PFN(pa)] = 1;
+        return pa;
+    }
+    pa = alloc_physical_page();
+    if (pa) {
+        memset(pa, 0, PGSIZE);
+    }
+    return pa;
+}
 
-    kmem.freelist = l;
-    kmem.free_page_count++;
-    kmem.pfn_ref[((uint64)l - KERNBASE) >> PGSHIFT] = 0;
+/**
+ * @brief Zero one more free page for alloc_zeroed_physical_page().
+ * Called by scheduler() when there is nothing to run on this hart,
+ * one page per call so that a runnable process is never kept waiting long.
+ *
+ * @return FALSE if the pool is full or memory is short
+ */
+int fill_zero_pool(void) {
+    if (zero_pool.count >= ZERO_POOL_HIGH)
+        return FALSE;
+    acquire(&kmem.lock);
+    // leave the last free pages to ordinary allocations
+    void *pa = kmem.free_page_count > ZERO_POOL_HIGH ? buddy_alloc(0) : NULL;
     release(&kmem.lock);
+    if (pa == NULL)
+        return FALSE;
+    memset(pa, 0, PGSIZE);
+    struct free_block *b = (struct free_block *)pa;
+    acquire(&zero_pool.lock);
+    b->prev = zero_pool.list;
+    zero_pool.list = b;
+    zero_pool.count++;
+    release(&zero_pool.lock);
+    return TRUE;
 }
 
-// Allocate one 4096-byte page of physical memory.
-// Returns a pointer that the kernel can use.
-// Returns 0 if the memory cannot be allocated.
-void *alloc_physical_page(void) {
-    struct linklist *l;
+/**
+ * @brief Allocate 2^order physically contiguous pages,
+ * aligned to their total size.
+ * Every page in the block gets a reference count of 1, so the block can
+ * be freed either as a whole with recycle_physical_pages() or page by page
+ * with put_physical_page().
+ *
+ * @return the first page, or NULL if no block is large enough
+ */
+void *alloc_physical_pages(int order) {
+    KERNEL_ASSERT(order >= 0 && order <= BUDDY_MAX_ORDER, "bad order");
+    if (order == 0)
+        return alloc_physical_page();
     acquire(&kmem.lock);
-    l = kmem.freelist;
-    if (l) {
-        kmem.freelist = l->next;
-        kmem.free_page_count--;
-        kmem.pfn_ref[((uint64)l - KERNBASE) >> PGSHIFT] = 1;
+    void *pa = buddy_alloc(order);
+    release(&kmem.lock);
+    if (pa == NULL) {
+        warnf("Out of memory, order=%d", order);
+        return NULL;
+    }
+    for (int i = 0; i < (1 << order); i++) {
+        kmem.pfn_ref[PFN(pa) + i] = 1;
     }
+    poison_page(pa, 5, (uint64)PGSIZE << order); // fill with junk
+    return pa;
+}
+
+/**
+ * @brief Free a block returned by alloc_physical_pages(order).
+ */
+void recycle_physical_pages(void *pa, int order) {
+    KERNEL_ASSERT(order >= 0 && order <= BUDDY_MAX_ORDER, "bad order");
+    if (((uint64)pa % ((uint64)PGSIZE << order)) != 0 || (char *)pa < ekernel || (uint64)pa >= PHYSTOP)
+        panic("recycle_physical_pages");
+    if (order == 0) {
+        recycle_physical_page(pa);
+        return;
+    }
+    poison_page(pa, 1, (uint64)PGSIZE << order);
+    for (int i = 0; i < (1 << order); i++) {
+        kmem.pfn_ref[PFN(pa) + i] = 0;
+    }
+    acquire(&kmem.lock);
+    buddy_free((uint64)pa, order);
     release(&kmem.lock);
-    if (l)
-        memset((char *)l, 5, PGSIZE); // fill with junk
-    else
-        warnf("Out of memory");
-    return (void *)l;
 }
 
-void dup_physical_page(void *pa) {
+/**
+ * @brief Allocate a zeroed 2MB block for a huge page (megapage) mapping.
+ * Every page of the block carries the reference count of the huge page,
+ * so a huge page can be split into 4KB mappings at any time.
+ * Does not complain when memory is too fragmented, callers fall back to 4KB pages.
+ *
+ * @return the block, or NULL if there is no free 2MB block
+ */
+void *alloc_huge_physical_page(void) {
     acquire(&kmem.lock);
-    kmem.pfn_ref[((uint64)pa - KERNBASE) >> PGSHIFT]++;
+    void *pa = buddy_alloc(HUGE_PAGE_ORDER);
     release(&kmem.lock);
+    if (pa == NULL)
+        return NULL;
+    for (int i = 0; i < HUGE_PAGE_NPAGES; i++) {
+        kmem.pfn_ref[PFN(pa) + i] = 1;
+    }
+    memset(pa, 0, HUGE_PAGE_SIZE);
+    return pa;
 }
 
-void put_physical_page(void *pa) {
-    struct linklist *l;
+void dup_huge_physical_page(void *pa) {
+    uint16 *ref = &kmem.pfn_ref[PFN(pa)];
     acquire(&kmem.lock);
-    if (--kmem.pfn_ref[((uint64)pa - KERNBASE) >> PGSHIFT] == 0) {
-        memset(pa, 1, PGSIZE);
-        l = (struct linklist *)pa;
-        l->next = kmem.freelist;
-        kmem.freelist = l;
-        kmem.free_page_count++;
+    for (int i = 0; i < HUGE_PAGE_NPAGES; i++) {
+        KERNEL_ASSERT(ref[i] < 0xFFFF, "page ref overflow");
+        ref[i]++;
     }
     release(&kmem.lock);
 }
 
-uint8 get_physical_page_ref(void *pa) {
+/**
+ * @brief Drop a huge page mapping of the 2MB block at pa.
+ * Pages of the block may still be mapped one by one by processes that
+ * split their copy, only the pages left without reference are freed.
+ */
+void put_huge_physical_page(void *pa) {
+    uint16 *ref = &kmem.pfn_ref[PFN(pa)];
+    uint64 dead[HUGE_PAGE_NPAGES / 64] = {0};
+    int ndead = 0;
+    acquire(&kmem.lock);
+    for (int i = 0; i < HUGE_PAGE_NPAGES; i++) {
+        KERNEL_ASSERT(ref[i] > 0, "put a free page");
+        if (--ref[i] == 0) {
+            dead[i / 64] |= 1ULL << (i % 64);
+            ndead++;
+        }
+    }
+    if (ndead == HUGE_PAGE_NPAGES) {
+        poison_page(pa, 1, HUGE_PAGE_SIZE);
+        buddy_free((uint64)pa, HUGE_PAGE_ORDER);
+    }
+    release(&kmem.lock);
+    if (ndead == HUGE_PAGE_NPAGES || ndead == 0)
+        return;
+    for (int i = 0; i < HUGE_PAGE_NPAGES; i++) {
+        if (dead[i / 64] & (1ULL << (i % 64))) {
+            void *page = (char *)pa + (uint64)i * PGSIZE;
+            poison_page(page, 1, PGSIZE);
+            free_page(page);
+        }
+    }
+}
+
+void dup_physical_page(void *pa) {
+    acquire(&kmem.lock);
+    KERNEL_ASSERT(kmem.pfn_ref[PFN(pa)] < 0xFFFF, "page ref overflow");
+    kmem.pfn_ref[PFN(pa)]++;
+    release(&kmem.lock);
+}
+
+void put_physical_page(void *pa) {
+    uint16 *ref = &kmem.pfn_ref[PFN(pa)];
+    if (*ref == 1) {
+        // we are the only owner, nobody can dup it concurrently
+        *ref = 0;
+    } else {
+        acquire(&kmem.lock);
+        KERNEL_ASSERT(*ref > 0, "put a free page");
+        int left = --*ref;
+        release(&kmem.lock);
+        if (left > 0)
+            return;
+    }
+    poison_page(pa, 1, PGSIZE);
+    free_page(pa);
+}
+
+uint16 get_physical_page_ref(void *pa) {
     acquire(&kmem.lock);
-    uint8 r = kmem.pfn_ref[((uint64)pa - KERNBASE) >> PGSHIFT];
+    uint16 r = kmem.pfn_ref[PFN(pa)];
     release(&kmem.lock);
     return r;
 }
@@ -56,7 +56,7 @@ struct shared_mem *get_shared_mem_by_name(char *name, int page_cnt)
 
             for (int j = 0; j < page_cnt; j++)
             {
-                void *p = alloc_physical_page();
+                void *p = alloc_zeroed_physical_page();
                 if (p == NULL)
                 {
                     // not enough mem, free all
@@ -108,34 +108,38 @@ void drop_shared_mem(struct shared_mem *shmem)
 
 void *map_shared_mem(struct shared_mem *shmem)
 {
-    struct proc *p = curr_proc();
+    struct mm *mm = curr_proc()->mm;
 
-    void *start_addr_va = p->next_shmem_addr;
+    acquire(&mm->lock);
+    void *start_addr_va = mm->next_shmem_addr;
 
         int j;  // empty id
     for ( j= 0; j < MAX_PROC_SHARED_MEM_INSTANCE; j++)
     {
-        if(p->shmem[j] == NULL){
+        if(mm->shmem[j] == NULL){
             break;
         }
     }
     if (j >= MAX_PROC_SHARED_MEM_INSTANCE)
     {   
         // full
+        release(&mm->lock);
         return NULL;
     }
     for (int i = 0; i < shmem->page_cnt; i++)
     {
-        int err = mappages(p->pagetable, (uint64)(start_addr_va + i * PGSIZE), PGSIZE, (uint64)shmem->mem_pages[i], PTE_R | PTE_W | PTE_X | PTE_U);
+        int err = mappages(mm->pagetable, (uint64)(start_addr_va + i * PGSIZE), PGSIZE, (uint64)shmem->mem_pages[i], PTE_R | PTE_W | PTE_X | PTE_U);
         if (err)
         {
             panic("map_shared_mem");
         }
     }
-    // p->total_size +=     // TODO
-    p->shmem[j]=shmem;
-    p->shmem_map_start[j]=start_addr_va;
+    tlb_flush_range(mm->pagetable, (uint64)start_addr_va, shmem->page_cnt * PGSIZE);
+    // mm->total_size +=     // TODO
+    mm->shmem[j]=shmem;
+    mm->shmem_map_start[j]=start_addr_va;
 
-    p->next_shmem_addr = start_addr_va + shmem->page_cnt* PGSIZE + PGSIZE;  // one guard page
+    mm->next_shmem_addr = start_addr_va + shmem->page_cnt* PGSIZE + PGSIZE;  // one guard page
+    release(&mm->lock);
     return start_addr_va;
 }
\ No newline at end of file
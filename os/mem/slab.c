@@ -0,0 +1,288 @@
+#include "slab.h"
+#include <arch/riscv.h>
+#include <mem/memory_layout.h>
+#include <ucore/defs.h>
+#include <utils/assert.h>
+#include <utils/log.h>
+
+/**
+ * Slab allocator for small kernel objects.
+ * Each cache hands out objects of a single size, carved from slabs of
+ * 2^order physically contiguous pages taken from the buddy allocator.
+ * A per-CPU stack of free objects sits in front of every cache, so the
+ * common alloc / free path does not take any lock.
+ */
+
+struct kmem_cache slab_caches[NSLAB_CACHE];
+struct spinlock slab_caches_lock;
+
+// offset + 1 to the first page of the slab that a page belongs to, 0 for non-slab pages
+static uint8 slab_page[(PHYSTOP - KERNBASE) >> PGSHIFT];
+
+#define KMALLOC_NR_CLASS 8 // 16, 32, ... 2048 bytes
+static struct kmem_cache *kmalloc_caches[KMALLOC_NR_CLASS];
+
+#define SLAB_PFN(pa) (((uint64)(pa) - KERNBASE) >> PGSHIFT)
+
+void slab_init() {
+    init_spin_lock_with_name(&slab_caches_lock, "slab_caches_lock");
+    for (int i = 0; i < NSLAB_CACHE; i++) {
+        slab_caches[i].used = FALSE;
+    }
+    char name[MAX_SLAB_NAME];
+    char ssize[16];
+    for (int i = 0; i < KMALLOC_NR_CLASS; i++) {
+        uint size = KMALLOC_MIN << i;
+        strcpy(name, "kmalloc-");
+        itoa(size, ssize, 10);
+        strcat(name, ssize);
+        kmalloc_caches[i] = kmem_cache_create(name, size);
+        KERNEL_ASSERT(kmalloc_caches[i] != NULL, "kmalloc cache");
+    }
+}
+
+/**
+ * @brief Create a cache for objects of the given size.
+ * Slabs are made as small as possible while wasting at most 1/8 of the slab.
+ *
+ * @return the cache, NULL if the cache table is full or size is too large
+ */
+struct kmem_cache *kmem_cache_create(const char *name, uint size) {
+    size = ROUNDUP(MAX(size, sizeof(void *)), sizeof(void *));
+    int order;
+    for (order = 0; order <= SLAB_MAX_ORDER; order++) {
+        uint64 slab_size = (uint64)PGSIZE << order;
+        uint64 n = (slab_size - sizeof(struct slab)) / size;
+        if (n >= 1 && (slab_size - n * size) * 8 <= slab_size)
+            break;
+    }
+    if (order > SLAB_MAX_ORDER) {
+        order = SLAB_MAX_ORDER;
+        if ((((uint64)PGSIZE << order) - sizeof(struct slab)) / size == 0) {
+            infof("kmem_cache_create: object of %d bytes is too large", size);
+            return NULL;
+        }
+    }
+
+    struct kmem_cache *cache = NULL;
+    acquire(&slab_caches_lock);
+    for (int i = 0; i < NSLAB_CACHE; i++) {
+        if (!slab_caches[i].used) {
+            cache = &slab_caches[i];
+            cache->used = TRUE;
+            break;
+        }
+    }
+    release(&slab_caches_lock);
+    if (cache == NULL) {
+        infof("kmem_cache_create: no free cache slot for %s", name);
+        return NULL;
+    }
+
+    safestrcpy(cache->name, name, MAX_SLAB_NAME);
+    cache->obj_size = size;
+    cache->order = order;
+    cache->objs_per_slab = (((uint64)PGSIZE << order) - sizeof(struct slab)) / size;
+    init_spin_lock_with_name(&cache->lock, "kmem_cache.lock");
+    cache->partial = NULL;
+    cache->full = NULL;
+    cache->nr_slabs = 0;
+    cache->nr_inuse = 0;
+    cache->nr_alloc = 0;
+    cache->nr_refill = 0;
+    for (int i = 0; i < NCPU; i++) {
+        cache->cpu[i].avail = 0;
+    }
+    return cache;
+}
+
+static void slab_list_add(struct slab **list, struct slab *s) {
+    s->prev = NULL;
+    s->next = *list;
+    if (*list)
+        (*list)->prev = s;
+    *list = s;
+}
+
+static void slab_list_del(struct slab **list, struct slab *s) {
+    if (s->prev)
+        s->prev->next = s->next;
+    else
+        *list = s->next;
+    if (s->next)
+        s->next->prev = s->prev;
+}
+
+// find the slab an object lives in
+static struct slab *obj_to_slab(void *obj) {
+    uint64 pfn = SLAB_PFN(obj);
+    KERNEL_ASSERT((uint64)obj >= KERNBASE && (uint64)obj < PHYSTOP && slab_page[pfn] != 0,
+                  "object is not from a slab");
+    return (struct slab *)(PGROUNDDOWN((uint64)obj) - ((uint64)(slab_page[pfn] - 1) << PGSHIFT));
+}
+
+// Make a new slab with all objects free. Caller must hold cache->lock.
+static struct slab *slab_grow(struct kmem_cache *cache) {
+    struct slab *s = alloc_physical_pages(cache->order);
+    if (s == NULL)
+        return NULL;
+    for (int i = 0; i < (1 << cache->order); i++) {
+        slab_page[SLAB_PFN(s) + i] = i + 1;
+    }
+    s->cache = cache;
+    s->inuse = 0;
+    s->freelist = NULL;
+    char *base = (char *)s + sizeof(struct slab);
+    for (int i = cache->objs_per_slab - 1; i >= 0; i--) {
+        void **obj = (void **)(base + i * cache->obj_size);
+        *obj = s->freelist;
+        s->freelist = obj;
+    }
+    slab_list_add(&cache->partial, s);
+    cache->nr_slabs++;
+    return s;
+}
+
+// Give an empty slab back to the buddy allocator. Caller must hold cache->lock.
+static void slab_destroy(struct kmem_cache *cache, struct slab *s) {
+    slab_list_del(&cache->partial, s);
+    for (int i = 0; i < (1 << cache->order); i++) {
+        slab_page[SLAB_PFN(s) + i] = 0;
+    }
+    cache->nr_slabs--;
+    recycle_physical_pages(s, cache->order);
+}
+
+// Take one object out of the slab lists. Caller must hold cache->lock.
+static void *slab_take(struct kmem_cache *cache) {
+    struct slab *s = cache->partial;
+    if (s == NULL && (s = slab_grow(cache)) == NULL)
+        return NULL;
+    void **obj = s->freelist;
+    s->freelist = *obj;
+    s->inuse++;
+    cache->nr_inuse++;
+    if (s->freelist == NULL) {
+        slab_list_del(&cache->partial, s);
+        slab_list_add(&cache->full, s);
+    }
+    return obj;
+}
+
+// Put one object back into its slab. Caller must hold cache->lock.
+static void slab_put(struct kmem_cache *cache, void *obj) {
+    struct slab *s = obj_to_slab(obj);
+    KERNEL_ASSERT(s->cache == cache, "object freed to a wrong cache");
+    if (s->freelist == NULL) {
+        slab_list_del(&cache->full, s);
+        slab_list_add(&cache->partial, s);
+    }
+    *(void **)obj = s->freelist;
+    s->freelist = obj;
+    s->inuse--;
+    cache->nr_inuse--;
+    if (s->inuse == 0 && (s->prev != NULL || s->next != NULL)) {
+        // keep the last partial slab around to avoid thrashing
+        slab_destroy(cache, s);
+    }
+}
+
+/**
+ * @brief Allocate one object from the cache, content is undefined.
+ *
+ * @return the object, or NULL if out of memory
+ */
+void *kmem_cache_alloc(struct kmem_cache *cache) {
+    void *obj = NULL;
+    push_off();
+    struct kmem_cache_cpu *c = &cache->cpu[cpuid()];
+    if (c->avail == 0) {
+        acquire(&cache->lock);
+        cache->nr_refill++;
+        while (c->avail < SLAB_CPU_CACHE_BATCH) {
+            void *o = slab_take(cache);
+            if (o == NULL)
+                break;
+            c->objs[c->avail++] = o;
+        }
+        release(&cache->lock);
+    }
+    if (c->avail > 0) {
+        obj = c->objs[--c->avail];
+        // counted racily, it is only for statistics
+        cache->nr_alloc++;
+    }
+    pop_off();
+    if (obj == NULL)
+        warnf("kmem_cache_alloc: %s out of memory", cache->name);
+    return obj;
+}
+
+/**
+ * @brief Free an object returned by kmem_cache_alloc(cache).
+ */
+void kmem_cache_free(struct kmem_cache *cache, void *obj) {
+    if (obj == NULL)
+        return;
+    push_off();
+    struct kmem_cache_cpu *c = &cache->cpu[cpuid()];
+    if (c->avail == SLAB_CPU_CACHE_SIZE) {
+        acquire(&cache->lock);
+        for (int i = 0; i < SLAB_CPU_CACHE_BATCH; i++) {
+            slab_put(cache, c->objs[--c->avail]);
+        }
+        release(&cache->lock);
+    }
+    c->objs[c->avail++] = obj;
+    pop_off();
+}
+
+/**
+ * @brief Allocate size bytes from the smallest size class that fits.
+ * size must not exceed KMALLOC_MAX, use alloc_physical_pages() for more.
+ */
+void *kmalloc(uint size) {
+    if (size > KMALLOC_MAX) {
+        infof("kmalloc: %d bytes is larger than KMALLOC_MAX", size);
+        return NULL;
+    }
+    int i = 0;
+    while ((KMALLOC_MIN << i) < size)
+        i++;
+    return kmem_cache_alloc(kmalloc_caches[i]);
+}
+
+void kfree(void *obj) {
+    if (obj == NULL)
+        return;
+    kmem_cache_free(obj_to_slab(obj)->cache, obj);
+}
+
+/**
+ * @brief Fill stat with the usage of the index-th cache.
+ *
+ * @return 0 on success, -1 if the slot is not used
+ */
+int get_slab_stat(int index, struct slab_stat *stat) {
+    if (index < 0 || index >= NSLAB_CACHE)
+        return -1;
+    struct kmem_cache *cache = &slab_caches[index];
+    if (!cache->used)
+        return -1;
+    uint64 cached = 0;
+    for (int i = 0; i < NCPU; i++) {
+        cached += cache->cpu[i].avail;
+    }
+    acquire(&cache->lock);
+    safestrcpy(stat->name, cache->name, MAX_SLAB_NAME);
+    stat->obj_size = cache->obj_size;
+    stat->objs_per_slab = cache->objs_per_slab;
+    stat->pages_per_slab = 1 << cache->order;
+    stat->nr_slabs = cache->nr_slabs;
+    stat->cached_objs = cached;
+    stat->active_objs = cache->nr_inuse > cached ? cache->nr_inuse - cached : 0;
+    stat->nr_alloc = cache->nr_alloc;
+    stat->nr_refill = cache->nr_refill;
+    release(&cache->lock);
+    return 0;
+}
@@ -0,0 +1,68 @@
+#if !defined(SLAB_H)
+#define SLAB_H
+
+#include <arch/cpu.h>
+#include <lock/lock.h>
+#include <ucore/types.h>
+
+#define MAX_SLAB_NAME 24
+#define NSLAB_CACHE 32            // system level
+#define SLAB_CPU_CACHE_SIZE 16    // objects kept per cpu
+#define SLAB_CPU_CACHE_BATCH 8    // objects moved per refill / flush
+#define SLAB_MAX_ORDER 3          // a slab is at most 8 pages
+#define KMALLOC_MIN 16
+#define KMALLOC_MAX 2048
+
+// header at the start of every slab
+struct slab {
+    struct kmem_cache *cache;
+    struct slab *prev;
+    struct slab *next;
+    void *freelist;     // free objects, linked through their first word
+    uint inuse;         // objects taken out of this slab
+};
+
+// per-CPU stack of free objects, only used by its own cpu with interrupts off
+struct kmem_cache_cpu {
+    void *objs[SLAB_CPU_CACHE_SIZE];
+    int avail;
+};
+
+struct kmem_cache {
+    char name[MAX_SLAB_NAME];
+    int used;
+    uint obj_size;
+    int order;              // every slab is 2^order pages
+    uint objs_per_slab;
+    struct spinlock lock;   // protects the slab lists and the counters below
+    struct slab *partial;   // slabs with free objects
+    struct slab *full;      // slabs without free objects
+    uint64 nr_slabs;
+    uint64 nr_inuse;        // objects taken out of slabs, including per-CPU cached ones
+    uint64 nr_alloc;        // kmem_cache_alloc calls served
+    uint64 nr_refill;       // times a per-CPU cache went to the slab lists
+    struct kmem_cache_cpu cpu[NCPU];
+};
+
+// usage statistics of one cache, see get_slab_stat()
+struct slab_stat {
+    char name[MAX_SLAB_NAME];
+    uint64 obj_size;
+    uint64 objs_per_slab;
+    uint64 pages_per_slab;
+    uint64 nr_slabs;
+    uint64 active_objs;     // objects in use by the kernel
+    uint64 cached_objs;     // free objects sitting in per-CPU caches
+    uint64 nr_alloc;
+    uint64 nr_refill;
+};
+
+void slab_init();
+struct kmem_cache *kmem_cache_create(const char *name, uint size);
+void *kmem_cache_alloc(struct kmem_cache *cache);
+void kmem_cache_free(struct kmem_cache *cache, void *obj);
+void *kmalloc(uint size);
+void kfree(void *obj);
+int get_slab_stat(int index, struct slab_stat *stat);
+
+#endif // SLAB_H
@@ -133,4 +133,16 @@ char *itoa(int n, char *s, int b) {
     t = s + i;
     *--t = 0;
     return t;
-}
\ No newline at end of file
+}
+// Write n in base b to s, which must have room for 65 chars.
+char *utoa(uint64 n, char *s, int b) {
+    char tmp[64];
+    int i = 0, j = 0;
+    do
+        tmp[i++] = "0123456789abcdef"[n % b];
+    while ((n /= b) > 0);
+    while (i > 0)
+        s[j++] = tmp[--i];
+    s[j] = '\0';
+    return s;
+}
@@ -0,0 +1,84 @@
+#include <arch/riscv.h>
+#include <proc/proc.h>
+#include <ucore/defs.h>
+
+/**
+ * TLB shootdown.
+ * A user page table may be live on several harts at once. After changing
+ * its PTEs, the hart that did it flushes its own TLB, then sends an IPI to
+ * every other hart running the address space right now and waits until
+ * they have flushed too. Harts that ran it before but run something else
+ * now are not interrupted: they lose their bit in tlb_harts and flush the
+ * ASID when they switch back to it, see asid_switch().
+ */
+
+static struct {
+    int busy;                   // one shootdown at a time
+    uint64 asid;
+    uint64 va;
+    uint64 len;
+    uint64 pending;             // harts that have not flushed yet
+} shootdown;
+
+// Flush for the shootdown aimed at this hart, if any.
+// Called for the software interrupt, and while spinning with interrupts off.
+void tlb_shootdown_handle() {
+    uint64 bit = 1ULL << cpuid();
+    if ((__atomic_load_n(&shootdown.pending, __ATOMIC_ACQUIRE) & bit) == 0) {
+        return;
+    }
+    asid_flush_local(shootdown.asid, shootdown.va, shootdown.len);
+    __atomic_fetch_and(&shootdown.pending, ~bit, __ATOMIC_RELEASE);
+}
+
+// Interrupts must be off.
+static void tlb_shootdown(uint64 harts, uint64 asid, uint64 va, uint64 len) {
+    while (__sync_lock_test_and_set(&shootdown.busy, 1) != 0) {
+        // the hart shooting down now may be waiting for this one
+        tlb_shootdown_handle();
+    }
+    shootdown.asid = asid;
+    shootdown.va = va;
+    shootdown.len = len;
+    __atomic_store_n(&shootdown.pending, harts, __ATOMIC_RELEASE);
+    sbi_send_ipi(harts);
+    while (__atomic_load_n(&shootdown.pending, __ATOMIC_ACQUIRE) != 0)
+        ;
+    __sync_lock_release(&shootdown.busy);
+}
+
+// Flush the TLB entries for [va, va + len) of a user page table after
+// its PTEs changed, on every hart. Returns after no TLB holds them, so
+// pages unmapped before can be freed. Only a process running the page
+// table changes it live; other page tables are brand new or being torn
+// down and are never in a TLB under their current ASID. The threads
+// sharing the page table may run on several harts at once.
+void tlb_flush_range(pagetable_t pagetable, uint64 va, uint64 len) {
+    push_off();
+    struct proc *p = curr_proc();
+    struct mm *mm = p ? p->mm : NULL;
+    if (mm == NULL || mm->pagetable != pagetable) {
+        pop_off();
+        return;
+    }
+    int hart = cpuid();
+    uwindow_flush_range(mm, va, len);
+    asid_flush_local(mm->asid, va, len);
+    __atomic_store_n(&mm->tlb_harts, 1ULL << hart, __ATOMIC_RELAXED);
+    // pairs with the scheduler setting cpu->proc before asid_switch()
+    // reads tlb_harts: either the hart is seen running here, or it
+    // sees its tlb_harts bit cleared there
+    __sync_synchronize();
+    uint64 harts = 0;
+    for (int i = 0; i < NCPU; i++) {
+        // the threads of mm running on other harts
+        struct proc *q = __atomic_load_n(&cpus[i].proc, __ATOMIC_RELAXED);
+        if (i != hart && q != NULL && q->mm == mm) {
+            harts |= 1ULL << i;
+        }
+    }
+    if (harts) {
+        tlb_shootdown(harts, mm->asid, va, len);
+    }
+    pop_off();
+}
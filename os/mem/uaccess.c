@@ -0,0 +1,241 @@
+#include <arch/riscv.h>
+#include <mem/memory_layout.h>
+#include <proc/proc.h>
+#include <trap/trap.h>
+#include <ucore/defs.h>
+
+/**
+ * Direct access to user memory.
+ * The kernel runs on its own page table, where user addresses mean
+ * nothing. Every hart has a copy of the kernel root page table whose
+ * entries at USER_WINDOW point to the level-1 page tables of the process
+ * it runs, so user address va shows up at USER_WINDOW + va. copyin and
+ * copyout access it with sstatus.SUM set instead of walking the page
+ * table for every page. A fault (a page not populated yet, copy-on-write,
+ * a bad address) stops the direct copy, and the caller walks the page
+ * table for that page as before.
+ */
+
+#define UWINDOW_ROOT_ENTRIES (USER_STACK_BOTTOM >> PXSHIFT(2))
+// a range flush of more pages than this reloads the whole window
+#define UWINDOW_FLUSH_PAGES_MAX 64
+// bytes copied with interrupts off at a time
+#define UACCESS_CHUNK (16 * PGSIZE)
+
+struct uaccess_fixup {
+    uint64 start;
+    uint64 end;
+    uint64 fixup;
+};
+
+extern struct uaccess_fixup __uaccess_table[], __uaccess_table_end[];
+uint64 __copy_user(void *dst, const void *src, uint64 len);
+uint64 __memset_user(void *dst, int c, uint64 len);
+int64 __strncpy_user(char *dst, const char *src, uint64 max);
+
+static uint64 pt_version_next = 1;
+
+static uint64 new_pt_version() {
+    return __atomic_fetch_add(&pt_version_next, 1, __ATOMIC_RELAXED);
+}
+
+// A new page table, no hart shows it in the user window.
+void uwindow_reset(struct mm *mm) {
+    mm->pt_version = new_pt_version();
+}
+
+// PTEs of the running address space mm in [va, va + len) changed.
+// Flush them from this hart's user window. Other harts reload
+// their window before they show mm again.
+void uwindow_flush_range(struct mm *mm, uint64 va, uint64 len) {
+    struct cpu *c = mycpu();
+    bool shown = c->uwindow_version == mm->pt_version;
+    mm->pt_version = new_pt_version();
+    if (!shown) {
+        return;
+    }
+    if (len > UWINDOW_FLUSH_PAGES_MAX * PGSIZE) {
+        c->uwindow_version = 0;
+        return;
+    }
+    for (uint64 a = PGROUNDDOWN(va); a < va + len && a < USER_STACK_BOTTOM; a += PGSIZE) {
+        sfence_vma_page(USER_WINDOW + a, 0);
+    }
+    c->uwindow_version = mm->pt_version;
+}
+
+// The window is about to show other PTEs. Only the pages accessed
+// through it since it was loaded can be in the TLB, flush just those and
+// keep the rest of the kernel's ASID 0 entries, unless there are too many.
+static void uwindow_flush_accessed(struct cpu *c) {
+    if (c->uwindow_hi - c->uwindow_lo > UWINDOW_FLUSH_PAGES_MAX * PGSIZE) {
+        sfence_vma_asid(0);
+    } else {
+        for (uint64 a = c->uwindow_lo; a < c->uwindow_hi; a += PGSIZE) {
+            sfence_vma_page(USER_WINDOW + a, 0);
+        }
+    }
+    c->uwindow_lo = c->uwindow_hi = 0;
+}
+
+// Show the running process's user memory in this hart's user window.
+// Returns the window address of user va, or 0 if [va, va + len)
+// is not the running process's user memory.
+// Interrupts must be off until the access is done.
+static uint64 uwindow_enter(pagetable_t pagetable, uint64 va, uint64 len) {
+    struct cpu *c = mycpu();
+    struct proc *p = c->proc;
+    if (p == NULL || p->mm == NULL || p->mm->pagetable != pagetable) {
+        return 0;
+    }
+    if (va >= USER_STACK_BOTTOM || len > USER_STACK_BOTTOM - va) {
+        return 0;
+    }
+    pagetable_t window = c->kernel_pagetable + PX(2, USER_WINDOW);
+    if (c->uwindow_version != p->mm->pt_version) {
+        for (int i = 0; i < UWINDOW_ROOT_ENTRIES; i++) {
+            window[i] = pagetable[i];
+        }
+        uwindow_flush_accessed(c);
+        c->uwindow_version = p->mm->pt_version;
+    }
+    uint64 lo = PGROUNDDOWN(va), hi = PGROUNDUP(va + len);
+    if (c->uwindow_lo == c->uwindow_hi) {
+        c->uwindow_lo = lo;
+        c->uwindow_hi = hi;
+    } else {
+        c->uwindow_lo = MIN(c->uwindow_lo, lo);
+        c->uwindow_hi = MAX(c->uwindow_hi, hi);
+    }
+    return USER_WINDOW + va;
+}
+
+// A direct access faulted. If a level-1 page table was added to the
+// process since the window was loaded, reload it next time.
+static void uwindow_fault(pagetable_t pagetable) {
+    struct cpu *c = mycpu();
+    pagetable_t window = c->kernel_pagetable + PX(2, USER_WINDOW);
+    for (int i = 0; i < UWINDOW_ROOT_ENTRIES; i++) {
+        if (window[i] != pagetable[i]) {
+            c->uwindow_version = 0;
+            return;
+        }
+    }
+}
+
+// Called by kerneltrap() for an exception in the kernel.
+// Returns TRUE and moves *sepc to the fixup if a direct user access faulted.
+bool uaccess_fixup(uint64 scause, uint64 *sepc) {
+    switch (scause) {
+    case LoadPageFault:
+    case StoreAMOPageFault:
+    case LoadAccessFault:
+    case StoreAMOAccessFault:
+        break;
+    default:
+        return FALSE;
+    }
+    for (struct uaccess_fixup *f = __uaccess_table; f < __uaccess_table_end; f++) {
+        if (*sepc >= f->start && *sepc < f->end) {
+            *sepc = f->fixup;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// Copy to user memory of the running process directly.
+// Returns the bytes copied, less than len if an access faulted.
+uint64 copyout_direct(pagetable_t pagetable, uint64 dstva, char *src, uint64 len) {
+    uint64 done = 0;
+    while (done < len) {
+        uint64 n = MIN(len - done, UACCESS_CHUNK), left = n;
+        push_off();
+        uint64 dst = uwindow_enter(pagetable, dstva + done, n);
+        if (dst) {
+            left = __copy_user((void *)dst, src + done, n);
+            if (left)
+                uwindow_fault(pagetable);
+        }
+        pop_off();
+        done += n - left;
+        if (left)
+            break;
+    }
+    return done;
+}
+
+// Copy from user memory of the running process directly.
+// Returns the bytes copied, less than len if an access faulted.
+uint64 copyin_direct(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len) {
+    uint64 done = 0;
+    while (done < len) {
+        uint64 n = MIN(len - done, UACCESS_CHUNK), left = n;
+        push_off();
+        uint64 src = uwindow_enter(pagetable, srcva + done, n);
+        if (src) {
+            left = __copy_user(dst + done, (void *)src, n);
+            if (left)
+                uwindow_fault(pagetable);
+        }
+        pop_off();
+        done += n - left;
+        if (left)
+            break;
+    }
+    return done;
+}
+
+// Fill user memory of the running process directly.
+// Returns the bytes set, less than len if an access faulted.
+uint64 uvmemset_direct(pagetable_t pagetable, uint64 dstva, char c, uint64 len) {
+    uint64 done = 0;
+    while (done < len) {
+        uint64 n = MIN(len - done, UACCESS_CHUNK), left = n;
+        push_off();
+        uint64 dst = uwindow_enter(pagetable, dstva + done, n);
+        if (dst) {
+            left = __memset_user((void *)dst, c, n);
+            if (left)
+                uwindow_fault(pagetable);
+        }
+        pop_off();
+        done += n - left;
+        if (left)
+            break;
+    }
+    return done;
+}
+
+// Copy a null-terminated string from user memory of the running
+// process directly, at most max bytes. *copied is set to the bytes copied.
+// Returns TRUE if the '\0' was copied.
+bool copyinstr_direct(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max, uint64 *copied) {
+    uint64 done = 0;
+    while (done < max) {
+        uint64 n = MIN(max - done, UACCESS_CHUNK);
+        if (srcva + done < USER_STACK_BOTTOM)
+            n = MIN(n, USER_STACK_BOTTOM - (srcva + done));
+        int64 left = n;
+        push_off();
+        uint64 src = uwindow_enter(pagetable, srcva + done, n);
+        if (src) {
+            left = __strncpy_user(dst + done, (char *)src, n);
+            if (left > 0)
+                uwindow_fault(pagetable);
+        }
+        pop_off();
+        if (left == 0) {
+            // found the '\0'
+            *copied = done + strlen(dst + done) + 1;
+            return TRUE;
+        }
+        if (left > 0) {
+            *copied = done + n - left;
+            return FALSE;
+        }
+        done += n;
+    }
+    *copied = done;
+    return FALSE;
+}
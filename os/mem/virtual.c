@@ -14,8 +14,7 @@ pagetable_t kvmmake(void)
 {
     pagetable_t kpgtbl;
 
-    kpgtbl = (pagetable_t)alloc_physical_page();
-    memset(kpgtbl, 0, PGSIZE);
+    kpgtbl = (pagetable_t)alloc_zeroed_physical_page();
 
     // uart registers
     // kvmmap(kpgtbl, UART0, UART0, PGSIZE, PTE_R | PTE_W);
@@ -57,37 +56,43 @@ void kvminit(void)
 // and enable paging.
 void kvminithart()
 {
+    // every hart runs on its own copy of the root page table,
+    // which differs only in the user window, see uaccess.c
+    struct cpu *c = mycpu();
+    if (c->kernel_pagetable == NULL) {
+        c->kernel_pagetable = (pagetable_t)alloc_physical_page();
+        KERNEL_ASSERT(c->kernel_pagetable != NULL, "kvminithart: out of memory");
+        memmove(c->kernel_pagetable, kernel_pagetable, PGSIZE);
+    }
+    c->uwindow_version = 0;
+
     // enable virtual memory
-    w_satp(MAKE_SATP(kernel_pagetable));
+    // the kernel page table runs with ASID 0
+    w_satp(MAKE_SATP(c->kernel_pagetable, 0));
 
     // update TLB
     sfence_vma();
     infof("enable paging at %p", r_satp());
 }
 
-// Return the address of the PTE in page table pagetable
-// that corresponds to virtual address va.  If alloc!=0,
-// create any required page-table pages.
-//
-// The risc-v Sv39 scheme has three levels of page-table
-// pages. A page-table page contains 512 64-bit PTEs.
-// A 64-bit virtual address is split into five fields:
-//   39..63 -- must be zero.
-//   30..38 -- 9 bits of level-2 index.
-//   21..29 -- 9 bits of level-1 index.
-//   12..20 -- 9 bits of level-0 index.
-//    0..11 -- 12 bits of byte offset within the page.
-pte_t *
-walk(pagetable_t pagetable, uint64 va, int alloc)
+// Return the address of the PTE at the given level in page table
+// pagetable that corresponds to virtual address va. If alloc!=0,
+// create any required page-table pages above that level.
+// Returns NULL if a larger leaf (superpage) already maps va.
+static pte_t *
+walk_level(pagetable_t pagetable, uint64 va, int level, int alloc)
 {
-    if (va >= MAXVA)
-        panic("walk");
-
-    for (int level = 2; level > 0; level--)
+    for (int l = 2; l > level; l--)
     {
-        pte_t *pte = &pagetable[PX(level, va)];
+        pte_t *pte = &pagetable[PX(l, va)];
         if (*pte & PTE_V)
         {
+            if (PTE_LEAF(*pte))
+            {
+                if (alloc)
+                    panic("walk: va is in a superpage");
+                return NULL;
+            }
             // found the pte
             pagetable = (pagetable_t)PTE2PA(*pte);
         }
@@ -99,7 +104,7 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
                 return NULL;
             }
             // should create new child page table
-            pagetable = (pde_t *)alloc_physical_page();
+            pagetable = (pde_t *)alloc_zeroed_physical_page();
             if (pagetable == NULL)
             {
                 warnf("out of memory when creating pagetable");
@@ -108,11 +113,57 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
 
             // create new child pagetable successfully
             // point to it
-            memset(pagetable, 0, PGSIZE);
             *pte = PA2PTE(pagetable) | PTE_V;
         }
     }
-    return &pagetable[PX(0, va)];
+    return &pagetable[PX(level, va)];
+}
+
+// Return the address of the PTE in page table pagetable
+// that corresponds to virtual address va.  If alloc!=0,
+// create any required page-table pages.
+//
+// The risc-v Sv39 scheme has three levels of page-table
+// pages. A page-table page contains 512 64-bit PTEs.
+// A 64-bit virtual address is split into five fields:
+//   39..63 -- must be zero.
+//   30..38 -- 9 bits of level-2 index.
+//   21..29 -- 9 bits of level-1 index.
+//   12..20 -- 9 bits of level-0 index.
+//    0..11 -- 12 bits of byte offset within the page.
+pte_t *
+walk(pagetable_t pagetable, uint64 va, int alloc)
+{
+    if (va >= MAXVA)
+        panic("walk");
+
+    return walk_level(pagetable, va, 0, alloc);
+}
+
+// Return the leaf PTE that maps va at any level, or NULL.
+// *level is set to the level of the leaf.
+static pte_t *
+walk_leaf(pagetable_t pagetable, uint64 va, int *level)
+{
+    for (int l = 2; l >= 0; l--)
+    {
+        pte_t *pte = &pagetable[PX(l, va)];
+        if ((*pte & PTE_V) == 0)
+            return NULL;
+        if (PTE_LEAF(*pte) || l == 0)
+        {
+            *level = l;
+            return pte;
+        }
+        pagetable = (pagetable_t)PTE2PA(*pte);
+    }
+    return NULL;
+}
+
+// physical address of the 4KB page holding va inside a leaf at level
+static inline uint64 leaf_page_pa(pte_t pte, uint64 va, int level)
+{
+    return PTE2PA(pte) + (va & (PXSIZE(level) - 1) & ~(PGSIZE - 1));
 }
 
 // Look up a virtual address, return the physical address,
@@ -122,38 +173,45 @@ uint64
 walkaddr(pagetable_t pagetable, uint64 va)
 {
     pte_t *pte;
-    uint64 pa;
+    int level;
 
     if (va >= MAXVA)
         return 0;
 
-    pte = walk(pagetable, va, FALSE);
+    pte = walk_leaf(pagetable, va, &level);
     if (pte == 0)
         return 0;
-    if ((*pte & PTE_V) == 0)
-        return 0;
     if ((*pte & PTE_U) == 0)
         return 0;
-    pa = PTE2PA(*pte);
-    return pa;
+    return leaf_page_pa(*pte, va, level);
+}
+
+// Whether a user access needing perm (PTE_R, PTE_W or PTE_X) to va
+// would succeed now, copy-on-write pages are not writable.
+bool uvmaccessible(pagetable_t pagetable, uint64 va, uint perm)
+{
+    pte_t *pte;
+    int level;
+
+    if (va >= MAXVA)
+        return FALSE;
+    pte = walk_leaf(pagetable, va, &level);
+    return pte != NULL && (*pte & (PTE_U | perm)) == (PTE_U | perm);
 }
 
 uint64
 walkaddr_k(pagetable_t pagetable, uint64 va)
 {
     pte_t *pte;
-    uint64 pa;
+    int level;
 
     if (va >= MAXVA)
         return 0;
 
-    pte = walk(pagetable, va, FALSE);
+    pte = walk_leaf(pagetable, va, &level);
     if (pte == 0)
         return 0;
-    if ((*pte & PTE_V) == 0)
-        return 0;
-    pa = PTE2PA(*pte);
-    return pa;
+    return leaf_page_pa(*pte, va, level);
 }
 
 // Look up a virtual address, return the physical address,
@@ -178,10 +236,13 @@ void kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 // physical addresses starting at pa. va and size might not
 // be page-aligned. Returns 0 on success, -1 if walk() couldn't
 // allocate a needed page-table page.
+// Where va and pa are both aligned and the range is large enough,
+// a single 2MB or 1GB leaf PTE is used instead of 4KB ones.
 int mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 {
     uint64 a, last;
     pte_t *pte;
+    int level;
 
     // debugf("va=%p->pa=%p, size=%p, UXWR=%d%d%d%d", va, pa, size,
     //        HAS_BIT(perm, PTE_U),
@@ -194,15 +255,18 @@ int mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
     for (;;)
     {
         // cnt+=1;
-        if ((pte = walk(pagetable, a, 1)) == 0)
+        level = 0;
+        while (level < 2 && ((a | pa) & (PXSIZE(level + 1) - 1)) == 0 && last - a >= PXSIZE(level + 1) - PGSIZE)
+            level++;
+        if ((pte = walk_level(pagetable, a, level, TRUE)) == 0)
             return -1;
         if (*pte & PTE_V)
             panic("remap");
         *pte = PA2PTE(pa) | perm | PTE_V | PTE_A | PTE_D; // U74 requires A and D = 1
-        if (a == last)
+        if (last - a < PXSIZE(level))
             break;
-        a += PGSIZE;
-        pa += PGSIZE;
+        a += PXSIZE(level);
+        pa += PXSIZE(level);
     }
     // debugf("map page cnt=%d", cnt);
     return 0;
@@ -236,32 +300,114 @@ int map1page(pagetable_t pagetable, uint64 va, uint64 pa, int perm)
     return size;
 }
 
+// Break the huge page mapped by the level-1 leaf *pte into 512 4KB
+// PTEs with the same flags. Every page of a huge page carries its
+// reference count already, so the physical pages need no change.
+// Returns 0 on success, -1 if out of memory.
+static int uvmsplit(pte_t *pte)
+{
+    pagetable_t pagetable = (pagetable_t)alloc_physical_page();
+    if (pagetable == NULL)
+        return -1;
+    uint64 pa = PTE2PA(*pte);
+    uint64 flags = PTE_FLAGS(*pte);
+    for (int i = 0; i < 512; i++)
+        pagetable[i] = PA2PTE(pa + (uint64)i * PGSIZE) | flags;
+    // stale TLB entries of the huge page map the same pages with
+    // the same permissions, nothing to flush
+    *pte = PA2PTE(pagetable) | PTE_V;
+    return 0;
+}
+
+// Return the 4KB leaf PTE mapping va. If va is in a huge page,
+// *level is set to 1 and the caller decides whether to split it.
+static pte_t *walk_user(pagetable_t pagetable, uint64 va, int *level)
+{
+    pte_t *pte = walk_leaf(pagetable, va, level);
+    if (pte && *level == 2)
+        panic("user gigapage");
+    return pte;
+}
+
+// Pages unmapped from [start, end) of a page table, to be freed once
+// no TLB holds them any more. One flush covers the whole batch.
+#define UNMAP_BATCH_SIZE 64
+
+struct unmap_batch {
+    pagetable_t pagetable;
+    uint64 start;
+    int count;
+    uint64 pages[UNMAP_BATCH_SIZE]; // physical address, | 1 for a huge page
+};
+
+static void unmap_batch_flush(struct unmap_batch *batch, uint64 end)
+{
+    if (end > batch->start)
+        tlb_flush_range(batch->pagetable, batch->start, end - batch->start);
+    for (int i = 0; i < batch->count; i++) {
+        uint64 pa = batch->pages[i];
+        if (pa & 1)
+            put_huge_physical_page((void *)(pa & ~1ULL));
+        else
+            put_physical_page((void *)pa);
+    }
+    batch->count = 0;
+    batch->start = end;
+}
+
+// Queue pa to be freed, flushing [batch->start, end) first if the batch is full.
+static void unmap_batch_add(struct unmap_batch *batch, uint64 pa, uint64 end)
+{
+    batch->pages[batch->count++] = pa;
+    if (batch->count == UNMAP_BATCH_SIZE)
+        unmap_batch_flush(batch, end);
+}
+
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
-// Optionally free the physical memory.
+// page-aligned. Pages that were never populated are skipped.
+// A huge page only partly in the range is split first.
+// Optionally free the physical memory, after the TLB flush.
 void uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
-    uint64 a;
+    uint64 a, end;
     pte_t *pte;
+    int level;
+    struct unmap_batch batch;
     debugf("va=%p npages=%d do_free=%d", va, npages, do_free);
     if ((va % PGSIZE) != 0)
         panic("uvmunmap: not aligned");
 
-    for (a = va; a < va + npages * PGSIZE; a += PGSIZE)
+    batch.pagetable = pagetable;
+    batch.start = va;
+    batch.count = 0;
+    end = va + npages * PGSIZE;
+    for (a = va; a < end; a += PGSIZE)
     {
-        if ((pte = walk(pagetable, a, FALSE)) == 0)
-            panic("uvmunmap: walk");
-        if ((*pte & PTE_V) == 0)
-            panic("uvmunmap: not mapped");
-        if (PTE_FLAGS(*pte) == PTE_V)
-            panic("uvmunmap: not a leaf");
-        if (do_free)
+        if ((pte = walk_user(pagetable, a, &level)) == 0)
+            continue;
+        if (level == 1)
         {
-            uint64 pa = PTE2PA(*pte);
-            put_physical_page((void *)pa);
+            if (a % HUGE_PAGE_SIZE == 0 && a + HUGE_PAGE_SIZE <= end)
+            {
+                uint64 pa = PTE2PA(*pte);
+                *pte = 0;
+                a += HUGE_PAGE_SIZE - PGSIZE;
+                if (do_free)
+                    unmap_batch_add(&batch, pa | 1, a + PGSIZE);
+                continue;
+            }
+            if (uvmsplit(pte) != 0)
+                panic("uvmunmap: out of memory when splitting a huge page");
+            pte = walk(pagetable, a, FALSE);
         }
+        if (PTE_FLAGS(*pte) == PTE_V)
+            panic("uvmunmap: not a leaf");
+        uint64 pa = PTE2PA(*pte);
         *pte = 0;
+        if (do_free)
+            unmap_batch_add(&batch, pa, a + PGSIZE);
     }
+    unmap_batch_flush(&batch, end);
 }
 
 // create an empty user page table.
@@ -271,12 +417,88 @@ pagetable_t
 create_empty_user_pagetable()
 {
     pagetable_t pagetable;
-    pagetable = (pagetable_t)alloc_physical_page();
-    if (pagetable != NULL)
+    pagetable = (pagetable_t)alloc_zeroed_physical_page();
+    return pagetable;
+}
+
+// Map a zeroed page at va for a demand-zero fault.
+// Returns 0 on success, -1 if va is mapped already or out of memory.
+int uvmpopulate(pagetable_t pagetable, uint64 va)
+{
+    pte_t *pte;
+    void *mem;
+
+    int level;
+
+    va = PGROUNDDOWN(va);
+    if (walk_leaf(pagetable, va, &level) != NULL)
+        return -1;
+    if ((pte = walk(pagetable, va, TRUE)) == 0)
+        return -1;
+    if ((mem = alloc_zeroed_physical_page()) == NULL) {
+        infof("uvmpopulate: out of memory");
+        return -1;
+    }
+    *pte = PA2PTE(mem) | PTE_U | PTE_R | PTE_W | PTE_X | PTE_V | PTE_A | PTE_D;
+    return 0;
+}
+
+// Check that nothing is mapped in the 2MB at va, so a huge page fits.
+static bool huge_range_free(pagetable_t pagetable, uint64 va)
+{
+    pte_t *pte = walk_level(pagetable, va, 1, FALSE);
+    if (pte == NULL || (*pte & PTE_V) == 0)
+        return TRUE;
+    if (PTE_LEAF(*pte))
+        return FALSE;
+    pagetable_t child = (pagetable_t)PTE2PA(*pte);
+    for (int i = 0; i < 512; i++)
     {
-        memset(pagetable, 0, PGSIZE);
+        if (child[i] & PTE_V)
+            return FALSE;
     }
-    return pagetable;
+    return TRUE;
+}
+
+// Map the 2MB block at pa to va with a single level-1 leaf PTE.
+// va and pa must be 2MB aligned. An empty page-table page left
+// in that slot by earlier unmaps is freed, once no hart can walk it.
+// Returns 0 on success, -1 if anything is mapped there or out of memory.
+int uvmmap_huge(pagetable_t pagetable, uint64 va, uint64 pa, int perm)
+{
+    pte_t *pte;
+    KERNEL_ASSERT(va % HUGE_PAGE_SIZE == 0 && pa % HUGE_PAGE_SIZE == 0, "uvmmap_huge: not aligned");
+    if (!huge_range_free(pagetable, va))
+        return -1;
+    if ((pte = walk_level(pagetable, va, 1, TRUE)) == 0)
+        return -1;
+    if (*pte & PTE_V) {
+        // other threads of the mm may still walk through the old table,
+        // a 2MB flush is wide enough to drop the ASID's non-leaf entries
+        void *table = (void *)PTE2PA(*pte);
+        *pte = 0;
+        tlb_flush_range(pagetable, va, HUGE_PAGE_SIZE);
+        recycle_physical_page(table);
+    }
+    *pte = PA2PTE(pa) | perm | PTE_V | PTE_A | PTE_D; // U74 requires A and D = 1
+    return 0;
+}
+
+// Map a zeroed huge page at the 2MB aligned va for a demand-zero fault.
+// Returns 0 on success, -1 if something is mapped there already
+// or no free 2MB block is left, the caller falls back to 4KB pages.
+int uvmpopulate_huge(pagetable_t pagetable, uint64 va)
+{
+    void *mem;
+    if (!huge_range_free(pagetable, va))
+        return -1;
+    if ((mem = alloc_huge_physical_page()) == NULL)
+        return -1;
+    if (uvmmap_huge(pagetable, va, (uint64)mem, PTE_U | PTE_R | PTE_W | PTE_X) != 0) {
+        recycle_physical_pages(mem, HUGE_PAGE_ORDER);
+        return -1;
+    }
+    return 0;
 }
 
 // Allocate PTEs and physical memory to grow process from oldsz to
@@ -293,13 +515,12 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
     oldsz = PGROUNDUP(oldsz);
     for (a = oldsz; a < newsz; a += PGSIZE)
     {
-        mem = alloc_physical_page();
+        mem = alloc_zeroed_physical_page();
         if (mem == 0)
         {
             uvmdealloc(pagetable, a, oldsz);
             return 0;
         }
-        memset(mem, 0, PGSIZE);
         if (mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_W | PTE_X | PTE_R | PTE_U) != 0)
         {
             recycle_physical_page(mem);
@@ -337,7 +558,8 @@ void free_pagetable_pages(pagetable_t pagetable)
     for (int i = 0; i < 512; i++)
     {
         pte_t pte = pagetable[i];
-        if ((pte & PTE_V) && (pte & (PTE_R | PTE_W | PTE_X)) == 0)
+        // a leaf, also a huge page at level 1, must be unmapped already
+        if ((pte & PTE_V) && !PTE_LEAF(pte))
         {
             // this PTE points to a lower-level page table.
             uint64 child = PTE2PA(pte);
@@ -383,61 +605,72 @@ void uvmclear(pagetable_t pagetable, uint64 va)
     *pte &= ~PTE_U;
 }
 
-int uvmcopy(pagetable_t old_pagetable, pagetable_t new_pagetable, uint64 total_size)
+// Share the page at va between two page tables copy-on-write.
+// A writable page becomes read-only with PTE_COW in both of them,
+// the first write fault gives the writer its own copy, see uvmcow().
+// A demand-zero page that was never touched stays unmapped in both.
+// Returns the bytes handled, HUGE_PAGE_SIZE for a huge page,
+// or -1 if out of memory.
+static int64 uvmshare_page(pagetable_t old_pagetable, pagetable_t new_pagetable, uint64 va)
 {
     pte_t *pte;
-    uint64 pa, cur_addr;
+    uint64 pa;
     uint flags;
-    char *mem;
+    int level;
+    if ((pte = walk_user(old_pagetable, va, &level)) == 0)
+        return PGSIZE;
+    pa = PTE2PA(*pte);
+    flags = PTE_FLAGS(*pte) | PTE_COW;
+    if (flags & PTE_W)
+        flags = (flags & ~PTE_W) | PTE_COW_W;
+    // the caller flushes the parent's stale writable TLB entries
+    *pte = PA2PTE(pa) | flags;
+    if (level == 1) {
+        KERNEL_ASSERT(va % HUGE_PAGE_SIZE == 0, "uvmshare_page: huge page not aligned");
+        if (uvmmap_huge(new_pagetable, va, pa, flags) != 0)
+            return -1;
+        dup_huge_physical_page((void *)pa);
+        return HUGE_PAGE_SIZE;
+    }
+    if (mappages(new_pagetable, va, PGSIZE, pa, flags) != 0)
+        return -1;
+    dup_physical_page((void *)pa);
+    return PGSIZE;
+}
+
+// Copy the user stack and the binary (including the heap) of a process
+// into a new page table, sharing the pages copy-on-write.
+int uvmcopy(pagetable_t old_pagetable, pagetable_t new_pagetable, uint64 total_size)
+{
+    uint64 cur_addr;
+    int64 n;
     // debugcore("to copy ustack, sz=%d", total_size);
     // copy ustack
-    for (cur_addr = USER_STACK_BOTTOM - USTACK_SIZE; cur_addr < USER_STACK_BOTTOM; cur_addr += PGSIZE)
+    for (cur_addr = USER_STACK_BOTTOM - USTACK_SIZE; cur_addr < USER_STACK_BOTTOM; cur_addr += n)
     {
-        if ((pte = walk(old_pagetable, cur_addr, FALSE)) == 0)
-            panic("uvmcopy: pte should exist");
-        if ((*pte & PTE_V) == 0)
-            panic("uvmcopy: page not present");
-        pa = PTE2PA(*pte);
-        flags = PTE_FLAGS(*pte);
-        if ((mem = alloc_physical_page()) == 0)
+        if ((n = uvmshare_page(old_pagetable, new_pagetable, cur_addr)) < 0)
             goto err_ustack;
-        memmove(mem, (char *)pa, PGSIZE);
-        if (mappages(new_pagetable, cur_addr, PGSIZE, (uint64)mem, flags) != 0)
-        {
-            recycle_physical_page(mem);
-            goto err_ustack;
-        }
     }
 
     total_size -= USTACK_SIZE;
     // debugcore("to copy bin, sz=%d", total_size);
     // free any other
-    for (cur_addr = USER_TEXT_START; cur_addr < USER_TEXT_START+total_size; cur_addr += PGSIZE)
+    for (cur_addr = USER_TEXT_START; cur_addr < USER_TEXT_START+total_size; cur_addr += n)
     {
-        if ((pte = walk(old_pagetable, cur_addr, FALSE)) == 0)
-            panic("uvmcopy: pte should exist");
-        if ((*pte & PTE_V) == 0)
-            panic("uvmcopy: page not present");
-        pa = PTE2PA(*pte);
-        flags = PTE_FLAGS(*pte);
-        if ((mem = alloc_physical_page()) == 0)
-            goto err;
-        memmove(mem, (char *)pa, PGSIZE);
-        if (mappages(new_pagetable, cur_addr, PGSIZE, (uint64)mem, flags) != 0)
-        {
-            recycle_physical_page(mem);
+        if ((n = uvmshare_page(old_pagetable, new_pagetable, cur_addr)) < 0)
             goto err;
-        }
     }
+    tlb_flush_range(old_pagetable, 0, MAXVA);
     return 0;
 
 err_ustack:
     debugcore("Copy ustack error");
-    uvmunmap(new_pagetable, USER_STACK_BOTTOM - USTACK_SIZE, USTACK_SIZE / PGSIZE, TRUE);
+    uvmunmap(new_pagetable, USER_STACK_BOTTOM - USTACK_SIZE, (cur_addr - (USER_STACK_BOTTOM - USTACK_SIZE)) / PGSIZE, TRUE);
     return -1;
 
 err:
     debugcore("Copy user space error");
+    uvmunmap(new_pagetable, USER_STACK_BOTTOM - USTACK_SIZE, USTACK_SIZE / PGSIZE, TRUE);
     uvmunmap(new_pagetable, USER_TEXT_START, (cur_addr - USER_TEXT_START) / PGSIZE, TRUE);
     return -1;
 }
@@ -446,74 +679,219 @@ int uvmmap_dup(pagetable_t old_pagetable, pagetable_t new_pagetable, uint64 va,
     pte_t *pte;
     uint64 pa, cur_addr;
     uint flags;
-    char *mem;
-    for (cur_addr = va; cur_addr < va + npages * PGSIZE; cur_addr += PGSIZE)
+    int level;
+    int64 n;
+    for (cur_addr = va; cur_addr < va + npages * PGSIZE; cur_addr += n)
     {
-        if ((pte = walk(old_pagetable, cur_addr, FALSE)) == 0)
-            panic("uvmcopy: pte should exist");
-        if ((*pte & PTE_V) == 0)
+        if (!shared) {
+            if ((n = uvmshare_page(old_pagetable, new_pagetable, cur_addr)) < 0)
+                goto err;
+            continue;
+        }
+        if ((pte = walk_user(old_pagetable, cur_addr, &level)) == 0)
             panic("uvmcopy: page not present");
         pa = PTE2PA(*pte);
         flags = PTE_FLAGS(*pte);
-        if (shared) {
-            dup_physical_page((char *)pa);
-            mem = pa;
-        } else {
-            if ((mem = alloc_physical_page()) == 0)
+        if (level == 1) {
+            if (uvmmap_huge(new_pagetable, cur_addr, pa, flags) != 0)
                 goto err;
-            memmove(mem, (char *)pa, PGSIZE);
+            dup_huge_physical_page((void *)pa);
+            n = HUGE_PAGE_SIZE;
+            continue;
         }
-        if (mappages(new_pagetable, cur_addr, PGSIZE, (uint64)mem, flags) != 0)
-        {
-            put_physical_page(mem);
+        if (mappages(new_pagetable, cur_addr, PGSIZE, pa, flags) != 0)
             goto err;
-        }
+        dup_physical_page((void *)pa);
+        n = PGSIZE;
     }
+    if (!shared)
+        tlb_flush_range(old_pagetable, va, npages * PGSIZE);
     return 0;
 
 err:
     debugcore("uvmmap_dup error");
-    uvmunmap(new_pagetable, va, npages, TRUE);
+    uvmunmap(new_pagetable, va, (cur_addr - va) / PGSIZE, TRUE);
     return -1;
 }
 
+// Give the process its own copy of a PTE_COW page.
+// The page gets PTE_W back if it was writable before the fork.
+// Returns the physical address of the private page, 0 if out of memory.
+static uint64 uvmunshare(pte_t *pte)
+{
+    uint64 pa = PTE2PA(*pte);
+    uint flags = PTE_FLAGS(*pte) & ~(PTE_COW | PTE_COW_W);
+    if (*pte & PTE_COW_W)
+        flags |= PTE_W;
+    if (get_physical_page_ref((void *)pa) > 1) {
+        char *mem = alloc_physical_page();
+        if (mem == NULL)
+            return 0;
+        memmove(mem, (char *)pa, PGSIZE);
+        put_physical_page((void *)pa);
+        pa = (uint64)mem;
+    }
+    // else every other sharer is gone already, take the page over
+    *pte = PA2PTE(pa) | flags;
+    return pa;
+}
+
+// Handle a store page fault at va.
+// Returns 0 if va is in a copy-on-write page that can be written now,
+// -1 if it is a real protection fault or out of memory.
+int uvmcow(pagetable_t pagetable, uint64 va)
+{
+    pte_t *pte;
+    int level;
+    if (va >= MAXVA)
+        return -1;
+    if ((pte = walk_user(pagetable, va, &level)) == 0)
+        return -1;
+    if ((*pte & (PTE_V | PTE_U | PTE_COW | PTE_COW_W)) != (PTE_V | PTE_U | PTE_COW | PTE_COW_W))
+        return -1;
+    // only the 4KB page being written is copied
+    if (level == 1) {
+        if (uvmsplit(pte) != 0) {
+            infof("uvmcow: out of memory");
+            return -1;
+        }
+        pte = walk(pagetable, va, FALSE);
+    }
+    if (uvmunshare(pte) == 0) {
+        infof("uvmcow: out of memory");
+        return -1;
+    }
+    tlb_flush_range(pagetable, PGROUNDDOWN(va), PGSIZE);
+    return 0;
+}
+
+// Look up a user page the kernel is about to write to,
+// breaking copy-on-write sharing first.
+// Returns the physical address, or 0 if not mapped.
+static uint64 walkaddr_write(pagetable_t pagetable, uint64 va)
+{
+    pte_t *pte;
+    int level;
+    if (va >= MAXVA)
+        return 0;
+    pte = walk_user(pagetable, va, &level);
+    if (pte == 0 || (*pte & PTE_U) == 0)
+        return 0;
+    if (*pte & PTE_COW) {
+        if (level == 1) {
+            if (uvmsplit(pte) != 0)
+                return 0;
+            pte = walk(pagetable, va, FALSE);
+        }
+        uint64 pa = uvmunshare(pte);
+        if (pa)
+            tlb_flush_range(pagetable, va, PGSIZE);
+        return pa;
+    }
+    return leaf_page_pa(*pte, va, level);
+}
+
+// The address space of the current process if pagetable is its page
+// table, NULL for a page table no other thread can touch.
+static struct mm *uvm_mm(pagetable_t pagetable)
+{
+    struct proc *p = curr_proc();
+    if (p == NULL || p->mm == NULL || p->mm->pagetable != pagetable)
+        return NULL;
+    return p->mm;
+}
+
+// The other threads of mm fault and unmap pages concurrently,
+// hold mm->lock from looking up a page until done with it.
+static inline void uvm_lock(struct mm *mm)
+{
+    if (mm)
+        acquire(&mm->lock);
+}
+
+static inline void uvm_unlock(struct mm *mm)
+{
+    if (mm)
+        release(&mm->lock);
+}
+
+// The kernel touched a user page that is not mapped yet.
+// Fault it in if the page table belongs to the current process.
+static int uvmfault(struct mm *mm, uint64 va, int access)
+{
+    if (mm == NULL)
+        return -1;
+    return handle_page_fault(curr_proc(), va, access);
+}
+
+static void pte_set_perm(pte_t *pte, uint perm) {
+    if (*pte & PTE_COW) {
+        // stay read-only until the page is copied
+        uint cow_perm = perm & PTE_W ? (perm & ~PTE_W) | PTE_COW_W : perm;
+        *pte = (*pte & ~(PTE_R | PTE_W | PTE_X | PTE_COW_W)) | cow_perm;
+        return;
+    }
+    *pte = (*pte & ~(PTE_R | PTE_W | PTE_X)) | perm;
+}
+
 int uvmprotect(pagetable_t pagetable, uint64 va, uint npages, uint perm) {
     pte_t *pte;
-    uint64 cur_addr;
+    uint64 cur_addr, end;
+    int level;
     if (perm & ~(PTE_R | PTE_W | PTE_X)) {
         infof("uvmprotect: invalid perm %x, only support RWX modification", perm);
         return -1;
     }
 
-    for (cur_addr = va; cur_addr < va + npages * PGSIZE; cur_addr += PGSIZE) {
-        if ((pte = walk(pagetable, cur_addr, FALSE)) == 0) {
-            infof("uvmprotect: pte should exist");
-            return -1;
-        }
-        if ((*pte & PTE_V) == 0) {
-            infof("uvmprotect: page not present");
-            return -1;
+    end = va + npages * PGSIZE;
+    for (cur_addr = va; cur_addr < end; cur_addr += PGSIZE) {
+        // demand-zero pages are not populated yet, skip them
+        if ((pte = walk_user(pagetable, cur_addr, &level)) == 0)
+            continue;
+        if (level == 1) {
+            if (cur_addr % HUGE_PAGE_SIZE == 0 && cur_addr + HUGE_PAGE_SIZE <= end) {
+                pte_set_perm(pte, perm);
+                cur_addr += HUGE_PAGE_SIZE - PGSIZE;
+                continue;
+            }
+            if (uvmsplit(pte) != 0) {
+                infof("uvmprotect: out of memory");
+                return -1;
+            }
+            pte = walk(pagetable, cur_addr, FALSE);
         }
-        *pte = (*pte & ~(PTE_R | PTE_W | PTE_X)) | perm;
+        pte_set_perm(pte, perm);
     }
+    tlb_flush_range(pagetable, va, npages * PGSIZE);
     return 0;
 }
 
-// Copy from kernel to user.
-// Copy len bytes from src to virtual address dstva in a given page table.
-// Return 0 on success, -1 on error.
-int copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len) {
+// Copy from kernel to user by walking the page table.
+// Fallback of copyout() for pages the direct access faulted on.
+static int copyout_walk(pagetable_t pagetable, uint64 dstva, char *src, uint64 len) {
     uint64 n, va0, pa0;
+    struct mm *mm = uvm_mm(pagetable);
 
     while (len > 0) {
         va0 = PGROUNDDOWN(dstva);
-        pa0 = walkaddr(pagetable, va0);
-        if (pa0 == 0)
+        uvm_lock(mm);
+        pa0 = walkaddr_write(pagetable, va0);
+        if (pa0 == 0) {
+            uvm_unlock(mm);
+            if (uvmfault(mm, va0, FAULT_STORE) != 0)
+                return -1;
+            uvm_lock(mm);
+            pa0 = walkaddr_write(pagetable, va0);
+        }
+        if (pa0 == 0) {
+            uvm_unlock(mm);
             return -1;
+        }
         n = PGSIZE - (dstva - va0);
         if (n > len)
             n = len;
         memmove((void *)(pa0 + (dstva - va0)), src, n);
+        uvm_unlock(mm);
 
         len -= n;
         src += n;
@@ -522,18 +900,30 @@ int copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len) {
     return 0;
 }
 
-int uvmemset(pagetable_t pagetable, uint64 dstva, char c, uint64 len) {
+static int uvmemset_walk(pagetable_t pagetable, uint64 dstva, char c, uint64 len) {
     uint64 n, va0, pa0;
+    struct mm *mm = uvm_mm(pagetable);
 
     while (len > 0) {
         va0 = PGROUNDDOWN(dstva);
-        pa0 = walkaddr(pagetable, va0);
-        if (pa0 == 0)
+        uvm_lock(mm);
+        pa0 = walkaddr_write(pagetable, va0);
+        if (pa0 == 0) {
+            uvm_unlock(mm);
+            if (uvmfault(mm, va0, FAULT_STORE) != 0)
+                return -1;
+            uvm_lock(mm);
+            pa0 = walkaddr_write(pagetable, va0);
+        }
+        if (pa0 == 0) {
+            uvm_unlock(mm);
             return -1;
+        }
         n = PGSIZE - (dstva - va0);
         if (n > len)
             n = len;
         memset((void *)(pa0 + (dstva - va0)), c, n);
+        uvm_unlock(mm);
 
         len -= n;
         dstva = va0 + PGSIZE;
@@ -541,21 +931,30 @@ int uvmemset(pagetable_t pagetable, uint64 dstva, char c, uint64 len) {
     return 0;
 }
 
-// Copy from user to kernel.
-// Copy len bytes to dst from virtual address srcva in a given page table.
-// Return 0 on success, -1 on error.
-int copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len) {
+static int copyin_walk(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len) {
     uint64 n, va0, pa0;
+    struct mm *mm = uvm_mm(pagetable);
 
     while (len > 0) {
         va0 = PGROUNDDOWN(srcva);
+        uvm_lock(mm);
         pa0 = walkaddr(pagetable, va0);
-        if (pa0 == 0)
+        if (pa0 == 0) {
+            uvm_unlock(mm);
+            if (uvmfault(mm, va0, FAULT_LOAD) != 0)
+                return -1;
+            uvm_lock(mm);
+            pa0 = walkaddr(pagetable, va0);
+        }
+        if (pa0 == 0) {
+            uvm_unlock(mm);
             return -1;
+        }
         n = PGSIZE - (srcva - va0);
         if (n > len)
             n = len;
         memmove(dst, (void *)(pa0 + (srcva - va0)), n);
+        uvm_unlock(mm);
 
         len -= n;
         dst += n;
@@ -564,18 +963,29 @@ int copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len) {
     return 0;
 }
 
-// Copy a null-terminated string from user to kernel.
-// Copy bytes to dst from virtual address srcva in a given page table,
-// until a '\0', or max.
-// Return 0 on success, -1 on error.
-int copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max) {
+// Copy a null-terminated string from user to kernel by walking the
+// page table, at most max bytes. *copied is set to the bytes copied.
+// Return 1 if the '\0' was copied, 0 if not within max, -1 on error.
+static int copyinstr_walk(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max, uint64 *copied) {
     uint64 n, va0, pa0;
-    int got_null = 0;
+    struct mm *mm = uvm_mm(pagetable);
+    *copied = 0;
 
-    while (got_null == 0 && max > 0) {
+    while (max > 0) {
         va0 = PGROUNDDOWN(srcva);
+        uvm_lock(mm);
         pa0 = walkaddr(pagetable, va0);
+        if (pa0 == 0) {
+            uvm_unlock(mm);
+            if (uvmfault(mm, va0, FAULT_LOAD) != 0) {
+                debugcore("bad addr");
+                return -1;
+            }
+            uvm_lock(mm);
+            pa0 = walkaddr(pagetable, va0);
+        }
         if (pa0 == 0){
+            uvm_unlock(mm);
             debugcore("bad addr");
             return -1;
         }
@@ -585,27 +995,121 @@ int copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max) {
 
         char *p = (char *)(pa0 + (srcva - va0));
         while (n > 0) {
+            *dst = *p;
+            ++*copied;
             if (*p == '\0') {
-                *dst = '\0';
-                got_null = 1;
-                break;
-            } else {
-                *dst = *p;
+                uvm_unlock(mm);
+                return 1;
             }
             --n;
             --max;
             p++;
             dst++;
         }
+        uvm_unlock(mm);
 
         srcva = va0 + PGSIZE;
     }
-    if (got_null) {
-        return 0;
-    } else {
-        debugcore("no null");
-        return -1;
+    return 0;
+}
+
+// Bytes from va to the end of its page, at most len.
+static inline uint64 page_rest(uint64 va, uint64 len) {
+    return MIN(PGSIZE - (va - PGROUNDDOWN(va)), len);
+}
+
+// Copy from kernel to user.
+// Copy len bytes from src to virtual address dstva in a given page table.
+// The running process's memory is written directly, see uaccess.c, a page
+// the direct access faults on is done by walking the page table.
+// Return 0 on success, -1 on error.
+int copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len) {
+    uint64 n;
+
+    while (len > 0) {
+        n = copyout_direct(pagetable, dstva, src, len);
+        len -= n;
+        src += n;
+        dstva += n;
+        if (len == 0)
+            break;
+        n = page_rest(dstva, len);
+        if (copyout_walk(pagetable, dstva, src, n) < 0)
+            return -1;
+        len -= n;
+        src += n;
+        dstva += n;
+    }
+    return 0;
+}
+
+int uvmemset(pagetable_t pagetable, uint64 dstva, char c, uint64 len) {
+    uint64 n;
+
+    while (len > 0) {
+        n = uvmemset_direct(pagetable, dstva, c, len);
+        len -= n;
+        dstva += n;
+        if (len == 0)
+            break;
+        n = page_rest(dstva, len);
+        if (uvmemset_walk(pagetable, dstva, c, n) < 0)
+            return -1;
+        len -= n;
+        dstva += n;
     }
+    return 0;
+}
+
+// Copy from user to kernel.
+// Copy len bytes to dst from virtual address srcva in a given page table.
+// Return 0 on success, -1 on error.
+int copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len) {
+    uint64 n;
+
+    while (len > 0) {
+        n = copyin_direct(pagetable, dst, srcva, len);
+        len -= n;
+        dst += n;
+        srcva += n;
+        if (len == 0)
+            break;
+        n = page_rest(srcva, len);
+        if (copyin_walk(pagetable, dst, srcva, n) < 0)
+            return -1;
+        len -= n;
+        dst += n;
+        srcva += n;
+    }
+    return 0;
+}
+
+// Copy a null-terminated string from user to kernel.
+// Copy bytes to dst from virtual address srcva in a given page table,
+// until a '\0', or max.
+// Return 0 on success, -1 on error.
+int copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max) {
+    uint64 n;
+
+    while (max > 0) {
+        if (copyinstr_direct(pagetable, dst, srcva, max, &n))
+            return 0;
+        max -= n;
+        dst += n;
+        srcva += n;
+        if (max == 0)
+            break;
+        int r = copyinstr_walk(pagetable, dst, srcva, page_rest(srcva, max), &n);
+        if (r < 0)
+            return -1;
+        if (r > 0)
+            return 0;
+        max -= n;
+        dst += n;
+        srcva += n;
+    }
+    debugcore("no null");
+    return -1;
 }
 
 // Copy to either a user address, or kernel address,
@@ -614,7 +1118,7 @@ int copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max) {
 err_t either_copyout(void *dst, void *src, size_t len, int is_user_dst) {
     struct proc *p = curr_proc();
     if (is_user_dst) {
-        return copyout(p->pagetable, (uint64)dst, src, len);
+        return copyout(p->mm->pagetable, (uint64)dst, src, len);
     } else {
         memmove(dst, src, len);
         return 0;
@@ -627,7 +1131,7 @@ err_t either_copyout(void *dst, void *src, size_t len, int is_user_dst) {
 err_t either_copyin(void *dst, void *src, size_t len, int is_user_src) {
     struct proc *p = curr_proc();
     if (is_user_src) {
-        return copyin(p->pagetable, dst, (uint64)src, len);
+        return copyin(p->mm->pagetable, dst, (uint64)src, len);
     } else {
         memmove(dst, src, len);
         return 0;
@@ -637,7 +1141,7 @@ err_t either_copyin(void *dst, void *src, size_t len, int is_user_src) {
 err_t either_memset(void *dst, char c, size_t len, int is_user_src) {
     struct proc *p = curr_proc();
     if (is_user_src) {
-        return uvmemset(p->pagetable, (uint64)dst, c, len);
+        return uvmemset(p->mm->pagetable, (uint64)dst, c, len);
     } else {
         memset(dst, c, len);
         return 0;
@@ -0,0 +1,486 @@
+#include "vma.h"
+#include <arch/riscv.h>
+#include <mem/slab.h>
+#include <ucore/defs.h>
+#include <utils/assert.h>
+#include <utils/log.h>
+
+/**
+ * Per-process mmap regions.
+ * A red-black tree ordered by start address, augmented with the largest
+ * gap in front of a region in each subtree (like Linux's rb_subtree_gap).
+ * The regions are also linked in address order, so the gap of a region is
+ * start - prev->end and a walk over a range needs no tree traversal.
+ */
+
+static struct kmem_cache *vma_cache;
+
+void vma_init() {
+    vma_cache = kmem_cache_create("vma", sizeof(struct vma));
+    KERNEL_ASSERT(vma_cache != NULL, "vma cache");
+}
+
+void vma_tree_init(struct vma_tree *tree) {
+    tree->root = NULL;
+    tree->first = NULL;
+    tree->last = NULL;
+    tree->count = 0;
+}
+
+// free space right below v
+static inline uint64 vma_gap(struct vma *v) {
+    return v->start - (v->prev ? v->prev->end : 0);
+}
+
+static inline uint64 subtree_gap(struct vma *v) {
+    return v ? v->subtree_gap : 0;
+}
+
+static void vma_recompute(struct vma *v) {
+    uint64 gap = vma_gap(v);
+    gap = MAX(gap, subtree_gap(v->left));
+    gap = MAX(gap, subtree_gap(v->right));
+    v->subtree_gap = gap;
+}
+
+// recompute v and all its ancestors after the gap of v changed
+static void vma_propagate(struct vma *v) {
+    for (; v != NULL; v = v->parent) {
+        vma_recompute(v);
+    }
+}
+
+static void replace_child(struct vma_tree *tree, struct vma *parent, struct vma *old, struct vma *new) {
+    if (parent == NULL) {
+        tree->root = new;
+    } else if (parent->left == old) {
+        parent->left = new;
+    } else {
+        parent->right = new;
+    }
+}
+
+// Rotations keep the augmented value right by recomputing the two nodes
+// whose subtrees changed, lower one first.
+static void rotate_left(struct vma_tree *tree, struct vma *x) {
+    struct vma *y = x->right;
+    x->right = y->left;
+    if (y->left)
+        y->left->parent = x;
+    y->parent = x->parent;
+    replace_child(tree, x->parent, x, y);
+    y->left = x;
+    x->parent = y;
+    vma_recompute(x);
+    vma_recompute(y);
+}
+
+static void rotate_right(struct vma_tree *tree, struct vma *x) {
+    struct vma *y = x->left;
+    x->left = y->right;
+    if (y->right)
+        y->right->parent = x;
+    y->parent = x->parent;
+    replace_child(tree, x->parent, x, y);
+    y->right = x;
+    x->parent = y;
+    vma_recompute(x);
+    vma_recompute(y);
+}
+
+static inline bool is_red(struct vma *v) {
+    return v != NULL && v->red;
+}
+
+static void insert_fixup(struct vma_tree *tree, struct vma *z) {
+    while (is_red(z->parent)) {
+        struct vma *parent = z->parent;
+        struct vma *grand = parent->parent;
+        if (parent == grand->left) {
+            struct vma *uncle = grand->right;
+            if (is_red(uncle)) {
+                parent->red = FALSE;
+                uncle->red = FALSE;
+                grand->red = TRUE;
+                z = grand;
+                continue;
+            }
+            if (z == parent->right) {
+                z = parent;
+                rotate_left(tree, z);
+                parent = z->parent;
+            }
+            parent->red = FALSE;
+            grand->red = TRUE;
+            rotate_right(tree, grand);
+        } else {
+            struct vma *uncle = grand->left;
+            if (is_red(uncle)) {
+                parent->red = FALSE;
+                uncle->red = FALSE;
+                grand->red = TRUE;
+                z = grand;
+                continue;
+            }
+            if (z == parent->left) {
+                z = parent;
+                rotate_right(tree, z);
+                parent = z->parent;
+            }
+            parent->red = FALSE;
+            grand->red = TRUE;
+            rotate_left(tree, grand);
+        }
+    }
+    tree->root->red = FALSE;
+}
+
+// link a node that overlaps no other region into the tree and the list
+static void vma_link(struct vma_tree *tree, struct vma *z) {
+    struct vma *parent = NULL, *prev = NULL, *next = NULL;
+    struct vma **link = &tree->root;
+    while (*link) {
+        parent = *link;
+        if (z->start < parent->start) {
+            next = parent;
+            link = &parent->left;
+        } else {
+            prev = parent;
+            link = &parent->right;
+        }
+    }
+    z->parent = parent;
+    z->left = z->right = NULL;
+    z->red = TRUE;
+    *link = z;
+
+    z->prev = prev;
+    z->next = next;
+    if (prev)
+        prev->next = z;
+    else
+        tree->first = z;
+    if (next)
+        next->prev = z;
+    else
+        tree->last = z;
+    tree->count++;
+
+    vma_propagate(z);
+    if (next)
+        vma_propagate(next);
+    insert_fixup(tree, z);
+}
+
+static void erase_fixup(struct vma_tree *tree, struct vma *x, struct vma *parent) {
+    while (x != tree->root && !is_red(x)) {
+        if (x == parent->left) {
+            struct vma *w = parent->right;
+            if (is_red(w)) {
+                w->red = FALSE;
+                parent->red = TRUE;
+                rotate_left(tree, parent);
+                w = parent->right;
+            }
+            if (!is_red(w->left) && !is_red(w->right)) {
+                w->red = TRUE;
+                x = parent;
+                parent = x->parent;
+            } else {
+                if (!is_red(w->right)) {
+                    w->left->red = FALSE;
+                    w->red = TRUE;
+                    rotate_right(tree, w);
+                    w = parent->right;
+                }
+                w->red = parent->red;
+                parent->red = FALSE;
+                w->right->red = FALSE;
+                rotate_left(tree, parent);
+                x = tree->root;
+            }
+        } else {
+            struct vma *w = parent->left;
+            if (is_red(w)) {
+                w->red = FALSE;
+                parent->red = TRUE;
+                rotate_right(tree, parent);
+                w = parent->left;
+            }
+            if (!is_red(w->left) && !is_red(w->right)) {
+                w->red = TRUE;
+                x = parent;
+                parent = x->parent;
+            } else {
+                if (!is_red(w->left)) {
+                    w->right->red = FALSE;
+                    w->red = TRUE;
+                    rotate_left(tree, w);
+                    w = parent->left;
+                }
+                w->red = parent->red;
+                parent->red = FALSE;
+                w->left->red = FALSE;
+                rotate_right(tree, parent);
+                x = tree->root;
+            }
+        }
+    }
+    if (x)
+        x->red = FALSE;
+}
+
+// take z out of the tree and the list, the node is not freed
+static void vma_unlink(struct vma_tree *tree, struct vma *z) {
+    struct vma *next = z->next;
+    if (z->prev)
+        z->prev->next = next;
+    else
+        tree->first = next;
+    if (next)
+        next->prev = z->prev;
+    else
+        tree->last = z->prev;
+    tree->count--;
+
+    struct vma *x, *x_parent, *y = z;
+    bool y_red = y->red;
+    if (z->left == NULL) {
+        x = z->right;
+        x_parent = z->parent;
+        replace_child(tree, z->parent, z, x);
+        if (x)
+            x->parent = x_parent;
+    } else if (z->right == NULL) {
+        x = z->left;
+        x_parent = z->parent;
+        replace_child(tree, z->parent, z, x);
+        x->parent = x_parent;
+    } else {
+        // the successor is z->next, the leftmost node of the right subtree
+        y = next;
+        y_red = y->red;
+        x = y->right;
+        if (y->parent == z) {
+            x_parent = y;
+        } else {
+            x_parent = y->parent;
+            x_parent->left = x;
+            if (x)
+                x->parent = x_parent;
+            y->right = z->right;
+            y->right->parent = y;
+        }
+        replace_child(tree, z->parent, z, y);
+        y->parent = z->parent;
+        y->left = z->left;
+        y->left->parent = y;
+        y->red = z->red;
+    }
+
+    // every node whose subtree changed is on the path from x_parent up,
+    // and the gap of next grew; fix the values before any rotation
+    vma_propagate(x_parent);
+    if (next)
+        vma_propagate(next);
+    if (!y_red)
+        erase_fixup(tree, x, x_parent);
+}
+
+static struct vma *vma_alloc(uint64 start, uint64 end, bool shared) {
+    struct vma *v = kmem_cache_alloc(vma_cache);
+    if (v == NULL) {
+        infof("vma_alloc: out of memory");
+        return NULL;
+    }
+    v->start = start;
+    v->end = end;
+    v->shared = shared;
+    return v;
+}
+
+// Return the region containing va, or NULL.
+struct vma *vma_find(struct vma_tree *tree, uint64 va) {
+    struct vma *v = vma_find_next(tree, va);
+    if (v && v->start <= va)
+        return v;
+    return NULL;
+}
+
+// Return the lowest region that ends above va, or NULL.
+struct vma *vma_find_next(struct vma_tree *tree, uint64 va) {
+    struct vma *v = tree->root, *found = NULL;
+    while (v) {
+        if (v->end > va) {
+            found = v;
+            if (v->start <= va)
+                break;
+            v = v->left;
+        } else {
+            v = v->right;
+        }
+    }
+    return found;
+}
+
+bool vma_overlap(struct vma_tree *tree, uint64 start, uint64 end) {
+    struct vma *v = vma_find_next(tree, start);
+    return v != NULL && v->start < end;
+}
+
+/**
+ * @brief Add the region [start, end), merging it with adjacent regions
+ * of the same kind.
+ *
+ * @return 0 on success, -1 if it overlaps a region or out of memory
+ */
+int vma_insert(struct vma_tree *tree, uint64 start, uint64 end, bool shared) {
+    KERNEL_ASSERT(start < end && start % PGSIZE == 0 && end % PGSIZE == 0, "vma_insert: bad range");
+    struct vma *next = vma_find_next(tree, start);
+    if (next && next->start < end) {
+        infof("vma_insert: overlap");
+        return -1;
+    }
+    struct vma *prev = next ? next->prev : tree->last;
+    bool merge_prev = prev && prev->end == start && prev->shared == shared;
+    bool merge_next = next && next->start == end && next->shared == shared;
+
+    if (merge_prev && merge_next) {
+        prev->end = next->end;
+        vma_unlink(tree, next);
+        kmem_cache_free(vma_cache, next);
+        if (prev->next)
+            vma_propagate(prev->next);
+    } else if (merge_prev) {
+        prev->end = end;
+        if (next)
+            vma_propagate(next);
+    } else if (merge_next) {
+        next->start = start;
+        vma_propagate(next);
+    } else {
+        struct vma *v = vma_alloc(start, end, shared);
+        if (v == NULL)
+            return -1;
+        vma_link(tree, v);
+    }
+    return 0;
+}
+
+/**
+ * @brief Remove [start, end) from the regions, trimming or splitting the
+ * regions that only partly overlap it. The caller unmaps the pages.
+ *
+ * @return 0 on success, -1 if out of memory when splitting
+ */
+int vma_remove(struct vma_tree *tree, uint64 start, uint64 end) {
+    struct vma *v = vma_find_next(tree, start);
+    while (v && v->start < end) {
+        struct vma *next = v->next;
+        if (v->start < start && v->end > end) {
+            // punch a hole in the middle
+            struct vma *upper = vma_alloc(end, v->end, v->shared);
+            if (upper == NULL)
+                return -1;
+            v->end = start;
+            vma_link(tree, upper);
+            return 0;
+        } else if (v->start < start) {
+            v->end = start;
+            if (next)
+                vma_propagate(next);
+        } else if (v->end > end) {
+            v->start = end;
+            vma_propagate(v);
+        } else {
+            vma_unlink(tree, v);
+            kmem_cache_free(vma_cache, v);
+        }
+        v = next;
+    }
+    return 0;
+}
+
+// free range [lo, hi) clipped to [low, high), or FALSE if shorter than len
+static inline bool clip_gap(uint64 *lo, uint64 *hi, uint64 len, uint64 low, uint64 high) {
+    *lo = MAX(*lo, low);
+    *hi = MIN(*hi, high);
+    return *hi > *lo && *hi - *lo >= len;
+}
+
+// Search v's subtree for the highest (topdown) or lowest fitting gap.
+// Subtrees whose largest gap is too small or that lie outside
+// [low, high) are skipped, so only O(log n) nodes are visited.
+static bool gap_search(struct vma *v, uint64 len, uint64 low, uint64 high, bool topdown, uint64 *addr) {
+    if (v == NULL || v->subtree_gap < len)
+        return FALSE;
+    uint64 lo = v->start - vma_gap(v), hi = v->start;
+    // the left subtree holds gaps below lo, the right one gaps above v->end
+    bool try_left = lo > low;
+    bool try_right = v->end < high;
+    if (topdown) {
+        if (try_right && gap_search(v->right, len, low, high, topdown, addr))
+            return TRUE;
+        if (clip_gap(&lo, &hi, len, low, high)) {
+            *addr = hi - len;
+            return TRUE;
+        }
+        return try_left && gap_search(v->left, len, low, high, topdown, addr);
+    } else {
+        if (try_left && gap_search(v->left, len, low, high, topdown, addr))
+            return TRUE;
+        if (clip_gap(&lo, &hi, len, low, high)) {
+            *addr = lo;
+            return TRUE;
+        }
+        return try_right && gap_search(v->right, len, low, high, topdown, addr);
+    }
+}
+
+/**
+ * @brief Find a free range of len bytes inside [low, high).
+ *
+ * @param topdown take the highest fitting range, otherwise the lowest
+ * @return start of the range, 0 if there is none
+ */
+uint64 vma_find_gap(struct vma_tree *tree, uint64 len, uint64 low, uint64 high, bool topdown) {
+    uint64 addr, lo, hi;
+    if (len == 0 || low >= high)
+        return 0;
+    // the space above the last region is not in front of any node
+    lo = tree->last ? tree->last->end : 0;
+    hi = high;
+    bool above_last = clip_gap(&lo, &hi, len, low, high);
+    if (topdown && above_last)
+        return hi - len;
+    if (gap_search(tree->root, len, low, high, topdown, &addr))
+        return addr;
+    if (!topdown && above_last)
+        return lo;
+    return 0;
+}
+
+// Copy every region of src into the empty tree dst.
+int vma_tree_dup(struct vma_tree *dst, struct vma_tree *src) {
+    KERNEL_ASSERT(dst->root == NULL, "vma_tree_dup: dst is not empty");
+    for (struct vma *v = src->first; v != NULL; v = v->next) {
+        struct vma *copy = vma_alloc(v->start, v->end, v->shared);
+        if (copy == NULL) {
+            vma_tree_clear(dst);
+            return -1;
+        }
+        vma_link(dst, copy);
+    }
+    return 0;
+}
+
+// Free all regions. The caller unmaps the pages.
+void vma_tree_clear(struct vma_tree *tree) {
+    struct vma *v = tree->first;
+    while (v) {
+        struct vma *next = v->next;
+        kmem_cache_free(vma_cache, v);
+        v = next;
+    }
+    vma_tree_init(tree);
+}
@@ -0,0 +1,43 @@
+#if !defined(VMA_H)
+#define VMA_H
+
+#include <ucore/types.h>
+
+// A mmap region [start, end) of a process.
+// Regions are kept in a red-black tree ordered by start address and in a
+// sorted list. Every node also records the largest free gap in front of a
+// region in its subtree, so a free range is found in O(log n).
+struct vma {
+    uint64 start;           // page aligned
+    uint64 end;             // page aligned, exclusive
+    bool shared;
+
+    struct vma *parent;
+    struct vma *left;
+    struct vma *right;
+    bool red;
+
+    struct vma *prev;       // region below, NULL for the first one
+    struct vma *next;       // region above, NULL for the last one
+    uint64 subtree_gap;     // max of vma_gap() over this subtree
+};
+
+struct vma_tree {
+    struct vma *root;
+    struct vma *first;
+    struct vma *last;
+    uint count;
+};
+
+void vma_init();
+void vma_tree_init(struct vma_tree *tree);
+struct vma *vma_find(struct vma_tree *tree, uint64 va);
+struct vma *vma_find_next(struct vma_tree *tree, uint64 va);
+bool vma_overlap(struct vma_tree *tree, uint64 start, uint64 end);
+int vma_insert(struct vma_tree *tree, uint64 start, uint64 end, bool shared);
+int vma_remove(struct vma_tree *tree, uint64 start, uint64 end);
+uint64 vma_find_gap(struct vma_tree *tree, uint64 len, uint64 low, uint64 high, bool topdown);
+int vma_tree_dup(struct vma_tree *dst, struct vma_tree *src);
+void vma_tree_clear(struct vma_tree *tree);
+
+#endif // VMA_H
@@ -26,12 +26,17 @@ int exec(char *name, int argc, const char **argv, int envc, const char **envp) {
 //    if (id < 0)
 //        return -1;
     struct proc *p = curr_proc();
+    if (p->group_leader != p) {
+        // the new program keeps the pid, which is the leader's
+        infof("exec: only the main thread of a process can exec");
+        return -1;
+    }
 
 //    move to elf loader
 //    proc_free_mem_and_pagetable(p);
-//    p->total_size = 0;
-//    p->pagetable = proc_pagetable(p);
-//    if (p->pagetable == 0) {
+//    p->mm->total_size = 0;
+//    p->mm->pagetable = proc_pagetable(p);
+//    if (p->mm->pagetable == 0) {
 //        panic("");
 //    }
 
@@ -75,6 +80,10 @@ int exec(char *name, int argc, const char **argv, int envc, const char **envp) {
     }
 
 load_success:
+    // the other threads die with the old program, which they still
+    // hold on to, this one has a new address space now
+    kill_other_threads(p, 0);
+    p->clear_child_tid = 0;
     safestrcpy(p->name, name, PROC_NAME_MAX);
     // push args
     char *sp = (char *)p->trapframe->sp;
@@ -83,7 +92,7 @@ load_success:
     // sp itself is on the boundary hence not mapped, but sp-1 is a valid address.
     // we can calculate the physical address of sp
     // but can NOT access sp_pa
-    char *sp_pa = (char *)(virt_addr_to_physical(p->pagetable, (uint64)sp - 1) + 1);
+    char *sp_pa = (char *)(virt_addr_to_physical(p->mm->pagetable, (uint64)sp - 1) + 1);
 
     char *sp_pa_bottom = sp_pa; // keep a record
 
@@ -1,24 +1,13 @@
 #include <proc/proc.h>
-
-static void close_proc_files(struct proc *p)
-{
-    // close files
-    for (int i = 0; i < FD_MAX; ++i)
-    {
-        if (p->files[i] != NULL)
-        {
-            fileclose(p->files[i]);
-            p->files[i] = NULL;
-        }
-    }
-}
+#include <proc/futex.h>
 
 /**
  * @brief make p->parent = NULL
  * 
  * If p is zombie, just free the struct
  * don't need to free the memory or files because they should be freed before p
- * became a zombie
+ * became a zombie. A zombie leader whose threads still run is freed by
+ * the last of them instead.
  * 
  * @param p 
  */
@@ -27,7 +16,7 @@ void reparent(struct proc *p)
     tracecore("reparent");
     KERNEL_ASSERT(holding(&wait_lock), "reparent lock");
 
-    if (p->state == ZOMBIE)
+    if (p->state == ZOMBIE && p->nr_threads == 0)
     {
         freeproc(p);
     }
@@ -38,13 +27,14 @@ void reparent(struct proc *p)
 }
 
 /**
- * Exit current running process
+ * Exit current running thread
  * will do:
  * 1. close files and dir
- * 2. reparent this process's children
- * 3. free all the memory and pagetables
+ * 2. reparent this thread's children
+ * 3. leave the address space, freed by the last thread
  * 4. set the state to ZOMBIE if parent is alive 
- *    or just free this proc struct if parent is dead
+ *    or just free this proc struct if parent is dead or it is a thread.
+ *    The leader's struct stays until the last thread of the group is gone.
  */
 void exit(int code)
 {   
@@ -53,14 +43,23 @@ void exit(int code)
     int pid_tmp = p->pid;   // keep for infof
     (void) pid_tmp;
     acquire(&p->lock);
-    p->exit_code = code;
+    if (!p->group_exit) {
+        p->exit_code = code;
+    }
+    release(&p->lock);
 
-    // 1. close files
-    close_proc_files(p);
+    // CLONE_CHILD_CLEARTID, tell a joining thread this one is gone
+    if (p->clear_child_tid) {
+        int zero = 0;
+        if (copyout(p->mm->pagetable, p->clear_child_tid, (char *)&zero, sizeof(zero)) == 0)
+            futex_wake(p->clear_child_tid, FALSE, 1, FUTEX_BITSET_MATCH_ANY);
+    }
 
-    iput(p->cwd);
-    p->cwd = NULL;
-    release(&p->lock);
+    // 1. close files
+    fdtable_put(p->files);
+    p->files = NULL;
+    fs_put(p->fs);
+    p->fs = NULL;
 
     // 2. reparent this process's children
     acquire(&wait_lock);
@@ -83,7 +82,7 @@ void exit(int code)
 
     // 3. free all the memory and pagetables
     KERNEL_ASSERT(p->trapframe !=NULL, "");
-    KERNEL_ASSERT(p->pagetable !=NULL, "");
+    KERNEL_ASSERT(p->mm !=NULL, "");
 
     proc_free_mem_and_pagetable(p);
 
@@ -97,15 +96,45 @@ void exit(int code)
     // 4. set the state
     acquire(&wait_lock);
     acquire(&p->lock);
-    if (p->parent != NULL)
+    struct proc *leader = p->group_leader;
+    bool last = --leader->nr_threads == 0;
+    if (p == leader)
     {
-        p->state = ZOMBIE;
-        wakeup(p->parent);
+        if (p->parent != NULL)
+        {
+            p->state = ZOMBIE;
+            wake_up(&p->parent->child_exit);
+        }
+        else if (last)
+        {
+            // parent is dead
+            freeproc(p);
+        }
+        else
+        {
+            // the threads still use group_leader, the last one frees it
+            p->state = ZOMBIE;
+        }
     }
     else
     {
-        // parent is dead
+        // nobody waits for a thread
         freeproc(p);
+        // the leader is a zombie waiting for its last thread
+        if (last)
+        {
+            if (leader->parent != NULL)
+            {
+                wake_up(&leader->parent->child_exit);
+            }
+            else
+            {
+                // it has switched away once its lock is free
+                acquire(&leader->lock);
+                freeproc(leader);
+                release(&leader->lock);
+            }
+        }
     }
     release(&wait_lock);
 
@@ -113,3 +142,15 @@ void exit(int code)
     switch_to_scheduler();
     pushtrace(0x3032);
 }
+
+/**
+ * Exit all threads of the current process
+ * The others are killed and exit when they next leave the kernel,
+ * code is the exit status of all of them.
+ */
+void exit_group(int code)
+{
+    struct proc *p = curr_proc();
+    kill_other_threads(p, code);
+    exit(code);
+}
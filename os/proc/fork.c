@@ -1,33 +1,105 @@
 #include <proc/proc.h>
 #include <trap/trap.h>
 #include <mem/shared.h>
+
+// Give np a copy of p's address space, copy-on-write.
+static int copy_mm(struct proc *p, struct proc *np) {
+    struct mm *mm = p->mm, *nmm = np->mm;
+    // other threads of p must not change the mappings meanwhile
+    acquire_mutex_sleep(&mm->mmap_lock);
+    acquire(&mm->lock);
+    // Copy user memory from parent to child.
+    if (uvmcopy(mm->pagetable, nmm->pagetable, mm->total_size) < 0) {
+        release(&mm->lock);
+        release_mutex_sleep(&mm->mmap_lock);
+        return -1;
+    }
+    nmm->total_size = mm->total_size;
+    nmm->heap_start = mm->heap_start;
+    nmm->heap_sz = mm->heap_sz;
+    nmm->stack_rlimit = mm->stack_rlimit;
+
+    infof("clone: stage4");
+    // dup shared mem
+    for (int i = 0; i < MAX_PROC_SHARED_MEM_INSTANCE; i++)
+    {
+
+        nmm->shmem[i] = (mm->shmem[i] == NULL)? NULL: dup_shared_mem(mm->shmem[i]);
+        nmm->shmem_map_start[i] = mm->shmem_map_start[i] ;
+    }
+
+    infof("clone: stage5");
+    // dup mapping, on failure the caller frees whatever made it into nmm,
+    // regions not mapped yet are skipped by the unmap
+    int ret = 0;
+    if (vma_tree_dup(&nmm->vmas, &mm->vmas) < 0) {
+        warnf("clone: failed to copy mmap regions");
+        ret = -1;
+    }
+    for (struct vma *v = nmm->vmas.first; v != NULL && ret == 0; v = v->next)
+    {
+        if (uvmmap_dup(mm->pagetable, nmm->pagetable, v->start, (v->end - v->start) / PGSIZE, v->shared) < 0) {
+            warnf("clone: failed to copy mmap region %p-%p", v->start, v->end);
+            ret = -1;
+        }
+    }
+
+    nmm->next_shmem_addr = mm->next_shmem_addr;
+    release(&mm->lock);
+    release_mutex_sleep(&mm->mmap_lock);
+    return ret;
+}
+
 /**
- * @brief fork current process
- * 
+ * @brief fork current process, or create a thread
+ *
+ * CLONE_VM, CLONE_FILES and CLONE_FS share the address space, the file
+ * descriptors and the current directory with the caller instead of
+ * copying them. A CLONE_THREAD child joins the caller's thread group, it
+ * is not waited for and is freed as soon as it exits. Signals are not
+ * implemented, CLONE_SIGHAND is accepted and does nothing.
+ *
+ * @param flags CLONE_* flags, the exit signal in the low byte is ignored
+ * @param stack the stack pointer of the child, NULL for the caller's
+ * @param ptid where to store the child tid for CLONE_PARENT_SETTID
+ * @param tls the tp of the child for CLONE_SETTLS
+ * @param ctid where to store the child tid for CLONE_CHILD_SETTID, and
+ *             cleared when the child exits for CLONE_CHILD_CLEARTID
  * @return int 0 or child pid, -1 on error
  */
-int clone(void* stack) {
-    int i, pid;
+int clone(uint64 flags, void *stack, void *ptid, uint64 tls, void *ctid) {
+    int pid;
     struct proc *np;
     struct proc *p = curr_proc();
 
+    // a thread shares everything a process is made of
+    if ((flags & CLONE_THREAD) && !(flags & CLONE_SIGHAND)) {
+        infof("clone: CLONE_THREAD needs CLONE_SIGHAND");
+        return -1;
+    }
+    if ((flags & CLONE_SIGHAND) && !(flags & CLONE_VM)) {
+        infof("clone: CLONE_SIGHAND needs CLONE_VM");
+        return -1;
+    }
+
     infof("clone: stage0");
     // Allocate process.
-    if ((np = alloc_proc()) == NULL) {
+    if ((np = alloc_proc(flags & CLONE_VM ? p->mm : NULL)) == NULL) {
         return -1;
     }
+    // np is USED, only we touch it until it is RUNNABLE,
+    // and copying may sleep
+    release(&np->lock);
 
     infof("clone: stage1");
-    // Copy user memory from parent to child.
-    if (uvmcopy(p->pagetable, np->pagetable, p->total_size) < 0) {
-        freeproc(np);
-        release(&np->lock);
-        return -1;
+    if (!(flags & CLONE_VM) && copy_mm(p, np) < 0) {
+        proc_free_mem_and_pagetable(np);
+        goto err;
     }
-    np->total_size = p->total_size;
-    np->heap_start = p->heap_start;
-    np->heap_sz = p->heap_sz;
     np->stride  = p->stride;
+    np->cpus_allowed = p->cpus_allowed;
+    np->policy = p->policy;
+    np->rt_priority = p->rt_priority;
     // copy saved user registers.
     *(np->trapframe) = *(p->trapframe);
 
@@ -38,55 +110,67 @@ int clone(void* stack) {
     if (stack != NULL) {
         np->trapframe->sp = (uint64)stack;
     }
+    if (flags & CLONE_SETTLS) {
+        np->trapframe->tp = tls;
+    }
 
     infof("clone: stage2");
-    // increment reference counts on open file descriptors.
-    for (i = 0; i < FD_MAX; i++)
-        if (p->files[i])
-            np->files[i] = filedup(p->files[i]);
-    infof("clone: stage3");
-    np->cwd = idup(p->cwd);
-
-    infof("clone: stage4");
-    // dup shared mem
-    for (int i = 0; i < MAX_PROC_SHARED_MEM_INSTANCE; i++)
-    {
-
-        np->shmem[i] = (p->shmem[i] == NULL)? NULL: dup_shared_mem(p->shmem[i]);
-        np->shmem_map_start[i] = p->shmem_map_start[i] ;
+    // share or copy the open file descriptors.
+    np->files = flags & CLONE_FILES ? fdtable_get(p->files) : fdtable_dup(p->files);
+    if (np->files == NULL) {
+        proc_free_mem_and_pagetable(np);
+        goto err;
     }
-
-    infof("clone: stage5");
-    // dup mapping
-    for (int i = 0; i < MAX_MAPPING; i++)
-    {
-        if (p->maps[i].va == NULL) {
-            break;
+    infof("clone: stage3");
+    if (flags & CLONE_FS) {
+        np->fs = fs_get(p->fs);
+    } else {
+        acquire_mutex_sleep(&p->fs->lock);
+        struct inode *cwd = p->fs->cwd ? idup(p->fs->cwd) : NULL;
+        release_mutex_sleep(&p->fs->lock);
+        if ((np->fs = fs_alloc(cwd)) == NULL) {
+            if (cwd)
+                iput(cwd);
+            fdtable_put(np->files);
+            np->files = NULL;
+            proc_free_mem_and_pagetable(np);
+            goto err;
         }
-        uvmmap_dup(p->pagetable, np->pagetable, p->maps[i].va, p->maps[i].npages, p->maps[i].shared);
-        np->maps[i].va = p->maps[i].va;
-        np->maps[i].npages = p->maps[i].npages;
-        np->maps[i].shared = p->maps[i].shared;
     }
 
-    np->next_shmem_addr = p->next_shmem_addr;
-
-    safestrcpy(np->name, p->name, sizeof(p->name));
-
+    if (flags & CLONE_THREAD) {
+        np->tgid = p->tgid;
+        np->group_leader = p->group_leader;
+    }
     pid = np->pid;
+    // the child runs in the caller's address space, or a copy of it
+    if ((flags & CLONE_PARENT_SETTID) && ptid != NULL)
+        copyout(p->mm->pagetable, (uint64)ptid, (char *)&pid, sizeof(pid));
+    if ((flags & CLONE_CHILD_SETTID) && ctid != NULL)
+        copyout(np->mm->pagetable, (uint64)ctid, (char *)&pid, sizeof(pid));
+    if (flags & CLONE_CHILD_CLEARTID)
+        np->clear_child_tid = (uint64)ctid;
 
-    release(&np->lock);
+    safestrcpy(np->name, p->name, sizeof(p->name));
 
     infof("clone: stage6");
     acquire(&wait_lock);
-    np->parent = p;
+    // nobody waits for a thread, it frees itself on exit
+    np->parent = flags & CLONE_THREAD ? NULL : p;
+    if (flags & CLONE_THREAD)
+        np->group_leader->nr_threads++;
     release(&wait_lock);
 
     infof("clone: stage7");
     acquire(&np->lock);
-    np->state = RUNNABLE;
+    make_runnable(np);
     release(&np->lock);
 
     infof("clone: stage8");
     return pid;
+
+err:
+    acquire(&np->lock);
+    abort_proc(np);
+    return -1;
 }
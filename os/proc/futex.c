@@ -0,0 +1,344 @@
+#include "futex.h"
+#include <arch/timer.h>
+#include <mem/shared.h>
+#include <proc/proc.h>
+#include <ucore/defs.h>
+#include <utils/log.h>
+
+/**
+ * Fast user-space locking.
+ * A private futex is named by its address space and the user address of
+ * the 32-bit word, which stays the same when a copy-on-write fault moves
+ * the word to another page. A futex in shared memory or a MAP_SHARED
+ * region, unless FUTEX_PRIVATE_FLAG says otherwise, is named by the
+ * physical address of the word, so that processes mapping it meet on
+ * the same futex. Waiters queue on their key's bucket in a hashed table,
+ * FUTEX_WAKE only looks at that bucket.
+ */
+
+#define FUTEX_HASH_BITS 8
+#define FUTEX_HASH_SIZE (1 << FUTEX_HASH_BITS)
+
+struct futex_bucket;
+
+struct futex_key {
+    struct mm *mm;                  // NULL for a shared futex
+    uint64 addr;                    // user address, physical if shared
+};
+
+// lives on the kernel stack of the waiting thread
+struct futex_waiter {
+    struct futex_key key;
+    uint32 bitset;
+    struct proc *proc;
+    void *chan;                     // what proc sleeps on, itself or its timer's queue
+    bool woken;
+    struct futex_bucket *bucket;    // changed by requeue, under both bucket locks
+    struct futex_waiter *prev;
+    struct futex_waiter *next;
+};
+
+// waiters in FIFO order
+struct futex_bucket {
+    struct spinlock lock;
+    struct futex_waiter *head;
+    struct futex_waiter *tail;
+};
+
+static struct futex_bucket futex_table[FUTEX_HASH_SIZE];
+
+void futex_init() {
+    for (int i = 0; i < FUTEX_HASH_SIZE; i++) {
+        init_spin_lock_with_name(&futex_table[i].lock, "futex.bucket");
+        futex_table[i].head = futex_table[i].tail = NULL;
+    }
+}
+
+static struct futex_bucket *futex_hash(struct futex_key *key) {
+    // Fibonacci hashing, the low 2 bits are always 0
+    uint64 h = (key->addr >> 2) ^ (uint64)key->mm;
+    return &futex_table[(h * 0x9E3779B97F4A7C15ULL) >> (64 - FUTEX_HASH_BITS)];
+}
+
+static bool key_eq(struct futex_key *a, struct futex_key *b) {
+    return a->mm == b->mm && a->addr == b->addr;
+}
+
+// Whether uaddr is in memory other processes may map, MAP_SHARED regions
+// and shared memory. Must hold mm->lock.
+static bool futex_shared(struct mm *mm, uint64 uaddr) {
+    struct vma *v = vma_find(&mm->vmas, uaddr);
+    if (v != NULL)
+        return v->shared;
+    for (int i = 0; i < MAX_PROC_SHARED_MEM_INSTANCE; i++) {
+        uint64 start = (uint64)mm->shmem_map_start[i];
+        if (mm->shmem[i] && uaddr >= start && uaddr < start + mm->shmem[i]->page_cnt * PGSIZE)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+// Must hold b->lock.
+static void bucket_append(struct futex_bucket *b, struct futex_waiter *w) {
+    w->bucket = b;
+    w->next = NULL;
+    w->prev = b->tail;
+    if (b->tail)
+        b->tail->next = w;
+    else
+        b->head = w;
+    b->tail = w;
+}
+
+// Must hold w->bucket->lock.
+static void bucket_remove(struct futex_waiter *w) {
+    struct futex_bucket *b = w->bucket;
+    if (w->prev)
+        w->prev->next = w->next;
+    else
+        b->head = w->next;
+    if (w->next)
+        w->next->prev = w->prev;
+    else
+        b->tail = w->prev;
+    w->prev = w->next = NULL;
+}
+
+// Dequeue w and make its thread runnable. Must hold w->bucket->lock.
+static void futex_wake_waiter(struct futex_waiter *w) {
+    struct proc *p = w->proc;
+    void *chan = w->chan;
+    bucket_remove(w);
+    // the waiter holds p->lock from before it dropped the bucket lock
+    // until it sleeps, so it cannot miss this
+    acquire(&p->lock);
+    w->woken = TRUE;    // w may be gone as soon as this is seen
+    if (p->state == SLEEPING && p->waiting_target == chan) {
+        make_runnable(p);
+    }
+    release(&p->lock);
+}
+
+// Lock two buckets in address order.
+static void double_lock(struct futex_bucket *b1, struct futex_bucket *b2) {
+    if (b1 > b2) {
+        struct futex_bucket *t = b1;
+        b1 = b2;
+        b2 = t;
+    }
+    acquire(&b1->lock);
+    if (b1 != b2)
+        acquire(&b2->lock);
+}
+
+static void double_unlock(struct futex_bucket *b1, struct futex_bucket *b2) {
+    release(&b1->lock);
+    if (b1 != b2)
+        release(&b2->lock);
+}
+
+/**
+ * @brief Name the futex at uaddr and find the physical address of its word
+ *
+ * The page is made present first. A copy-on-write page is copied, so that
+ * the word read is the one a waker writes.
+ * @param private the caller says no other process maps the word
+ * Returns with p->mm->lock held so that the page stays put, or 0 without
+ * it if uaddr is not a readable user address.
+ */
+static uint64 futex_key(struct proc *p, uint64 uaddr, bool private, struct futex_key *key) {
+    struct mm *mm = p->mm;
+    if (uaddr % sizeof(uint32) != 0) {
+        infof("futex: unaligned address %p", uaddr);
+        return 0;
+    }
+    // a read-only word is good enough once a store fault has failed
+    for (int tries = 0; tries < 3; tries++) {
+        acquire(&mm->lock);
+        if (uvmaccessible(mm->pagetable, uaddr, PTE_W) ||
+            (tries > 0 && uvmaccessible(mm->pagetable, uaddr, PTE_R))) {
+            uint64 pa = walkaddr(mm->pagetable, uaddr) + (uaddr & (PGSIZE - 1));
+            if (private || !futex_shared(mm, uaddr)) {
+                key->mm = mm;
+                key->addr = uaddr;
+            } else {
+                key->mm = NULL;
+                key->addr = pa;
+            }
+            return pa;
+        }
+        release(&mm->lock);
+        if (handle_page_fault(p, uaddr, FAULT_STORE) != 0 &&
+            handle_page_fault(p, uaddr, FAULT_LOAD) != 0) {
+            break;
+        }
+    }
+    infof("futex: bad address %p", uaddr);
+    return 0;
+}
+
+/**
+ * @brief Sleep until woken on uaddr if it still holds val
+ *
+ * @param deadline tick to give up at, 0 to wait forever
+ * @param bitset only wakes whose bitset intersects this one count
+ * @return 0 if woken, -1 if *uaddr != val, on timeout or when killed
+ */
+int futex_wait(uint64 uaddr, bool private, uint32 val, uint64 deadline, uint32 bitset) {
+    struct proc *p = curr_proc();
+    struct futex_waiter w;
+    struct timer *timer = NULL;
+    struct wait_queue_entry timer_entry;
+
+    if (bitset == 0)
+        return -1;
+    if (deadline != 0) {
+        uint64 now = get_tick();
+        if (deadline <= now)
+            return -1;
+        if ((timer = add_timer(TICK_TO_US(deadline - now) + 1)) == NULL) {
+            infof("futex_wait: cannot add timer");
+            return -1;
+        }
+        // the deadline is checked under p->lock, we cannot miss the timer
+        release(&timer->guard_lock);
+    }
+
+    uint64 word = futex_key(p, uaddr, private, &w.key);
+    if (word == 0) {
+        if (timer)
+            del_timer(timer);
+        return -1;
+    }
+    w.bitset = bitset;
+    w.proc = p;
+    w.chan = timer ? (void *)&timer->wq : (void *)&w;
+    w.woken = FALSE;
+
+    struct futex_bucket *b = futex_hash(&w.key);
+    acquire(&b->lock);
+    // the word is read under the bucket lock, a waker that changed it
+    // before us takes the lock after we queued
+    uint32 cur = *(volatile uint32 *)word;
+    release(&p->mm->lock);
+    if (cur != val) {
+        release(&b->lock);
+        if (timer)
+            del_timer(timer);
+        return -1;
+    }
+    bucket_append(b, &w);
+    if (timer) {
+        init_wait_queue_entry(&timer_entry, p, &timer->wq, 0);
+        wait_queue_add(&timer->wq, &timer_entry);
+    }
+
+    acquire(&p->lock);
+    release(&b->lock);
+    while (!w.woken && !p->killed && !(timer && get_tick() >= timer->wakeup_tick)) {
+        p->waiting_target = w.chan;
+        p->state = SLEEPING;
+        switch_to_scheduler();
+        p->waiting_target = NULL;
+    }
+    release(&p->lock);
+
+    if (!w.woken) {
+        // timed out or killed, leave whatever bucket requeue moved us to
+        for (;;) {
+            b = w.bucket;
+            acquire(&b->lock);
+            if (w.woken || w.bucket == b)
+                break;
+            release(&b->lock);
+        }
+        if (!w.woken)
+            bucket_remove(&w);
+        release(&b->lock);
+    }
+    if (timer) {
+        wait_queue_remove(&timer->wq, &timer_entry);
+        del_timer(timer);
+    }
+    return w.woken ? 0 : -1;
+}
+
+/**
+ * @brief Wake up to nr_wake waiters on uaddr, oldest first
+ *
+ * @return the number of waiters woken, -1 on a bad address
+ */
+int futex_wake(uint64 uaddr, bool private, int nr_wake, uint32 bitset) {
+    struct proc *p = curr_proc();
+    struct futex_key key;
+    if (bitset == 0)
+        return -1;
+    if (futex_key(p, uaddr, private, &key) == 0)
+        return -1;
+    release(&p->mm->lock);
+
+    struct futex_bucket *b = futex_hash(&key);
+    int woken = 0;
+    acquire(&b->lock);
+    struct futex_waiter *w = b->head, *next;
+    for (; w != NULL && woken < nr_wake; w = next) {
+        next = w->next;
+        if (key_eq(&w->key, &key) && (w->bitset & bitset)) {
+            futex_wake_waiter(w);
+            woken++;
+        }
+    }
+    release(&b->lock);
+    return woken;
+}
+
+/**
+ * @brief Wake up to nr_wake waiters on uaddr and move up to nr_requeue
+ * of the others to wait on uaddr2
+ *
+ * With cmp, nothing happens unless *uaddr still holds cmpval.
+ * @return the number of waiters woken or moved, -1 on error
+ */
+int futex_requeue(uint64 uaddr, uint64 uaddr2, bool private, int nr_wake, int nr_requeue,
+                  bool cmp, uint32 cmpval) {
+    struct proc *p = curr_proc();
+    struct futex_key key, key2;
+    if (futex_key(p, uaddr2, private, &key2) == 0)
+        return -1;
+    release(&p->mm->lock);
+    uint64 word = futex_key(p, uaddr, private, &key);
+    if (word == 0)
+        return -1;
+
+    struct futex_bucket *b = futex_hash(&key), *b2 = futex_hash(&key2);
+    double_lock(b, b2);
+    if (cmp && *(volatile uint32 *)word != cmpval) {
+        double_unlock(b, b2);
+        release(&p->mm->lock);
+        return -1;
+    }
+    release(&p->mm->lock);
+
+    int count = 0, moved = 0;
+    struct futex_waiter *w = b->head, *next;
+    for (; w != NULL; w = next) {
+        next = w->next;
+        if (!key_eq(&w->key, &key))
+            continue;
+        if (count < nr_wake) {
+            futex_wake_waiter(w);
+        } else if (moved < nr_requeue) {
+            if (b != b2) {
+                bucket_remove(w);
+                bucket_append(b2, w);
+            }
+            w->key = key2;
+            moved++;
+        } else {
+            break;
+        }
+        count++;
+    }
+    double_unlock(b, b2);
+    return count;
+}
@@ -0,0 +1,25 @@
+#if !defined(FUTEX_H)
+#define FUTEX_H
+
+#include <ucore/types.h>
+
+#define FUTEX_WAIT 0
+#define FUTEX_WAKE 1
+#define FUTEX_REQUEUE 3
+#define FUTEX_CMP_REQUEUE 4
+#define FUTEX_WAIT_BITSET 9
+#define FUTEX_WAKE_BITSET 10
+
+#define FUTEX_PRIVATE_FLAG 128
+#define FUTEX_CLOCK_REALTIME 256
+#define FUTEX_CMD_MASK (~(FUTEX_PRIVATE_FLAG | FUTEX_CLOCK_REALTIME))
+
+#define FUTEX_BITSET_MATCH_ANY 0xffffffff
+
+void futex_init();
+int futex_wait(uint64 uaddr, bool private, uint32 val, uint64 deadline, uint32 bitset);
+int futex_wake(uint64 uaddr, bool private, int nr_wake, uint32 bitset);
+int futex_requeue(uint64 uaddr, uint64 uaddr2, bool private, int nr_wake, int nr_requeue,
+                  bool cmp, uint32 cmpval);
+
+#endif // FUTEX_H
@@ -1,33 +1,60 @@
 #include <proc/proc.h>
+
+// Mark q killed, it exits when it next leaves the kernel.
+// Must hold q->lock.
+static void kill_locked(struct proc *q) {
+    q->killed = 1;
+    if (q->state == SLEEPING) {
+        make_runnable(q);
+    }
+}
+
+// Kill every thread of the process pid.
 int kill(int pid) {
     // pid < 0 is not supported
     if(pid < 0) {
         return -1;
     }
 
-    // search the process with pid
+    // search the threads of pid
     struct proc *p;
-    acquire(&pool_lock);
+    bool found = FALSE;
     for (p = pool; p < &pool[NPROC]; p++) {
+        // only the threads of pid are locked, tgid is constant
+        if (!proc_in_use(p) || p->tgid != pid)
+            continue;
         acquire(&p->lock);
-        if (p->state != UNUSED && p->state != ZOMBIE && p->pid == pid) {
-            release(&pool_lock);
-            goto found;
+        if (p->state != UNUSED && p->state != ZOMBIE && p->tgid == pid) {
+            kill_locked(p);
+            found = TRUE;
         }
         release(&p->lock);
     }
-    release(&pool_lock);
-    infof ("kill: no such pid %d", pid);
-//    return -3; // -ESRCH, means no such process
-    return 0; // we think it is success
-
-found:
-    infof("kill: pid %d found", pid);
-    // kill the process
-    p->killed = 1;
-    if (p->state == SLEEPING) {
-        p->state = RUNNABLE;
+    if (!found) {
+        infof ("kill: no such pid %d", pid);
+//        return -3; // -ESRCH, means no such process
+        return 0; // we think it is success
     }
-    release(&p->lock);
+    infof("kill: pid %d found", pid);
     return 0;
-}
\ No newline at end of file
+}
+
+// Kill the threads of p's group other than p, for exit_group().
+// code becomes the exit status of all of them.
+void kill_other_threads(struct proc *p, int code) {
+    struct proc *q;
+    for (q = pool; q < &pool[NPROC]; q++) {
+        if (q == p || !proc_in_use(q) || q->tgid != p->tgid) {
+            continue;
+        }
+        acquire(&q->lock);
+        if (q->state != UNUSED && q->tgid == p->tgid) {
+            q->exit_code = code;
+            q->group_exit = TRUE;
+            if (q->state != ZOMBIE) {
+                kill_locked(q);
+            }
+        }
+        release(&q->lock);
+    }
+}
@@ -141,16 +141,12 @@ int get_app_id_by_name(char *name)
     return -1;
 }
 
+// Only the top page of the user stack is mapped, exec puts the arguments
+// there. The rest is populated on demand by handle_page_fault().
 void alloc_ustack(struct proc *p)
 {
-    for (uint64 va = USER_STACK_BOTTOM - USTACK_SIZE; va < USER_STACK_BOTTOM; va += PGSIZE) {
-        void *pa = alloc_physical_page();
-        if (!pa) {
-            panic("alloc_ustack::alloc_physical_page failed");
-        }
-        if (mappages(p->pagetable, va, PGSIZE, (uint64)pa, PTE_U | PTE_R | PTE_W | PTE_X) != 0) {
-            panic("alloc_ustack::mappages failed");
-        }
+    if (uvmpopulate(p->mm->pagetable, USER_STACK_BOTTOM - PGSIZE) != 0) {
+        panic("alloc_ustack::uvmpopulate failed");
     }
     p->ustack_bottom = USER_STACK_BOTTOM;
     p->trapframe->sp = p->ustack_bottom;
@@ -168,15 +164,15 @@ void bin_loader(uint64 start, uint64 end, struct proc *p)
             panic("bin_loader alloc_physical_page");
         }
         memmove(page, (const void *)pa, PGSIZE);
-        if (mappages(p->pagetable, va, PGSIZE, (uint64)page, PTE_U | PTE_R | PTE_W | PTE_X) != 0)
+        if (mappages(p->mm->pagetable, va, PGSIZE, (uint64)page, PTE_U | PTE_R | PTE_W | PTE_X) != 0)
             panic("bin_loader mappages");
     }
 
     p->trapframe->epc = USER_TEXT_START;
     alloc_ustack(p);
-    p->next_shmem_addr = (void*) p->ustack_bottom+PGSIZE;
-    p->total_size = USTACK_SIZE + length;
-    p->heap_start = USER_TEXT_START + length;
+    p->mm->next_shmem_addr = (void*) p->ustack_bottom+PGSIZE;
+    p->mm->total_size = USTACK_SIZE + length;
+    p->mm->heap_start = USER_TEXT_START + length;
 }
 
 void loader(int id, struct proc *p) {
@@ -361,14 +357,14 @@ int loadelf(struct proc *p, struct inode *ip, bool is_interp, struct elfhdr
     if (!is_interp) {
         if (is_dyn) {
             map_base = USER_TEXT_START;
-            if (uvmalloc(p->pagetable, USER_TEXT_START, USER_TEXT_START +
+            if (uvmalloc(p->mm->pagetable, USER_TEXT_START, USER_TEXT_START +
             max_va) != USER_TEXT_START + max_va) {
                 infof("elf_loader uvmalloc failed");
                 return -1;
             }
         } else {
             map_base = min_va;
-            if (uvmalloc(p->pagetable, USER_TEXT_START, max_va) != max_va) {
+            if (uvmalloc(p->mm->pagetable, USER_TEXT_START, max_va) != max_va) {
                 infof("elf_loader uvmalloc failed");
                 return -1;
             }
@@ -392,7 +388,7 @@ int loadelf(struct proc *p, struct inode *ip, bool is_interp, struct elfhdr
             continue;
         }
         uint64 loadva = phdr.vaddr + (map_base - min_va);
-        if (loadseg(p->pagetable, loadva, ip, phdr.off, phdr.filesz) < 0) {
+        if (loadseg(p->mm->pagetable, loadva, ip, phdr.off, phdr.filesz) < 0) {
             infof("elf_loader loadseg failed");
             return -1;
         }
@@ -522,9 +518,7 @@ int elf_loader(char* name, struct proc *p, struct auxv_t *auxv, int *auxc) {
     }
 
     proc_free_mem_and_pagetable(p);
-    p->total_size = 0;
-    p->pagetable = proc_pagetable(p);
-    KERNEL_ASSERT(p->pagetable != NULL, "elf_loader alloc page table failed");
+    KERNEL_ASSERT(proc_pagetable(p) != NULL, "elf_loader alloc page table failed");
 
     // can't revoke the modification from here because the old page table is freed,
     // so we must use panic.
@@ -537,6 +531,8 @@ int elf_loader(char* name, struct proc *p, struct auxv_t *auxv, int *auxc) {
     if (loadelf(p, ip, FALSE, &ehdr[0], &base[0], &npages[0]) < 0) {
         panic("elf_loader loadelf exec failed");
     }
+    // mmap (the interpreter below) only searches above the heap start
+    p->mm->heap_start = base[0] + npages[0] * PGSIZE;
 
     // find interpreter and load it if exists
     bool has_interp = FALSE;
@@ -578,11 +574,11 @@ int elf_loader(char* name, struct proc *p, struct auxv_t *auxv, int *auxc) {
     p->trapframe->epc = entry;
     infof("elf_loader epc %p", entry);
     alloc_ustack(p);
-    p->next_shmem_addr = (void*) p->ustack_bottom+PGSIZE;
+    p->mm->next_shmem_addr = (void*) p->ustack_bottom+PGSIZE;
     uint64 edata = base[0] + npages[0] * PGSIZE;
-    p->total_size = USTACK_SIZE + (edata - USER_TEXT_START);
-    p->heap_start = edata;
-    infof("elf_loader total_size %p", p->total_size);
+    p->mm->total_size = USTACK_SIZE + (edata - USER_TEXT_START);
+    p->mm->heap_start = edata;
+    infof("elf_loader total_size %p", p->mm->total_size);
     return 0;
 }
 
@@ -590,7 +586,7 @@ int elf_loader(char* name, struct proc *p, struct auxv_t *auxv, int *auxc) {
 // and make it a proc
 int make_shell_proc()
 {
-    struct proc *p = alloc_proc();
+    struct proc *p = alloc_proc(NULL);
 
     // still need to init: 
     //  * parent           
@@ -611,10 +607,12 @@ int make_shell_proc()
     // name
     safestrcpy(p->name, "shell", PROC_NAME_MAX);
 
-    // cwd
+    // files and cwd
 //    p->cwd = inode_by_name("/");
-    p->cwd = NULL;
-    p->state = RUNNABLE;
+    p->files = fdtable_alloc();
+    p->fs = fs_alloc(NULL);
+    KERNEL_ASSERT(p->files != NULL && p->fs != NULL, "make_shell_proc: out of memory");
+    make_runnable(p);
     release(&p->lock);
 
     return 0;
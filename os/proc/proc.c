@@ -7,12 +7,12 @@
 #include <ucore/defs.h>
 #include <utils/log.h>
 #include <mem/shared.h>
+#include <mem/slab.h>
 #include <fatfs/fftest.h>
 #include <fatfs/init.h>
 
 struct proc pool[NPROC];
-volatile struct proc *creating_proc;
-struct spinlock creating_lock;
+int nr_procs;   // procs not UNUSED, the schedulers stop once there are none
 
 __attribute__((aligned(16))) char kstack[NPROC][KSTACK_SIZE];
 // helps ensure that wakeups of wait()ing
@@ -20,7 +20,6 @@ __attribute__((aligned(16))) char kstack[NPROC][KSTACK_SIZE];
 // memory model when using p->parent.
 // must be acquired before any p->lock.
 struct spinlock wait_lock;
-struct spinlock pool_lock;
 // struct spinlock proc_tree_lock;
 struct
 {
@@ -37,35 +36,38 @@ struct proc *curr_proc() {
     return p;
 }
 
+// The proc whose pid is pid, NULL if there is none.
+// It is not locked and may exit at any time.
 struct proc *findproc(int pid) {
-    struct proc *p = NULL;
-    acquire(&pool_lock);
-    for (p = pool; p < &pool[NPROC]; p++) {
-        acquire(&p->lock);
-        if (p->state != UNUSED && p->pid == pid) {
-            release(&p->lock);
+    struct proc *found = NULL;
+    rcu_read_lock();
+    for (struct proc *p = pool; p < &pool[NPROC]; p++) {
+        if (proc_in_use(p) && p->pid == pid) {
+            found = p;
             break;
         }
-        release(&p->lock);
     }
-    release(&pool_lock);
-    return p;
+    rcu_read_unlock();
+    return found;
 }
 
 void procinit(void) {
     struct proc *p;
-    init_spin_lock_with_name(&pool_lock, "pool_lock");
     init_spin_lock_with_name(&wait_lock, "wait_lock");
-    init_spin_lock_with_name(&creating_lock, "creating_lock");
     // init_spin_lock_with_name(&proc_tree_lock, "proc_tree_lock");
     for (p = pool; p < &pool[NPROC]; p++) {
         init_spin_lock_with_name(&p->lock, "proc.lock");
+        init_wait_queue(&p->child_exit);
+        init_seqcount(&p->time_seq);
         p->state = UNUSED;
 
     }
 
     next_pid.pid = 1;
     init_spin_lock_with_name(&next_pid.lock, "next_pid.lock");
+    vma_init();
+    mm_init();
+    wait_queue_init_chans();
 }
 
 int alloc_pid() {
@@ -75,83 +77,75 @@ int alloc_pid() {
     release(&next_pid.lock);
     return pid;
 }
-pagetable_t proc_pagetable(struct proc *p) {
-    pagetable_t pagetable;
-
-    // An empty page table.
-    pagetable = create_empty_user_pagetable();
-    if (pagetable == NULL)
-        panic("cannot create empty user pagetable");
-
-    if (mappages(pagetable, TRAMPOLINE, PGSIZE,
-                 (uint64)trampoline, PTE_R | PTE_X) < 0) {
-        free_pagetable_pages(pagetable);
-        return 0;
-    }
+// Map p's trapframe into mm, for trampoline.S.
+static int proc_map_trapframe(struct proc *p, struct mm *mm) {
+    acquire(&mm->lock);
+    int ret = mappages(mm->pagetable, p->trapframe_va, PGSIZE,
+                       (uint64)(p->trapframe), PTE_R | PTE_W);
+    release(&mm->lock);
+    return ret;
+}
 
-    if ((p->trapframe = (struct trapframe *)alloc_physical_page()) == 0) {
-        panic("alloc trapframe page failed\n");
+// Give p a new and empty address space.
+pagetable_t proc_pagetable(struct proc *p) {
+    KERNEL_ASSERT(p->mm == NULL, "proc_pagetable: p has an address space already");
+    struct mm *mm = mm_create();
+    if (mm == NULL) {
+        return NULL;
     }
-
-    // map the trapframe just below TRAMPOLINE, for trampoline.S.
-    if (mappages(pagetable, TRAPFRAME, PGSIZE,
-                 (uint64)(p->trapframe), PTE_R | PTE_W) < 0) {
-        ;
-        panic("Can not map TRAPFRAME");
+    if (proc_map_trapframe(p, mm) < 0) {
+        mm_put(mm);
+        return NULL;
     }
-
-    return pagetable;
+    // readers of the pool may see p->mm as soon as it is set
+    p->mm = mm;
+    return mm->pagetable;
 }
 
-// Free a process's page table, and free the
-// physical memory it refers to.
+// Leave p's address space, the memory is freed
+// when no other thread is using it.
 void proc_free_mem_and_pagetable(struct proc* p) {
-    uvmunmap(p->pagetable, TRAMPOLINE, 1, FALSE);  // unmap, don't recycle physical, shared
-    uvmunmap(p->pagetable, TRAPFRAME, 1, TRUE);   // unmap, should recycle physical
-    p->trapframe = NULL;
-
-    // unmap shared memory
-    for (int i = 0; i < MAX_PROC_SHARED_MEM_INSTANCE; i++)
-    {
-        if (p->shmem[i])
-        { // active shared memory
-            debugcore("free shared mem");
-            uvmunmap(p->pagetable, (uint64)p->shmem_map_start[i], p->shmem[i]->page_cnt, FALSE);
-            // debugcore("free page = %d", get_free_page_count());
-            drop_shared_mem(p->shmem[i]);
-            p->shmem[i]=NULL;
-            p->shmem_map_start[i] = 0;
-            // debugcore("free page = %d", get_free_page_count());
+    struct mm *mm = p->mm;
+    acquire(&mm->lock);
+    uvmunmap(mm->pagetable, p->trapframe_va, 1, FALSE);   // unmap, the trapframe goes with p
+    release(&mm->lock);
+    // readers of the pool may be looking at mm, mm_put() frees it
+    // after a grace period
+    acquire(&p->lock);
+    p->mm = NULL;
+    release(&p->lock);
+    // a page table no process runs is in no TLB under its ASID,
+    // tearing it down needs no flush
+    mm_put(mm);
+}
 
-        }
+struct fs_struct *fs_alloc(struct inode *cwd) {
+    struct fs_struct *fs = kmalloc(sizeof(struct fs_struct));
+    if (fs == NULL) {
+        infof("fs_alloc: out of memory");
+        return NULL;
     }
-
-    // unmap mapping pages
-    for (int i = 0; i < MAX_MAPPING; i++)
-    {
-        if (p->maps[i].va == NULL) {
-            break;
-        }
-        uvmunmap(p->pagetable, (uint64)p->maps[i].va, p->maps[i].npages, TRUE);
-        memset(&p->maps[i], 0, sizeof(struct mapping));
-    }
-
-    // total_size sanity check, avoid memory leak
-    KERNEL_ASSERT(
-            p->total_size ==
-            (p->heap_start - USER_TEXT_START) + // bin size
-            p->heap_sz + // heap size
-            USTACK_SIZE, // stack size
-            "proc_free_mem_and_pagetable: total_size sanity check failed"
-    );
-    free_user_mem_and_pagetables(p->pagetable, p->total_size);
-    p->pagetable = NULL;
-    p->total_size = 0;
-    p->heap_start = 0;
-    p->heap_sz = 0;
+    fs->ref = 1;
+    init_mutex_with_name(&fs->lock, "fs_struct.lock");
+    fs->cwd = cwd;
+    return fs;
 }
 
+struct fs_struct *fs_get(struct fs_struct *fs) {
+    __atomic_fetch_add(&fs->ref, 1, __ATOMIC_RELAXED);
+    return fs;
+}
 
+// Drop a reference, the last one releases the current directory.
+void fs_put(struct fs_struct *fs) {
+    if (__atomic_sub_fetch(&fs->ref, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+    if (fs->cwd) {
+        iput(fs->cwd);
+    }
+    kfree(fs);
+}
 
 /**
  * @brief clean a process struct
@@ -164,33 +158,46 @@ void proc_free_mem_and_pagetable(struct proc* p) {
 void freeproc(struct proc *p) {
     KERNEL_ASSERT(holding(&p->lock), "should lock the process to free");
 
-    KERNEL_ASSERT(p->trapframe == NULL, "p->trapfram is pointing somewhere, did you forget to free trapframe?");
-    KERNEL_ASSERT(p->pagetable == NULL, "p->pagetable is pointing somewhere, did you forget to free pagetable?");
-    KERNEL_ASSERT(p->cwd == NULL, "p->cwd is not NULL, did you forget to release the inode?");
+    KERNEL_ASSERT(p->mm == NULL, "p->mm is pointing somewhere, did you forget to free pagetable?");
+    KERNEL_ASSERT(p->files == NULL, "p->files is not NULL, did you forget to close the files?");
+    KERNEL_ASSERT(p->fs == NULL, "p->fs is not NULL, did you forget to release the inode?");
     KERNEL_ASSERT(p->waiting_target == NULL, "p->cwd is waiting something");
-    KERNEL_ASSERT(p->total_size == 0, "memory not freed");
-    KERNEL_ASSERT(p->heap_sz == 0, "heap not freed");
-
 
-    p->heap_start = 0;
+    if (p->trapframe) {
+        put_physical_page(p->trapframe);
+        p->trapframe = NULL;
+    }
+    p->trapframe_va = 0;
     p->state = UNUSED;  // very important
+    if (__atomic_sub_fetch(&nr_procs, 1, __ATOMIC_SEQ_CST) == 0) {
+        // harts waiting for work have to see that there will be none
+        wake_idle_harts();
+    }
     p->pid = 0;
+    p->tgid = 0;
+    p->group_leader = NULL;
+    p->nr_threads = 0;
     p->killed = FALSE;
+    p->group_exit = FALSE;
     p->parent = NULL;
     p->exit_code = 0;
     p->parent = NULL;
     p->ustack_bottom = 0;
     p->kstack = 0;
+    p->clear_child_tid = 0;
     memset(&p->context, 0, sizeof(p->context));
     p->stride = 0;
     p->priority = 0;
+    p->cpus_allowed = 0;
+    p->last_cpu = -1;
+    p->nr_migrations = 0;
+    p->policy = SCHED_OTHER;
+    p->rt_priority = 0;
+    write_seqcount_begin(&p->time_seq);
     p->kernel_time = 0;
     p->user_time = 0;
+    write_seqcount_end(&p->time_seq);
     p->last_start_time = 0;
-    for (int i = 0; i < FD_MAX; i++)
-    {
-        KERNEL_ASSERT(p->files[i] == NULL, "some file is not closed");
-    }
     memset(p->name, 0, PROC_NAME_MAX);
     
 
@@ -198,6 +205,34 @@ void freeproc(struct proc *p) {
     // still holding the lock
 }
 
+/**
+ * @brief Give back a proc from alloc_proc() that will never run
+ * Its address space, files and fs must be released already.
+ * 
+ * @param p the proc, with lock, released on return
+ */
+void abort_proc(struct proc *p) {
+    freeproc(p);
+    release(&p->lock);
+}
+
+/**
+ * @brief Find the live thread whose thread id is tid
+ *
+ * @return the thread with its lock held, or NULL
+ */
+struct proc *lock_thread(int tid) {
+    for (struct proc *p = pool; p < &pool[NPROC]; p++) {
+        if (!proc_in_use(p) || p->pid != tid)
+            continue;
+        acquire(&p->lock);
+        if (p->state != UNUSED && p->state != ZOMBIE && p->pid == tid)
+            return p;
+        release(&p->lock);
+    }
+    return NULL;
+}
+
 /**
  * @brief Allocate a unused proc in the pool
  * and it's initialized to some extend
@@ -206,54 +241,57 @@ void freeproc(struct proc *p) {
  * 
  * parent           NULL
  * ustack_bottom    0
- * total_size       0
- * cwd              NULL
+ * files            NULL
+ * fs               NULL
  * name             ""
- * next_shmem_addr  0
  * 
+ * @param mm the address space to share, NULL for a new one
  * @return struct proc* p with lock 
  */
-struct proc *alloc_proc(void) {
+struct proc *alloc_proc(struct mm *mm) {
     struct proc *p;
-    acquire(&pool_lock);
     for (p = pool; p < &pool[NPROC]; p++) {
         acquire(&p->lock);
         if (p->state == UNUSED) {
-            release(&pool_lock);
             goto found;
         }
         release(&p->lock);
     }
-    release(&pool_lock);
     return NULL;
 
 found:
-    // set creating proc to p
-    for (;;) {
-        acquire(&creating_lock);
-        if (creating_proc == NULL) {
-            creating_proc = p;
-            release(&creating_lock);
-            break;
-        }
-        release(&creating_lock);
-    }
-
+    __atomic_fetch_add(&nr_procs, 1, __ATOMIC_RELAXED);
     p->pid = alloc_pid();
-    p->state = USED;
-    p->total_size = 0;
-    p->heap_start = 0;
-    p->heap_sz = 0;
+    p->tgid = p->pid;
+    p->group_leader = p;
+    p->nr_threads = 1;
+    // lockless readers that see the slot in use see its ids
+    __atomic_store_n(&p->state, USED, __ATOMIC_RELEASE);
+    p->minflt = 0;
     p->killed = FALSE;
+    p->group_exit = FALSE;
     p->waiting_target = NULL;
     p->exit_code = -1;
     p->parent = NULL;
     p->ustack_bottom = 0;
-    p->pagetable = proc_pagetable(p);
-    if (p->pagetable == NULL) {
+    p->clear_child_tid = 0;
+    p->files = NULL;
+    p->fs = NULL;
+
+    // every thread has its own trapframe, mapped at its own address
+    p->trapframe_va = TRAPFRAME - (uint64)(p - pool) * PGSIZE;
+    p->mm = NULL;
+    if ((p->trapframe = (struct trapframe *)alloc_physical_page()) == NULL) {
+        errorf("failed to alloc trapframe page");
+    } else if (mm != NULL) {
+        if (proc_map_trapframe(p, mm) == 0)
+            p->mm = mm_get(mm);
+    } else {
+        proc_pagetable(p);
+    }
+    if (p->mm == NULL) {
         errorf("failed to create user pagetable");
-        freeproc(p);
-        release(&p->lock);
+        abort_proc(p);
         return NULL;
     }
     memset(&p->context, 0, sizeof(p->context));
@@ -265,28 +303,20 @@ found:
 
     p->stride = 0;
     p->priority = 16;
+    p->rq_cpu = -1;
+    p->rq_index = -1;
+    p->cpus_allowed = CPUS_ALL;
+    p->last_cpu = -1;
+    p->nr_migrations = 0;
+    p->policy = SCHED_OTHER;
+    p->rt_priority = 0;
+    p->slice_end = 0;
+    p->yielded = FALSE;
+    p->rt_prev = p->rt_next = NULL;
     p->user_time = 0;
     p->kernel_time = 0;
     p->last_start_time = 0;
-    for (int i = 0; i < FD_MAX; i++) {
-        p->files[i] = NULL;
-    }
-    p->cwd = NULL;
     p->name[0] = '\0';
-    for (int i = 0; i < MAX_PROC_SHARED_MEM_INSTANCE; i++)
-    {
-       p->shmem[i] = NULL;
-       p->shmem_map_start[i]= 0;
-    }
-    p->next_shmem_addr = 0;
-
-    // clear mapping fields
-    for (int i = 0; i < MAX_MAPPING; i++)
-    {
-        p->maps[i].va = 0;
-        p->maps[i].npages = 0;
-        p->maps[i].shared = FALSE;
-    }
 
     return p;
 }
@@ -296,10 +326,6 @@ found:
 void forkret(void) {
     pushtrace(0x3200);
     static int first = TRUE;
-    // reset creating_proc to NULL
-    acquire(&creating_lock);
-    creating_proc = NULL;
-    release(&creating_lock);
     // Still holding p->lock from scheduler.
     release(&curr_proc()->lock);
 
@@ -332,6 +358,7 @@ void switch_to_scheduler(void) {
     KERNEL_ASSERT(p->state != RUNNING, "current proc shouldn't be running");
     KERNEL_ASSERT(holding(&p->lock), "should hold currernt proc's lock"); // holding currernt proc's lock
     KERNEL_ASSERT(mycpu()->noff == 1, "");                                // and it's the only lock
+    KERNEL_ASSERT(mycpu()->preempt_count == 0, "sleeping with preemption disabled");
     KERNEL_ASSERT(!intr_get(), "interrput should be off");                // interrput is off
 
     base_interrupt_status = mycpu()->base_interrupt_status;
@@ -372,9 +399,10 @@ void print_proc(struct proc *proc) {
     } else {
         printf_k("UNKNOWN\n");
     }
-    printf_k("* locked:             %d\n", proc->lock.locked);
+    printf_k("* locked:             %d\n", spin_is_locked(&proc->lock));
     printf_k("* killed:             %d\n", proc->killed);
-    printf_k("* pagetable:          %p\n", proc->pagetable);
+    printf_k("* tgid:               %d\n", proc->tgid);
+    printf_k("* mm:                 %p\n", proc->mm);
     printf_k("* waiting target:     %p\n", proc->waiting_target);
     printf_k("* exit_code:          %d\n", proc->exit_code);
     printf_k("*\n");
@@ -391,26 +419,29 @@ void print_proc(struct proc *proc) {
     printf_k("* context:            \n");
     printf_k("*     ra:             %p\n", proc->context.ra);
     printf_k("*     sp:             %p\n", proc->context.sp);
-    printf_k("* total_size:         %p\n", proc->total_size);
-    printf_k("* heap_start:         %p\n", proc->heap_start);
-    printf_k("* heap_sz:            %p\n", proc->heap_sz);
+    if (proc->mm) {
+        printf_k("* pagetable:          %p\n", proc->mm->pagetable);
+        printf_k("* total_size:         %p\n", proc->mm->total_size);
+        printf_k("* heap_start:         %p\n", proc->mm->heap_start);
+        printf_k("* heap_sz:            %p\n", proc->mm->heap_sz);
+    }
     printf_k("* stride:             %p\n", proc->stride);
     printf_k("* priority:           %p\n", proc->priority);
     printf_k("* kernel_time:        %p\n", proc->kernel_time);
     printf_k("* user_time:          %p\n", proc->user_time);
     printf_k("* last_time:          %p\n", proc->last_start_time);
     printf_k("* files:              \n");
-    for (int i = 0; i < FD_MAX; i++) {
-        if (proc->files[i] != NULL) {
+    for (int i = 0; proc->files && i < FD_MAX; i++) {
+        if (proc->files->fd[i] != NULL) {
             if (i < 10) {
-                printf_k("*     files[ %d]:      %p\n", i, proc->files[i]);
+                printf_k("*     files[ %d]:      %p\n", i, proc->files->fd[i]);
             } else {
-                printf_k("*     files[%d]:      %p\n", i, proc->files[i]);
+                printf_k("*     files[%d]:      %p\n", i, proc->files->fd[i]);
             }
         }
     }
     printf_k("* files:              \n");
-    printf_k("* cwd:                %p\n", proc->cwd);
+    printf_k("* cwd:                %p\n", proc->fs ? proc->fs->cwd : NULL);
     printf_k("* name:               %s\n", proc->name);
 
     printf_k("* -------------------------------\n");
@@ -422,94 +453,68 @@ void print_proc(struct proc *proc) {
  * Allocate a file descriptor of this process for the given file
  */
 int fdalloc(struct file *f) {
-    struct proc *p = curr_proc();
+    struct fdtable *t = curr_proc()->files;
 
+    write_lock(&t->lock);
     for (int i = 0; i < FD_MAX; ++i) {
-        if (p->files[i] == 0) {
-            p->files[i] = f;
+        if (t->fd[i] == 0) {
+            t->fd[i] = f;
+            write_unlock(&t->lock);
             return i;
         }
     }
+    write_unlock(&t->lock);
     return -1;
 }
 
 int fdalloc2(struct file *f, int fd) {
-    struct proc *p = curr_proc();
+    struct fdtable *t = curr_proc()->files;
 
     if (fd < 0 || fd >= FD_MAX) {
         return -1;
     }
-    if (p->files[fd] != 0) {
+    write_lock(&t->lock);
+    if (t->fd[fd] != 0) {
+        write_unlock(&t->lock);
         return -1;
     }
-    p->files[fd] = f;
+    t->fd[fd] = f;
+    write_unlock(&t->lock);
     return fd;
 }
 
-void wakeup(void *waiting_target) {
-    struct proc *p;
-
-    acquire(&creating_lock);
-    for (p = pool; p < &pool[NPROC]; p++) {
-        if (p != curr_proc() && p != creating_proc) {
-            acquire(&p->lock);
-            if (p->state == SLEEPING && p->waiting_target == waiting_target) {
-                p->state = RUNNABLE;
-            }
-            release(&p->lock);
-        }
-    }
-    release(&creating_lock);
-}
-
-// Atomically release lock and sleep on chan.
-// Reacquires lock when awakened.
-void sleep(void *waiting_target, struct spinlock *lk) {
-    
-    struct proc *p = curr_proc();
-
-//    tracecore("sleep");
-    // Must acquire p->lock in order to
-    // change p->state and then call switch_to_scheduler.
-    // Once we hold p->lock, we can be
-    // guaranteed that we won't miss any wakeup
-    // (wakeup locks p->lock),
-    // so it's okay to release lk.
-    // print_proc(p);
-
-    acquire(&p->lock); 
-
-    release(lk);
-
-    // Go to sleep.
-    p->waiting_target = waiting_target;
-    p->state = SLEEPING;
-
-    switch_to_scheduler();
-    pushtrace(0x3031);
-
-    // Tidy up.
-    p->waiting_target = NULL;
-
-    // Reacquire original lock.
-
-    release(&p->lock);
-
-    acquire(lk);
-
-    // debugcore("sleep end");
-}
-
-struct file *get_proc_file_by_fd(struct proc *p, int fd) {
+/**
+ * Look up fd of p and take a reference to its file, so that a close()
+ * by another thread sharing the table cannot free it meanwhile.
+ * The caller drops it with fileclose().
+ */
+struct file *fget(struct proc *p, int fd) {
     if (p == NULL) {
-        panic("get_proc_file_by_fd: p is NULL");
+        panic("fget: p is NULL");
     }
 
     if (fd < 0 || fd >= FD_MAX) {
         return NULL;
     }
 
-    return p->files[fd];
+    struct fdtable *t = p->files;
+    read_lock(&t->lock);
+    struct file *f = t->fd[fd];
+    if (f != NULL) {
+        filedup(f);
+    }
+    read_unlock(&t->lock);
+    return f;
+}
+
+// Read p's times without its lock, they are never torn.
+void get_proc_times(struct proc *p, uint64 *user, uint64 *kernel) {
+    uint seq;
+    do {
+        seq = read_seqcount_begin(&p->time_seq);
+        *user = p->user_time;
+        *kernel = p->kernel_time;
+    } while (read_seqcount_retry(&p->time_seq, seq));
 }
 
 // get the given process and its child processes running time in ticks
@@ -524,184 +529,106 @@ int get_cpu_time(struct proc *p, struct tms *tms) {
         return -1;
     }
 
-    tms->tms_utime = p->user_time;
-    tms->tms_stime = p->kernel_time;
+    get_proc_times(p, &tms->tms_utime, &tms->tms_stime);
     tms->tms_cutime = 0;
     tms->tms_cstime = 0;
 
-    acquire(&pool_lock);
+    // takes no p->lock, the scheduler runs on undisturbed
+    rcu_read_lock();
     struct proc *child;
     for (child = pool; child < &pool[NPROC]; child++)
     {
-        if (child != p) // avoid deadlock
+        if (proc_in_use(child) && child->parent == p)
         {
-            acquire(&child->lock);
-            if (child->state != UNUSED && child->parent == p)
-            {
-                // found a child
-                tms->tms_cutime += child->user_time;
-                tms->tms_cstime += child->kernel_time;
-            }
-            release(&child->lock);
+            // found a child
+            uint64 user, kernel;
+            get_proc_times(child, &user, &kernel);
+            tms->tms_cutime += user;
+            tms->tms_cstime += kernel;
         }
     }
-    release(&pool_lock);
+    rcu_read_unlock();
     return 0;
 }
 
 bool the_only_proc_in_pool() {
-    acquire(&pool_lock);
-    int count = 0;
-    struct proc *p;
-    for (p = pool; p < &pool[NPROC]; p++) {
-        acquire(&p->lock);
-        if (p->state != UNUSED) {
-            count++;
-        }
-        release(&p->lock);
-    }
-    release(&pool_lock);
-    return count == 1;
+    return __atomic_load_n(&nr_procs, __ATOMIC_ACQUIRE) == 1;
 }
 
-static bool is_free_range(pagetable_t pagetable, uint64 start, uint npages) {
-    uint64 va;
-    pte_t *pte;
-    for (va = start; va < start + npages * PGSIZE; va += PGSIZE) {
-        if ((pte = walk(pagetable, va, TRUE)) == 0) {
-            return FALSE;
-        }
-        if ((*pte & PTE_V) != 0) {
-            return FALSE;
-        }
-    }
-    return TRUE;
-}
+// mmap regions live between the end of the heap and the stack guard page
+#define MMAP_HIGH (USER_STACK_BOTTOM - USTACK_SIZE - USTACK_GUARD_SIZE)
 
-static void *get_free_range(pagetable_t pagetable, uint npages, uint64 hint_address) {
-    infof("get_free_range: npages: %d, hint_address: %p", npages, hint_address);
-    uint64 va;
-    if (hint_address) {
-        for (va = hint_address; va <= USER_STACK_BOTTOM - USTACK_SIZE - (npages + 1) * PGSIZE; va += PGSIZE) {
-            if (is_free_range(pagetable, va, npages)) {
-                return (void *)va;
-            }
-        }
-    } else {
-        for (va = USER_STACK_BOTTOM - USTACK_SIZE - npages * PGSIZE; va > USER_TEXT_START; va -= PGSIZE) {
-            if (is_free_range(pagetable, va, npages)) {
-                return (void *) va;
-            }
-        }
-    }
-    return NULL;
+static uint64 mmap_low(struct proc *p) {
+    return MAX(USER_TEXT_START, PGROUNDUP(p->mm->heap_start + p->mm->heap_sz));
 }
 
-static int mapping_add(struct proc *p, uint64 va, uint npages, bool shared) {
-    KERNEL_ASSERT(p->maps[MAX_MAPPING - 1].va == NULL, "mapping_add: too many mappings");
-
-    // find a entry to insert
-    int i;
-    for (i = 0; i < MAX_MAPPING; i++) {
-        if (p->maps[i].va > va || p->maps[i].va == NULL) {
-            break;
-        }
-    }
-
-    // make sure there's no overlap
-    if (p->maps[i].va && va + npages * PGSIZE > p->maps[i].va) {
-        infof("mapping_add: overlap");
-        return -1;
-    }
-
-    // move all mappings after i to the right
-    for (int j = MAX_MAPPING - 1; j > i; j--) {
-        p->maps[j] = p->maps[j - 1];
-    }
-
-    // insert the new mapping
-    p->maps[i].va = va;
-    p->maps[i].npages = npages;
-    p->maps[i].shared = shared;
-    return 0;
-}
-
-static int mapping_remove_fixed(struct proc *p, uint64 va, uint npages) {
-    // find the mapping
-    int i;
-    for (i = 0; i < MAX_MAPPING; i++) {
-        if (p->maps[i].va == va && p->maps[i].npages == npages) {
-            break;
-        }
-    }
-    if (i == MAX_MAPPING) {
-        infof("mapping_remove: not found");
-        return -1;
+// Find len bytes of free address space starting at a multiple of align,
+// the lowest range at or above hint_address if given, otherwise the highest one.
+static uint64 get_free_range(struct proc *p, uint64 len, uint64 align, uint64 hint_address) {
+    infof("get_free_range: len: %p, hint_address: %p", len, hint_address);
+    uint64 low = mmap_low(p);
+    uint64 va = 0;
+    // any range this long holds an aligned one of len bytes
+    len += align - PGSIZE;
+    if (hint_address) {
+        va = vma_find_gap(&p->mm->vmas, len, MAX(hint_address, low), MMAP_HIGH, FALSE);
     }
-
-    // move all mappings after i to the left
-    for (int j = i; j < MAX_MAPPING - 1; j++) {
-        p->maps[j] = p->maps[j + 1];
+    if (va == 0) {
+        va = vma_find_gap(&p->mm->vmas, len, low, MMAP_HIGH, TRUE);
     }
-    memset(&p->maps[MAX_MAPPING - 1], 0, sizeof(struct mapping));
-    return 0;
+    return ROUNDUP(va, align);
 }
 
-static int mapping_try_remove_page(struct proc *p, uint64 check_va) {
-    KERNEL_ASSERT(check_va % PGSIZE == 0, "mapping_get_range: check_va is not page aligned");
-    uint64 left_va, right_va;
-    uint left_npages, right_npages;
-
-    // find a entry contains check_va
-    int i;
-    uint64 begin, end;
-    bool shared;
-    for (i = 0; i < MAX_MAPPING; i++) {
-        begin = p->maps[i].va;
-        end = begin + p->maps[i].npages * PGSIZE;
-        shared = p->maps[i].shared;
-        if (check_va >= begin && check_va < end) {
-            goto range_found;
+// Unmap the parts of the mmap regions that fall inside [start, end).
+// Must hold p->mm->lock.
+static int unmap_range(struct proc *p, uint64 start, uint64 end) {
+    struct vma *v = vma_find_next(&p->mm->vmas, start);
+    if (v && v->start < start && v->end > end) {
+        // the only case vma_remove() allocates, do it before touching the pages
+        if (vma_remove(&p->mm->vmas, start, end) < 0) {
+            return -1;
         }
+        uvmunmap(p->mm->pagetable, start, (end - start) / PGSIZE, TRUE);
+        return 0;
     }
-    // not found
-    return -1;
-
-range_found:
-    left_va = begin;
-    left_npages = (check_va - begin) / PGSIZE;
-    right_va = check_va + PGSIZE;
-    right_npages = (end - right_va) / PGSIZE;
-
-    // remove the mapping
-    if (mapping_remove_fixed(p, begin, (end - begin) / PGSIZE) < 0) {
-        panic("mapping_try_remove_page: mapping_remove_fixed failed");
-    }
-    // add the left and right mappings
-    if (left_npages > 0 && mapping_add(p, left_va, left_npages, shared) < 0) {
-        panic("mapping_try_remove_page: mapping_add left failed");
-    }
-    if (right_npages > 0 && mapping_add(p, right_va, right_npages, shared) < 0) {
-        panic("mapping_try_remove_page: mapping_add right failed");
+    for (; v && v->start < end; v = v->next) {
+        uint64 s = MAX(v->start, start), e = MIN(v->end, end);
+        uvmunmap(p->mm->pagetable, s, (e - s) / PGSIZE, TRUE);
     }
+    KERNEL_ASSERT(vma_remove(&p->mm->vmas, start, end) == 0, "unmap_range: vma_remove failed");
     return 0;
 }
 
-void *mmap(struct proc *p, void *start, size_t len, int prot, int flags, struct inode *ip, off_t off) {
-    if (p->maps[MAX_MAPPING - 1].va != 0) {
-        infof("sys_mmap: too many mappings");
-        return MAP_FAILED;
-    }
-
+static void *do_mmap(struct proc *p, void *start, size_t len, int prot, int flags, struct inode *ip, off_t off) {
     // length sanity check and do alignment
     if (len == 0) {
         infof("sys_mmap: len cannot be 0");
         return MAP_FAILED;
     }
     len = PGROUNDUP(len);
+    // anonymous regions of 2MB or more are backed by huge pages where
+    // aligned, MAP_HUGETLB asks for nothing but huge pages
+    bool hugetlb = !!(flags & MAP_HUGETLB);
+    uint64 align = PGSIZE;
+    if (hugetlb) {
+        if (!(flags & MAP_ANONYMOUS)) {
+            infof("MAP_HUGETLB: only anonymous mappings are supported");
+            return MAP_FAILED;
+        }
+        len = ROUNDUP(len, HUGE_PAGE_SIZE);
+        if ((flags & MAP_FIXED) && (uint64)start % HUGE_PAGE_SIZE != 0) {
+            infof("MAP_HUGETLB: start must be 2MB aligned");
+            return MAP_FAILED;
+        }
+    }
+    bool huge = (flags & MAP_ANONYMOUS) && len >= HUGE_PAGE_SIZE;
+    if (huge) {
+        align = HUGE_PAGE_SIZE;
+    }
     uint npages = len / PGSIZE;
 
     // get valid start address
+    uint64 va;
     if (flags & MAP_FIXED) {
         // MAP_FIXED sanity check
         if (start == NULL) {
@@ -712,23 +639,22 @@ void *mmap(struct proc *p, void *start, size_t len, int prot, int flags, struct
             infof("MAP_FIXED: start must be page aligned");
             return MAP_FAILED;
         }
-
-        if (!is_free_range(p->pagetable, (uint64)start, npages)) {
-            // try to remove existing mapping overlapping with the new one
-            for (uint64 va = (uint64)start; va < (uint64)start + npages * PGSIZE; va += PGSIZE) {
-                if (mapping_try_remove_page(p, va) == 0) {
-                    uvmunmap(p->pagetable, va, 1, TRUE);
-                }
-            }
-            // check again
-            if (!is_free_range(p->pagetable, (uint64)start, npages)) {
-                infof("MAP_FIXED: start is not free");
-                return MAP_FAILED;
-            }
+        va = (uint64)start;
+        if (va < mmap_low(p) || va + len > MMAP_HIGH || va + len < va) {
+            infof("MAP_FIXED: start is not free");
+            return MAP_FAILED;
+        }
+        // remove existing mappings overlapping with the new one
+        acquire(&p->mm->lock);
+        int err = unmap_range(p, va, va + len);
+        release(&p->mm->lock);
+        if (err < 0) {
+            infof("MAP_FIXED: failed to remove old mappings");
+            return MAP_FAILED;
         }
     } else {
-        start = get_free_range(p->pagetable, npages, PGROUNDUP((uint64)start));
-        if (start == NULL) {
+        va = get_free_range(p, len, align, PGROUNDUP((uint64)start));
+        if (va == 0) {
             infof("sys_mmap: no free range");
             return MAP_FAILED;
         }
@@ -745,90 +671,112 @@ void *mmap(struct proc *p, void *start, size_t len, int prot, int flags, struct
     if (prot & PROT_EXEC) {
         page_prot |= PTE_X;
     }
+    if (!(page_prot & (PTE_R | PTE_W | PTE_X))) {
+        // a level-1 PTE without RWX is a pointer to a page table
+        huge = FALSE;
+    }
 
-    // do mmap
-    void *pa_arr[npages];
-    memset(pa_arr, 0, sizeof(pa_arr));
+    if (!(flags & MAP_ANONYMOUS) && PGROUNDUP(f_size(&ip->file)) < off + len) {
+        infof("sys_mmap: file is too small, so expand it");
+        f_lseek(&ip->file, off + len);
+    }
 
-    if (flags & MAP_ANONYMOUS) {
-        // allocate physical pages
-        for (uint i = 0; i < npages; i++) {
-            void *pa = alloc_physical_page();
+    // do mmap, page by page
+    for (uint i = 0; i < npages; i++) {
+        void *pa;
+        uint64 a = va + i * PGSIZE;
+        if (huge && a % HUGE_PAGE_SIZE == 0 && i + HUGE_PAGE_NPAGES <= npages) {
+            pa = alloc_huge_physical_page();
+            if (pa != NULL) {
+                acquire(&p->mm->lock);
+                int err = uvmmap_huge(p->mm->pagetable, a, (uint64)pa, page_prot);
+                release(&p->mm->lock);
+                if (err == 0) {
+                    i += HUGE_PAGE_NPAGES - 1;
+                    continue;
+                }
+            }
+            if (pa != NULL) {
+                recycle_physical_pages(pa, HUGE_PAGE_ORDER);
+            }
+            if (hugetlb) {
+                infof("MAP_HUGETLB: no free huge page");
+                goto free_pages;
+            }
+            // fall back to 4KB pages
+        }
+        if (flags & MAP_ANONYMOUS) {
+            pa = alloc_zeroed_physical_page();
             if (pa == NULL) {
                 infof("sys_mmap: no free physical page");
                 goto free_pages;
             }
-            memset(pa, 0, PGSIZE);
-            pa_arr[i] = pa;
-        }
-    } else {
-        if (PGROUNDUP(f_size(&ip->file)) < off + len) {
-            infof("sys_mmap: file is too small, so expand it");
-            f_lseek(&ip->file, off + len);
-        }
-        struct page_cache *cache;
-        void *pa;
-        for (uint i = 0; i < npages; i++) {
-            cache = ctable_acquire(ip, off + i * PGSIZE);
+        } else {
+            struct page_cache *cache = ctable_acquire(ip, off + i * PGSIZE);
             if (cache == NULL) {
                 infof("sys_mmap: file is too small");
                 goto free_pages;
             }
-//            if (flags & MAP_SHARED) {
-//                pa = cache->page;
-//                dup_physical_page(cache->page);
-//            } else {
-                pa = alloc_physical_page();
-                if (pa == NULL) {
-                    infof("sys_mmap: no free physical page");
-                    goto free_pages;
-                }
-                memmove(pa, cache->page, PGSIZE);
-//            }
-            pa_arr[i] = pa;
+            pa = alloc_physical_page();
+            if (pa == NULL) {
+                infof("sys_mmap: no free physical page");
+                release_mutex_sleep(&cache->lock);
+                goto free_pages;
+            }
+            memmove(pa, cache->page, PGSIZE);
             release_mutex_sleep(&cache->lock);
         }
-    }
-
-    // map pages
-    for (uint i = 0; i < npages; i++) {
-        if (map1page(p->pagetable, (uint64)start + i * PGSIZE,
-                     (uint64)pa_arr[i], page_prot) < 0) {
-            panic("sys_mmap: map1page failed, should not happen");
+        acquire(&p->mm->lock);
+        int err = mappages(p->mm->pagetable, a, PGSIZE, (uint64)pa, page_prot);
+        release(&p->mm->lock);
+        if (err != 0) {
+            infof("sys_mmap: mappages failed");
+            put_physical_page(pa);
+            goto free_pages;
         }
     }
 
+    acquire(&p->mm->lock);
+    tlb_flush_range(p->mm->pagetable, va, len);
+
     // record mapping info
-    if (mapping_add(p, (uint64)start, npages, !!(flags & MAP_SHARED)) < 0) {
-        panic("sys_mmap: mapping_add failed, found data inconsistent");
+    if (vma_insert(&p->mm->vmas, va, va + len, !!(flags & MAP_SHARED)) < 0) {
+        release(&p->mm->lock);
+        infof("sys_mmap: vma_insert failed");
+        goto free_pages;
     }
-    return start;
+    release(&p->mm->lock);
+    return (void *)va;
 
     free_pages:
-    for (uint i = 0; i < npages; i++) {
-        if (pa_arr[i] == NULL) {
-            break;
-        }
-        put_physical_page(pa_arr[i]);
-    }
+    // pages not mapped yet are skipped
+    acquire(&p->mm->lock);
+    uvmunmap(p->mm->pagetable, va, npages, TRUE);
+    release(&p->mm->lock);
     return MAP_FAILED;
 }
 
+void *mmap(struct proc *p, void *start, size_t len, int prot, int flags, struct inode *ip, off_t off) {
+    acquire_mutex_sleep(&p->mm->mmap_lock);
+    void *ret = do_mmap(p, start, len, prot, flags, ip, off);
+    release_mutex_sleep(&p->mm->mmap_lock);
+    return ret;
+}
+
 int munmap(struct proc *p, void *start, size_t len) {
     if ((uint64)start % PGSIZE != 0) {
         infof("sys_munmap: start is not page aligned");
         return -1;
     }
-    len = PGROUNDUP(len);
-    uint npages = len / PGSIZE;
-
-    bool removed = FALSE;
-    for (uint64 va = (uint64)start; va < (uint64)start + npages * PGSIZE; va += PGSIZE) {
-        if (mapping_try_remove_page(p, va) == 0) {
-            removed = TRUE;
-            uvmunmap(p->pagetable, va, 1, TRUE);
-        }
-    }
-
-    return removed ? 0 : -1;
-}
\ No newline at end of file
+    uint64 va = (uint64)start;
+    uint64 end = va + PGROUNDUP(len);
+    acquire_mutex_sleep(&p->mm->mmap_lock);
+    acquire(&p->mm->lock);
+    int ret = -1;
+    if (end >= va && vma_overlap(&p->mm->vmas, va, end)) {
+        ret = unmap_range(p, va, end);
+    }
+    release(&p->mm->lock);
+    release_mutex_sleep(&p->mm->mmap_lock);
+    return ret;
+}
@@ -7,14 +7,13 @@
 #include <file/file.h>
 #include <lock/lock.h>
 #include <arch/timer.h>
+#include <mem/mm.h>
 #define NPROC (256)
 #define KSTACK_SIZE (PGSIZE * 16)
-#define USTACK_SIZE (PGSIZE * 128) // must be multiple of PGSIZE
+#define USTACK_SIZE (PGSIZE * 2048) // reserved stack, populated on demand, must be multiple of PGSIZE
+#define USTACK_GUARD_SIZE (PGSIZE)  // never mapped, below the stack limit
 #define TRAPFRAME_SIZE (4096)
-#define FD_MAX (256)
 #define PROC_NAME_MAX (16)
-#define MAX_PROC_SHARED_MEM_INSTANCE (32)   // every proc
-#define MAX_MAPPING (128)
 #define RANDOM_SIZE (16)
 
 // for wait()
@@ -22,6 +21,18 @@
 #define WUNTRACED	0x00000002
 #define WCONTINUED	0x00000008
 
+// for clone
+#define CSIGNAL              0x000000ff
+#define CLONE_VM             0x00000100
+#define CLONE_FS             0x00000200
+#define CLONE_FILES          0x00000400
+#define CLONE_SIGHAND        0x00000800
+#define CLONE_THREAD         0x00010000
+#define CLONE_SETTLS         0x00080000
+#define CLONE_PARENT_SETTID  0x00100000
+#define CLONE_CHILD_CLEARTID 0x00200000
+#define CLONE_CHILD_SETTID   0x01000000
+
 // for mmap
 #define MAP_FAILED ((void *) -1)
 
@@ -74,6 +85,10 @@
 #define RUSAGE_BOTH	(-2)		/* sys_wait4() uses this */
 #define	RUSAGE_THREAD	1		/* only the calling thread */
 
+// for prlimit64
+#define RLIMIT_STACK	3
+#define RLIM_INFINITY	(~0ULL)
+
 // for clock_gettime
 #define CLOCK_REALTIME			    0
 #define CLOCK_MONOTONIC			    1
@@ -130,17 +145,24 @@ enum procstate {
     ZOMBIE
 };
 
+// scheduling policies, FIFO and RR procs always run before SCHED_OTHER ones
+#define SCHED_OTHER 0   // stride scheduling
+#define SCHED_FIFO 1    // real-time, runs until it blocks or yields
+#define SCHED_RR 2      // real-time, round robin among equal priorities
+#define RT_PRIO_MAX 99  // real-time priorities are 1 to 99, higher runs first
+
+// Current directory, shared by threads created with CLONE_FS.
+struct fs_struct {
+    int ref;
+    struct mutex lock;  // protects cwd
+    struct inode *cwd;
+};
+
 struct auxv_t {
     uint64 type;
     uint64 val;
 };
 
-struct mapping {
-    uint64 va; // must be PGSIZE aligned
-    uint npages;
-    bool shared;
-};
-
 // Per-process state
 struct proc {
     struct spinlock lock;
@@ -149,32 +171,47 @@ struct proc {
     enum procstate state;  // Process state
     int pid;               // Process ID
     int killed;            // If non-zero, have been killed
-    pagetable_t pagetable; // User page table
-    void *waiting_target;  // used by sleep and wakeup, a pointer of anything
+    bool group_exit;       // exit_code was set by exit_group()
+    void *waiting_target;  // what it sleeps on, a wait queue or a sleep() channel
     uint64 exit_code;      // Exit status to be returned to parent's wait
 
     // proc_tree_lock must be held when using this:
-    struct proc *parent; // Parent process
+    struct proc *parent; // Parent process, NULL for a thread other than the leader
+    struct wait_queue child_exit;  // wait() sleeps here for a child to exit
+    int nr_threads;                // of a leader, threads of its group not yet exited
+
+    // set by clone(), constant afterwards
+    int tgid;                   // thread group ID, the pid of the leader
+    struct proc *group_leader;  // the first thread of the group, p itself for a process
 
     // PRIVATE: these are private to the process, so p->lock need not be held.
     uint64 ustack_bottom;        // Virtual address of user stack
     uint64 kstack;               // Virtual address of kernel stack
     struct trapframe *trapframe; // data page for trampoline.S, physical address
+    uint64 trapframe_va;         // where trapframe is mapped, different for every thread
     struct context context;      // swtch() here to run process
-    uint64 total_size;           // total memory used by this process
-    uint64 heap_start;           // start of heap
-    uint64 heap_sz;
+    struct mm *mm;               // user address space, shared by CLONE_VM threads
+    uint64 clear_child_tid;      // user address zeroed on exit, CLONE_CHILD_CLEARTID
+    uint64 minflt;               // demand-zero page faults served
     uint64 stride;
     uint64 priority;
+    int rq_cpu;                 // run queue holding p, -1 if none
+    int rq_index;               // position in that run queue's heap
+    int policy;                 // SCHED_*, changed under p->lock while not queued
+    int rt_priority;            // 1 to RT_PRIO_MAX for FIFO and RR, 0 otherwise
+    uint64 slice_end;           // tick the RR quantum runs out at
+    bool yielded;               // gave up the hart by sched_yield()
+    struct proc *rt_prev;       // on its run queue's real-time list
+    struct proc *rt_next;
+    uint64 cpus_allowed;        // harts p may run on, changed under p->lock
+    int last_cpu;               // hart p last ran on, -1 if it has not run yet
+    uint64 nr_migrations;       // runs on another hart than the run before
     uint64 user_time;           // us, user only
     uint64 kernel_time;         // us, kernel only
     uint64 last_start_time;     // us
-    struct file *files[FD_MAX]; // Opened files
-    struct inode *cwd;          // Current directory
-    struct shared_mem * shmem[MAX_PROC_SHARED_MEM_INSTANCE];
-    void * shmem_map_start[MAX_PROC_SHARED_MEM_INSTANCE];
-    void* next_shmem_addr;
-    struct mapping maps[MAX_MAPPING];
+    struct seqcount time_seq;   // user_time and kernel_time, written only by the hart running p
+    struct fdtable *files;      // Opened files, shared by CLONE_FILES threads
+    struct fs_struct *fs;       // Current directory, shared by CLONE_FS threads
     char name[PROC_NAME_MAX]; // Process name (debugging)
 };
 
@@ -206,13 +243,24 @@ struct rusage {
     long ru_nivcsw;          // involuntary context switches
 };
 
+struct rlimit {
+    uint64 rlim_cur;
+    uint64 rlim_max;
+};
+
 struct proc *findproc(int pid);
 
 struct proc *curr_proc();
 // int spawn(char *filename);
 extern struct proc pool[NPROC];
-extern struct spinlock pool_lock;
+extern int nr_procs;
 extern struct spinlock wait_lock;
+
+// A racy look at whether p's slot is taken, for walking the pool without
+// locks. Once it is, p's pid, tgid and group_leader are set.
+static inline bool proc_in_use(struct proc *p) {
+    return __atomic_load_n(&p->state, __ATOMIC_ACQUIRE) != UNUSED;
+}
 // extern struct spinlock proc_tree_lock;
 
 void sleep(void *waiting_target, struct spinlock *lk);
@@ -222,11 +270,16 @@ void print_proc(struct proc *proc);
 void forkret(void);
 
 void proc_free_mem_and_pagetable(struct proc* p);
-struct proc *alloc_proc(void);
-struct file *get_proc_file_by_fd(struct proc *p, int fd);
+struct proc *alloc_proc(struct mm *mm);
+struct file *fget(struct proc *p, int fd);
 pagetable_t proc_pagetable(struct proc *p);
+struct fs_struct *fs_alloc(struct inode *cwd);
+struct fs_struct *fs_get(struct fs_struct *fs);
+void fs_put(struct fs_struct *fs);
 void freeproc(struct proc *p);
+void abort_proc(struct proc *p);
 int get_cpu_time(struct proc *p, struct tms *tms);
+void get_proc_times(struct proc *p, uint64 *user, uint64 *kernel);
 bool the_only_proc_in_pool();
 void *mmap(struct proc *p, void *start, size_t len, int prot, int flags, struct inode *ip, off_t off);
 int munmap(struct proc *p, void *start, size_t len);
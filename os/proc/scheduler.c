@@ -2,8 +2,518 @@
 #include <proc/proc.h>
 #include <ucore/ucore.h>
 #include <arch/timer.h>
+
+/**
+ * Stride scheduling on per-hart run queues.
+ * Every hart picks the smallest stride of its own queue, so picking
+ * costs O(log n) and no lock is shared by all harts. A proc made
+ * runnable goes to the least loaded hart of those in its cpus_allowed,
+ * the hart it last ran on winning ties. A hart with nothing to run
+ * steals from the busiest one, and every sample period (10 Hz) it pulls
+ * work from the busiest queue if that one is ahead by two or more.
+ * Stealing leaves alone the procs that may not run on the thief.
+ *
+ * SCHED_FIFO and SCHED_RR procs wait on a list of their own, highest
+ * priority first, and run before any stride proc. One made runnable goes
+ * to the hart whose most important work is least important, and takes
+ * the hart at once through an IPI if it outranks the proc running there.
+ * A hart that finds no work at all waits in WFI, with the timer set for
+ * the next timer deadline only. Queueing work on it sends it an IPI.
+ *
+ * Lock order is p->lock, then a run queue lock. Two run queues are
+ * locked in hart order.
+ */
+
+struct run_queue run_queues[NCPU];
+
+// round robin quantum of SCHED_RR procs
+static uint64 rr_quantum_us = RR_QUANTUM_US;
+
 void init_scheduler()
 {
+    for (int i = 0; i < NCPU; i++) {
+        init_spin_lock_with_name(&run_queues[i].lock, "run_queue.lock");
+        run_queues[i].nr = 0;
+        run_queues[i].rt_head = run_queues[i].rt_tail = NULL;
+        run_queues[i].nr_rt = 0;
+        run_queues[i].min_stride = 0;
+        run_queues[i].online = FALSE;
+        run_queues[i].idle = FALSE;
+    }
+}
+
+static void heap_swap(struct run_queue *rq, int i, int j)
+{
+    struct proc *t = rq->heap[i];
+    rq->heap[i] = rq->heap[j];
+    rq->heap[j] = t;
+    rq->heap[i]->rq_index = i;
+    rq->heap[j]->rq_index = j;
+}
+
+static void heap_up(struct run_queue *rq, int i)
+{
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (rq->heap[parent]->stride <= rq->heap[i]->stride)
+            break;
+        heap_swap(rq, i, parent);
+        i = parent;
+    }
+}
+
+static void heap_down(struct run_queue *rq, int i)
+{
+    for (;;) {
+        int min = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < rq->nr && rq->heap[l]->stride < rq->heap[min]->stride)
+            min = l;
+        if (r < rq->nr && rq->heap[r]->stride < rq->heap[min]->stride)
+            min = r;
+        if (min == i)
+            break;
+        heap_swap(rq, i, min);
+        i = min;
+    }
+}
+
+// Must hold rq->lock.
+static void heap_insert(struct run_queue *rq, struct proc *p)
+{
+    KERNEL_ASSERT(rq->nr < NPROC, "run queue overflow");
+    // a proc back from sleep or from another hart must not
+    // make up for the time it was away
+    if (p->stride < rq->min_stride)
+        p->stride = rq->min_stride;
+    p->rq_cpu = rq - run_queues;
+    p->rq_index = rq->nr;
+    rq->heap[rq->nr++] = p;
+    heap_up(rq, p->rq_index);
+}
+
+// Must hold rq->lock.
+static void heap_remove(struct run_queue *rq, struct proc *p)
+{
+    int i = p->rq_index;
+    KERNEL_ASSERT(p->rq_cpu == rq - run_queues && rq->heap[i] == p, "proc is not on this run queue");
+    rq->nr--;
+    if (i != rq->nr) {
+        rq->heap[i] = rq->heap[rq->nr];
+        rq->heap[i]->rq_index = i;
+        heap_down(rq, i);
+        heap_up(rq, i);
+    }
+    p->rq_cpu = -1;
+    p->rq_index = -1;
+}
+
+// Queue a real-time proc behind those of its priority, or with head
+// in front of them. Must hold rq->lock.
+static void rt_insert(struct run_queue *rq, struct proc *p, bool head)
+{
+    struct proc *q = rq->rt_head;
+    while (q != NULL && (q->rt_priority > p->rt_priority ||
+                         (!head && q->rt_priority == p->rt_priority)))
+        q = q->rt_next;
+    // p goes in front of q, or last
+    p->rt_next = q;
+    p->rt_prev = q ? q->rt_prev : rq->rt_tail;
+    if (p->rt_prev)
+        p->rt_prev->rt_next = p;
+    else
+        rq->rt_head = p;
+    if (q)
+        q->rt_prev = p;
+    else
+        rq->rt_tail = p;
+    rq->nr_rt++;
+    p->rq_cpu = rq - run_queues;
+}
+
+// Must hold rq->lock.
+static void rt_remove(struct run_queue *rq, struct proc *p)
+{
+    KERNEL_ASSERT(p->rq_cpu == rq - run_queues, "proc is not on this run queue");
+    if (p->rt_prev)
+        p->rt_prev->rt_next = p->rt_next;
+    else
+        rq->rt_head = p->rt_next;
+    if (p->rt_next)
+        p->rt_next->rt_prev = p->rt_prev;
+    else
+        rq->rt_tail = p->rt_prev;
+    p->rt_prev = p->rt_next = NULL;
+    rq->nr_rt--;
+    p->rq_cpu = -1;
+}
+
+// A proc's policy only changes while it is not queued.
+// Must hold rq->lock.
+static void rq_insert(struct run_queue *rq, struct proc *p, bool head)
+{
+    if (p->policy == SCHED_OTHER)
+        heap_insert(rq, p);
+    else
+        rt_insert(rq, p, head);
+}
+
+// Must hold rq->lock.
+static void rq_remove(struct run_queue *rq, struct proc *p)
+{
+    if (p->policy == SCHED_OTHER)
+        heap_remove(rq, p);
+    else
+        rt_remove(rq, p);
+}
+
+// queued procs plus the one running
+static int rq_load(int cpu)
+{
+    return run_queues[cpu].nr + run_queues[cpu].nr_rt + (cpus[cpu].proc != NULL);
+}
+
+// 0 for stride procs, real-time ones rank by their priority
+static int proc_rank(struct proc *p)
+{
+    return p->policy == SCHED_OTHER ? 0 : p->rt_priority;
+}
+
+// The rank of the most important proc running on or queued for cpu.
+// Reads without the lock, for choosing a hart only.
+static int cpu_rank(int cpu)
+{
+    struct proc *running = cpus[cpu].proc;
+    struct proc *queued = run_queues[cpu].rt_head;
+    int rank = running ? proc_rank(running) : 0;
+    if (queued && queued->rt_priority > rank)
+        rank = queued->rt_priority;
+    return rank;
+}
+
+static bool cpu_allowed(struct proc *p, int cpu)
+{
+    return (p->cpus_allowed & (1ULL << cpu)) != 0;
+}
+
+// The least loaded hart p may run on, for a real-time p of those with
+// the least important work. The hart p last ran on wins ties, its caches
+// may still hold what p works on.
+static struct run_queue *select_rq(struct proc *p)
+{
+    bool rt = p->policy != SCHED_OTHER;
+    int best = -1, best_rank = 0, best_load = 0;
+    int last = p->last_cpu;
+    if (last >= 0 && run_queues[last].online && cpu_allowed(p, last)) {
+        best = last;
+        best_rank = rt ? cpu_rank(last) : 0;
+        best_load = rq_load(last);
+    }
+    for (int i = 0; i < NCPU; i++) {
+        if (!run_queues[i].online || !cpu_allowed(p, i))
+            continue;
+        int rank = rt ? cpu_rank(i) : 0;
+        int load = rq_load(i);
+        if (best < 0 || rank < best_rank || (rank == best_rank && load < best_load)) {
+            best = i;
+            best_rank = rank;
+            best_load = load;
+        }
+    }
+    // no hart it may use is up yet, one steals it from here later
+    if (best < 0)
+        best = cpuid();
+    return &run_queues[best];
+}
+
+/**
+ * @brief Make p runnable and queue it on the least loaded hart
+ * A hart waiting in WFI, or running a proc that p outranks, gets an IPI.
+ * A proc p outranks on this hart is preempted at its next preemption point.
+ * Must hold p->lock, and p must not be running.
+ */
+void make_runnable(struct proc *p)
+{
+    KERNEL_ASSERT(holding(&p->lock), "make_runnable: p is not locked");
+    p->state = RUNNABLE;
+    struct run_queue *rq = select_rq(p);
+    acquire(&rq->lock);
+    rq_insert(rq, p, FALSE);
+    release(&rq->lock);
+    // release() fenced the insert before this load, pairs with idle_wait()
+    int cpu = rq - run_queues;
+    struct proc *running = cpus[cpu].proc;
+    bool preempt = running != NULL && running != p && proc_rank(p) > proc_rank(running);
+    if (cpu == cpuid()) {
+        // the caller is preempted once it may be
+        if (preempt)
+            cpus[cpu].need_resched = TRUE;
+    } else if (preempt || __atomic_load_n(&rq->idle, __ATOMIC_RELAXED)) {
+        sbi_send_ipi(1ULL << cpu);
+    }
+}
+
+// Take p off the run queue it waits on. Must hold p->lock.
+// Returns whether p was queued.
+static bool rq_detach(struct proc *p)
+{
+    // stealing may move p while we look, rq_cpu is stable under its queue lock
+    for (;;) {
+        int cpu = __atomic_load_n(&p->rq_cpu, __ATOMIC_RELAXED);
+        if (cpu < 0)
+            return FALSE;
+        struct run_queue *rq = &run_queues[cpu];
+        acquire(&rq->lock);
+        if (p->rq_cpu == cpu) {
+            rq_remove(rq, p);
+            release(&rq->lock);
+            return TRUE;
+        }
+        release(&rq->lock);
+    }
+}
+
+/**
+ * @brief Let p run only on the harts in mask
+ *
+ * A queued p leaves a hart it may no longer use at once, a running one
+ * when it next gives up the hart. Must hold p->lock.
+ * @return 0, or -1 if no hart in mask runs the scheduler
+ */
+int set_cpus_allowed(struct proc *p, uint64 mask)
+{
+    KERNEL_ASSERT(holding(&p->lock), "set_cpus_allowed: p is not locked");
+    uint64 online = 0;
+    for (int i = 0; i < NCPU; i++) {
+        if (run_queues[i].online)
+            online |= 1ULL << i;
+    }
+    if ((mask & online) == 0)
+        return -1;
+    p->cpus_allowed = mask;
+    // pull_procs() reads the mask under the run queue lock only
+    __sync_synchronize();
+    int cpu = __atomic_load_n(&p->rq_cpu, __ATOMIC_RELAXED);
+    if (p->state == RUNNABLE && cpu >= 0 && !cpu_allowed(p, cpu) && rq_detach(p))
+        make_runnable(p);
+    return 0;
+}
+
+/**
+ * @brief Change the scheduling policy of p
+ *
+ * A queued p is queued again by its new policy. Must hold p->lock.
+ * @param priority 1 to RT_PRIO_MAX for SCHED_FIFO and SCHED_RR, 0 for SCHED_OTHER
+ * @return 0, or -1 for a bad policy or priority
+ */
+int set_scheduler(struct proc *p, int policy, int priority)
+{
+    KERNEL_ASSERT(holding(&p->lock), "set_scheduler: p is not locked");
+    if (policy == SCHED_OTHER ? priority != 0 :
+        (policy != SCHED_FIFO && policy != SCHED_RR) || priority < 1 || priority > RT_PRIO_MAX)
+        return -1;
+    bool queued = p->state == RUNNABLE && rq_detach(p);
+    p->policy = policy;
+    p->rt_priority = priority;
+    p->slice_end = 0;
+    if (queued)
+        make_runnable(p);
+    return 0;
+}
+
+uint64 get_rr_quantum()
+{
+    return __atomic_load_n(&rr_quantum_us, __ATOMIC_RELAXED);
+}
+
+// Set the round robin quantum, in us.
+int set_rr_quantum(uint64 us)
+{
+    if (us == 0)
+        return -1;
+    __atomic_store_n(&rr_quantum_us, us, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/**
+ * @brief Whether p, running on this hart, should give it up now
+ *
+ * A real-time proc queued here takes the hart from a less important one.
+ * On a timer tick a stride proc always gives up the hart, and an RR proc
+ * does at the end of its quantum when another of its priority waits.
+ * Interrupts must be off.
+ */
+bool should_resched(struct proc *p, bool tick)
+{
+    // a racy look, the scheduler picks under the lock
+    struct proc *queued = run_queues[cpuid()].rt_head;
+    int top = queued ? queued->rt_priority : 0;
+    int rank = proc_rank(p);
+    if (top > rank)
+        return TRUE;
+    if (!tick)
+        return FALSE;
+    if (p->policy == SCHED_OTHER)
+        return TRUE;
+    if (p->policy == SCHED_RR && get_tick() >= p->slice_end) {
+        if (top == rank)
+            return TRUE;
+        // nobody to take turns with, go on with another quantum
+        p->slice_end = get_tick() + US_TO_TICK(get_rr_quantum());
+    }
+    return FALSE;
+}
+
+// Send an IPI to every hart waiting in WFI.
+void wake_idle_harts()
+{
+    uint64 mask = 0;
+    __sync_synchronize();
+    for (int i = 0; i < NCPU; i++) {
+        if (__atomic_load_n(&run_queues[i].idle, __ATOMIC_RELAXED))
+            mask |= 1ULL << i;
+    }
+    if (mask)
+        sbi_send_ipi(mask);
+}
+
+// Take the first real-time proc off our queue, or else the one with the
+// smallest stride.
+static struct proc *pick_next(struct run_queue *rq)
+{
+    struct proc *p = NULL;
+    acquire(&rq->lock);
+    if (rq->rt_head != NULL) {
+        p = rq->rt_head;
+        rt_remove(rq, p);
+    } else if (rq->nr > 0) {
+        p = rq->heap[0];
+        heap_remove(rq, p);
+        rq->min_stride = p->stride;
+    }
+    release(&rq->lock);
+    return p;
+}
+
+static struct run_queue *busiest_rq(int me)
+{
+    int busiest = -1, max = 0;
+    for (int i = 0; i < NCPU; i++) {
+        int nr = run_queues[i].nr + run_queues[i].nr_rt;
+        if (i != me && nr > max) {
+            busiest = i;
+            max = nr;
+        }
+    }
+    return busiest < 0 ? NULL : &run_queues[busiest];
+}
+
+static void double_rq_lock(struct run_queue *a, struct run_queue *b)
+{
+    if (a > b) {
+        struct run_queue *t = a;
+        a = b;
+        b = t;
+    }
+    acquire(&a->lock);
+    acquire(&b->lock);
+}
+
+// Move procs that may run on dst from the tail of src's heap to dst,
+// which leaves the ones src runs next alone. An idle dst takes the first
+// real-time proc waiting on src instead, if there is one it may run.
+// Returns how many were moved.
+static int pull_procs(struct run_queue *dst, struct run_queue *src, bool idle)
+{
+    int moved = 0;
+    int cpu = dst - run_queues;
+    double_rq_lock(dst, src);
+    if (idle) {
+        struct proc *p = src->rt_head;
+        while (p != NULL && !cpu_allowed(p, cpu))
+            p = p->rt_next;
+        if (p != NULL) {
+            rt_remove(src, p);
+            rt_insert(dst, p, FALSE);
+            moved++;
+        }
+    }
+    // an idle hart takes one proc, a periodic balance evens the queues out
+    int n = idle ? (src->nr > 0 && moved == 0) : (src->nr - dst->nr) / 2;
+    for (int i = src->nr - 1; i >= 0 && moved < n; i--) {
+        if (i >= src->nr)
+            continue;   // the tail moved up into a slot we passed
+        struct proc *p = src->heap[i];
+        if (!cpu_allowed(p, cpu))
+            continue;
+        heap_remove(src, p);
+        heap_insert(dst, p);
+        moved++;
+    }
+    release(&src->lock);
+    release(&dst->lock);
+    return moved;
+}
+
+static void load_balance(int me, bool idle)
+{
+    struct run_queue *src = busiest_rq(me);
+    if (src == NULL)
+        return;
+    // racy reads are fine, pull_procs() looks again under the locks
+    if (!idle && src->nr - run_queues[me].nr < 2)
+        return;
+    // harts already queued on its lock are ahead of us, try next round
+    if (spin_is_contended(&src->lock))
+        return;
+    pull_procs(&run_queues[me], src, idle);
+}
+
+// With procs waiting here, wake one hart in WFI that may steal them.
+static void kick_idle_hart(int me)
+{
+    struct run_queue *rq = &run_queues[me];
+    uint64 wanted = 0;
+    acquire(&rq->lock);
+    for (int i = 0; i < rq->nr; i++)
+        wanted |= rq->heap[i]->cpus_allowed;
+    for (struct proc *p = rq->rt_head; p != NULL; p = p->rt_next)
+        wanted |= p->cpus_allowed;
+    release(&rq->lock);
+    for (int i = 0; i < NCPU; i++) {
+        if (i != me && (wanted & (1ULL << i)) &&
+            __atomic_load_n(&run_queues[i].idle, __ATOMIC_RELAXED)) {
+            sbi_send_ipi(1ULL << i);
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Wait in WFI until make_runnable() sends an IPI or the next timer
+ * deadline passes
+ *
+ * Interrupts are off from setting rq->idle until WFI, and WFI returns on
+ * a pending interrupt even so, so an IPI sent after the last look at the
+ * queues is not lost. It is taken by intr_on().
+ */
+static void idle_wait(struct run_queue *rq, int me)
+{
+    intr_off();
+    __atomic_store_n(&rq->idle, TRUE, __ATOMIC_RELAXED);
+    __sync_synchronize();   // pairs with make_runnable() and wake_idle_harts()
+    // procs queued elsewhere may be pinned there, kick_idle_hart() wakes
+    // us for those we may steal
+    // a grace period started since our last pass IPIs us, unless it saw
+    // us busy, then it waits for us to report
+    if (rq->nr == 0 && rq->nr_rt == 0 && __atomic_load_n(&nr_procs, __ATOMIC_RELAXED) != 0 &&
+        !rcu_qs_pending(me)) {
+        set_idle_timer();
+        wfi();
+        cpus[me].idle_wakeups++;
+    }
+    __atomic_store_n(&rq->idle, FALSE, __ATOMIC_RELAXED);
+    intr_on();
+    stop_timer_interrupt();
 }
 
 void scheduler(void)
@@ -11,52 +521,55 @@ void scheduler(void)
     uint64 busy = 0;
     uint64 all = 0;
     uint64 timestamp1 = r_cycle();
+    push_off();
+    int me = cpuid();
+    pop_off();
+    struct run_queue *rq = &run_queues[me];
+    rq->online = TRUE;
     for (;;)
     {
-        uint64 min_stride = ~0ULL;
-        struct proc *next_proc = NULL;
-        int any_proc = FALSE;
-        // lock when picking proc
-        acquire(&pool_lock);
-
-        for (struct proc *p = pool; p < &pool[NPROC]; p++)
-        {
-            if (!p->state == UNUSED)
-            {
-                any_proc = TRUE;
-                // debugcore("state=%d", p->state);
-            }
-            if (p->state == RUNNABLE && !p->lock.locked)
-            {
-                if (p->stride < min_stride)
-                {
-                    min_stride = p->stride;
-                    next_proc = p;
-                }
-            }
+        // every pass, after swtch() has come back, is a quiescent state
+        rcu_qs(me);
+        struct proc *next_proc = pick_next(rq);
+        if (next_proc == NULL) {
+            load_balance(me, TRUE);
+            next_proc = pick_next(rq);
         }
 
         if (next_proc != NULL)
         {
-            // found a process to run, lock down the proc;
+            cpus[me].idle = FALSE;
+            // the hart that queued it may still be switching away from it
             acquire(&next_proc->lock);
-        }
-        // picking proc done
-        release(&pool_lock);
-
-        if (next_proc != NULL)
-        {
+            KERNEL_ASSERT(next_proc->state == RUNNABLE, "picked a proc that is not runnable");
+            // its mask changed after it was queued here
+            if (!cpu_allowed(next_proc, me)) {
+                make_runnable(next_proc);
+                release(&next_proc->lock);
+                continue;
+            }
+            if (next_proc->last_cpu != me) {
+                if (next_proc->last_cpu >= 0)
+                    next_proc->nr_migrations++;
+                next_proc->last_cpu = me;
+            }
                 // printf("Core %d pick proc %s\n", cpuid(),next_proc->name);
-            
+
             struct cpu *mycore = mycpu();
             mycore->proc = next_proc;
+            mycore->need_resched = FALSE;
             next_proc->state = RUNNING;
+            // a new quantum, unless one cut short by a more important proc is left
+            if (next_proc->policy == SCHED_RR && get_tick() >= next_proc->slice_end)
+                next_proc->slice_end = get_tick() + US_TO_TICK(get_rr_quantum());
             start_timer_interrupt();
 
             uint64 busy_start = r_cycle();
             next_proc->last_start_time = get_tick();
-            uint64 pass = BIGSTRIDE / (next_proc->priority);
-            next_proc->stride += pass;
+            if (next_proc->policy == SCHED_OTHER) {
+                uint64 pass = BIGSTRIDE / (next_proc->priority);
+                next_proc->stride += pass;
+            }
             pushtrace(0x3011);
             pushtrace(next_proc->context.ra);
 
@@ -64,23 +577,42 @@ void scheduler(void)
 
             busy += r_cycle() - busy_start;
             uint64 time_delta = get_tick() - next_proc->last_start_time;
+            write_seqcount_begin(&next_proc->time_seq);
             next_proc->kernel_time += time_delta;
+            write_seqcount_end(&next_proc->time_seq);
             pushtrace(0x3007);
 
             stop_timer_interrupt();
             mycore->proc = NULL;
 
+            // yielded, its context is saved now that it can be queued
+            if (next_proc->state == RUNNABLE && cpu_allowed(next_proc, me)) {
+                // a preempted real-time proc is next among its priority
+                bool head = !next_proc->yielded &&
+                            !(next_proc->policy == SCHED_RR && get_tick() >= next_proc->slice_end);
+                acquire(&rq->lock);
+                rq_insert(rq, next_proc, head);
+                release(&rq->lock);
+            } else if (next_proc->state == RUNNABLE) {
+                make_runnable(next_proc);
+            }
+            next_proc->yielded = FALSE;
             release(&next_proc->lock);
         }
         else
         {
-            if (!any_proc)
+            if (__atomic_load_n(&nr_procs, __ATOMIC_ACQUIRE) == 0)
             {
                 debugcore("zero proc in pool");
                 break;
                 // end scheduler, kernel will shutdown
             }
             pushtrace(0x3019);
+            cpus[me].idle = TRUE;
+            // nothing to run, zero a page for alloc_zeroed_physical_page(),
+            // and sleep once the pool is full
+            if (!fill_zero_pool())
+                idle_wait(rq, me);
         }
         // printf("core%d\n",cpuid());
         // sample cpu usage
@@ -104,6 +636,8 @@ void scheduler(void)
             all = 0;
             busy = 0;
             pop_off();
+            load_balance(me, FALSE);
+            kick_idle_hart(me);
         }
     }
-}
\ No newline at end of file
+}
@@ -1,8 +1,36 @@
 #ifndef UCORE_SMP_SCHEDULER_H
 #define UCORE_SMP_SCHEDULER_H
 #include <ucore/types.h>
+#include <lock/spinlock.h>
+#include <arch/cpu.h>
+#include <proc/proc.h>
+
+// Runnable processes of one hart, a min-heap on stride.
+// A queued proc's stride and rq fields are protected by lock.
+struct run_queue {
+    struct spinlock lock;
+    struct proc *heap[NPROC];
+    int nr;                 // queued stride procs
+    struct proc *rt_head;   // queued real-time procs, highest priority first,
+    struct proc *rt_tail;   // in the order they came among equal ones
+    int nr_rt;
+    uint64 min_stride;      // stride of the last pick, the floor for newcomers
+    bool online;            // the hart runs scheduler()
+    bool idle;              // the hart waits in WFI, queueing here must send it an IPI
+};
+
+extern struct run_queue run_queues[NCPU];
+
 void init_scheduler();
 void scheduler();
+void make_runnable(struct proc *p);
+void wake_idle_harts();
+int set_cpus_allowed(struct proc *p, uint64 mask);
+int set_scheduler(struct proc *p, int policy, int priority);
+bool should_resched(struct proc *p, bool tick);
+uint64 get_rr_quantum();
+int set_rr_quantum(uint64 us);
 static const int64 BIGSTRIDE = 0x7FFFFFFFLL;
+#define RR_QUANTUM_US 100000    // default SCHED_RR quantum, 100 ms
 
 #endif //UCORE_SMP_SCHEDULER_H
@@ -1,6 +1,8 @@
 #include <proc/proc.h>
+
 /**
  * wait for child process with pid to exit
+ * A process is reaped when all its threads have exited.
  */
 int wait(int pid, int *wstatus_va, int options, void* rusage)
 {
@@ -23,7 +25,7 @@ int wait(int pid, int *wstatus_va, int options, void* rusage)
                 if (pid < 0 || maybe_child->pid == pid) // this is one of the target
                 {
                     havekids = TRUE;
-                    if (maybe_child->state == ZOMBIE)
+                    if (maybe_child->state == ZOMBIE && maybe_child->nr_threads == 0)
                     {
                         // Found one.
                         int child_pid = maybe_child->pid;
@@ -31,7 +33,7 @@ int wait(int pid, int *wstatus_va, int options, void* rusage)
                         // construct the wait status
                         // see WEXITSTATUS
                         wstatus = (wstatus & 0xff) << 8;
-                        if (wstatus_va && copyout(p->pagetable, (uint64)wstatus_va, (char *)&wstatus,  sizeof(wstatus)) < 0)
+                        if (wstatus_va && copyout(p->mm->pagetable, (uint64)wstatus_va, (char *)&wstatus,  sizeof(wstatus)) < 0)
                         {
                             release(&maybe_child->lock);
                             release(&wait_lock);
@@ -61,6 +63,6 @@ int wait(int pid, int *wstatus_va, int options, void* rusage)
             return 0;
         }
         // Wait for a child to exit.
-        sleep(p, &wait_lock); 
+        wait_queue_sleep(&p->child_exit, &wait_lock);
     }
 }
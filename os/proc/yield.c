@@ -1,5 +1,14 @@
 #include <proc/proc.h>
 
+/**
+ * Kernel preemption.
+ * need_resched asks the proc running on a cpu to give it up, which it
+ * does at the next preemption point: on return from an interrupt, when
+ * pop_off() turns interrupts back on, in preempt_enable(), and on the
+ * way back to user mode. A proc holding a spinlock, which has
+ * interrupts off, or inside preempt_disable() is never preempted.
+ */
+
 // Give up the CPU for one scheduling round.
 void yield(void) {
     pushtrace(0x3005);
@@ -7,8 +16,69 @@ void yield(void) {
     KERNEL_ASSERT(p != NULL, "yield() has no current proc");
     acquire(&p->lock);
     pushtrace(0x3035);
+    // scheduler() queues p again once it has switched away
     p->state = RUNNABLE;
     switch_to_scheduler();
     pushtrace(0x3030);
     release(&p->lock);
 }
+
+// Whether the running proc was asked to give up the cpu and has not
+// disabled preemption. For a caller that holds no spinlock, with
+// interrupts off.
+bool need_preempt(void) {
+    struct cpu *c = mycpu();
+    return c->need_resched && c->proc != NULL && c->preempt_count == 0;
+}
+
+// Give up the cpu at a preemption point, with no spinlock held.
+// need_resched is cleared before the switch, and preempt_count is raised
+// while p->lock is dropped after it, so the push_off() / pop_off() pairs
+// on the way cannot preempt again from inside here.
+void preempt_schedule(void) {
+    push_off();
+    while (need_preempt()) {
+        struct cpu *c = mycpu();
+        struct proc *p = c->proc;
+        c->need_resched = FALSE;
+        acquire(&p->lock);
+        pop_off();
+        p->state = RUNNABLE;
+        switch_to_scheduler();
+        // maybe on another cpu now
+        mycpu()->preempt_count++;
+        release(&p->lock);
+        push_off();
+        mycpu()->preempt_count--;
+    }
+    pop_off();
+}
+
+// Keep the running proc on this cpu, without turning off interrupts.
+// It must not sleep until preempt_enable().
+void preempt_disable(void) {
+    push_off();
+    mycpu()->preempt_count++;
+    pop_off();
+}
+
+void preempt_enable(void) {
+    push_off();
+    struct cpu *c = mycpu();
+    KERNEL_ASSERT(c->preempt_count > 0, "preempt_enable: not disabled");
+    c->preempt_count--;
+    // pop_off() preempts if that was asked for meanwhile
+    pop_off();
+}
+
+// A preemption point for code that holds no spinlock.
+void cond_resched(void) {
+    push_off();
+    bool resched = need_preempt();
+    // with interrupts on, pop_off() preempts by itself
+    if (mycpu()->base_interrupt_status)
+        resched = FALSE;
+    pop_off();
+    if (resched)
+        preempt_schedule();
+}
@@ -54,8 +54,26 @@ char *syscall_names(int id)
         return "SYS_fstatat";
     case SYS_exit:
         return "SYS_exit";
+    case SYS_exit_group:
+        return "SYS_exit_group";
+    case SYS_set_tid_address:
+        return "SYS_set_tid_address";
+    case SYS_futex:
+        return "SYS_futex";
     case SYS_wait4:
         return "SYS_wait4";
+    case SYS_sched_setscheduler:
+        return "SYS_sched_setscheduler";
+    case SYS_sched_getscheduler:
+        return "SYS_sched_getscheduler";
+    case SYS_sched_rr_get_interval:
+        return "SYS_sched_rr_get_interval";
+    case SYS_sched_rr_set_interval:
+        return "SYS_sched_rr_set_interval";
+    case SYS_sched_setaffinity:
+        return "SYS_sched_setaffinity";
+    case SYS_sched_getaffinity:
+        return "SYS_sched_getaffinity";
     case SYS_sched_yield:
         return "SYS_sched_yield";
     case SYS_kill:
@@ -76,6 +94,8 @@ char *syscall_names(int id)
         return "SYS_getpid";
     case SYS_getppid:
         return "SYS_getppid";
+    case SYS_gettid:
+        return "SYS_gettid";
     case SYS_sysinfo:
         return "SYS_sysinfo";
     case SYS_brk:
@@ -182,6 +202,33 @@ void syscall()
     case SYS_exit:
         ret = sys_exit(args[0]);
         break;
+    case SYS_exit_group:
+        ret = sys_exit_group(args[0]);
+        break;
+    case SYS_set_tid_address:
+        ret = sys_set_tid_address((int *)args[0]);
+        break;
+    case SYS_futex:
+        ret = sys_futex((uint32 *)args[0], args[1], args[2], (struct timespec *)args[3], (uint32 *)args[4], args[5]);
+        break;
+    case SYS_sched_setscheduler:
+        ret = sys_sched_setscheduler((pid_t)args[0], args[1], (int *)args[2]);
+        break;
+    case SYS_sched_getscheduler:
+        ret = sys_sched_getscheduler((pid_t)args[0]);
+        break;
+    case SYS_sched_rr_get_interval:
+        ret = sys_sched_rr_get_interval((pid_t)args[0], (struct timespec *)args[1]);
+        break;
+    case SYS_sched_rr_set_interval:
+        ret = sys_sched_rr_set_interval((struct timespec *)args[0]);
+        break;
+    case SYS_sched_setaffinity:
+        ret = sys_sched_setaffinity((pid_t)args[0], args[1], (uint64 *)args[2]);
+        break;
+    case SYS_sched_getaffinity:
+        ret = sys_sched_getaffinity((pid_t)args[0], args[1], (uint64 *)args[2]);
+        break;
     case SYS_sched_yield:
         ret = sys_sched_yield();
         break;
@@ -197,6 +244,9 @@ void syscall()
     case SYS_getppid:
         ret = sys_getppid();
         break;
+    case SYS_gettid:
+        ret = sys_gettid();
+        break;
     case SYS_dup:
         ret = sys_dup((int)args[0]);
         break;
@@ -273,7 +323,7 @@ void syscall()
         ret = sys_dummy_success();
         break;
     case SYS_prlimit64:
-        ret = sys_dummy_success();
+        ret = sys_prlimit64((pid_t)args[0], args[1], (const struct rlimit *)args[2], (struct rlimit *)args[3]);
         break;
     case SYS_utimensat:
         ret = sys_utimensat(args[0], (char *)args[1], (struct timeval *)args[2], args[3]);
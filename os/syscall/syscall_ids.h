@@ -22,8 +22,16 @@
 #define SYS_fstatat 79
 #define SYS_fstat 80
 #define SYS_exit 93
+#define SYS_exit_group 94
+#define SYS_set_tid_address 96
+#define SYS_futex 98
 #define SYS_wait4 260
+#define SYS_sched_setscheduler 119
+#define SYS_sched_getscheduler 120
+#define SYS_sched_setaffinity 122
+#define SYS_sched_getaffinity 123
 #define SYS_sched_yield 124
+#define SYS_sched_rr_get_interval 127
 #define SYS_kill 129
 #define SYS_setpriority 140
 #define SYS_getpriority 141
@@ -34,6 +42,7 @@
 #define SYS_settimeofday 170
 #define SYS_getpid 172
 #define SYS_getppid 173
+#define SYS_gettid 178
 #define SYS_sysinfo 179
 #define SYS_brk 214
 #define SYS_munmap 215
@@ -44,6 +53,7 @@
 #define SYS_spawn 400
 #define SYS_mailread 401
 #define SYS_mailwrite 402
+#define SYS_sched_rr_set_interval 403
 #define SYS_renameat2 276
 #define SYS_getrusage 165
 #define SYS_clock_gettime 113
@@ -6,6 +6,7 @@
 #include <file/fcntl.h>
 #include <mem/shared.h>
 #include <mem/memory_layout.h>
+#include <proc/futex.h>
 #define min(a, b) (a) < (b) ? (a) : (b);
 
 int sys_fstat(int fd, struct kstat *statbuf_va){
@@ -17,7 +18,7 @@ int sys_fstat(int fd, struct kstat *statbuf_va){
         return -1;
     }
 
-    struct file *f = p->files[fd];
+    struct file *f = fget(p, fd);
 
     // invalid fd
     if (f == NULL) {
@@ -25,7 +26,9 @@ int sys_fstat(int fd, struct kstat *statbuf_va){
         return -1;
     }
 
-    return filestat(f, (uint64)statbuf_va);
+    int ret = filestat(f, (uint64)statbuf_va);
+    fileclose(f);
+    return ret;
 
 }
 
@@ -48,9 +51,9 @@ int sys_pipe(int (*pipefd_va)[2], int flags) {
     struct proc *p = curr_proc();
     struct file *rf, *wf;
     int fd0, fd1;
-    int(*pipefd)[2];
-    pipefd = (void *)virt_addr_to_physical(p->pagetable, (uint64)pipefd_va);
-    if (pipefd == NULL) {
+    // pipefd may sit in a stack page that is not populated yet,
+    // copyout() below faults it in
+    if (pipefd_va == NULL) {
         infof("pipefd invalid");
         return -1;
     }
@@ -59,20 +62,20 @@ int sys_pipe(int (*pipefd_va)[2], int flags) {
     }
     fd0 = -1;
     if ((fd0 = fdalloc(rf)) < 0 || (fd1 = fdalloc(wf)) < 0) {
+        // sys_close() clears the slot under the fdtable lock
         if (fd0 >= 0)
-            p->files[fd0] = 0;
-        fileclose(rf);
+            sys_close(fd0);
+        else
+            fileclose(rf);
         fileclose(wf);
         return -1;
     }
     infof("fd0=%d, fd1=%d", fd0, fd1);
     phex(pipefd_va);
-    if (copyout(p->pagetable, (uint64)pipefd_va, (char *)&fd0, sizeof(fd0)) < 0 ||
-        copyout(p->pagetable, (uint64)pipefd_va + sizeof(fd0), (char *)&fd1, sizeof(fd1)) < 0) {
-        p->files[fd0] = 0;
-        p->files[fd1] = 0;
-        fileclose(rf);
-        fileclose(wf);
+    if (copyout(p->mm->pagetable, (uint64)pipefd_va, (char *)&fd0, sizeof(fd0)) < 0 ||
+        copyout(p->mm->pagetable, (uint64)pipefd_va + sizeof(fd0), (char *)&fd1, sizeof(fd1)) < 0) {
+        sys_close(fd0);
+        sys_close(fd1);
         return -1;
     }
     return 0;
@@ -83,18 +86,35 @@ int sys_exit(int code) {
     return 0;
 }
 
+int sys_exit_group(int code) {
+    exit_group(code);
+    return 0;
+}
+
+pid_t sys_set_tid_address(int *tidptr) {
+    struct proc *p = curr_proc();
+    p->clear_child_tid = (uint64)tidptr;
+    return p->pid;
+}
+
 int sys_sched_yield() {
+    // a real-time proc goes behind the others of its priority
+    curr_proc()->yielded = TRUE;
     yield();
     return 0;
 }
 
 pid_t sys_getpid() {
+    return curr_proc()->tgid;
+}
+
+pid_t sys_gettid() {
     return curr_proc()->pid;
 }
 
 pid_t sys_getppid()
 {
-    struct proc *p = curr_proc();
+    struct proc *p = curr_proc()->group_leader;
     acquire(&wait_lock);
     struct proc *parent = p->parent;
     int ppid;
@@ -108,13 +128,9 @@ pid_t sys_getppid()
     return -1;
 }
 
-// only support SIGCHLD, and other params are ignored.
+// the exit signal in the low byte is ignored, there are no signals.
 pid_t sys_clone(unsigned long flags, void *child_stack, void *ptid, void *tls, void *ctid) {
-//    if (flags != SIGCHLD) {
-//        infof("clone: flags must be SIGCHLD");
-//        return -1;
-//    }
-    return clone(child_stack);
+    return clone(flags, child_stack, ptid, (uint64)tls, ctid);
 }
 
 /**
@@ -128,7 +144,7 @@ pid_t sys_clone(unsigned long flags, void *child_stack, void *ptid, void *tls, v
 //    char path[MAXPATH];
 //    struct inode *ip;
 //
-//    if (copyinstr(p->pagetable, path, (uint64)path_va, MAXPATH) != 0) {
+//    if (copyinstr(p->mm->pagetable, path, (uint64)path_va, MAXPATH) != 0) {
 //        return -2;
 //    }
 //    ip = create(path, T_DIR, 0, 0);
@@ -149,7 +165,7 @@ int sys_mkdirat(int dirfd, char *path_va, unsigned int mode) {
     char * final_path;
     struct inode *ip;
 
-    if (copyinstr(p->pagetable, path, (uint64)path_va, MAXPATH) != 0) {
+    if (copyinstr(p->mm->pagetable, path, (uint64)path_va, MAXPATH) != 0) {
         return -2;
     }
 
@@ -161,7 +177,7 @@ int sys_mkdirat(int dirfd, char *path_va, unsigned int mode) {
             return -1;
         }
 
-        struct file *f = p->files[dirfd];
+        struct file *f = fget(p, dirfd);
         if (f == NULL) {
             infof("sys_mkdirat: invalid dirfd %d (2)", dirfd);
             return -1;
@@ -172,6 +188,7 @@ int sys_mkdirat(int dirfd, char *path_va, unsigned int mode) {
         if (inode->type != T_DIR) {
             infof("sys_mkdirat: %s is not a dir", inode->path);
             iunlock(inode);
+            fileclose(f);
             return -1;
         }
 
@@ -182,6 +199,7 @@ int sys_mkdirat(int dirfd, char *path_va, unsigned int mode) {
         }
         strcat(adjust_path, path);
         iunlock(inode);
+        fileclose(f);
 
         final_path = adjust_path;
     }
@@ -201,7 +219,7 @@ int sys_chdir(char *path_va) {
     struct inode *ip;
     struct proc *p = curr_proc();
 
-    if (copyinstr(p->pagetable, path, (uint64)path_va, MAXPATH) != 0) {
+    if (copyinstr(p->mm->pagetable, path, (uint64)path_va, MAXPATH) != 0) {
         return -2;
     }
     ip = inode_by_name(path);
@@ -214,9 +232,13 @@ int sys_chdir(char *path_va) {
         return -1;
     }
     iunlock(ip);
-    iput(p->cwd);
-
-    p->cwd = ip;
+    acquire_mutex_sleep(&p->fs->lock);
+    struct inode *old = p->fs->cwd;
+    p->fs->cwd = ip;
+    release_mutex_sleep(&p->fs->lock);
+    if (old) {
+        iput(old);
+    }
     return 0;
 }
 
@@ -225,7 +247,7 @@ int sys_mknod(char *path_va, short major, short minor) {
     struct inode *ip;
     char path[MAXPATH];
 
-    if (copyinstr(p->pagetable, path, (uint64)path_va, MAXPATH) != 0) {
+    if (copyinstr(p->mm->pagetable, path, (uint64)path_va, MAXPATH) != 0) {
         debugcore("can not copyinstr");
         return -1;
     }
@@ -247,7 +269,7 @@ static int arg_copy(struct proc* p, char *arg_va[], char *arg[], char arg_str[][
     while (argc < MAX_EXEC_ARG_COUNT)
     {
         char* arg_i;   // the argv[i]
-        if (copyin(p->pagetable, (char*)&arg_i, (uint64) &arg_va[argc], sizeof(char*))<0){
+        if (copyin(p->mm->pagetable, (char*)&arg_i, (uint64) &arg_va[argc], sizeof(char*))<0){
             break;
         }
 
@@ -257,7 +279,7 @@ static int arg_copy(struct proc* p, char *arg_va[], char *arg[], char arg_str[][
         }
 
         // copy *arg[i] (the string)
-        if (copyinstr(p->pagetable, arg_str[argc], (uint64)arg_i, MAX_EXEC_ARG_LENGTH) < 0) {
+        if (copyinstr(p->mm->pagetable, arg_str[argc], (uint64)arg_i, MAX_EXEC_ARG_LENGTH) < 0) {
             break;
         }
 
@@ -272,7 +294,7 @@ int sys_execve( char *pathname_va, char * argv_va[], char * envp_va[]) {
     char name[MAXPATH];
     char argv_str[MAX_EXEC_ARG_COUNT][MAX_EXEC_ARG_LENGTH];
     char envp_str[MAX_EXEC_ARG_COUNT][MAX_EXEC_ARG_LENGTH];
-    copyinstr(p->pagetable, name, (uint64)pathname_va, MAXPATH);
+    copyinstr(p->mm->pagetable, name, (uint64)pathname_va, MAXPATH);
     infof("sys_exec %s", name);
 
     int argc, envc;
@@ -315,7 +337,7 @@ uint64 sys_times(struct tms *tms_va) {
         return -1;
     }
     release(&p->lock);
-    if (copyout(p->pagetable, (uint64)tms_va, (char *)&tms, sizeof(struct tms)) < 0) {
+    if (copyout(p->mm->pagetable, (uint64)tms_va, (char *)&tms, sizeof(struct tms)) < 0) {
         infof("sys_times: copyout failed");
         return -1;
     }
@@ -353,6 +375,150 @@ int64 sys_getpriority() {
     return priority;
 }
 
+/**
+ * @brief Set the scheduling policy of thread pid
+ *
+ * @param pid thread id, 0 for the caller
+ * @param policy SCHED_OTHER, SCHED_FIFO or SCHED_RR
+ * @param param_va user pointer to struct sched_param, whose only field
+ *                 is the int priority
+ * @return 0, or -1 on error
+ */
+int sys_sched_setscheduler(pid_t pid, int policy, int *param_va) {
+    struct proc *me = curr_proc();
+    int priority;
+    if (copyin(me->mm->pagetable, (char *)&priority, (uint64)param_va, sizeof(priority)) != 0) {
+        infof("sys_sched_setscheduler: copyin failed");
+        return -1;
+    }
+    struct proc *p = pid == 0 || pid == me->pid ? me : lock_thread(pid);
+    if (p == NULL) {
+        infof("sys_sched_setscheduler: no such thread %d", pid);
+        return -1;
+    }
+    if (p == me)
+        acquire(&p->lock);
+    int ret = set_scheduler(p, policy, priority);
+    release(&p->lock);
+    if (ret < 0)
+        infof("sys_sched_setscheduler: bad policy %d or priority %d", policy, priority);
+    return ret;
+}
+
+/**
+ * @brief Get the scheduling policy of thread pid, 0 for the caller
+ */
+int sys_sched_getscheduler(pid_t pid) {
+    struct proc *me = curr_proc();
+    struct proc *p = pid == 0 || pid == me->pid ? me : lock_thread(pid);
+    if (p == NULL) {
+        infof("sys_sched_getscheduler: no such thread %d", pid);
+        return -1;
+    }
+    if (p == me)
+        acquire(&p->lock);
+    int policy = p->policy;
+    release(&p->lock);
+    return policy;
+}
+
+/**
+ * @brief Get the SCHED_RR quantum, which is the same for every thread
+ */
+int sys_sched_rr_get_interval(pid_t pid, struct timespec *interval_va) {
+    uint64 us = get_rr_quantum();
+    struct timespec ts = {.tv_sec = us / USEC_PER_SEC, .tv_nsec = us % USEC_PER_SEC * 1000};
+    if (copyout(curr_proc()->mm->pagetable, (uint64)interval_va, (char *)&ts, sizeof(ts)) != 0) {
+        infof("sys_sched_rr_get_interval: copyout failed");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Set the SCHED_RR quantum
+ * It is independent of the time slice of SCHED_OTHER procs.
+ */
+int sys_sched_rr_set_interval(struct timespec *interval_va) {
+    struct timespec ts;
+    if (copyin(curr_proc()->mm->pagetable, (char *)&ts, (uint64)interval_va, sizeof(ts)) != 0) {
+        infof("sys_sched_rr_set_interval: copyin failed");
+        return -1;
+    }
+    if (set_rr_quantum(ts.tv_sec * USEC_PER_SEC + ts.tv_nsec / 1000) < 0) {
+        infof("sys_sched_rr_set_interval: zero quantum");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Let thread pid run only on the harts in the user mask
+ *
+ * @param pid thread id, 0 for the caller
+ * @param len bytes in the mask, a bit per hart
+ * @return 0, or -1 if pid is not found or no hart in the mask schedules
+ */
+int sys_sched_setaffinity(pid_t pid, uint64 len, uint64 *mask_va) {
+    struct proc *me = curr_proc();
+    uint64 mask = 0;
+    if (len > sizeof(mask))
+        len = sizeof(mask);
+    if (copyin(me->mm->pagetable, (char *)&mask, (uint64)mask_va, len) != 0) {
+        infof("sys_sched_setaffinity: copyin failed");
+        return -1;
+    }
+    struct proc *p = pid == 0 || pid == me->pid ? me : lock_thread(pid);
+    if (p == NULL) {
+        infof("sys_sched_setaffinity: no such thread %d", pid);
+        return -1;
+    }
+    if (p == me)
+        acquire(&p->lock);
+    int ret = set_cpus_allowed(p, mask);
+    release(&p->lock);
+    if (ret < 0) {
+        infof("sys_sched_setaffinity: no hart in mask %p", mask);
+        return -1;
+    }
+    // leave a hart we may no longer run on
+    push_off();
+    bool must_move = p == me && !(mask & (1ULL << cpuid()));
+    pop_off();
+    if (must_move)
+        yield();
+    return 0;
+}
+
+/**
+ * @brief Get the harts thread pid may run on
+ *
+ * @param pid thread id, 0 for the caller
+ * @param len bytes in the user buffer
+ * @return the size of the mask in bytes, or -1 on error
+ */
+int sys_sched_getaffinity(pid_t pid, uint64 len, uint64 *mask_va) {
+    struct proc *me = curr_proc();
+    if (len < sizeof(uint64)) {
+        infof("sys_sched_getaffinity: buffer too small");
+        return -1;
+    }
+    struct proc *p = pid == 0 || pid == me->pid ? me : lock_thread(pid);
+    if (p == NULL) {
+        infof("sys_sched_getaffinity: no such thread %d", pid);
+        return -1;
+    }
+    if (p == me)
+        acquire(&p->lock);
+    uint64 mask = p->cpus_allowed;
+    release(&p->lock);
+    if (copyout(me->mm->pagetable, (uint64)mask_va, (char *)&mask, sizeof(mask)) != 0) {
+        infof("sys_sched_getaffinity: copyout failed");
+        return -1;
+    }
+    return sizeof(mask);
+}
+
 
 int sys_close(int fd) {
     struct proc *p = curr_proc();
@@ -363,15 +529,18 @@ int sys_close(int fd) {
         return -1;
     }
 
-    struct file *f = p->files[fd];
+    write_lock(&p->files->lock);
+    struct file *f = p->files->fd[fd];
 
     // invalid fd
     if (f == NULL) {
+        write_unlock(&p->files->lock);
         infof("fd %d is not opened", fd);
         return -1;
     }
 
-    p->files[fd] = NULL;
+    p->files->fd[fd] = NULL;
+    write_unlock(&p->files->lock);
 
     fileclose(f);
     return 0;
@@ -381,7 +550,7 @@ int sys_close(int fd) {
 //    debugcore("sys_open");
 //    struct proc *p = curr_proc();
 //    char path[MAXPATH];
-//    copyinstr(p->pagetable, path, (uint64)pathname_va, MAXPATH);
+//    copyinstr(p->mm->pagetable, path, (uint64)pathname_va, MAXPATH);
 //    return fileopen(path, flags);
 //}
 
@@ -390,7 +559,7 @@ int sys_openat(int dirfd, char *filename, int flags, int mode) {
     debugcore("sys_openat");
     struct proc *p = curr_proc();
     char path[MAXPATH];
-    copyinstr(p->pagetable, path, (uint64)filename, MAXPATH);
+    copyinstr(p->mm->pagetable, path, (uint64)filename, MAXPATH);
     return fileopenat(dirfd, path, flags);
 }
 
@@ -403,8 +572,8 @@ int sys_linkat(int olddirfd, char *oldpath, int newdirfd, char *newpath, int fla
     struct proc *p = curr_proc();
     char old[MAXPATH];
     char new[MAXPATH];
-    copyinstr(p->pagetable, old, (uint64)oldpath, MAXPATH);
-    copyinstr(p->pagetable, new, (uint64)newpath, MAXPATH);
+    copyinstr(p->mm->pagetable, old, (uint64)oldpath, MAXPATH);
+    copyinstr(p->mm->pagetable, new, (uint64)newpath, MAXPATH);
 
     int oldfd = -1, newfd = -1, ret;
     oldfd = fileopenat(olddirfd, old, O_RDONLY);
@@ -420,11 +589,19 @@ int sys_linkat(int olddirfd, char *oldpath, int newdirfd, char *newpath, int fla
         goto end;
     }
 
-    struct file * file_old = get_proc_file_by_fd(p, oldfd);
-    struct file * file_new = get_proc_file_by_fd(p, newfd);
-    KERNEL_ASSERT(file_old != NULL && file_new != NULL, "sys_linkat: file is NULL, data is corrupted");
-
-    ret = filelink(file_old, file_new);
+    // another thread may have closed them meanwhile
+    struct file * file_old = fget(p, oldfd);
+    struct file * file_new = fget(p, newfd);
+    if (file_old != NULL && file_new != NULL) {
+        ret = filelink(file_old, file_new);
+    } else {
+        infof("sys_linkat: fd closed meanwhile");
+        ret = -1;
+    }
+    if (file_old != NULL)
+        fileclose(file_old);
+    if (file_new != NULL)
+        fileclose(file_new);
 
 end:
     if (oldfd >= 0) {
@@ -441,7 +618,7 @@ int sys_unlinkat(int dirfd, char *pathname, int flags) {
 
     struct proc *p = curr_proc();
     char path[MAXPATH];
-    copyinstr(p->pagetable, path, (uint64)pathname, MAXPATH);
+    copyinstr(p->mm->pagetable, path, (uint64)pathname, MAXPATH);
 
     int fd = fileopenat(dirfd, path, O_RDONLY);
     if (fd < 0) {
@@ -449,10 +626,13 @@ int sys_unlinkat(int dirfd, char *pathname, int flags) {
         return -1;
     }
 
-    struct file * file = get_proc_file_by_fd(p, fd);
-    KERNEL_ASSERT(file != NULL, "sys_unlinkat: file is NULL, data is corrupted");
-
-    int ret = fileunlink(file);
+    // another thread may have closed it meanwhile
+    struct file * file = fget(p, fd);
+    int ret = -1;
+    if (file != NULL) {
+        ret = fileunlink(file);
+        fileclose(file);
+    }
 
     sys_close(fd);
     return ret;
@@ -507,7 +687,7 @@ int sys_unlinkat(int dirfd, char *pathname, int flags) {
 //    uint64 va = (uint64)start;
 //    uint64 a;
 //    pte_t *pte;
-//    pagetable_t pagetable = curr_proc()->pagetable;
+//    pagetable_t pagetable = curr_proc()->mm->pagetable;
 //
 //    if (((uint64)start % PGSIZE) != 0) {
 //        return -1;
@@ -547,32 +727,34 @@ void *sys_mmap(void *start, size_t len, int prot, int flags, int fd, off_t off)
             infof("sys_mmap: invalid fd");
             return MAP_FAILED;
         }
-        struct file *f = p->files[fd];
+        struct file *f = fget(p, fd);
         if (f == NULL) {
             infof("sys_mmap: invalid fd");
             return MAP_FAILED;
         }
         if (f->type != FD_INODE) {
             infof("sys_mmap: fd is not a file");
-            return MAP_FAILED;
+            goto out;
         }
         if ((prot & PROT_WRITE) && !f->writable && (flags & MAP_SHARED)) {
             infof("sys_mmap: file is not writable");
-            return MAP_FAILED;
+            goto out;
         }
         if (off % PGSIZE != 0) {
             infof("sys_mmap: offset is not page aligned");
-            return MAP_FAILED;
+            goto out;
         }
         struct inode *ip = f->ip;
         ilock(ip);
         if (ip->type != T_FILE) {
             iunlock(ip);
             infof("sys_mmap: fd is not a file");
-            return MAP_FAILED;
+            goto out;
         }
         addr = mmap(p, start, len, prot, flags, ip, off);
         iunlock(ip);
+out:
+        fileclose(f);
     }
     return addr;
 }
@@ -587,11 +769,13 @@ ssize_t sys_read(int fd, void *dst_va, size_t len) {
         return -1;
     }
     struct proc *p = curr_proc();
-    struct file *f = p->files[fd];
+    struct file *f = fget(p, fd);
     if (f == NULL) {
         return -1;
     }
-    return fileread(f, dst_va, len);
+    ssize_t ret = fileread(f, dst_va, len);
+    fileclose(f);
+    return ret;
 }
 
 ssize_t sys_write(int fd, void *src_va, size_t len) {
@@ -599,19 +783,21 @@ ssize_t sys_write(int fd, void *src_va, size_t len) {
         return -1;
     }
     struct proc *p = curr_proc();
-    struct file *f = p->files[fd];
+    struct file *f = fget(p, fd);
     if (f == NULL) {
         return -1;
     }
 
-    return filewrite(f, src_va, len);
+    ssize_t ret = filewrite(f, src_va, len);
+    fileclose(f);
+    return ret;
 }
 
 int sys_dup(int oldfd) {
     struct file *f;
     int fd;
     struct proc *p = curr_proc();
-    f = get_proc_file_by_fd(p, oldfd);
+    f = fget(p, oldfd);
 
     if (f == NULL) {
         infof("old fd is not valid");
@@ -619,11 +805,12 @@ int sys_dup(int oldfd) {
         return -1;
     }
 
+    // the new fd takes over the reference of fget()
     if ((fd = fdalloc(f)) < 0) {
         infof("cannot allocate new fd");
+        fileclose(f);
         return -1;
     }
-    filedup(f);
     return fd;
 }
 
@@ -634,10 +821,10 @@ int sys_link(char *oldpath_va, char *newpath_va) {
 //    struct inode *dp, *ip;
 //
 //    struct proc *p = curr_proc();
-//    if (copyinstr(p->pagetable, old, (uint64)oldpath_va, MAXPATH) != 0) {
+//    if (copyinstr(p->mm->pagetable, old, (uint64)oldpath_va, MAXPATH) != 0) {
 //        return -1;
 //    }
-//    if (copyinstr(p->pagetable, new, (uint64)newpath_va, MAXPATH) != 0) {
+//    if (copyinstr(p->mm->pagetable, new, (uint64)newpath_va, MAXPATH) != 0) {
 //        return -1;
 //    }
 //
@@ -684,7 +871,7 @@ int sys_unlink(char *pathname_va) {
 //    uint off;
 //
 //    struct proc *p = curr_proc();
-//    if (copyinstr(p->pagetable, path, (uint64)pathname_va, MAXPATH) != 0) {
+//    if (copyinstr(p->mm->pagetable, path, (uint64)pathname_va, MAXPATH) != 0) {
 //        return -1;
 //    }
 //
@@ -732,7 +919,7 @@ void*sys_sharedmem(char* name_va, size_t len){
     char name[MAX_SHARED_NAME];
 
     struct proc* p = curr_proc();
-    err_t err = copyinstr(p->pagetable ,name, (uint64)name_va, MAX_SHARED_NAME);
+    err_t err = copyinstr(p->mm->pagetable ,name, (uint64)name_va, MAX_SHARED_NAME);
     if(err <0){
         return NULL;
     }
@@ -769,14 +956,18 @@ void*sys_sharedmem(char* name_va, size_t len){
 
 char * sys_getcwd(char *buf, size_t size) {
     struct proc* p = curr_proc();
-    ilock(p->cwd);
-    int length = strlen(p->cwd->path);
+    acquire_mutex_sleep(&p->fs->lock);
+    struct inode *cwd = p->fs->cwd;
+    ilock(cwd);
+    int length = strlen(cwd->path);
     if(length > size){
-        iunlock(p->cwd);
+        iunlock(cwd);
+        release_mutex_sleep(&p->fs->lock);
         return NULL;
     }
-    err_t err = copyout(p->pagetable, (uint64)buf, p->cwd->path, length);
-    iunlock(p->cwd);
+    err_t err = copyout(p->mm->pagetable, (uint64)buf, cwd->path, length);
+    iunlock(cwd);
+    release_mutex_sleep(&p->fs->lock);
     if(err < 0){
         return NULL;
     }
@@ -791,7 +982,7 @@ int sys_dup3(int oldfd, int newfd, int flags) {
     struct file *f;
     int fd;
     struct proc *p = curr_proc();
-    f = get_proc_file_by_fd(p, oldfd);
+    f = fget(p, oldfd);
 
     if (f == NULL) {
         infof("old fd is not valid");
@@ -802,24 +993,26 @@ int sys_dup3(int oldfd, int newfd, int flags) {
     if (newfd == oldfd) {
         // do nothing
         // ref: https://linux.die.net/man/2/dup3
+        fileclose(f);
         return newfd;
     }
 
     // try close new fd
     sys_close(newfd);
 
+    // the new fd takes over the reference of fget()
     if ((fd = fdalloc2(f, newfd)) < 0) {
         infof("cannot allocate new fd");
+        fileclose(f);
         return -1;
     }
-    filedup(f);
     return fd;
 }
 
 int sys_getdents(int fd, struct linux_dirent64 *dirp64, unsigned long len) {
     struct file *f;
     struct proc *p = curr_proc();
-    f = get_proc_file_by_fd(p, fd);
+    f = fget(p, fd);
     if (f == NULL) {
         infof("sys_getdents: fd=%d is not valid", fd);
         print_proc(p);
@@ -829,13 +1022,14 @@ int sys_getdents(int fd, struct linux_dirent64 *dirp64, unsigned long len) {
     // buffer for kernel usage
     char buf[len];
     int result = getdents(f, buf, len);
+    fileclose(f);
     if (result < 0) {
         infof("getdents failed");
         return -1;
     }
 
     // copy to user space if success
-    copyout(p->pagetable, (uint64)dirp64, buf, result);
+    copyout(p->mm->pagetable, (uint64)dirp64, buf, result);
     return result;
 }
 
@@ -849,7 +1043,7 @@ int sys_uname(struct utsname *utsname_va) {
     strcpy(utsname.machine, "riscv64");
     strcpy(utsname.domainname, "Metaverse");
 
-    if (copyout(p->pagetable, (uint64)utsname_va, (char*)&utsname, sizeof(utsname)) != 0) {
+    if (copyout(p->mm->pagetable, (uint64)utsname_va, (char*)&utsname, sizeof(utsname)) != 0) {
         infof("sys_uname: copyout failed");
         return -1;
     }
@@ -871,11 +1065,11 @@ int sys_gettimeofday(struct timeval *tv_va, struct timezone *tz_va) {
     memset(&tz, 0, sizeof(tz));
 
     struct proc *p = curr_proc();
-    if (tv_va && copyout(p->pagetable, (uint64)tv_va, (char*)&tv, sizeof(struct timeval)) != 0) {
+    if (tv_va && copyout(p->mm->pagetable, (uint64)tv_va, (char*)&tv, sizeof(struct timeval)) != 0) {
         infof("sys_gettimeofday: copyout failed");
         return -1;
     }
-    if (tz_va && copyout(p->pagetable, (uint64)tz_va, (char*)&tz, sizeof(struct timezone)) != 0) {
+    if (tz_va && copyout(p->mm->pagetable, (uint64)tz_va, (char*)&tz, sizeof(struct timezone)) != 0) {
         infof("sys_gettimeofday: copyout failed");
         return -1;
     }
@@ -890,32 +1084,32 @@ int sys_nanosleep(struct timeval *req_va, struct timeval *rem_va) {
     struct timeval req;
     struct timeval rem;
     struct proc *p = curr_proc();
-    if (copyin(p->pagetable, (char*)&req, (uint64)req_va, sizeof(struct timeval)) != 0) {
+    if (copyin(p->mm->pagetable, (char*)&req, (uint64)req_va, sizeof(struct timeval)) != 0) {
         infof("sys_nanosleep: copyin failed");
         return -1;
     }
 
     uint64 timeus = get_time_us();
     uint64 expires = req.tv_sec * USEC_PER_SEC + req.tv_usec;
+    uint64 remain = expires;
 
     // already expired
-    if (timeus + expires > get_time_us()) {
+    if (expires == 0) {
         return 0;
     }
 
     struct timer *timer = add_timer(expires);
     if (timer == NULL) {
-        infof("sys_nanosleep: timer is full, cannot add timer");
+        infof("sys_nanosleep: cannot add timer");
         goto err_rem;
     }
     // guard lock is acquired by add_timer
-    sleep(timer, &timer->guard_lock);
+    wait_queue_sleep(&timer->wq, &timer->guard_lock);
 
     release(&timer->guard_lock);
     del_timer(timer);
 
     uint64 duration = get_time_us() - timeus;
-    uint64 remain = 0;
     if (duration < expires)  {
         remain = expires - duration;
         goto err_rem;
@@ -927,7 +1121,7 @@ err_rem:
     if (rem_va) {
         rem.tv_sec = remain / USEC_PER_SEC;
         rem.tv_usec = remain % USEC_PER_SEC;
-        if (copyout(p->pagetable, (uint64)rem_va, (char*)&rem, sizeof(struct timeval)) != 0) {
+        if (copyout(p->mm->pagetable, (uint64)rem_va, (char*)&rem, sizeof(struct timeval)) != 0) {
             infof("sys_nanosleep: copyout failed");
             return -1;
         }
@@ -936,48 +1130,52 @@ err_rem:
 }
 
 uint64 sys_brk(void* addr) {
-    struct proc *p = curr_proc();
-    uint64 old_pos = p->heap_start + p->heap_sz;
+    struct mm *mm = curr_proc()->mm;
+    acquire_mutex_sleep(&mm->mmap_lock);
+    acquire(&mm->lock);
+    uint64 old_pos = mm->heap_start + mm->heap_sz;
     uint64 new_pos = (uint64)addr;
 
     if (addr == NULL) {
         // different from Linux
-        return old_pos;
-    }
-    if ((uint64)addr < p->heap_start) {
+        new_pos = old_pos;
+    } else if ((uint64)addr < mm->heap_start) {
         infof("sys_brk: addr is below heap start");
-        return old_pos;
-    }
-    if (new_pos > old_pos) {
-        // allocate memory
-        new_pos = uvmalloc(p->pagetable, old_pos, new_pos);
+        new_pos = old_pos;
+    } else if (new_pos > old_pos) {
+        // only reserve the range, pages are zero-filled on first touch
+        if (new_pos > USER_STACK_BOTTOM - USTACK_SIZE - USTACK_GUARD_SIZE) {
+            infof("sys_brk: heap would run into the stack");
+            new_pos = old_pos;
+        } else if (vma_overlap(&mm->vmas, PGROUNDUP(old_pos), PGROUNDUP(new_pos))) {
+            infof("sys_brk: heap would overlap a mapping");
+            new_pos = old_pos;
+        }
     } else {
         // deallocate memory
-        new_pos = uvmdealloc(p->pagetable, old_pos, new_pos);
+        new_pos = uvmdealloc(mm->pagetable, old_pos, new_pos);
     }
 
-    if (new_pos == 0) {
-        infof("sys_brk: uvmalloc/uvmdealloc failed");
-        return old_pos;
-    }
-
-    p->heap_sz = new_pos - p->heap_start;
-    p->total_size += new_pos - old_pos;
+    mm->heap_sz = new_pos - mm->heap_start;
+    mm->total_size += new_pos - old_pos;
+    release(&mm->lock);
+    release_mutex_sleep(&mm->mmap_lock);
     return new_pos;
 }
 
 int sys_writev(int fd, struct iovec *iov_va, int iovcnt) {
     struct file *f;
     struct proc *p = curr_proc();
-    f = get_proc_file_by_fd(p, fd);
+    f = fget(p, fd);
     if (f == NULL) {
         infof("sys_writev: fd=%d is not valid", fd);
         return -1;
     }
 
     struct iovec iov[iovcnt];
-    if (copyin(p->pagetable, (char*)iov, (uint64)iov_va, sizeof(struct iovec) * iovcnt) != 0) {
+    if (copyin(p->mm->pagetable, (char*)iov, (uint64)iov_va, sizeof(struct iovec) * iovcnt) != 0) {
         infof("sys_writev: copyin failed");
+        fileclose(f);
         return -1;
     }
 
@@ -987,25 +1185,28 @@ int sys_writev(int fd, struct iovec *iov_va, int iovcnt) {
         int result = filewrite(f, (void *)iov[i].iov_base, iov[i].iov_len);
         if (result < 0) {
             infof("filewrite failed at iov[%d], base = %p, len = %d", i, iov[i].iov_base, iov[i].iov_len);
+            fileclose(f);
             return -1;
         }
         total_len += result;
     }
+    fileclose(f);
     return total_len;
 }
 
 int sys_readv(int fd, struct iovec *iov_va, int iovcnt) {
     struct file *f;
     struct proc *p = curr_proc();
-    f = get_proc_file_by_fd(p, fd);
+    f = fget(p, fd);
     if (f == NULL) {
         infof("sys_readv: fd=%d is not valid", fd);
         return -1;
     }
 
     struct iovec iov[iovcnt];
-    if (copyin(p->pagetable, (char*)iov, (uint64)iov_va, sizeof(struct iovec) * iovcnt) != 0) {
+    if (copyin(p->mm->pagetable, (char*)iov, (uint64)iov_va, sizeof(struct iovec) * iovcnt) != 0) {
         infof("sys_readv: copyin failed");
+        fileclose(f);
         return -1;
     }
 
@@ -1015,10 +1216,12 @@ int sys_readv(int fd, struct iovec *iov_va, int iovcnt) {
         int result = fileread(f, (void *)iov[i].iov_base, iov[i].iov_len);
         if (result < 0) {
             infof("fileread failed at iov[%d], base = %p, len = %d", i, iov[i].iov_base, iov[i].iov_len);
+            fileclose(f);
             return -1;
         }
         total_len += result;
     }
+    fileclose(f);
     return total_len;
 }
 
@@ -1056,18 +1259,25 @@ int sys_mprotect(void *addr, size_t len, int prot) {
         page_prot |= PTE_X;
     }
 
-    return uvmprotect(p->pagetable, start, npages, page_prot);
+    acquire_mutex_sleep(&p->mm->mmap_lock);
+    acquire(&p->mm->lock);
+    int ret = uvmprotect(p->mm->pagetable, start, npages, page_prot);
+    release(&p->mm->lock);
+    release_mutex_sleep(&p->mm->mmap_lock);
+    return ret;
 }
 
 off_t sys_lseek(int fd, off_t offset, int whence) {
     struct file *f;
     struct proc *p = curr_proc();
-    f = get_proc_file_by_fd(p, fd);
+    f = fget(p, fd);
     if (f == NULL) {
         infof("sys_lseek: fd=%d is not valid", fd);
         return -1;
     }
-    return filelseek(f, offset, whence);
+    off_t ret = filelseek(f, offset, whence);
+    fileclose(f);
+    return ret;
 }
 
 int sys_utimensat(int dirfd, const char *pathname, const struct timeval times[2], int flags) {
@@ -1110,8 +1320,8 @@ int sys_renameat2(int olddirfd, char *oldpath, int newdirfd, char *newpath, int
     struct proc *p = curr_proc();
     char old[MAXPATH];
     char new[MAXPATH];
-    copyinstr(p->pagetable, old, (uint64)oldpath, MAXPATH);
-    copyinstr(p->pagetable, new, (uint64)newpath, MAXPATH);
+    copyinstr(p->mm->pagetable, old, (uint64)oldpath, MAXPATH);
+    copyinstr(p->mm->pagetable, new, (uint64)newpath, MAXPATH);
 
     int oldfd = -1, newfd = -1, ret;
     struct file * file_old = NULL, *file_new = NULL;
@@ -1132,19 +1342,33 @@ int sys_renameat2(int olddirfd, char *oldpath, int newdirfd, char *newpath, int
         goto end;
     }
 
-    file_old = get_proc_file_by_fd(p, oldfd);
-    file_new = get_proc_file_by_fd(p, newfd);
-    KERNEL_ASSERT(file_old != NULL && file_new != NULL, "sys_linkat: file is NULL, data is corrupted");
+    // another thread may have closed them meanwhile
+    file_old = fget(p, oldfd);
+    file_new = fget(p, newfd);
+    if (file_old == NULL || file_new == NULL) {
+        infof("sys_renameat2: fd closed meanwhile");
+        sys_close(newfd);
+        ret = -1;
+        goto end;
+    }
 
     // copy out the full path
     filepath(file_new, path_new);
 
     fileunlink(file_new);
+    fileclose(file_new);
+    file_new = NULL;
     sys_close(newfd);
 
     ret = filerename(file_old, path_new);
 
 end:
+    if (file_old != NULL) {
+        fileclose(file_old);
+    }
+    if (file_new != NULL) {
+        fileclose(file_new);
+    }
     if (oldfd >= 0) {
         sys_close(oldfd);
     }
@@ -1154,12 +1378,55 @@ end:
 int sys_ioctl(int fd, int request, void *arg) {
     struct file *f;
     struct proc *p = curr_proc();
-    f = get_proc_file_by_fd(p, fd);
+    f = fget(p, fd);
     if (f == NULL) {
         infof("sys_ioctl: fd=%d is not valid", fd);
         return -1;
     }
-    return fileioctl(f, request, arg);
+    int ret = fileioctl(f, request, arg);
+    fileclose(f);
+    return ret;
+}
+
+int sys_prlimit64(pid_t pid, int resource, const struct rlimit *new_limit_va, struct rlimit *old_limit_va) {
+    struct proc *p = curr_proc();
+    if (pid != 0 && pid != p->tgid) {
+        infof("sys_prlimit64: only the calling process is supported");
+        return -1;
+    }
+    if (resource != RLIMIT_STACK) {
+        // other limits are not enforced
+        return 0;
+    }
+    struct rlimit limit;
+    if (old_limit_va != NULL) {
+        limit.rlim_cur = p->mm->stack_rlimit;
+        limit.rlim_max = USTACK_SIZE;
+        if (copyout(p->mm->pagetable, (uint64)old_limit_va, (char *)&limit, sizeof(struct rlimit)) != 0) {
+            infof("sys_prlimit64: copyout failed");
+            return -1;
+        }
+    }
+    if (new_limit_va != NULL) {
+        if (copyin(p->mm->pagetable, (char *)&limit, (uint64)new_limit_va, sizeof(struct rlimit)) != 0) {
+            infof("sys_prlimit64: copyin failed");
+            return -1;
+        }
+        if (limit.rlim_cur > limit.rlim_max) {
+            infof("sys_prlimit64: rlim_cur is above rlim_max");
+            return -1;
+        }
+        // the stack reservation is fixed, RLIM_INFINITY means all of it
+        if (limit.rlim_cur > USTACK_SIZE) {
+            limit.rlim_cur = USTACK_SIZE;
+        }
+        if (limit.rlim_cur < PGSIZE) {
+            infof("sys_prlimit64: stack limit is too small");
+            return -1;
+        }
+        p->mm->stack_rlimit = PGROUNDDOWN(limit.rlim_cur);
+    }
+    return 0;
 }
 
 int sys_getrusage(int who, struct rusage *usage_va) {
@@ -1176,15 +1443,16 @@ int sys_getrusage(int who, struct rusage *usage_va) {
     struct rusage usage;
     memset(&usage, 0, sizeof(struct rusage));
 
-    uint64 user_time = p->user_time;
-    uint64 sys_time = p->kernel_time;
+    uint64 user_time, sys_time;
+    get_proc_times(p, &user_time, &sys_time);
 
     usage.ru_utime.tv_sec = user_time / USEC_PER_SEC;
     usage.ru_utime.tv_usec = user_time % USEC_PER_SEC;
     usage.ru_stime.tv_sec = sys_time / USEC_PER_SEC;
     usage.ru_stime.tv_usec = sys_time % USEC_PER_SEC;
+    usage.ru_minflt = p->minflt;
 
-    if (copyout(p->pagetable, (uint64)usage_va, &usage, sizeof(struct rusage)) != 0) {
+    if (copyout(p->mm->pagetable, (uint64)usage_va, &usage, sizeof(struct rusage)) != 0) {
         infof("sys_getrusage: copyout failed");
         return -1;
     }
@@ -1207,7 +1475,7 @@ int sys_clock_gettime(int clock_id, struct timespec *tp_va) {
     t.tv_sec = time / USEC_PER_SEC;
     t.tv_nsec = (time % USEC_PER_SEC) * 1000;
 
-    if (copyout(p->pagetable, (uint64)tp_va, &t, sizeof(struct timespec)) != 0) {
+    if (copyout(p->mm->pagetable, (uint64)tp_va, &t, sizeof(struct timespec)) != 0) {
         infof("sys_clock_gettime: copyout failed");
         return -1;
     }
@@ -1215,6 +1483,51 @@ int sys_clock_gettime(int clock_id, struct timespec *tp_va) {
     return 0;
 }
 
+/**
+ * @brief futex(2), see proc/futex.c
+ *
+ * timeout_va is relative for FUTEX_WAIT and an absolute clock_gettime()
+ * time for FUTEX_WAIT_BITSET, NULL waits forever. The requeue ops take
+ * the number of waiters to move in its place.
+ */
+int sys_futex(uint32 *uaddr, int op, uint32 val, struct timespec *timeout_va, uint32 *uaddr2, uint32 val3) {
+    struct proc *p = curr_proc();
+    int cmd = op & FUTEX_CMD_MASK;
+    bool private = (op & FUTEX_PRIVATE_FLAG) != 0;
+    uint64 deadline = 0;
+
+    if ((cmd == FUTEX_WAIT || cmd == FUTEX_WAIT_BITSET) && timeout_va != NULL) {
+        struct timespec ts;
+        if (copyin(p->mm->pagetable, (char *)&ts, (uint64)timeout_va, sizeof(struct timespec)) != 0) {
+            infof("sys_futex: copyin failed");
+            return -1;
+        }
+        deadline = SECOND_TO_TICK(ts.tv_sec) + US_TO_TICK(ts.tv_nsec / 1000);
+        if (cmd == FUTEX_WAIT)
+            deadline += get_tick();
+        if (deadline == 0)
+            deadline = 1;   // long expired, 0 means no timeout
+    }
+
+    switch (cmd) {
+    case FUTEX_WAIT:
+        return futex_wait((uint64)uaddr, private, val, deadline, FUTEX_BITSET_MATCH_ANY);
+    case FUTEX_WAIT_BITSET:
+        return futex_wait((uint64)uaddr, private, val, deadline, val3);
+    case FUTEX_WAKE:
+        return futex_wake((uint64)uaddr, private, val, FUTEX_BITSET_MATCH_ANY);
+    case FUTEX_WAKE_BITSET:
+        return futex_wake((uint64)uaddr, private, val, val3);
+    case FUTEX_REQUEUE:
+        return futex_requeue((uint64)uaddr, (uint64)uaddr2, private, val, (int)(uint64)timeout_va, FALSE, 0);
+    case FUTEX_CMP_REQUEUE:
+        return futex_requeue((uint64)uaddr, (uint64)uaddr2, private, val, (int)(uint64)timeout_va, TRUE, val3);
+    default:
+        infof("sys_futex: op %d is not supported", op);
+        return -1;
+    }
+}
+
 int sys_pselect6(
         int nfds,
         struct fd_set *readfds_va,
@@ -1242,7 +1555,7 @@ int sys_pselect6(
     struct fd_set readfds;
     memset(&readfds, 0, sizeof(struct fd_set));
     int loop_cnt = 1000;
-    if (copyin(p->pagetable, &checkfds, (uint64)readfds_va, sizeof(struct fd_set)) != 0) {
+    if (copyin(p->mm->pagetable, &checkfds, (uint64)readfds_va, sizeof(struct fd_set)) != 0) {
         infof("sys_pselect6: copyin readfds failed");
         goto err;
     }
@@ -1251,7 +1564,7 @@ int sys_pselect6(
             if (!FD_ISSET(i, &checkfds)) {
                 continue;
             }
-            struct file *f = get_proc_file_by_fd(p, i);
+            struct file *f = fget(p, i);
             if (f == NULL) {
                 infof("sys_pselect6: fd=%d is not valid", i);
                 continue;
@@ -1259,22 +1572,25 @@ int sys_pselect6(
             // only support pipe selection
             if (f->type != FD_PIPE) {
                 infof("sys_pselect6: fd=%d is not pipe", i);
+                fileclose(f);
                 continue;
             }
-            if (pipe_readable(f->pipe)) {
+            bool readable = pipe_readable(f->pipe);
+            fileclose(f);
+            if (readable) {
                 FD_SET(i, &readfds);
                 break;
             }
         }
         yield();
     }
-    if (copyout(p->pagetable, (uint64)readfds_va, &readfds, sizeof(struct fd_set)) != 0) {
+    if (copyout(p->mm->pagetable, (uint64)readfds_va, &readfds, sizeof(struct fd_set)) != 0) {
         infof("sys_pselect6: copyout readfds failed");
     }
 
 clear_fds:
     // try to clear exceptfds
-    if (exceptfds_va && uvmemset(p->pagetable, (uint64)exceptfds_va, 0, sizeof
+    if (exceptfds_va && uvmemset(p->mm->pagetable, (uint64)exceptfds_va, 0, sizeof
     (struct fd_set)) != 0) {
         infof("sys_pselect6: exceptfds_va uvmemset failed");
     }
@@ -1282,11 +1598,11 @@ clear_fds:
     return 0;
 
 err:
-    if (readfds_va && uvmemset(p->pagetable, (uint64)readfds_va, 0, sizeof
+    if (readfds_va && uvmemset(p->mm->pagetable, (uint64)readfds_va, 0, sizeof
             (struct fd_set)) != 0) {
         infof("sys_pselect6: readfds_va uvmemset failed");
     }
-    if (writefds_va && uvmemset(p->pagetable, (uint64)writefds_va, 0, sizeof
+    if (writefds_va && uvmemset(p->mm->pagetable, (uint64)writefds_va, 0, sizeof
             (struct fd_set)) != 0) {
         infof("sys_pselect6: writefds_va uvmemset failed");
     }
@@ -21,6 +21,8 @@ struct iovec;
 
 struct rusage;
 
+struct rlimit;
+
 struct timespec;
 
 struct fd_set;
@@ -28,6 +30,8 @@ struct fd_set;
 int sys_execve( char *pathname_va, char * argv_va[], char * envp_va[]);
 
 int sys_exit(int status);
+int sys_exit_group(int status);
+pid_t sys_set_tid_address(int *tidptr);
 
 ssize_t sys_read(int fd, void *dst_va, size_t len);
 
@@ -36,6 +40,7 @@ ssize_t sys_write(int fd, void *src_va, size_t len);
 long sys_lseek(int fd, long offset, int whence);
 
 pid_t sys_getpid(void);
+pid_t sys_gettid(void);
 
 pid_t sys_getppid();
 
@@ -79,6 +84,18 @@ int64 sys_setpriority(int64 priority);
 
 int64 sys_getpriority();
 
+int sys_sched_setscheduler(pid_t pid, int policy, int *param_va);
+
+int sys_sched_getscheduler(pid_t pid);
+
+int sys_sched_rr_get_interval(pid_t pid, struct timespec *interval_va);
+
+int sys_sched_rr_set_interval(struct timespec *interval_va);
+
+int sys_sched_setaffinity(pid_t pid, uint64 len, uint64 *mask_va);
+
+int sys_sched_getaffinity(pid_t pid, uint64 len, uint64 *mask_va);
+
 void* sys_sharedmem(char* name_va, size_t len);
 
 char * sys_getcwd(char *buf, size_t size);
@@ -115,10 +132,14 @@ int sys_renameat2(int olddirfd, char *oldpath, int newdirfd, char *newpath, int
 
 int sys_ioctl(int fd, int request, void *arg);
 
+int sys_prlimit64(pid_t pid, int resource, const struct rlimit *new_limit_va, struct rlimit *old_limit_va);
+
 int sys_getrusage(int who, struct rusage *usage_va);
 
 int sys_clock_gettime(int clock_id, struct timespec *tp_va);
 
+int sys_futex(uint32 *uaddr, int op, uint32 val, struct timespec *timeout_va, uint32 *uaddr2, uint32 val3);
+
 int sys_pselect6(
         int nfds,
         struct fd_set *readfds_va,
@@ -33,8 +33,29 @@ void kernel_interrupt_handler(uint64 scause, uint64 stval, uint64 sepc) {
     switch (cause) {
     case SupervisorTimer:
         try_wakeup_timer();
+        if (curr_proc() == NULL) {
+            // an idle hart woken for a deadline, scheduler() sets the next one
+            stop_timer_interrupt();
+            break;
+        }
+        // the interrupted code can be in no RCU read section, which
+        // keeps preemption off, a proc long in the kernel must not hold
+        // up a grace period
+        if (mycpu()->preempt_count == 0)
+            rcu_qs_report(cpuid());
+        // may start another RR quantum, before the timer is set for it,
+        // kerneltrap() preempts on the way out
+        if (should_resched(curr_proc(), TRUE))
+            mycpu()->need_resched = TRUE;
         set_next_timer();
-        yield();
+        break;
+    case SupervisorSoft:
+        // an IPI asking for a TLB flush, waking an idle hart,
+        // or queueing a proc that outranks the one running here
+        w_sip(r_sip() & ~SIP_SSIP);
+        tlb_shootdown_handle();
+        if (curr_proc() != NULL && should_resched(curr_proc(), FALSE))
+            mycpu()->need_resched = TRUE;
         break;
     case SupervisorExternal:
         irq = plic_claim();
@@ -56,7 +77,7 @@ void kernel_interrupt_handler(uint64 scause, uint64 stval, uint64 sepc) {
 
 static void print_user_stack(struct proc *p) {
     uint64 stack_buf[32];
-    copyin(p->pagetable, (char *)stack_buf, p->trapframe->sp, sizeof(stack_buf));
+    copyin(p->mm->pagetable, (char *)stack_buf, p->trapframe->sp, sizeof(stack_buf));
     printf("user stack:\n");
     for (int i = 0; i < sizeof(stack_buf) / sizeof(uint64); i++) {
         printf("%p\n", stack_buf[i]);
@@ -68,8 +89,19 @@ void user_interrupt_handler(uint64 scause, uint64 stval, uint64 sepc) {
     switch (scause & 0xff) {
     case SupervisorTimer:
         try_wakeup_timer();
+        // may start another RR quantum, before the timer is set for it,
+        // usertrap() yields before going back
+        if (should_resched(curr_proc(), TRUE))
+            mycpu()->need_resched = TRUE;
         set_next_timer();
-        yield();
+        break;
+    case SupervisorSoft:
+        // an IPI asking for a TLB flush, or queueing a proc that
+        // outranks this one
+        w_sip(r_sip() & ~SIP_SSIP);
+        tlb_shootdown_handle();
+        if (should_resched(curr_proc(), FALSE))
+            mycpu()->need_resched = TRUE;
         break;
     case SupervisorExternal:
         irq = plic_claim();
@@ -92,55 +124,124 @@ void user_interrupt_handler(uint64 scause, uint64 stval, uint64 sepc) {
         break;
     }
 }
+// Must hold mm->lock.
+static int do_page_fault(struct proc *p, struct mm *mm, uint64 va, int access) {
+    uint perm = access == FAULT_STORE ? PTE_W : access == FAULT_FETCH ? PTE_X : PTE_R;
+    if (uvmaccessible(mm->pagetable, va, perm)) {
+        // another thread served the fault first
+        asid_flush_local(mm->asid, PGROUNDDOWN(va), PGSIZE);
+        return 0;
+    }
+    if (access == FAULT_STORE && uvmcow(mm->pagetable, va) == 0) {
+        return 0;
+    }
+    va = PGROUNDDOWN(va);
+    uint64 stack_limit = USER_STACK_BOTTOM - mm->stack_rlimit;
+    if (va >= stack_limit && va < USER_STACK_BOTTOM) {
+        goto demand_zero;
+    }
+    if (va >= PGROUNDDOWN(mm->heap_start) && va < PGROUNDUP(mm->heap_start + mm->heap_sz)) {
+        // back a 2MB aligned chunk wholly inside the heap with a huge page
+        uint64 huge = va & ~(uint64)(HUGE_PAGE_SIZE - 1);
+        if (huge >= mm->heap_start && huge + HUGE_PAGE_SIZE <= mm->heap_start + mm->heap_sz &&
+            uvmpopulate_huge(mm->pagetable, huge) == 0) {
+            tlb_flush_range(mm->pagetable, huge, HUGE_PAGE_SIZE);
+            p->minflt++;
+            return 0;
+        }
+        goto demand_zero;
+    }
+    if (va >= stack_limit - USTACK_GUARD_SIZE && va < stack_limit) {
+        infof("stack overflow in user application: pid=%d, va=%p, limit=%p", p->pid, va, stack_limit);
+    }
+    return -1;
+
+demand_zero:
+    if (uvmpopulate(mm->pagetable, va) != 0) {
+        // mapped already, a protection fault
+        return -1;
+    }
+    // sfence.vma also orders the PTE write before the retried access
+    tlb_flush_range(mm->pagetable, va, PGSIZE);
+    p->minflt++;
+    return 0;
+}
+
+// Handle a page fault of process p at va.
+// Store faults on copy-on-write pages get a private copy, faults inside
+// the stack limit or the heap get a zeroed page. The threads sharing the
+// address space fault concurrently, they are serialized by mm->lock.
+// Returns 0 if the access can be retried, -1 if it is a real fault.
+int handle_page_fault(struct proc *p, uint64 va, int access) {
+    if (va >= MAXVA) {
+        return -1;
+    }
+    struct mm *mm = p->mm;
+    acquire(&mm->lock);
+    int ret = do_page_fault(p, mm, va, access);
+    release(&mm->lock);
+    return ret;
+}
+
 void user_exception_handler(uint64 scause, uint64 stval, uint64 sepc) {
     struct proc *p = curr_proc();
     struct trapframe *trapframe = p->trapframe;
     switch (scause & 0xff) {
     case InstructionAccessFault:    // 1
         infof("InstructionAccessFault in user application: %p, stval = %p sepc = %p\n", scause, stval, sepc);
-        exit(-1);
+        exit_group(-1);
         break;
     case IllegalInstruction:    // 2
         errorf("IllegalInstruction in user application: %p, stval = %p sepc = %p\n", scause, stval, sepc);
-        exit(-2);
+        exit_group(-2);
         break;
     case LoadAccessFault:   // 5
         infof("LoadAccessFault in user application: %p, stval = %p sepc = %p\n", scause, stval, sepc);
-        exit(-5);
+        exit_group(-5);
         break;
     case AMOAddressMisaligned:  // 6
         errorf("AMOAddressMisaligned in user application: %p, stval = %p sepc = %p\n", scause, stval, sepc);
-        exit(-6);
+        exit_group(-6);
         break;
     case StoreAMOAccessFault:  // 7
         infof("StoreAccessFault in user application: %p, stval = %p sepc = %p\n", scause, stval, sepc);
-        exit(-8);
+        exit_group(-8);
         break;
     case UserEnvCall:   // 8
 //        if (p->killed)
-//            exit(-1);
+//            exit_group(-1);
         trapframe->epc += 4;
         intr_on();
         syscall();
         break;
     case InstructionPageFault:  // 12
+        if (handle_page_fault(p, stval, FAULT_FETCH) == 0) {
+            break;
+        }
         infof("InstructionPageFault in user application: %p, stval = %p sepc = %p\n", scause, stval, sepc);
         print_user_stack(p);
-        exit(-5);
+        exit_group(-5);
         break;
     case LoadPageFault: // 13
+        if (handle_page_fault(p, stval, FAULT_LOAD) == 0) {
+            break;
+        }
         infof("LoadPageFault in user application: %p, stval = %p sepc = %p\n", scause, stval, sepc);
         print_user_stack(p);
-        exit(-2);
+        exit_group(-2);
         break;
     case StoreAMOPageFault:    //15
+        if (handle_page_fault(p, stval, FAULT_STORE) == 0) {
+            // copy-on-write or demand-zero page, retry the store
+            break;
+        }
         infof("StorePageFault in user application: %p, stval = %p sepc = %p\n", scause, stval, sepc);
         print_user_stack(p);
-        exit(-7);
+        exit_group(-7);
         break;
     default:
         errorf("Unknown exception in user application: %p, stval = %p sepc = %p\n", scause, stval, sepc);
-        exit(-1);
+        exit_group(-1);
         break;
     }
 }
@@ -167,10 +268,13 @@ void usertrap() {
     // record user time
     struct proc* p = curr_proc();
     uint64 curr_time = get_tick();
-    acquire(&p->lock);
+    // only this hart writes them while p runs, readers use the sequence
+    write_seqcount_begin(&p->time_seq);
     p->user_time += curr_time - p->last_start_time;
+    write_seqcount_end(&p->time_seq);
     p->last_start_time = curr_time;
-    release(&p->lock);
+    // from user mode, p is in no RCU read section
+    rcu_qs_report(cpuid());
 
     if (scause & (1ULL << 63)) { // interrput = 1
         user_interrupt_handler(scause, stval, sepc);
@@ -180,6 +284,7 @@ void usertrap() {
     if (p->killed) {
         exit(-1);
     }
+    cond_resched();
     pushtrace(0x3036);
     usertrapret();
 }
@@ -214,15 +319,16 @@ void usertrapret() {
     x |= SSTATUS_SPIE; // enable interrupts in user mode
     w_sstatus(x);
 
-    // tell trampoline.S the user page table to switch to.
-    uint64 satp = MAKE_SATP(p->pagetable);
+    // tell trampoline.S the user page table to switch to,
+    // tagged with the process's ASID.
+    uint64 satp = asid_switch(p);
 
     // jump to trampoline.S at the top of memory, which
     // switches to the user page table, restores user registers,
     // and switches to user mode with sret.
     uint64 fn = TRAMPOLINE + (userret - trampoline);
     // debugcore("return to user, satp=%p, trampoline=%p, kernel_trap=%p\n",satp, fn,  trapframe->kernel_trap);
-    ((void (*)(uint64, uint64))fn)(TRAPFRAME, satp);
+    ((void (*)(uint64, uint64))fn)(p->trapframe_va, satp);
 }
 
 void kernel_exception_handler(uint64 scause, uint64 stval, uint64 sepc) {
@@ -291,9 +397,14 @@ void kerneltrap() {
     if (scause & (1ULL << 63)) // interrput
     {
         kernel_interrupt_handler(scause, stval, sepc);
+        // the interrupted code had interrupts on, so it held no spinlock
+        if (need_preempt())
+            yield();
     } else // exception
     {
-        kernel_exception_handler(scause, stval, sepc);
+        // a faulting direct user access resumes at its fixup
+        if (!uaccess_fixup(scause, &sepc))
+            kernel_exception_handler(scause, stval, sepc);
     }
 
     // the yield() may have caused some traps to occur,
@@ -1,9 +1,10 @@
 #if !defined(TRAP_H)
 #define TRAP_H
 #include <ucore/defs.h>
-// per-process data for the trap handling code in trampoline.S.
-// sits in a page by itself just under the trampoline page in the
-// user page table. not specially mapped in the kernel page table.
+// per-thread data for the trap handling code in trampoline.S.
+// sits in a page by itself under the trampoline page in the
+// user page table, at p->trapframe_va, the threads sharing a page table
+// each have their own. not specially mapped in the kernel page table.
 // the sscratch register points here.
 // uservec in trampoline.S saves user registers in the trapframe,
 // then initializes registers from the trapframe's
@@ -10,6 +10,7 @@ struct superblock;
 struct inode;
 struct buf;
 struct auxv_t;
+struct mm;
 
 // panic.c
 void loop();
@@ -20,6 +21,7 @@ void sbi_console_putchar(int);
 int sbi_console_getchar();
 void shutdown();
 void set_timer(uint64 stime);
+void sbi_send_ipi(uint64 hart_mask);
 
 // printf.c
 void printf(char *, ...);
@@ -32,6 +34,11 @@ void trapinit_hart();
 void usertrapret();
 void set_usertrap();
 void set_kerneltrap();
+// access types of handle_page_fault()
+#define FAULT_LOAD 0
+#define FAULT_STORE 1
+#define FAULT_FETCH 2
+int handle_page_fault(struct proc *p, uint64 va, int access);
 
 // string.c
 int memcmp(const void *, const void *, uint);
@@ -45,6 +52,8 @@ char *strncpy(char *, const char *, int);
 char *strcpy(char *, const char *);
 char *strchr(const char *, int);
 char* strcat(char *, const char *);
+char *itoa(int, char *, int);
+char *utoa(uint64, char *, int);
 
 // syscall.c
 void syscall();
@@ -63,14 +72,28 @@ int check_script_header(char *name, char *interp, char *opt_arg);
 // proc.c
 struct proc *curr_proc();
 void exit(int);
+void exit_group(int);
 void procinit();
 void scheduler(); // __attribute__((noreturn));
 void switch_to_scheduler();
 void yield();
-int clone(void* stack);
+bool need_preempt(void);
+void preempt_schedule(void);
+void preempt_disable(void);
+void preempt_enable(void);
+void cond_resched(void);
+void make_runnable(struct proc *p);
+void wake_idle_harts();
+int set_cpus_allowed(struct proc *p, uint64 mask);
+int set_scheduler(struct proc *p, int policy, int priority);
+bool should_resched(struct proc *p, bool tick);
+uint64 get_rr_quantum();
+int set_rr_quantum(uint64 us);
+int clone(uint64 flags, void *stack, void *ptid, uint64 tls, void *ctid);
 int exec(char *name, int argc, const char **argv, int envc, const char **envp);
 int wait(int, int *, int, void*);
-struct proc *alloc_proc();
+struct proc *alloc_proc(struct mm *mm);
+struct proc *lock_thread(int tid);
 void init_scheduler();
 int fdalloc(struct file *);
 int fdalloc2(struct file *, int);
@@ -82,10 +105,39 @@ void recycle_physical_page(void *);
 void kinit(void);
 void dup_physical_page(void *pa);
 void put_physical_page(void *pa);
-uint8 get_physical_page_ref(void *pa);
+uint16 get_physical_page_ref(void *pa);
+void *alloc_physical_pages(int order);
+void recycle_physical_pages(void *pa, int order);
+void *alloc_huge_physical_page(void);
+void dup_huge_physical_page(void *pa);
+void put_huge_physical_page(void *pa);
+void get_free_block_counts(uint64 *counts);
+void *alloc_zeroed_physical_page(void);
+int fill_zero_pool(void);
+void get_zero_pool_stat(uint64 *count, uint64 *hit, uint64 *miss);
+
+// asid.c
+void asid_init();
+void asid_alloc(struct mm *mm);
+uint64 asid_switch(struct proc *p);
+void asid_flush_local(uint64 asid, uint64 va, uint64 len);
+
+// tlb.c
+void tlb_flush_range(pagetable_t pagetable, uint64 va, uint64 len);
+void tlb_shootdown_handle();
+
+// uaccess.c
+void uwindow_reset(struct mm *mm);
+void uwindow_flush_range(struct mm *mm, uint64 va, uint64 len);
+bool uaccess_fixup(uint64 scause, uint64 *sepc);
+uint64 copyout_direct(pagetable_t pagetable, uint64 dstva, char *src, uint64 len);
+uint64 copyin_direct(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len);
+uint64 uvmemset_direct(pagetable_t pagetable, uint64 dstva, char c, uint64 len);
+bool copyinstr_direct(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max, uint64 *copied);
 
 // kill.c
 int kill(int pid);
+void kill_other_threads(struct proc *p, int code);
 
 // vm.c
 void kvminit(void);
@@ -97,10 +149,15 @@ uint64 uvmdealloc(pagetable_t, uint64, uint64);
 int uvmcopy(pagetable_t, pagetable_t, uint64);
 int uvmmap_dup(pagetable_t old_pagetable, pagetable_t new_pagetable, uint64 va, uint npages, bool shared);
 int uvmprotect(pagetable_t pagetable, uint64 va, uint npages, uint perm);
+int uvmcow(pagetable_t pagetable, uint64 va);
+int uvmpopulate(pagetable_t pagetable, uint64 va);
+int uvmpopulate_huge(pagetable_t pagetable, uint64 va);
+int uvmmap_huge(pagetable_t pagetable, uint64 va, uint64 pa, int perm);
 void free_user_mem_and_pagetables(pagetable_t, uint64);
 void uvmunmap(pagetable_t, uint64, uint64, int);
 void uvmclear(pagetable_t, uint64);
 uint64 walkaddr(pagetable_t, uint64);
+bool uvmaccessible(pagetable_t pagetable, uint64 va, uint perm);
 uint64 walkaddr_k(pagetable_t pagetable, uint64 va);
 uint64 virt_addr_to_physical(pagetable_t, uint64);
 int copyout(pagetable_t, uint64, char *, uint64);
@@ -118,6 +175,7 @@ err_t either_memset(void *dst, char c, size_t len, int is_user_src);
 // timer.c
 void timerinit();
 void set_next_timer();
+void set_idle_timer();
 uint64 get_time_ms();
 uint64 get_time_us();
 uint64 get_tick();
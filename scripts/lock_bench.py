@@ -0,0 +1,38 @@
+import os
+import signal
+import subprocess
+import sys
+
+# Boot a LOCK_BENCH=1 kernel under QEMU for every spinlock flavour and
+# hart count, and collect the lines lock_bench() prints.
+# usage: python3 scripts/lock_bench.py [flavour ...]
+
+FLAVOURS = ["tas", "ticket", "mcs"]
+HARTS = [1, 2, 4, 8]
+
+def run(flavour, cpus):
+    args = ["CPUS=%d" % cpus, "SPINLOCK=%s" % flavour, "LOCK_BENCH=1"]
+    # the flags are not part of the objects' dependencies
+    subprocess.run(["rm", "-rf", "build"], check=True)
+    subprocess.run(["make", "build/kernel"] + args, check=True, stdout=subprocess.DEVNULL)
+    qemu = subprocess.Popen(["make", "run"] + args, stdin=subprocess.DEVNULL,
+                            stdout=subprocess.PIPE, stderr=subprocess.STDOUT, text=True,
+                            start_new_session=True)
+    lines = []
+    try:
+        for line in qemu.stdout:
+            if "[lockbench]" in line:
+                lines.append(line.strip())
+                if len(lines) == 2:
+                    break
+    finally:
+        # make and the QEMU it started
+        os.killpg(qemu.pid, signal.SIGKILL)
+    return lines
+
+if __name__ == '__main__':
+    flavours = sys.argv[1:] or FLAVOURS
+    for flavour in flavours:
+        for cpus in HARTS:
+            for line in run(flavour, cpus):
+                print(line)
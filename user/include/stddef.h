@@ -50,6 +50,7 @@ typedef int pid_t;
 typedef __builtin_va_list va_list;
 
 // [NEW]
+#define SIGKILL   9
 #define SIGCHLD   17
 
 #define O_RDONLY 0x000
@@ -134,10 +135,45 @@ struct linux_dirent64 {
 #define MAP_FILE 0
 #define MAP_SHARED 0x01
 #define MAP_PRIVATE 0X02
+#define MAP_FIXED 0x10
+#define MAP_ANONYMOUS 0x20
+#define MAP_HUGETLB 0x40000
 #define MAP_FAILED ((void *) -1)
 
 // for clone
 #define SIGCHLD   17
+#define CLONE_VM             0x00000100
+#define CLONE_FS             0x00000200
+#define CLONE_FILES          0x00000400
+#define CLONE_SIGHAND        0x00000800
+#define CLONE_THREAD         0x00010000
+#define CLONE_SETTLS         0x00080000
+#define CLONE_PARENT_SETTID  0x00100000
+#define CLONE_CHILD_CLEARTID 0x00200000
+#define CLONE_CHILD_SETTID   0x01000000
+
+// for futex
+#define FUTEX_WAIT         0
+#define FUTEX_WAKE         1
+#define FUTEX_REQUEUE      3
+#define FUTEX_CMP_REQUEUE  4
+#define FUTEX_WAIT_BITSET  9
+#define FUTEX_WAKE_BITSET  10
+#define FUTEX_PRIVATE_FLAG 128
+
+struct timespec {
+        uint64 tv_sec;
+        uint64 tv_nsec;
+};
+
+// for sched_setscheduler
+#define SCHED_OTHER 0
+#define SCHED_FIFO  1
+#define SCHED_RR    2
+
+struct sched_param {
+        int sched_priority;
+};
 
 
 #endif // __STDDEF_H__
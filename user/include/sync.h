@@ -0,0 +1,30 @@
+#if !defined(__SYNC_H__)
+#define __SYNC_H__
+
+/*
+ * Mutexes and condition variables for threads sharing memory, built on
+ * futex(2): the uncontended paths never enter the kernel.
+ */
+
+typedef struct {
+    int val;    // 0 unlocked, 1 locked, 2 locked and maybe waited for
+} mutex_t;
+
+typedef struct {
+    int seq;            // bumped by every signal and broadcast
+    mutex_t *mutex;     // the mutex of the last waiter
+} cond_t;
+
+#define MUTEX_INITIALIZER {0}
+#define COND_INITIALIZER {0, 0}
+
+void mutex_lock(mutex_t *m);
+int mutex_trylock(mutex_t *m);
+void mutex_unlock(mutex_t *m);
+
+void cond_wait(cond_t *c, mutex_t *m);
+void cond_signal(cond_t *c);
+// must hold the mutex the waiters use
+void cond_broadcast(cond_t *c);
+
+#endif // __SYNC_H__
@@ -32,6 +32,8 @@ struct cpu_stat {
     uint64 uptime;
     uint64 sample_duration;
     uint64 sample_busy_duration;
+    uint64 idle_acquires;   // spinlocks acquired with nothing to run, ~0 without LOCKSTAT
+    uint64 idle_wakeups;    // returns from WFI
 };
 
 
@@ -50,5 +52,7 @@ struct proc_stat
     uint64 heap_sz;
     uint64 total_size;
     uint64 cpu_time; // ms, user and kernel
+    int last_cpu;    // hart it last ran on, -1 if none
+    uint64 nr_migrations; // runs on another hart than the run before
 };
 #endif // UCORE_DEFS_H
@@ -18,6 +18,8 @@ pid_t getpid(void);
 
 pid_t getppid(void);
 
+pid_t gettid(void);
+
 int open(const char *pathname, int flags);
 
 int mknod(const char *pathname, short major, short minor);
@@ -26,6 +28,22 @@ int dup(int oldfd);
 
 int sched_yield(void);
 
+int kill(pid_t pid, int sig);
+
+// a bit per hart in mask
+int sched_setaffinity(pid_t pid, size_t len, const uint64 *mask);
+
+int sched_getaffinity(pid_t pid, size_t len, uint64 *mask);
+
+int sched_setscheduler(pid_t pid, int policy, const struct sched_param *param);
+
+int sched_getscheduler(pid_t pid);
+
+int sched_rr_get_interval(pid_t pid, struct timespec *interval);
+
+// the SCHED_RR quantum is the same for every thread
+int sched_rr_set_interval(const struct timespec *interval);
+
 pid_t waitpid(pid_t pid, int *wstatus,int n);//temporary
 
 pid_t wait(int *wstatus);
@@ -40,6 +58,8 @@ uint64 time_ms();
 
 int sleep(unsigned long long time_in_ms);
 
+int usleep(unsigned long long us);
+
 int pipe(int pipefd[2]);
 
 int fstat(int fd, struct kstat *statbuf);
@@ -74,6 +94,8 @@ int openat(int fd, const char *pathname, int flags);
 
 int64 get_time();
 
+int64 get_time_us();
+
 int brk(void *addr);
 
 void *mmap(void *start, size_t len, int prot, int flags, int fd, off_t off);
@@ -82,12 +104,18 @@ int munmap(void *start, size_t len);
 
 pid_t clone(int (*fn)(void *arg), void *arg, size_t *stack, size_t stack_size, unsigned long flags);
 
+int futex(int *uaddr, int op, int val, const struct timespec *timeout, int *uaddr2, int val3);
+
 int execve(const char *name, char *const argv[], char *const argp[]);
 
 int waitpid(int pid, int *code, int options);
 
 int times(void *mytimes);
 
+int getrlimit(int resource, void *rlim);
+
+int setrlimit(int resource, const void *rlim);
+
 int uname(void *buf);
 
 #endif // UCORE_SYSCALL_H
@@ -21,8 +21,14 @@
 #define SYS_fstat 80 // todo
 #define SYS_exit 93 // todo
 #define SYS_waitpid 95
+#define SYS_futex 98
 #define SYS_nanosleep 101 // new
+#define SYS_sched_setscheduler 119
+#define SYS_sched_getscheduler 120
+#define SYS_sched_setaffinity 122
+#define SYS_sched_getaffinity 123
 #define SYS_sched_yield 124 // todo
+#define SYS_sched_rr_get_interval 127
 #define SYS_kill 129
 #define SYS_setpriority 140
 #define SYS_getpriority 141
@@ -32,6 +38,7 @@
 #define SYS_settimeofday 170
 #define SYS_getpid 172
 #define SYS_getppid 173
+#define SYS_gettid 178
 #define SYS_sysinfo 179
 #define SYS_brk 214 // todo
 #define SYS_munmap 215 // todo
@@ -44,6 +51,7 @@
 #define SYS_spawn 400
 #define SYS_mailread 401
 #define SYS_mailwrite 402
+#define SYS_sched_rr_set_interval 403
 
 
 
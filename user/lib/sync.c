@@ -0,0 +1,66 @@
+#include <stddef.h>
+#include <ucore.h>
+#include <sync.h>
+
+static int cmpxchg(int *p, int old, int new) {
+    __atomic_compare_exchange_n(p, &old, new, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+    return old;
+}
+
+// Lock m marking it contended, for those who slept on it.
+static void mutex_lock_contended(mutex_t *m) {
+    while (__atomic_exchange_n(&m->val, 2, __ATOMIC_ACQUIRE) != 0) {
+        futex(&m->val, FUTEX_WAIT | FUTEX_PRIVATE_FLAG, 2, NULL, NULL, 0);
+    }
+}
+
+void mutex_lock(mutex_t *m) {
+    int c = cmpxchg(&m->val, 0, 1);
+    if (c == 0)
+        return;
+    // announce a waiter unless there is one already
+    if (c != 2 && __atomic_exchange_n(&m->val, 2, __ATOMIC_ACQUIRE) == 0)
+        return;
+    mutex_lock_contended(m);
+}
+
+int mutex_trylock(mutex_t *m) {
+    return cmpxchg(&m->val, 0, 1) == 0 ? 0 : -1;
+}
+
+void mutex_unlock(mutex_t *m) {
+    if (__atomic_fetch_sub(&m->val, 1, __ATOMIC_RELEASE) != 1) {
+        // 2, somebody may be sleeping
+        __atomic_store_n(&m->val, 0, __ATOMIC_RELEASE);
+        futex(&m->val, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, 1, NULL, NULL, 0);
+    }
+}
+
+void cond_wait(cond_t *c, mutex_t *m) {
+    int seq = __atomic_load_n(&c->seq, __ATOMIC_RELAXED);
+    c->mutex = m;
+    mutex_unlock(m);
+    // returns at once if a signal came after the unlock
+    futex(&c->seq, FUTEX_WAIT | FUTEX_PRIVATE_FLAG, seq, NULL, NULL, 0);
+    // we may have been requeued onto m, whoever unlocks it must wake the rest
+    mutex_lock_contended(m);
+}
+
+void cond_signal(cond_t *c) {
+    __atomic_fetch_add(&c->seq, 1, __ATOMIC_RELEASE);
+    futex(&c->seq, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, 1, NULL, NULL, 0);
+}
+
+void cond_broadcast(cond_t *c) {
+    __atomic_fetch_add(&c->seq, 1, __ATOMIC_RELEASE);
+    mutex_t *m = c->mutex;
+    if (m == NULL)
+        return;     // nobody has ever waited
+    // wake one and move the others onto the mutex, they would only
+    // fight for it otherwise. A waiter not asleep yet sees seq changed.
+    // The caller holds m, marking it contended makes its unlock wake the
+    // next of them.
+    cmpxchg(&m->val, 1, 2);
+    futex(&c->seq, FUTEX_REQUEUE | FUTEX_PRIVATE_FLAG, 1, (const struct timespec *)INT_MAX,
+          &m->val, 0);
+}
@@ -39,6 +39,11 @@ pid_t getppid(void)
     return syscall(SYS_getppid);
 }
 
+pid_t gettid(void)
+{
+    return syscall(SYS_gettid);
+}
+
 int open(const char *path, int flags)
 {
     return syscall(SYS_openat, AT_FDCWD, path, flags, O_RDWR);
@@ -59,6 +64,41 @@ int sched_yield(void)
     return syscall(SYS_sched_yield);
 }
 
+int kill(pid_t pid, int sig)
+{
+    return syscall(SYS_kill, pid, sig);
+}
+
+int sched_setaffinity(pid_t pid, size_t len, const uint64 *mask)
+{
+    return syscall(SYS_sched_setaffinity, pid, len, mask);
+}
+
+int sched_getaffinity(pid_t pid, size_t len, uint64 *mask)
+{
+    return syscall(SYS_sched_getaffinity, pid, len, mask);
+}
+
+int sched_setscheduler(pid_t pid, int policy, const struct sched_param *param)
+{
+    return syscall(SYS_sched_setscheduler, pid, policy, param);
+}
+
+int sched_getscheduler(pid_t pid)
+{
+    return syscall(SYS_sched_getscheduler, pid);
+}
+
+int sched_rr_get_interval(pid_t pid, struct timespec *interval)
+{
+    return syscall(SYS_sched_rr_get_interval, pid, interval);
+}
+
+int sched_rr_set_interval(const struct timespec *interval)
+{
+    return syscall(SYS_sched_rr_set_interval, interval);
+}
+
 pid_t waitpid(pid_t pid, int *wstatus,int n) //temporary
 {
     return syscall(SYS_wait4, pid, wstatus, n, 0);
@@ -92,6 +132,12 @@ int sleep(unsigned long long time)
     return 0;
 }
 
+int usleep(unsigned long long us)
+{
+    TimeVal tv = {.sec = us / 1000000, .usec = us % 1000000};
+    return syscall(SYS_nanosleep, &tv, 0);
+}
+
 int pipe(int pipefd[2])
 {
     return syscall(SYS_pipe2, pipefd, 0);
@@ -187,14 +233,12 @@ int brk(void *addr)
 
 void *mmap(void *start, size_t len, int prot, int flags, int fd, off_t off)
 {
-    return 0;
-    // return syscall(SYS_mmap, start, len, prot, flags, fd, off);
+    return (void *)syscall(SYS_mmap, start, len, prot, flags, fd, off);
 }
 
 int munmap(void *start, size_t len)
 {
-    return 0;
-    // return syscall(SYS_munmap, start, len);
+    return syscall(SYS_munmap, start, len);
 }
 
 pid_t clone(int (*fn)(void *arg), void *arg, size_t *stack, size_t stack_size, unsigned long flags)
@@ -206,6 +250,11 @@ pid_t clone(int (*fn)(void *arg), void *arg, size_t *stack, size_t stack_size, u
     //return syscall(SYS_clone, fn, stack, flags, NULL, NULL, NULL);
 }
 
+int futex(int *uaddr, int op, int val, const struct timespec *timeout, int *uaddr2, int val3)
+{
+    return syscall(SYS_futex, uaddr, op, val, timeout, uaddr2, val3);
+}
+
 int execve(const char *name, char *const argv[], char *const argp[])
 {
      return syscall(SYS_execve, name, argv, argp);
@@ -216,6 +265,16 @@ int times(void *mytimes)
     return syscall(SYS_times, mytimes);
 }
 
+int getrlimit(int resource, void *rlim)
+{
+    return syscall(SYS_prlimit64, 0, resource, NULL, rlim);
+}
+
+int setrlimit(int resource, const void *rlim)
+{
+    return syscall(SYS_prlimit64, 0, resource, rlim, NULL);
+}
+
 int sys_get_time(TimeVal *ts, int tz)
 {
     return syscall(SYS_gettimeofday, ts, tz);
@@ -235,6 +294,20 @@ int64 get_time()
     }
 }
 
+int64 get_time_us()
+{
+    TimeVal time;
+    int err = sys_get_time(&time, 0);
+    if (err == 0)
+    {
+        return time.sec * 1000000 + time.usec;
+    }
+    else
+    {
+        return -1;
+    }
+}
+
 int uname(void *buf)
 {
     return syscall(SYS_uname, buf);
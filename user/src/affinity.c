@@ -0,0 +1,72 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "ucore.h"
+
+/*
+ * CPU 亲和性：sched_setaffinity 把线程限制在掩码中的 hart 上运行，
+ * /dev/proc 报告每个进程最后运行的 hart 和迁移次数。
+ * 测试通过时应输出：
+ * "  getaffinity: ok"
+ * "  pinned to hart [num]: ok"
+ * "  empty mask: rejected"
+ * "  migrations while pinned: 0"
+ */
+#define MAX_PROCS 64
+
+static struct proc_stat stats[MAX_PROCS];
+
+static struct proc_stat *my_stat(void) {
+    int fd = open("/dev/proc", O_RDONLY);
+    assert(fd >= 0);
+    int n = read(fd, stats, sizeof(stats));
+    assert(n > 0);
+    close(fd);
+    for (int i = 0; i < n / (int)sizeof(struct proc_stat); i++) {
+        if (stats[i].pid == gettid())
+            return &stats[i];
+    }
+    return NULL;
+}
+
+void test_affinity(void) {
+    TEST_START(__func__);
+    uint64 all = 0;
+    assert(sched_getaffinity(0, sizeof(all), &all) == sizeof(all));
+    assert(all != 0);
+    printf("  getaffinity: ok\n");
+
+    // the first hart in the mask that runs the scheduler
+    int hart = -1;
+    for (int i = 0; i < 64 && hart < 0; i++) {
+        uint64 one = 1ULL << i;
+        if ((all & one) && sched_setaffinity(0, sizeof(one), &one) == 0)
+            hart = i;
+    }
+    assert(hart >= 0);
+    uint64 mask = 0;
+    assert(sched_getaffinity(getpid(), sizeof(mask), &mask) == sizeof(mask));
+    assert(mask == 1ULL << hart);
+    struct proc_stat *st = my_stat();
+    assert(st != NULL && st->last_cpu == hart);
+    printf("  pinned to hart %d: ok\n", hart);
+
+    uint64 none = 0;
+    assert(sched_setaffinity(0, sizeof(none), &none) == -1);
+    printf("  empty mask: rejected\n");
+
+    uint64 before = st->nr_migrations;
+    for (int i = 0; i < 100; i++) {
+        sched_yield();
+    }
+    st = my_stat();
+    assert(st != NULL && st->last_cpu == hart);
+    printf("  migrations while pinned: %l\n", st->nr_migrations - before);
+
+    assert(sched_setaffinity(0, sizeof(all), &all) == 0);
+    TEST_END(__func__);
+}
+
+int main(void) {
+    test_affinity();
+    return 0;
+}
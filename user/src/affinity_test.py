@@ -0,0 +1,12 @@
+from test_base import TestBase
+
+
+class affinity_test(TestBase):
+    def __init__(self):
+        super().__init__("affinity", 4)
+
+    def test(self, data):
+        self.assert_in_str(r"  getaffinity: ok", data)
+        self.assert_in_str(r"  pinned to hart \d+: ok", data)
+        self.assert_in_str(r"  empty mask: rejected", data)
+        self.assert_in_str(r"  migrations while pinned: 0", data)
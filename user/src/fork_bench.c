@@ -0,0 +1,56 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "ucore.h"
+#include "string.h"
+
+/*
+ * 测量 fork 的延迟：父进程先用 brk 把堆扩大到指定大小并写满，
+ * 再反复 fork + wait，子进程立即退出。
+ * 输出形如：
+ * "  fork latency with 1024 KiB heap: [num] us"
+ * "  fork latency with 65536 KiB heap: [num] us"
+ */
+#define ROUNDS 16
+#define PAGE_SIZE 4096
+
+static int64 fork_latency(int64 heap_bytes) {
+    intptr_t base = brk(0);
+    if (brk((void *)(base + heap_bytes)) != base + heap_bytes) {
+        printf("  brk failed\n");
+        return -1;
+    }
+    // touch every page so that the parent really owns the memory
+    for (int64 off = 0; off < heap_bytes; off += PAGE_SIZE) {
+        ((char *)base)[off] = (char)off;
+    }
+
+    int64 start = get_time_us();
+    for (int i = 0; i < ROUNDS; i++) {
+        int wstatus;
+        int cpid = fork();
+        assert(cpid != -1);
+        if (cpid == 0) {
+            exit(0);
+        }
+        wait(&wstatus);
+    }
+    int64 duration = get_time_us() - start;
+
+    brk((void *)base);
+    return duration / ROUNDS;
+}
+
+void test_fork_bench(void) {
+    TEST_START(__func__);
+    int64 sizes[] = {1 << 20, 64 << 20};
+    for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        int64 us = fork_latency(sizes[i]);
+        printf("  fork latency with %l KiB heap: %l us\n", sizes[i] >> 10, us);
+    }
+    TEST_END(__func__);
+}
+
+int main(void) {
+    test_fork_bench();
+    return 0;
+}
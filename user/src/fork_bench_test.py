@@ -0,0 +1,10 @@
+from test_base import TestBase
+
+
+class fork_bench_test(TestBase):
+    def __init__(self):
+        super().__init__("fork_bench", 2)
+
+    def test(self, data):
+        self.assert_in_str(r"  fork latency with 1024 KiB heap: \d+ us", data)
+        self.assert_in_str(r"  fork latency with 65536 KiB heap: \d+ us", data)
@@ -0,0 +1,116 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "ucore.h"
+#include "sync.h"
+
+/*
+ * futex：NTHREAD 个线程在条件变量上等待开始信号（broadcast 会把等待者
+ * requeue 到互斥锁上），然后争抢同一把锁给共享计数器加一。分别用基于
+ * futex 的互斥锁和用 sched_yield 自旋的锁测一遍，线程退出时由
+ * CLONE_CHILD_CLEARTID 的 futex 唤醒汇合。
+ * 测试通过时应输出：
+ * "  futex mutex counter: ok"
+ * "  yield lock counter: ok"
+ * "  futex mutex: [num] us"
+ * "  yield lock: [num] us"
+ */
+#define NTHREAD 4
+#define ROUNDS 2000
+#define STACK_SIZE 4096
+#define THREAD_FLAGS (CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_SIGHAND | CLONE_THREAD | \
+                      CLONE_PARENT_SETTID | CLONE_CHILD_CLEARTID)
+
+static char stacks[NTHREAD][STACK_SIZE] __attribute__((aligned(16)));
+static int tids[NTHREAD];
+
+static mutex_t start_lock = MUTEX_INITIALIZER;
+static cond_t start_cond = COND_INITIALIZER;
+static int started;
+
+static mutex_t mutex = MUTEX_INITIALIZER;
+static int yield_lock;
+static volatile int counter;
+
+static void yield_acquire(void) {
+    while (__atomic_exchange_n(&yield_lock, 1, __ATOMIC_ACQUIRE) != 0) {
+        sched_yield();
+    }
+}
+
+static void yield_release(void) {
+    __atomic_store_n(&yield_lock, 0, __ATOMIC_RELEASE);
+}
+
+static void wait_start(void) {
+    mutex_lock(&start_lock);
+    while (!started) {
+        cond_wait(&start_cond, &start_lock);
+    }
+    mutex_unlock(&start_lock);
+}
+
+static int futex_worker(void *arg) {
+    wait_start();
+    for (int i = 0; i < ROUNDS; i++) {
+        mutex_lock(&mutex);
+        counter = counter + 1;
+        mutex_unlock(&mutex);
+    }
+    return 0;
+}
+
+static int yield_worker(void *arg) {
+    wait_start();
+    for (int i = 0; i < ROUNDS; i++) {
+        yield_acquire();
+        counter = counter + 1;
+        yield_release();
+    }
+    return 0;
+}
+
+// sleep until the kernel clears tids[i] on thread exit
+static void join(int i) {
+    int tid;
+    while ((tid = __atomic_load_n(&tids[i], __ATOMIC_ACQUIRE)) != 0) {
+        futex(&tids[i], FUTEX_WAIT, tid, NULL, NULL, 0);
+    }
+}
+
+static int64 run(int (*worker)(void *)) {
+    counter = 0;
+    started = 0;
+    for (int i = 0; i < NTHREAD; i++) {
+        assert(__clone(worker, stacks[i] + STACK_SIZE, THREAD_FLAGS, NULL,
+                       &tids[i], NULL, &tids[i]) > 0);
+    }
+    int64 start = get_time_us();
+    mutex_lock(&start_lock);
+    started = 1;
+    cond_broadcast(&start_cond);
+    mutex_unlock(&start_lock);
+    for (int i = 0; i < NTHREAD; i++) {
+        join(i);
+    }
+    return get_time_us() - start;
+}
+
+void test_futex_bench(void) {
+    TEST_START(__func__);
+    int64 futex_us = run(futex_worker);
+    if (counter == NTHREAD * ROUNDS) {
+        printf("  futex mutex counter: ok\n");
+    }
+    int64 yield_us = run(yield_worker);
+    if (counter == NTHREAD * ROUNDS) {
+        printf("  yield lock counter: ok\n");
+    }
+    printf("  futex mutex: %l us\n", futex_us);
+    printf("  yield lock: %l us\n", yield_us);
+    TEST_END(__func__);
+}
+
+int main(void) {
+    test_futex_bench();
+    return 0;
+}
@@ -0,0 +1,12 @@
+from test_base import TestBase
+
+
+class futex_bench_test(TestBase):
+    def __init__(self):
+        super().__init__("futex_bench", 4)
+
+    def test(self, data):
+        self.assert_in_str("  futex mutex counter: ok", data)
+        self.assert_in_str("  yield lock counter: ok", data)
+        self.assert_in_str(r"  futex mutex: \d+ us", data)
+        self.assert_in_str(r"  yield lock: \d+ us", data)
@@ -0,0 +1,94 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "ucore.h"
+
+/*
+ * 2MB 大页：比较 32 个 1MB 映射（小于大页，只能用 4KB 页）与一个
+ * 32MB MAP_HUGETLB 映射上按页跨步访问的耗时，并检查大页在 fork 后
+ * 写时复制、以及部分 munmap 时的拆分。
+ * 测试通过时应输出：
+ * "  huge mapping aligned: ok"
+ * "  fork copy-on-write: ok"
+ * "  partial munmap: ok"
+ * "  4K pages: [num] us"
+ * "  2M pages: [num] us"
+ */
+#define PAGE_SIZE 4096
+#define HUGE_SIZE (2 * 1024 * 1024)
+#define TOTAL (32 * 1024 * 1024)
+#define SMALL (1024 * 1024)
+#define ROUNDS 16
+
+static char *map_anon(size_t len, int flags) {
+    return mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+}
+
+// read one byte of every page, the loop is bound by TLB misses
+static int64 stride(char **bases, int nbase, size_t len) {
+    int64 start = get_time_us();
+    int sum = 0;
+    for (int r = 0; r < ROUNDS; r++) {
+        for (size_t off = 0; off < len; off += PAGE_SIZE) {
+            for (int b = 0; b < nbase; b++) {
+                sum += bases[b][off];
+            }
+        }
+    }
+    assert(sum == ROUNDS * nbase * (int)(len / PAGE_SIZE));
+    return get_time_us() - start;
+}
+
+static void touch(char *base, size_t len) {
+    for (size_t off = 0; off < len; off += PAGE_SIZE) {
+        base[off] = 1;
+    }
+}
+
+void test_hugepage(void) {
+    TEST_START(__func__);
+    char *huge = map_anon(TOTAL, MAP_HUGETLB);
+    assert(huge != MAP_FAILED);
+    assert((uint64)huge % HUGE_SIZE == 0);
+    touch(huge, TOTAL);
+    printf("  huge mapping aligned: ok\n");
+
+    int pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        huge[0] = 2;
+        huge[HUGE_SIZE + PAGE_SIZE] = 3;
+        assert(huge[PAGE_SIZE] == 1);
+        exit(0);
+    }
+    int code;
+    assert(waitpid(pid, &code, 0) == pid && code == 0);
+    assert(huge[0] == 1 && huge[HUGE_SIZE + PAGE_SIZE] == 1);
+    printf("  fork copy-on-write: ok\n");
+
+    char *small[TOTAL / SMALL];
+    for (int i = 0; i < TOTAL / SMALL; i++) {
+        small[i] = map_anon(SMALL, 0);
+        assert(small[i] != MAP_FAILED);
+        touch(small[i], SMALL);
+    }
+    int64 t4k = stride(small, TOTAL / SMALL, SMALL);
+    int64 t2m = stride(&huge, 1, TOTAL);
+    for (int i = 0; i < TOTAL / SMALL; i++) {
+        assert(munmap(small[i], SMALL) == 0);
+    }
+
+    // a hole in the middle of a huge page splits it
+    assert(munmap(huge + HUGE_SIZE + PAGE_SIZE, PAGE_SIZE) == 0);
+    assert(huge[HUGE_SIZE] == 1 && huge[HUGE_SIZE + 2 * PAGE_SIZE] == 1);
+    assert(munmap(huge, TOTAL) == 0);
+    printf("  partial munmap: ok\n");
+
+    printf("  4K pages: %l us\n", t4k);
+    printf("  2M pages: %l us\n", t2m);
+    TEST_END(__func__);
+}
+
+int main(void) {
+    test_hugepage();
+    return 0;
+}
@@ -0,0 +1,13 @@
+from test_base import TestBase
+
+
+class hugepage_bench_test(TestBase):
+    def __init__(self):
+        super().__init__("hugepage_bench", 5)
+
+    def test(self, data):
+        self.assert_in_str(r"  huge mapping aligned: ok", data)
+        self.assert_in_str(r"  fork copy-on-write: ok", data)
+        self.assert_in_str(r"  partial munmap: ok", data)
+        self.assert_in_str(r"  4K pages: \d+ us", data)
+        self.assert_in_str(r"  2M pages: \d+ us", data)
@@ -0,0 +1,57 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "ucore.h"
+
+/*
+ * 空闲的 hart 在 WFI 中等待，定时器只设到下一个到期时刻，
+ * 有任务入队时由 IPI 唤醒。睡眠期间统计每个 hart 的加锁次数，
+ * 只有 LOCKSTAT=1 的内核才统计。
+ * 测试通过时应输出：
+ * "  sleep on idle harts: ok"
+ * "  hart [num]: [num] idle lock acquisitions, [num] wakeups in 1 s"
+ * 或者（LOCKSTAT=0）
+ * "  hart [num]: idle lock acquisitions not counted without LOCKSTAT, [num] wakeups in 1 s"
+ */
+#define MAX_HARTS 8
+
+static struct cpu_stat before[MAX_HARTS];
+static struct cpu_stat after[MAX_HARTS];
+
+static int read_stat(struct cpu_stat *stat) {
+    int fd = open("/dev/cpu", O_RDONLY);
+    assert(fd >= 0);
+    int n = read(fd, stat, sizeof(struct cpu_stat) * MAX_HARTS);
+    assert(n > 0);
+    close(fd);
+    return n / sizeof(struct cpu_stat);
+}
+
+void test_idle_stat(void) {
+    TEST_START(__func__);
+    int harts = read_stat(before);
+    int64 start = get_time_us();
+    // every other hart has nothing to do for a second
+    assert(sleep(1) == 0);
+    int64 slept = get_time_us() - start;
+    assert(read_stat(after) == harts);
+    assert(slept >= 1000000);
+    printf("  sleep on idle harts: ok\n");
+
+    // hart 0 does not schedule
+    for (int i = 1; i < harts; i++) {
+        uint64 wakeups = after[i].idle_wakeups - before[i].idle_wakeups;
+        if (after[i].idle_acquires == ~0ULL) {
+            printf("  hart %d: idle lock acquisitions not counted without LOCKSTAT, %l wakeups in 1 s\n",
+                   i, wakeups);
+        } else {
+            printf("  hart %d: %l idle lock acquisitions, %l wakeups in 1 s\n", i,
+                   after[i].idle_acquires - before[i].idle_acquires, wakeups);
+        }
+    }
+    TEST_END(__func__);
+}
+
+int main(void) {
+    test_idle_stat();
+    return 0;
+}
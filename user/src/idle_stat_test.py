@@ -0,0 +1,10 @@
+from test_base import TestBase
+
+
+class idle_stat_test(TestBase):
+    def __init__(self):
+        super().__init__("idle_stat", 2)
+
+    def test(self, data):
+        self.assert_in_str(r"  sleep on idle harts: ok", data)
+        self.assert_in_str(r"  hart \d+: (\d+ idle lock acquisitions|idle lock acquisitions not counted without LOCKSTAT), \d+ wakeups in 1 s", data)
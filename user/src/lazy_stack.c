@@ -0,0 +1,79 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "ucore.h"
+
+/*
+ * 栈和堆按需分配：brk 只预留地址空间，第一次访问时才分配清零的物理页；
+ * 栈超过 RLIMIT_STACK 后会碰到保护页，进程被杀死。
+ * 测试通过时应输出：
+ * "  brk 65536 KiB: ok"
+ * "  stack 1024 KiB: ok"
+ * "  stack overflow: killed"
+ */
+#define PAGE_SIZE 4096
+#define RLIMIT_STACK 3
+
+struct rlimit {
+    uint64 rlim_cur;
+    uint64 rlim_max;
+};
+
+// every frame touches one page of stack
+static int grow_stack(int depth) {
+    volatile char frame[PAGE_SIZE];
+    frame[0] = (char)depth;
+    if (depth == 0) {
+        return frame[0];
+    }
+    return grow_stack(depth - 1) + frame[0];
+}
+
+static void test_lazy_heap(void) {
+    int64 size = 64 << 20;
+    intptr_t base = brk(0);
+    assert(brk((void *)(base + size)) == base + size);
+    // fresh heap pages read as zero, no matter where they are touched first
+    char *last = (char *)(base + size - PAGE_SIZE);
+    assert(*last == 0);
+    last[1] = 1;
+    assert(last[1] == 1);
+    assert(((char *)base)[0] == 0);
+    brk((void *)base);
+    printf("  brk %l KiB: ok\n", size >> 10);
+}
+
+static void test_lazy_stack(void) {
+    grow_stack(256);
+    printf("  stack %d KiB: ok\n", 256 * PAGE_SIZE >> 10);
+}
+
+static void test_stack_overflow(void) {
+    int wstatus = 0;
+    int cpid = fork();
+    assert(cpid != -1);
+    if (cpid == 0) {
+        struct rlimit limit = {64 * 1024, 64 * 1024};
+        assert(setrlimit(RLIMIT_STACK, &limit) == 0);
+        grow_stack(64);
+        // should not get here
+        exit(0);
+    }
+    assert(wait(&wstatus) == cpid);
+    printf("  stack overflow: %s\n", wstatus != 0 ? "killed" : "not caught");
+}
+
+void test_lazy_stack_heap(void) {
+    TEST_START(__func__);
+    struct rlimit limit;
+    assert(getrlimit(RLIMIT_STACK, &limit) == 0);
+    assert(limit.rlim_cur >= 1024 * 1024);
+    test_lazy_heap();
+    test_lazy_stack();
+    test_stack_overflow();
+    TEST_END(__func__);
+}
+
+int main(void) {
+    test_lazy_stack_heap();
+    return 0;
+}
@@ -0,0 +1,11 @@
+from test_base import TestBase
+
+
+class lazy_stack_test(TestBase):
+    def __init__(self):
+        super().__init__("lazy_stack", 3)
+
+    def test(self, data):
+        self.assert_in_str(r"  brk 65536 KiB: ok", data)
+        self.assert_in_str(r"  stack 1024 KiB: ok", data)
+        self.assert_in_str(r"  stack overflow: killed", data)
@@ -0,0 +1,73 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "ucore.h"
+
+/*
+ * 大量 mmap 区域：映射远多于 128 个的匿名区域，隔一个释放一个，
+ * 再用 MAP_FIXED 填回空洞，并在一个区域中间 munmap 把它拆成两半。
+ * 测试通过时应输出：
+ * "  mapped 1024 regions"
+ * "  fixed mapping reused the hole"
+ * "  split mapping: ok"
+ * "  mmap+munmap of 256 pages: [num] us"
+ */
+#define PAGE_SIZE 4096
+#define NREGION 1024
+#define BIG_PAGES 256
+
+static char *regions[NREGION];
+
+static char *map_anon(void *addr, size_t len, int flags) {
+    return mmap(addr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+}
+
+void test_mmap_many(void) {
+    TEST_START(__func__);
+    for (int i = 0; i < NREGION; i++) {
+        regions[i] = map_anon(NULL, PAGE_SIZE, 0);
+        assert(regions[i] != MAP_FAILED);
+    }
+    for (int i = 1; i < NREGION; i += 2) {
+        regions[i][0] = (char)i;
+    }
+    printf("  mapped %d regions\n", NREGION);
+
+    for (int i = 0; i < NREGION; i += 2) {
+        assert(munmap(regions[i], PAGE_SIZE) == 0);
+    }
+    char *hole = regions[NREGION / 2];
+    char *p = map_anon(hole, PAGE_SIZE, MAP_FIXED);
+    assert(p == hole && p[0] == 0);
+    p[0] = 1;
+    printf("  fixed mapping reused the hole\n");
+
+    char *big = map_anon(NULL, 3 * PAGE_SIZE, 0);
+    assert(big != MAP_FAILED);
+    big[0] = 1;
+    big[2 * PAGE_SIZE] = 3;
+    assert(munmap(big + PAGE_SIZE, PAGE_SIZE) == 0);
+    assert(big[0] == 1 && big[2 * PAGE_SIZE] == 3);
+    assert(munmap(big, 3 * PAGE_SIZE) == 0);
+    assert(munmap(big, 3 * PAGE_SIZE) == -1);
+    printf("  split mapping: ok\n");
+
+    int64 start = get_time_us();
+    for (int i = 0; i < 16; i++) {
+        char *q = map_anon(NULL, BIG_PAGES * PAGE_SIZE, 0);
+        assert(q != MAP_FAILED);
+        assert(munmap(q, BIG_PAGES * PAGE_SIZE) == 0);
+    }
+    printf("  mmap+munmap of %d pages: %l us\n", BIG_PAGES, (get_time_us() - start) / 16);
+
+    for (int i = 1; i < NREGION; i += 2) {
+        assert(regions[i][0] == (char)i);
+        munmap(regions[i], PAGE_SIZE);
+    }
+    munmap(hole, PAGE_SIZE);
+    TEST_END(__func__);
+}
+
+int main(void) {
+    test_mmap_many();
+    return 0;
+}
@@ -0,0 +1,12 @@
+from test_base import TestBase
+
+
+class mmap_many_test(TestBase):
+    def __init__(self):
+        super().__init__("mmap_many", 4)
+
+    def test(self, data):
+        self.assert_in_str(r"  mapped 1024 regions", data)
+        self.assert_in_str(r"  fixed mapping reused the hole", data)
+        self.assert_in_str(r"  split mapping: ok", data)
+        self.assert_in_str(r"  mmap\+munmap of 256 pages: \d+ us", data)
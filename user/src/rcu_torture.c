@@ -0,0 +1,165 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "ucore.h"
+#include "string.h"
+
+/*
+ * RCU 压力测试，用 make run CPUS=8 运行：NREADER 个读者反复按路径打开
+ * 文件并检查内容是否属于这个路径，遍历 /dev/proc 并检查每一项；同时
+ * NCHURN 个进程不停地 fork 再回收子进程、创建再删除文件，让进程槽、
+ * 地址空间和 inode 槽被无锁的读者看着时释放和重用。
+ * 测试通过时应输出：
+ * "  rcu torture on [num] harts"
+ * "  path lookups: ok"
+ * "  /dev/proc walks: ok"
+ * "  churn: ok"
+ */
+#define NFILE 8
+#define NREADER 4
+#define NCHURN 4
+#define ROUNDS 200
+#define MAX_PROCS 64
+
+#define FAIL_LOOKUP 1
+#define FAIL_PROC 2
+#define FAIL_CHURN 4
+
+static struct proc_stat stats[MAX_PROCS];
+
+static void file_name(char *buf, const char *prefix, int i) {
+    strcpy(buf, prefix);
+    int n = strlen(buf);
+    buf[n] = '0' + i / 10;
+    buf[n + 1] = '0' + i % 10;
+    buf[n + 2] = '\0';
+}
+
+// Write a file whose every byte is tag.
+static int make_file(const char *name, char tag) {
+    char data[64];
+    memset(data, tag, sizeof(data));
+    int fd = open(name, O_CREATE | O_RDWR);
+    if (fd < 0)
+        return -1;
+    int ok = write(fd, data, sizeof(data)) == sizeof(data);
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+// Whether name opens a file whose bytes are all tag.
+static int check_file(const char *name, char tag) {
+    char data[64];
+    int fd = open(name, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    int n = read(fd, data, sizeof(data));
+    close(fd);
+    if (n != sizeof(data))
+        return -1;
+    for (int i = 0; i < n; i++) {
+        if (data[i] != tag)
+            return -1;
+    }
+    return 0;
+}
+
+// Every slot /dev/proc reports is in use and the caller is among them.
+static int check_procs(void) {
+    int fd = open("/dev/proc", O_RDONLY);
+    if (fd < 0)
+        return -1;
+    int n = read(fd, stats, sizeof(stats));
+    close(fd);
+    if (n <= 0 || n % (int)sizeof(struct proc_stat) != 0)
+        return -1;
+    int me = 0;
+    for (int i = 0; i < n / (int)sizeof(struct proc_stat); i++) {
+        if (stats[i].pid <= 0 || stats[i].state == 0)
+            return -1;
+        if (stats[i].pid == getpid())
+            me = 1;
+    }
+    return me ? 0 : -1;
+}
+
+static int reader(int id) {
+    char name[32];
+    int fail = 0;
+    for (int r = 0; r < ROUNDS; r++) {
+        int i = (r + id) % NFILE;
+        file_name(name, "./rcu_torture_", i);
+        if (check_file(name, 'a' + i) < 0)
+            fail |= FAIL_LOOKUP;
+        if (r % 4 == 0 && check_procs() < 0)
+            fail |= FAIL_PROC;
+    }
+    return fail;
+}
+
+static int churner(int id) {
+    char name[32];
+    file_name(name, "./rcu_churn_", id);
+    int fail = 0;
+    for (int r = 0; r < ROUNDS / 4; r++) {
+        int pid = fork();
+        if (pid == 0)
+            exit(0);
+        int wstatus;
+        if (pid < 0 || waitpid(pid, &wstatus, 0) != pid)
+            fail |= FAIL_CHURN;
+        // a new file under a new path each round, so that its inode
+        // slot is freed and taken again while readers look up theirs
+        if (make_file(name, 'A' + r % 26) < 0 || check_file(name, 'A' + r % 26) < 0)
+            fail |= FAIL_CHURN;
+        if (unlink(name) < 0)
+            fail |= FAIL_CHURN;
+    }
+    return fail;
+}
+
+void test_rcu_torture(void) {
+    TEST_START(__func__);
+    uint64 harts = 0;
+    assert(sched_getaffinity(0, sizeof(harts), &harts) == sizeof(harts));
+    int nharts = 0;
+    for (; harts; harts &= harts - 1)
+        nharts++;
+    printf("  rcu torture on %d harts\n", nharts);
+
+    char name[32];
+    for (int i = 0; i < NFILE; i++) {
+        file_name(name, "./rcu_torture_", i);
+        assert(make_file(name, 'a' + i) == 0);
+    }
+
+    for (int i = 0; i < NREADER + NCHURN; i++) {
+        int pid = fork();
+        assert(pid != -1);
+        if (pid == 0) {
+            exit(i < NREADER ? reader(i) : churner(i - NREADER));
+        }
+    }
+    int fail = 0;
+    for (int i = 0; i < NREADER + NCHURN; i++) {
+        int wstatus;
+        assert(wait(&wstatus) > 0);
+        fail |= (wstatus >> 8) & 0xff;
+    }
+
+    if (!(fail & FAIL_LOOKUP))
+        printf("  path lookups: ok\n");
+    if (!(fail & FAIL_PROC))
+        printf("  /dev/proc walks: ok\n");
+    if (!(fail & FAIL_CHURN))
+        printf("  churn: ok\n");
+    for (int i = 0; i < NFILE; i++) {
+        file_name(name, "./rcu_torture_", i);
+        unlink(name);
+    }
+    TEST_END(__func__);
+}
+
+int main(void) {
+    test_rcu_torture();
+    return 0;
+}
@@ -0,0 +1,12 @@
+from test_base import TestBase
+
+
+class rcu_torture_test(TestBase):
+    def __init__(self):
+        super().__init__("rcu_torture", 4)
+
+    def test(self, data):
+        self.assert_in_str(r"  rcu torture on \d+ harts", data)
+        self.assert_in_str("  path lookups: ok", data)
+        self.assert_in_str("  /dev/proc walks: ok", data)
+        self.assert_in_str("  churn: ok", data)
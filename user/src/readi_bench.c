@@ -0,0 +1,85 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "ucore.h"
+#include "string.h"
+
+/*
+ * 并行 readi：先写一个 FILE_SIZE 字节的文件，再让 1 个和 NCHILD 个进程
+ * 各自打开它，以 CHUNK 字节为单位反复读完 ROUNDS 次。所有读者都在同一个
+ * inode 的睡眠锁和同一批页缓存锁上竞争，临界区比一次上下文切换还短。
+ * 测试通过时应输出：
+ * "  readi data: ok"
+ * "  readi with 1 procs: [num] us per 1000 reads"
+ * "  readi with 4 procs: [num] us per 1000 reads"
+ */
+#define FILE_NAME "./readi_bench.txt"
+#define FILE_SIZE 16384
+#define CHUNK 256
+#define ROUNDS 8
+#define NCHILD 4
+
+static char buf[FILE_SIZE];
+
+static int read_all(void) {
+    for (int r = 0; r < ROUNDS; r++) {
+        int fd = open(FILE_NAME, O_RDONLY);
+        if (fd < 0)
+            return -1;
+        char chunk[CHUNK];
+        for (int off = 0; off < FILE_SIZE; off += CHUNK) {
+            if (read(fd, chunk, CHUNK) != CHUNK || chunk[0] != (char)(off / CHUNK)) {
+                close(fd);
+                return -1;
+            }
+        }
+        close(fd);
+    }
+    return 0;
+}
+
+// us per 1000 reads with nproc readers at once, -1 if one read wrong data
+static int64 run(int nproc) {
+    int ok = 1;
+    int64 start = get_time_us();
+    for (int i = 0; i < nproc; i++) {
+        int pid = fork();
+        assert(pid != -1);
+        if (pid == 0) {
+            exit(read_all() == 0 ? 0 : 1);
+        }
+    }
+    for (int i = 0; i < nproc; i++) {
+        int wstatus;
+        wait(&wstatus);
+        if (wstatus != 0)
+            ok = 0;
+    }
+    int64 us = get_time_us() - start;
+    return ok ? us * 1000 / ((int64)nproc * ROUNDS * (FILE_SIZE / CHUNK)) : -1;
+}
+
+void test_readi_bench(void) {
+    TEST_START(__func__);
+    for (int off = 0; off < FILE_SIZE; off += CHUNK) {
+        memset(buf + off, off / CHUNK, CHUNK);
+    }
+    int fd = open(FILE_NAME, O_CREATE | O_RDWR);
+    assert(fd >= 0);
+    assert(write(fd, buf, FILE_SIZE) == FILE_SIZE);
+    close(fd);
+
+    int64 one = run(1);
+    int64 many = run(NCHILD);
+    if (one >= 0 && many >= 0) {
+        printf("  readi data: ok\n");
+    }
+    printf("  readi with 1 procs: %l us per 1000 reads\n", one);
+    printf("  readi with %d procs: %l us per 1000 reads\n", NCHILD, many);
+    unlink(FILE_NAME);
+    TEST_END(__func__);
+}
+
+int main(void) {
+    test_readi_bench();
+    return 0;
+}
@@ -0,0 +1,11 @@
+from test_base import TestBase
+
+
+class readi_bench_test(TestBase):
+    def __init__(self):
+        super().__init__("readi_bench", 3)
+
+    def test(self, data):
+        self.assert_in_str("  readi data: ok", data)
+        self.assert_in_str(r"  readi with 1 procs: \d+ us per 1000 reads", data)
+        self.assert_in_str(r"  readi with 4 procs: \d+ us per 1000 reads", data)
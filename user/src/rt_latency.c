@@ -0,0 +1,89 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "ucore.h"
+
+/*
+ * 实时调度：SCHED_FIFO 线程在定时器唤醒后通过 IPI 抢占步长调度的
+ * CPU 密集进程。分别测量普通与 FIFO 策略下的唤醒延迟并输出直方图。
+ * 测试通过时应输出：
+ * "  rr quantum: ok"
+ * "  setscheduler: ok"
+ * "  stride wakeup latency: avg [num] us, max [num] us"
+ * "  fifo wakeup latency: avg [num] us, max [num] us"
+ */
+#define NR_HOGS 8
+#define ROUNDS 200
+#define SLEEP_US 2000
+#define NR_BUCKETS 8
+
+static const int bounds[NR_BUCKETS - 1] = {50, 100, 200, 500, 1000, 2000, 5000};
+
+static void measure(const char *name) {
+    int hist[NR_BUCKETS] = {0};
+    int64 sum = 0, max = 0;
+    for (int r = 0; r < ROUNDS; r++) {
+        int64 start = get_time_us();
+        usleep(SLEEP_US);
+        int64 late = get_time_us() - start - SLEEP_US;
+        if (late < 0)
+            late = 0;
+        sum += late;
+        if (late > max)
+            max = late;
+        int b = 0;
+        while (b < NR_BUCKETS - 1 && late >= bounds[b])
+            b++;
+        hist[b]++;
+    }
+    printf("  %s wakeup latency: avg %l us, max %l us\n", name, sum / ROUNDS, max);
+    for (int b = 0; b < NR_BUCKETS - 1; b++) {
+        printf("    < %d us: %d\n", bounds[b], hist[b]);
+    }
+    printf("    >= %d us: %d\n", bounds[NR_BUCKETS - 2], hist[NR_BUCKETS - 1]);
+}
+
+void test_rt_latency(void) {
+    TEST_START(__func__);
+    struct timespec quantum, tuned = {.tv_sec = 0, .tv_nsec = 20000000}, got;
+    assert(sched_rr_get_interval(0, &quantum) == 0);
+    assert(sched_rr_set_interval(&tuned) == 0);
+    assert(sched_rr_get_interval(0, &got) == 0);
+    assert(got.tv_sec == 0 && got.tv_nsec == tuned.tv_nsec);
+    assert(sched_rr_set_interval(&quantum) == 0);
+    printf("  rr quantum: ok\n");
+
+    int hogs[NR_HOGS];
+    for (int i = 0; i < NR_HOGS; i++) {
+        hogs[i] = fork();
+        assert(hogs[i] >= 0);
+        if (hogs[i] == 0) {
+            for (;;)
+                ;
+        }
+    }
+
+    measure("stride");
+
+    struct sched_param param = {.sched_priority = 50};
+    assert(sched_setscheduler(0, SCHED_FIFO, &param) == 0);
+    assert(sched_getscheduler(0) == SCHED_FIFO);
+    struct sched_param bad = {.sched_priority = 0};
+    assert(sched_setscheduler(0, SCHED_RR, &bad) == -1);
+    printf("  setscheduler: ok\n");
+
+    measure("fifo");
+
+    param.sched_priority = 0;
+    assert(sched_setscheduler(0, SCHED_OTHER, &param) == 0);
+    for (int i = 0; i < NR_HOGS; i++) {
+        int code;
+        kill(hogs[i], SIGKILL);
+        assert(waitpid(hogs[i], &code, 0) == hogs[i]);
+    }
+    TEST_END(__func__);
+}
+
+int main(void) {
+    test_rt_latency();
+    return 0;
+}
@@ -0,0 +1,12 @@
+from test_base import TestBase
+
+
+class rt_latency_test(TestBase):
+    def __init__(self):
+        super().__init__("rt_latency", 4)
+
+    def test(self, data):
+        self.assert_in_str(r"  rr quantum: ok", data)
+        self.assert_in_str(r"  setscheduler: ok", data)
+        self.assert_in_str(r"  stride wakeup latency: avg \d+ us, max \d+ us", data)
+        self.assert_in_str(r"  fifo wakeup latency: avg \d+ us, max \d+ us", data)
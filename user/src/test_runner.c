@@ -272,6 +272,7 @@ int main() {
     mknod("/dev/zero", 6, 0);
 
     mknod("/dev/rtc", 9, 0);
+    mknod("/dev/lockstat", 12, 0);
 
 
     // create /proc directory
@@ -282,6 +283,7 @@ int main() {
 
     mknod("/proc/mounts", 7, 0);
     mknod("/proc/meminfo", 8, 0);
+    mknod("/proc/slabinfo", 11, 0);
 
     // link busybox as ls, so the command "which ls" can work correctly
     link("/busybox", "/ls");
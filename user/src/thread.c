@@ -0,0 +1,89 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "ucore.h"
+
+/*
+ * 线程：用 clone(CLONE_VM | CLONE_THREAD ...) 创建若干线程，它们共享地址
+ * 空间和 pid，各自有自己的 tid。每个线程对共享计数器原子加一，主线程等待
+ * CLONE_CHILD_CLEARTID 把 tid 清零后汇合，再与 fork 比较创建的耗时。
+ * 测试通过时应输出：
+ * "  threads share pid: ok"
+ * "  threads share memory: ok"
+ * "  thread create+join: [num] us"
+ * "  fork+wait: [num] us"
+ */
+#define NTHREAD 4
+#define ROUNDS 16
+#define STACK_SIZE 4096
+#define THREAD_FLAGS (CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_SIGHAND | CLONE_THREAD | \
+                      CLONE_PARENT_SETTID | CLONE_CHILD_CLEARTID)
+
+static char stacks[NTHREAD][STACK_SIZE] __attribute__((aligned(16)));
+static volatile int tids[NTHREAD];
+static volatile int counter;
+static int main_pid;
+static volatile int bad_pid;
+
+static int thread_func(void *arg) {
+    if (getpid() != main_pid || gettid() == main_pid) {
+        bad_pid = 1;
+    }
+    __atomic_fetch_add(&counter, (int)(uint64)arg, __ATOMIC_SEQ_CST);
+    return 0;
+}
+
+static int spawn(int i, int inc) {
+    return __clone(thread_func, stacks[i] + STACK_SIZE, THREAD_FLAGS, (void *)(uint64)inc,
+                   &tids[i], NULL, &tids[i]);
+}
+
+// the kernel clears tids[i] and wakes us when the thread is gone
+static void join(int i) {
+    int tid;
+    while ((tid = tids[i]) != 0) {
+        futex((int *)&tids[i], FUTEX_WAIT, tid, NULL, NULL, 0);
+    }
+}
+
+void test_thread(void) {
+    TEST_START(__func__);
+    main_pid = getpid();
+    counter = 0;
+    for (int i = 0; i < NTHREAD; i++) {
+        assert(spawn(i, i + 1) > 0);
+    }
+    for (int i = 0; i < NTHREAD; i++) {
+        join(i);
+    }
+    if (!bad_pid) {
+        printf("  threads share pid: ok\n");
+    }
+    if (counter == NTHREAD * (NTHREAD + 1) / 2) {
+        printf("  threads share memory: ok\n");
+    }
+
+    int64 start = get_time_us();
+    for (int r = 0; r < ROUNDS; r++) {
+        assert(spawn(0, 0) > 0);
+        join(0);
+    }
+    printf("  thread create+join: %l us\n", (get_time_us() - start) / ROUNDS);
+
+    start = get_time_us();
+    for (int r = 0; r < ROUNDS; r++) {
+        int wstatus;
+        int cpid = fork();
+        assert(cpid != -1);
+        if (cpid == 0) {
+            exit(0);
+        }
+        wait(&wstatus);
+    }
+    printf("  fork+wait: %l us\n", (get_time_us() - start) / ROUNDS);
+    TEST_END(__func__);
+}
+
+int main(void) {
+    test_thread();
+    return 0;
+}
@@ -0,0 +1,12 @@
+from test_base import TestBase
+
+
+class thread_test(TestBase):
+    def __init__(self):
+        super().__init__("thread", 4)
+
+    def test(self, data):
+        self.assert_in_str("  threads share pid: ok", data)
+        self.assert_in_str("  threads share memory: ok", data)
+        self.assert_in_str(r"  thread create\+join: \d+ us", data)
+        self.assert_in_str(r"  fork\+wait: \d+ us", data)
@@ -0,0 +1,13 @@
+from test_base import TestBase
+
+
+class uaccess_bench_test(TestBase):
+    def __init__(self):
+        super().__init__("uaccess_bench", 5)
+
+    def test(self, data):
+        self.assert_in_str(r"  read into demand-zero heap: ok", data)
+        self.assert_in_str(r"  read into copy-on-write page: ok", data)
+        self.assert_in_str(r"  bad address: rejected", data)
+        self.assert_in_str(r"  pipe 2048 B round trip: \d+ us", data)
+        self.assert_in_str(r"  /dev/zero 65536 B read: \d+ us", data)